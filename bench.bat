@@ -0,0 +1,6 @@
+cls
+del bsingle.kdb
+del bbatch.kdb
+del kdb_bench.exe
+gcc -o kdb_bench.exe -O2 kdb_bench.c
+kdb_bench.exe %* > bench.json
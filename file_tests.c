@@ -1,4 +1,5 @@
 #include <limits.h>
+#include <math.h>
 #include <stdlib.h>
 #include <time.h>
 
@@ -7,10 +8,2321 @@
 #define KDB_IMPLEMENTATION
 #include "kdb.h"
 
+// FSCTL_SET_SPARSE for the large file check
+#ifdef _WIN32
+  #include <winioctl.h>
+#endif
+
 #define DB_NAME         "test"
 #define DB_RECORD_COUNT 1000
 #define DB_SMA_FRAME    15
 
+// Counts a failed check and says which one, the run exits with 1 if any did
+#define CHECK(condition) \
+  if (!(condition)) \
+  { \
+    printf("CHECK FAILED (line %d): %s\n", __LINE__, #condition); \
+    \
+    failures += 1; \
+  }
+
+uint32_t failures = 0;
+
+KDB_VALUE_TYPE value_at(uint64_t index)
+{
+  return perlin2d(index * 0.1, 0, 0.123, 5);
+}
+
+bool near(double value, double expected)
+{
+  return fabs(value - expected) <= 1e-3 * (fabs(expected) > 1.0 ? fabs(expected) : 1.0);
+}
+
+int compare_doubles(const void* a, const void* b)
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+
+  return (x > y) - (x < y);
+}
+
+// Quantile q of sorted values, interpolating between the two closest ranks
+double quantile_of(const double* values, uint64_t count, double q)
+{
+  double   position = q * (count - 1);
+  uint64_t lower    = (uint64_t)position;
+  uint64_t upper    = lower + 1 < count ? lower + 1 : lower;
+
+  return values[lower] + (position - lower) * (values[upper] - values[lower]);
+}
+
+// Leftovers of a previous run would change what the checks expect
+void remove_files(const char* name)
+{
+  const char* extensions[] = { "kdb", "kds", "kdz", "kdp", "kdi", "kdc", "kdr", "kdb.tmp" };
+  char        filename[64];
+
+  for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); ++i)
+  {
+    snprintf(filename, sizeof(filename), "%s.%s", name, extensions[i]);
+    remove(filename);
+  }
+}
+
+// Record i of db must be value_at(first + i) at timestamp i
+void check_records(KDB* db, uint64_t count, uint64_t first)
+{
+  CHECK(kdb_count(db) == count);
+
+  KDB_DATA data;
+  uint64_t mismatches = 0;
+  double   sum        = 0.0;
+
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    sum += value_at(first + i);
+
+    if (!kdb_get_data(db, i, &data) || data.timestamp != i || data.value != value_at(first + i) || !near(data.sum, sum))
+    {
+      mismatches += 1;
+    }
+  }
+
+  CHECK(mismatches == 0);
+}
+
+// Header statistics against the same ones computed from every value
+void check_stats(KDB* db, uint64_t count, uint64_t first)
+{
+  double* values = (double*)malloc(sizeof(double) * count);
+  double  sum    = 0.0;
+  double  m2     = 0.0;
+
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    values[i] = value_at(first + i);
+    sum      += values[i];
+  }
+
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    m2 += (values[i] - sum / count) * (values[i] - sum / count);
+  }
+
+  qsort(values, count, sizeof(double), compare_doubles);
+
+  CHECK(near(kdb_sum(db), sum));
+  CHECK(near(kdb_average(db), sum / count));
+  CHECK(kdb_min(db) == values[0]);
+  CHECK(kdb_max(db) == values[count - 1]);
+  CHECK(near(kdb_variance(db), m2 / count));
+  CHECK(near(kdb_stddev(db), sqrt(m2 / count)));
+  CHECK(near(kdb_median(db), quantile_of(values, count, 0.5)));
+
+  double         qs[]       = { 0.0, 0.01, 0.25, 0.9, 0.99, 1.0 };
+  KDB_VALUE_TYPE results[6];
+  uint64_t       mismatches = 0;
+
+  CHECK(kdb_quantiles(db, qs, 6, results));
+
+  for (uint32_t k = 0; k < 6; ++k)
+  {
+    mismatches += !near(results[k], quantile_of(values, count, qs[k]));
+    mismatches += !near(kdb_quantile(db, qs[k]), quantile_of(values, count, qs[k]));
+  }
+
+  CHECK(mismatches == 0);
+
+  free(values);
+}
+
+// Batches are readable before the commit and leave nothing behind on rollback
+void check_batch(void)
+{
+  printf("CHECK BATCH\n");
+
+  remove_files("batch");
+
+  KDB* db = kdb_initialize("batch");
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  for (uint64_t i = 0; i < 100; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  CHECK(kdb_begin(db));
+
+  for (uint64_t i = 100; i < 150; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  CHECK(kdb_committed_count(db) == 100);
+  check_records(db, 150, 0);
+
+  kdb_rollback(db);
+
+  KDB_DATA data;
+
+  check_records(db, 100, 0);
+  CHECK(kdb_get_data(db, 120, &data) && data.timestamp == 0 && data.value == 0.0f);
+  check_stats(db, 100, 0);
+
+  CHECK(kdb_begin(db));
+
+  for (uint64_t i = 100; i < 200; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  CHECK(kdb_commit(db));
+  check_records(db, 200, 0);
+  check_stats(db, 200, 0);
+  CHECK(kdb_finalize(db));
+
+  db = kdb_initialize("batch");
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  check_records(db, 200, 0);
+  check_stats(db, 200, 0);
+  CHECK(kdb_finalize(db));
+}
+
+// Mapped reads go through the same calls and follow later appends, kdb_records
+// only exists mapped
+void check_map(void)
+{
+  printf("CHECK MAP\n");
+
+  remove_files("mapped");
+
+  KDB* db = kdb_initialize("mapped");
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  for (uint64_t i = 0; i < 200; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  // Only row files of unthreaded builds can be mapped
+  bool mapped = kdb_map(db);
+
+  #if !defined(KDB_USE_THREADS) && !defined(KDB_USE_COMPRESSION) && !defined(KDB_USE_COLUMNS) && !defined(_WIN32)
+    CHECK(mapped);
+  #endif
+
+  const KDB_DATA* records;
+  uint64_t        count;
+
+  check_records(db, 200, 0);
+
+  if (mapped)
+  {
+    records = kdb_records(db, &count);
+
+    CHECK(records && count == 200 && records[199].value == value_at(199));
+  }
+
+  for (uint64_t i = 200; i < 500; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  check_records(db, 500, 0);
+
+  if (mapped)
+  {
+    records = kdb_records(db, &count);
+
+    CHECK(records && count == 500 && records[499].timestamp == 499 && records[499].value == value_at(499));
+  }
+
+  kdb_unmap(db);
+
+  CHECK(kdb_records(db, &count) == NULL && count == 0);
+  check_records(db, 500, 0);
+  CHECK(kdb_finalize(db));
+}
+
+// Ranges and cursors hand out the same records as kdb_get_data, committed or
+// still in a batch, and stop at the last record
+void check_cursor(void)
+{
+  printf("CHECK CURSOR\n");
+
+  remove_files("cursor");
+
+  KDB* db = kdb_initialize("cursor");
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  for (uint64_t i = 0; i < 1000; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  CHECK(kdb_begin(db));
+
+  for (uint64_t i = 1000; i < 1100; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  // Straddles the committed records and the batch, then runs past the end
+  KDB_DATA range[200];
+  uint64_t mismatches = 0;
+
+  CHECK(kdb_get_range(db, 950, 200, range));
+
+  for (uint64_t i = 0; i < 200; ++i)
+  {
+    if (950 + i < 1100)
+    {
+      mismatches += range[i].timestamp != 950 + i || range[i].value != value_at(950 + i);
+    }
+    else
+    {
+      mismatches += range[i].timestamp != 0 || range[i].value != 0.0f;
+    }
+  }
+
+  CHECK(mismatches == 0);
+  CHECK(kdb_commit(db));
+
+  uint64_t starts[] = { 0, 10, 999, 1090 };
+  uint64_t counts[] = { 1100, 180, 50, 500 };
+  uint32_t chunks[] = { 0, 32, 7, 1 };
+
+  for (uint32_t c = 0; c < 4; ++c)
+  {
+    KDB_CURSOR      cursor;
+    const KDB_DATA* records;
+    uint64_t        count;
+    uint64_t        expected = starts[c] + counts[c] < 1100 ? counts[c] : 1100 - starts[c];
+    uint64_t        position = 0;
+
+    mismatches = 0;
+
+    CHECK(kdb_cursor_open(&cursor, db, starts[c], counts[c], chunks[c], c % 2 ? KDB_CURSOR_READAHEAD : 0));
+
+    while ((count = kdb_cursor_next_block(&cursor, &records)) > 0)
+    {
+      for (uint64_t i = 0; i < count; ++i, ++position)
+      {
+        mismatches += records[i].timestamp != starts[c] + position || records[i].value != value_at(starts[c] + position);
+      }
+    }
+
+    kdb_cursor_close(&cursor);
+
+    CHECK(position == expected && mismatches == 0);
+
+    // Record at a time over the same span
+    const KDB_DATA* record;
+
+    position = 0;
+
+    CHECK(kdb_cursor_open(&cursor, db, starts[c], counts[c], chunks[c], 0));
+
+    while ((record = kdb_cursor_next(&cursor)) != NULL)
+    {
+      mismatches += record->timestamp != starts[c] + position || record->value != value_at(starts[c] + position);
+      position   += 1;
+    }
+
+    kdb_cursor_close(&cursor);
+
+    CHECK(position == expected && mismatches == 0);
+  }
+
+  CHECK(kdb_finalize(db));
+}
+
+// Version 1 files are rewritten as current ones on open
+void check_migration(void)
+{
+  printf("CHECK MIGRATION\n");
+
+  remove_files("migrate");
+
+  KDB_HEADER_V1 header = { 0 };
+  KDB_DATA      data   = { 0 };
+
+  memcpy(header.version, "KDB\1", KDB_VERSION_SIZE);
+  memcpy(header.name, "migrate", strlen("migrate"));
+
+  #ifdef KDB_USE_LONG_DOUBLE
+    header.flags = KDB_FLAGS_USE_LONG_DOUBLE;
+  #elif defined(KDB_USE_DOUBLE)
+    header.flags = KDB_FLAGS_USE_DOUBLE;
+  #endif
+
+  header.count = 300;
+  header.min   = value_at(0);
+  header.max   = value_at(0);
+
+  for (uint64_t i = 0; i < header.count; ++i)
+  {
+    header.sum += value_at(i);
+    header.min  = value_at(i) < header.min ? value_at(i) : header.min;
+    header.max  = value_at(i) > header.max ? value_at(i) : header.max;
+  }
+
+  header.average = header.sum / header.count;
+
+  FILE* file = fopen("migrate.kdb", "wb");
+
+  CHECK(file != NULL);
+
+  if (!file)
+  {
+    return;
+  }
+
+  fwrite(&header, sizeof(KDB_HEADER_V1), 1, file);
+
+  for (uint64_t i = 0; i < header.count; ++i)
+  {
+    data.timestamp  = i;
+    data.value      = value_at(i);
+    data.sum       += data.value;
+
+    fwrite(&data, sizeof(KDB_DATA), 1, file);
+  }
+
+  fclose(file);
+
+  KDB* db = kdb_initialize("migrate");
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  check_records(db, 300, 0);
+  check_stats(db, 300, 0);
+  CHECK(kdb_finalize(db));
+
+  char version[KDB_VERSION_SIZE] = { 0 };
+
+  file = fopen("migrate.kdb", "rb");
+
+  CHECK(file && fread(version, KDB_VERSION_SIZE, 1, file) == 1 && memcmp(version, KDB_VERSION, KDB_VERSION_SIZE) == 0);
+
+  if (file)
+  {
+    fclose(file);
+  }
+
+  db = kdb_initialize("migrate");
+
+  CHECK(db != NULL);
+
+  if (db)
+  {
+    check_records(db, 300, 0);
+    CHECK(kdb_finalize(db));
+  }
+}
+
+// Approximate quantiles against the sorted values, the sketch answers with the
+// value at rank q * (count - 1) within its relative error
+void check_sketch_quantiles(KDB* db, uint64_t count)
+{
+  double*  values     = (double*)malloc(sizeof(double) * count);
+  double   qs[]       = { 0.0, 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99, 1.0 };
+  uint64_t mismatches = 0;
+
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    values[i] = value_at(i);
+  }
+
+  qsort(values, count, sizeof(double), compare_doubles);
+
+  for (uint32_t k = 0; k < 9; ++k)
+  {
+    uint64_t rank   = (uint64_t)(qs[k] * (count - 1));
+    uint64_t next   = rank + 1 < count ? rank + 1 : rank;
+    double   approx = kdb_quantile_approx(db, qs[k]);
+    double   exact  = kdb_quantile(db, qs[k]);
+
+    // kdb_quantile interpolates towards the next rank, the sketch does not
+    mismatches += fabs(approx - values[rank]) > KDB_SKETCH_ALPHA * fabs(values[rank]) + 1e-6;
+    mismatches += fabs(approx - exact) > KDB_SKETCH_ALPHA * fabs(values[rank]) + (values[next] - values[rank]) + 1e-6;
+  }
+
+  CHECK(mismatches == 0);
+  CHECK(kdb_median_approx(db) == kdb_quantile_approx(db, 0.5));
+
+  free(values);
+}
+
+// The sketch follows appends, is saved on finalize and catches up on open with
+// records appended after the .kds file was written
+void check_sketch(void)
+{
+  printf("CHECK SKETCH\n");
+
+  remove_files("sketch");
+
+  KDB* db = kdb_initialize("sketch");
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  for (uint64_t i = 0; i < 500; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  // Enabling saves the sketch, keep that copy to put it back later
+  KDB_SKETCH stale;
+  FILE*      file;
+
+  CHECK(kdb_sketch_enable(db));
+  CHECK((file = fopen("sketch.kds", "rb")) != NULL && fread(&stale, sizeof(KDB_SKETCH), 1, file) == 1 && stale.count == 500);
+
+  if (file)
+  {
+    fclose(file);
+  }
+
+  for (uint64_t i = 500; i < 1000; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  check_sketch_quantiles(db, 1000);
+  CHECK(kdb_finalize(db));
+
+  CHECK((file = fopen("sketch.kds", "wb")) != NULL && fwrite(&stale, sizeof(KDB_SKETCH), 1, file) == 1);
+
+  if (file)
+  {
+    fclose(file);
+  }
+
+  for (uint32_t pass = 0; pass < 2; ++pass)
+  {
+    db = kdb_initialize("sketch");
+
+    CHECK(db != NULL);
+
+    if (!db)
+    {
+      return;
+    }
+
+    // The first pass reloads the stale copy, the second what the first saved
+    check_sketch_quantiles(db, 1000 + pass * 500);
+
+    for (uint64_t i = 1000; pass == 0 && i < 1500; ++i)
+    {
+      kdb_add_ts(db, i, value_at(i));
+    }
+
+    check_sketch_quantiles(db, 1500);
+    CHECK(kdb_finalize(db));
+  }
+}
+
+// Runs of three equal timestamps 10 apart, a jump every 500 records and a run
+// of 300 equal ones that crosses index blocks
+uint64_t find_timestamp(uint64_t index)
+{
+  if (index >= 600 && index < 900)
+  {
+    index = 600;
+  }
+
+  return 1000 + (index / 3) * 10 + (index / 500) * 100000;
+}
+
+// Lookups around every stored timestamp and outside of them against a linear
+// scan of the first count records
+void check_find_queries(KDB* db, uint64_t count)
+{
+  uint64_t* timestamps = (uint64_t*)malloc(sizeof(uint64_t) * count);
+  uint64_t  mismatches = 0;
+  uint64_t  index;
+
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    timestamps[i] = find_timestamp(i);
+  }
+
+  for (uint64_t q = 0; q < count + 4; ++q)
+  {
+    uint64_t targets[] = { 0, 999, find_timestamp(count - 1) + 1, UINT64_MAX };
+    uint64_t target    = q < count ? timestamps[q] - q % 3 + 1 : targets[q - count];
+
+    // First record at or after the target, then first one strictly after it
+    for (uint32_t bound = 0; bound < 2; ++bound)
+    {
+      uint64_t expected = 0;
+
+      while (expected < count && (bound == 0 ? timestamps[expected] < target : timestamps[expected] <= target))
+      {
+        ++expected;
+      }
+
+      mismatches += !kdb_find_ts(db, target, bound == 0 ? KDB_BOUND_LOWER : KDB_BOUND_UPPER, &index) || index != expected;
+    }
+  }
+
+  CHECK(mismatches == 0);
+
+  // Ranges [t0, t1) between stored timestamps, gaps, and outside of them
+  mismatches = 0;
+
+  for (uint64_t a = 0; a < count + 2; a += 37)
+  {
+    for (uint64_t b = a; b < count + 2; b += 53)
+    {
+      uint64_t t0    = a < count ? timestamps[a] + a % 2 : timestamps[count - 1] + 1;
+      uint64_t t1    = b < count ? timestamps[b] + b % 5 : UINT64_MAX;
+      uint64_t first = 0;
+      uint64_t end   = 0;
+      double   sum   = 0.0;
+      uint64_t start;
+      uint64_t found;
+
+      t0 = a == 0 ? 0 : t0;
+
+      while (first < count && timestamps[first] < t0)
+      {
+        ++first;
+      }
+
+      for (end = first; end < count && timestamps[end] < t1; ++end)
+      {
+        sum += value_at(end);
+      }
+
+      mismatches += !kdb_range_by_time(db, t0, t1, &start, &found) || found != end - first || (found > 0 && start != first);
+      mismatches += !near(kdb_sma_by_time(db, t0, t1), end > first ? sum / (end - first) : 0.0);
+    }
+  }
+
+  CHECK(mismatches == 0);
+
+  free(timestamps);
+}
+
+// Timestamp lookups over committed records, an open batch and after a reopen
+void check_find_ts(void)
+{
+  printf("CHECK FIND TS\n");
+
+  remove_files("findts");
+
+  KDB* db = kdb_initialize("findts");
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  for (uint64_t i = 0; i < 1200; ++i)
+  {
+    kdb_add_ts(db, find_timestamp(i), value_at(i));
+  }
+
+  check_find_queries(db, 1200);
+
+  CHECK(kdb_begin(db));
+
+  for (uint64_t i = 1200; i < 1300; ++i)
+  {
+    kdb_add_ts(db, find_timestamp(i), value_at(i));
+  }
+
+  check_find_queries(db, 1300);
+  CHECK(kdb_commit(db));
+  CHECK(kdb_finalize(db));
+
+  db = kdb_initialize("findts");
+
+  CHECK(db != NULL);
+
+  if (db)
+  {
+    check_find_queries(db, 1300);
+    CHECK(kdb_finalize(db));
+  }
+}
+
+// Perlin values with a whole zone of a constant above all of them
+KDB_VALUE_TYPE filter_value(uint64_t index)
+{
+  return index >= 2 * KDB_ZONE_SIZE && index < 3 * KDB_ZONE_SIZE ? 2.0f : value_at(index);
+}
+
+// Every predicate against a brute force scan, collected a page at a time
+// through position, plus range statistics over zone edges
+void check_filter_queries(KDB* db, uint64_t count)
+{
+  KDB_VALUE_TYPE thresholds[] = { -0.2f, 0.0f, filter_value(123), 2.0f, 5.0f };
+  uint64_t*      indexes      = (uint64_t*)malloc(sizeof(uint64_t) * count);
+  uint64_t       page[37];
+  uint64_t       mismatches   = 0;
+
+  for (uint32_t predicate = KDB_PREDICATE_GREATER; predicate <= KDB_PREDICATE_LESS_EQUAL; ++predicate)
+  {
+    for (uint32_t t = 0; t < 5; ++t)
+    {
+      KDB_VALUE_TYPE threshold = thresholds[t];
+      uint64_t       expected  = 0;
+      uint64_t       collected = 0;
+      uint64_t       position  = 17;
+      uint64_t       end       = count - 5;
+      uint32_t       found;
+
+      for (uint64_t i = position; i < end; ++i)
+      {
+        KDB_VALUE_TYPE value = filter_value(i);
+
+        if (
+          predicate == KDB_PREDICATE_GREATER       ? value >  threshold :
+          predicate == KDB_PREDICATE_GREATER_EQUAL ? value >= threshold :
+          predicate == KDB_PREDICATE_LESS          ? value <  threshold :
+                                                     value <= threshold
+        )
+        {
+          indexes[expected++] = i;
+        }
+      }
+
+      while (position < end)
+      {
+        if (!kdb_filter(db, (KDB_PREDICATE)predicate, threshold, &position, end, page, 37, &found))
+        {
+          mismatches += 1;
+
+          break;
+        }
+
+        for (uint32_t i = 0; i < found; ++i, ++collected)
+        {
+          mismatches += collected >= expected || page[i] != indexes[collected];
+        }
+      }
+
+      mismatches += collected != expected;
+    }
+  }
+
+  CHECK(mismatches == 0);
+
+  uint64_t ranges[][2] = { { 0, count }, { 5, 4096 }, { 4000, 4 * 4096 + 3 }, { 2 * 4096, 3 * 4096 }, { 100, 100 } };
+  KDB_ZONE stats;
+
+  mismatches = 0;
+
+  for (uint32_t r = 0; r < 5; ++r)
+  {
+    double         sum  = 0.0;
+    KDB_VALUE_TYPE low  = INFINITY;
+    KDB_VALUE_TYPE high = -INFINITY;
+
+    for (uint64_t i = ranges[r][0]; i < ranges[r][1]; ++i)
+    {
+      sum  += filter_value(i);
+      low   = filter_value(i) < low ? filter_value(i) : low;
+      high  = filter_value(i) > high ? filter_value(i) : high;
+    }
+
+    mismatches += !kdb_range_stats(db, ranges[r][0], ranges[r][1], &stats) || stats.count != ranges[r][1] - ranges[r][0];
+    mismatches += stats.count > 0 && (!near(stats.sum, sum) || stats.min != low || stats.max != high);
+  }
+
+  CHECK(mismatches == 0);
+
+  free(indexes);
+}
+
+// Zone maps enabled on an empty database, filled by appends and loaded back
+void check_filter(void)
+{
+  printf("CHECK FILTER\n");
+
+  remove_files("filter");
+
+  uint64_t count = 4 * KDB_ZONE_SIZE + 1000;
+  KDB*     db    = kdb_initialize("filter");
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  CHECK(kdb_zones_enable(db));
+
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    kdb_add_ts(db, i, filter_value(i));
+  }
+
+  check_filter_queries(db, count);
+  CHECK(kdb_finalize(db));
+
+  db = kdb_initialize("filter");
+
+  CHECK(db != NULL);
+
+  if (db)
+  {
+    check_filter_queries(db, count);
+    CHECK(kdb_finalize(db));
+  }
+}
+
+// Range minimums and maximums against a scan, over aligned and unaligned
+// ranges, before and after the pyramid is loaded back
+void check_pyramid_queries(KDB* db, uint64_t count)
+{
+  uint64_t       mismatches = 0;
+  KDB_VALUE_TYPE min;
+  KDB_VALUE_TYPE max;
+
+  for (uint64_t start = 0; start < count; start += 97)
+  {
+    for (uint64_t end = start + 1; end <= count; end += end < start + 300 ? 13 : 211)
+    {
+      KDB_VALUE_TYPE low  = value_at(start);
+      KDB_VALUE_TYPE high = value_at(start);
+
+      for (uint64_t i = start; i < end; ++i)
+      {
+        low  = value_at(i) < low ? value_at(i) : low;
+        high = value_at(i) > high ? value_at(i) : high;
+      }
+
+      mismatches += !kdb_range_min_max(db, start, end, &min, &max) || min != low || max != high;
+      mismatches += kdb_range_min(db, start, end) != low || kdb_range_max(db, start, end) != high;
+    }
+  }
+
+  // Whole levels of the pyramid
+  mismatches += !kdb_range_min_max(db, 0, 16 * 16 * 16, &min, &max) || min != kdb_range_min(db, 0, 4096) || max != kdb_range_max(db, 0, 4096);
+
+  CHECK(mismatches == 0);
+}
+
+// Pyramid enabled on an empty database, filled by appends and loaded back
+void check_pyramid(void)
+{
+  printf("CHECK PYRAMID\n");
+
+  remove_files("pyramid");
+
+  KDB* db = kdb_initialize("pyramid");
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  CHECK(kdb_pyramid_enable(db));
+
+  for (uint64_t i = 0; i < 5000; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  check_pyramid_queries(db, 5000);
+  CHECK(kdb_finalize(db));
+
+  db = kdb_initialize("pyramid");
+
+  CHECK(db != NULL);
+
+  if (db)
+  {
+    check_pyramid_queries(db, 5000);
+    CHECK(kdb_finalize(db));
+  }
+}
+
+#ifdef KDB_USE_COMPRESSION
+  // Timestamps and values that hit every case of the Gorilla encoding: steady
+  // and changing deltas, long gaps, repeated values and sign flips
+  uint64_t gorilla_timestamp(uint64_t index)
+  {
+    return index * 1000 + (index % 7) * 13 + (index / 300) * 1000000;
+  }
+
+  KDB_VALUE_TYPE gorilla_value(uint64_t index)
+  {
+    if (index % 5 == 4)
+    {
+      return gorilla_value(index - 1);
+    }
+
+    return index % 11 == 0 ? -1000.0f * value_at(index) : value_at(index);
+  }
+
+  void check_gorilla_records(KDB* db, uint64_t count)
+  {
+    KDB_DATA data;
+    uint64_t mismatches = 0;
+
+    CHECK(kdb_count(db) == count);
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+      mismatches += !kdb_get_data(db, i, &data) || data.timestamp != gorilla_timestamp(i) || data.value != gorilla_value(i);
+    }
+
+    CHECK(mismatches == 0);
+  }
+
+  // Sealed blocks and the raw tail after them read back the records they
+  // were given, before and after a reopen
+  void check_compression(void)
+  {
+    printf("CHECK COMPRESSION\n");
+
+    remove_files("gorilla");
+
+    // Written, read back after a reopen, extended across the next block
+    // boundary and read back after another reopen
+    uint64_t ends[] = { 2 * KDB_BLOCK_SIZE + 37, 2 * KDB_BLOCK_SIZE + 37, 3 * KDB_BLOCK_SIZE + 37, 3 * KDB_BLOCK_SIZE + 37 };
+    uint64_t count  = 0;
+
+    for (uint32_t pass = 0; pass < 4; ++pass)
+    {
+      KDB* db = kdb_initialize("gorilla");
+
+      CHECK(db != NULL);
+
+      if (!db)
+      {
+        return;
+      }
+
+      for (uint64_t i = count; i < ends[pass]; ++i)
+      {
+        kdb_add_ts(db, gorilla_timestamp(i), gorilla_value(i));
+      }
+
+      count = ends[pass];
+
+      check_gorilla_records(db, count);
+
+      // Reads loaded the offsets of the sealed blocks
+      CHECK(db->blocks_count == count / KDB_BLOCK_SIZE && db->tail_count == count % KDB_BLOCK_SIZE);
+      CHECK(kdb_finalize(db));
+    }
+  }
+#endif
+
+// Kernel aggregates over ranges that start and end inside chunks, against
+// the same statistics computed one value at a time
+void check_aggregate(void)
+{
+  printf("CHECK AGGREGATE\n");
+
+  remove_files("aggreg");
+
+  uint64_t count = 2 * KDB_CURSOR_CHUNK_SIZE + 1000;
+  KDB*     db    = kdb_initialize("aggreg");
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  uint64_t       ranges[][2] = { { 0, count }, { 1, count - 1 }, { 1000, 1001 }, { 17, KDB_CURSOR_CHUNK_SIZE + 3 }, { 5, count + 100 } };
+  KDB_VALUE_TYPE width       = (kdb_max(db) - kdb_min(db)) / KDB_HISTOGRAM_BINS;
+  KDB_AGGREGATE  aggregate;
+  uint64_t       mismatches  = 0;
+
+  for (uint32_t r = 0; r < 5; ++r)
+  {
+    uint64_t start                    = ranges[r][0];
+    uint64_t end                      = ranges[r][1] < count ? ranges[r][1] : count;
+    uint64_t bins[KDB_HISTOGRAM_BINS] = { 0 };
+    double   sum                      = 0.0;
+    double   m2                       = 0.0;
+    double   low                      = value_at(start);
+    double   high                     = value_at(start);
+
+    for (uint64_t i = start; i < end; ++i)
+    {
+      int64_t bin = (int64_t)((value_at(i) - kdb_min(db)) / width);
+
+      bins[bin < 0 ? 0 : bin >= KDB_HISTOGRAM_BINS ? KDB_HISTOGRAM_BINS - 1 : bin] += 1;
+
+      sum  += value_at(i);
+      low   = value_at(i) < low ? value_at(i) : low;
+      high  = value_at(i) > high ? value_at(i) : high;
+    }
+
+    for (uint64_t i = start; i < end; ++i)
+    {
+      m2 += (value_at(i) - sum / (end - start)) * (value_at(i) - sum / (end - start));
+    }
+
+    mismatches += !kdb_aggregate_range(db, ranges[r][0], ranges[r][1], KDB_AGGREGATE_ALL, &aggregate) || aggregate.count != end - start;
+    mismatches += !near(aggregate.sum, sum) || !near(aggregate.average, sum / (end - start)) || !near(aggregate.variance, m2 / (end - start));
+    mismatches += aggregate.min != low || aggregate.max != high;
+
+    for (uint32_t b = 0; b < KDB_HISTOGRAM_BINS; ++b)
+    {
+      mismatches += aggregate.histogram[b] != bins[b];
+    }
+  }
+
+  CHECK(mismatches == 0);
+  CHECK(kdb_finalize(db));
+}
+
+// Counts and offsets past 32 bits without writing 4 billion records: the
+// records of a small database are moved up to index UINT32_MAX - 14 and the
+// hole before them is left sparse. Compressed and columnar files lay their
+// records out differently, the row layout is enough to cover the offsets
+#if !defined(KDB_USE_COMPRESSION) && !defined(KDB_USE_COLUMNS)
+  void check_large(void)
+  {
+    printf("CHECK LARGE\n");
+
+    remove_files("large");
+
+    uint64_t base = (uint64_t)UINT32_MAX - 14;
+    KDB*     db   = kdb_initialize("large");
+
+    CHECK(db != NULL);
+
+    if (!db)
+    {
+      return;
+    }
+
+    for (uint64_t i = 0; i < 10; ++i)
+    {
+      kdb_add_ts(db, i, value_at(i));
+    }
+
+    CHECK(kdb_finalize(db));
+
+    KDB_HEADER header;
+    KDB_DATA   records[10];
+    FILE*      file = fopen("large.kdb", "r+b");
+
+    CHECK(file != NULL);
+
+    if (!file)
+    {
+      return;
+    }
+
+    // Windows would allocate the whole hole otherwise
+    #ifdef _WIN32
+      DWORD returned;
+
+      DeviceIoControl((HANDLE)_get_osfhandle(_fileno(file)), FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+    #endif
+
+    bool moved = fread(&header, sizeof(KDB_HEADER), 1, file) == 1 && fread(records, sizeof(KDB_DATA), 10, file) == 10;
+
+    header.count = base + 10;
+
+    moved = moved &&
+      KDB_SEEK(file, 0, SEEK_SET) == 0 &&
+      fwrite(&header, sizeof(KDB_HEADER), 1, file) == 1 &&
+      KDB_SEEK(file, sizeof(KDB_HEADER) + base * sizeof(KDB_DATA), SEEK_SET) == 0 &&
+      fwrite(records, sizeof(KDB_DATA), 10, file) == 10;
+
+    CHECK(fclose(file) == 0 && moved);
+
+    for (uint32_t pass = 0; moved && pass < 2; ++pass)
+    {
+      db = kdb_initialize("large");
+
+      CHECK(db != NULL);
+
+      if (!db)
+      {
+        break;
+      }
+
+      // The first pass appends across index 2^32, the second reads it back
+      CHECK(kdb_count(db) == base + 10 + pass * 10);
+
+      for (uint64_t i = 10; pass == 0 && i < 20; ++i)
+      {
+        kdb_add_ts(db, i, value_at(i));
+      }
+
+      KDB_DATA data;
+      KDB_DATA range[20];
+      uint64_t mismatches = 0;
+      double   sum        = 0.0;
+
+      CHECK(kdb_count(db) == base + 20 && kdb_count(db) > UINT32_MAX);
+      CHECK(kdb_get_range(db, base, 20, range));
+
+      for (uint64_t i = 0; i < 20; ++i)
+      {
+        sum        += value_at(i);
+        mismatches += !kdb_get_data(db, base + i, &data) || data.timestamp != i || data.value != value_at(i) || !near(data.sum, sum);
+        mismatches += range[i].timestamp != i || range[i].value != value_at(i);
+      }
+
+      CHECK(mismatches == 0);
+      CHECK(near(kdb_sum(db), sum));
+      CHECK(kdb_finalize(db));
+    }
+
+    // Sparse or not, the file claims more than 60 GB
+    remove_files("large");
+  }
+#endif
+
+// Records another handle finds in the file, that is the ones handed to the OS
+uint64_t file_count(const char* filename)
+{
+  KDB_HEADER header = { 0 };
+  FILE*      file   = fopen(filename, "rb");
+
+  if (file)
+  {
+    if (fread(&header, sizeof(KDB_HEADER), 1, file) != 1)
+    {
+      header.count = 0;
+    }
+
+    fclose(file);
+  }
+
+  return header.count;
+}
+
+// Records appended since the last sync, under the lock the flusher takes
+uint64_t unsynced_count(KDB* db)
+{
+  #ifdef KDB_USE_THREADS
+    KDB*     previous = kdb_lock(db, false);
+    uint64_t count    = db->unsynced;
+
+    kdb_unlock(db, previous);
+
+    return count;
+  #else
+    return db->unsynced;
+  #endif
+}
+
+// Every mode syncs where it says it does, kdb_sync and kdb_finalize are
+// barriers in all of them
+void check_durability(void)
+{
+  printf("CHECK DURABILITY\n");
+
+  KDB_DURABILITY modes[] = { KDB_DURABILITY_FLUSH, KDB_DURABILITY_SYNC, KDB_DURABILITY_GROUP, KDB_DURABILITY_BUFFERED };
+  KDB_OPTIONS    options = { 0 };
+  KDB*           db;
+
+  for (uint32_t m = 0; m < 4; ++m)
+  {
+    options.durability    = modes[m];
+    options.group_records = 10;
+
+    remove_files("durable");
+
+    db = kdb_initialize_with_options("durable", &options);
+
+    CHECK(db != NULL);
+
+    if (!db)
+    {
+      return;
+    }
+
+    uint64_t mismatches = 0;
+
+    for (uint64_t i = 0; i < 25; ++i)
+    {
+      kdb_add_ts(db, i, value_at(i));
+
+      // Sync syncs every append and group every tenth, the others never
+      uint64_t expected = modes[m] == KDB_DURABILITY_SYNC ? 0 : modes[m] == KDB_DURABILITY_GROUP ? (i + 1) % 10 : i + 1;
+      bool     handed   = modes[m] == KDB_DURABILITY_FLUSH || modes[m] == KDB_DURABILITY_SYNC || expected == 0;
+
+      mismatches += unsynced_count(db) != expected;
+      mismatches += handed && file_count("durable.kdb") != i + 1;
+    }
+
+    CHECK(mismatches == 0);
+
+    // A batch counts once committed, group then has 20 records to sync
+    CHECK(kdb_begin(db));
+
+    for (uint64_t i = 25; i < 40; ++i)
+    {
+      kdb_add_ts(db, i, value_at(i));
+    }
+
+    CHECK(unsynced_count(db) == (modes[m] == KDB_DURABILITY_SYNC ? 0 : modes[m] == KDB_DURABILITY_GROUP ? 5 : 25));
+    CHECK(kdb_commit(db));
+    CHECK(unsynced_count(db) == (modes[m] == KDB_DURABILITY_SYNC || modes[m] == KDB_DURABILITY_GROUP ? 0 : 40));
+
+    CHECK(kdb_sync(db) && unsynced_count(db) == 0 && file_count("durable.kdb") == 40);
+
+    for (uint64_t i = 40; i < 45; ++i)
+    {
+      kdb_add_ts(db, i, value_at(i));
+    }
+
+    CHECK(kdb_finalize(db));
+    CHECK(file_count("durable.kdb") == 45);
+  }
+
+  options.durability    = KDB_DURABILITY_GROUP;
+  options.group_records = 0;
+  options.group_ms      = 200;
+
+  remove_files("durable");
+
+  #ifdef KDB_USE_THREADS
+    db = kdb_initialize_with_options("durable", &options);
+
+    CHECK(db != NULL);
+
+    if (!db)
+    {
+      return;
+    }
+
+    // Records left behind by a pause are synced by the flusher thread
+    CHECK(kdb_add_ts(db, 0, value_at(0)) && kdb_sync(db));
+    CHECK(kdb_add_ts(db, 1, value_at(1)) && unsynced_count(db) == 1);
+
+    uint64_t start = kdb_now_ms();
+
+    while (unsynced_count(db) > 0 && kdb_now_ms() - start < 5000)
+    {
+    }
+
+    CHECK(unsynced_count(db) == 0 && file_count("durable.kdb") == 2);
+    CHECK(kdb_finalize(db));
+  #else
+    // Nothing would run during the pause
+    CHECK(kdb_initialize_with_options("durable", &options) == NULL);
+  #endif
+}
+
+#ifdef KDB_USE_THREADS
+  #define INGEST_PRODUCERS 4
+  #define INGEST_RECORDS   5000
+
+  typedef struct
+  {
+    KDB*     db;
+    uint32_t index;
+    uint64_t failed;
+  } INGEST_PRODUCER;
+
+  // Producer p ingests records p * INGEST_RECORDS + k in order of k, the
+  // timestamp says which one each is
+  void* ingest_records(void* argument)
+  {
+    INGEST_PRODUCER* producer = (INGEST_PRODUCER*)argument;
+
+    for (uint64_t k = 0; k < INGEST_RECORDS; ++k)
+    {
+      uint64_t record = producer->index * INGEST_RECORDS + k;
+
+      producer->failed += !kdb_ingest(producer->db, record, value_at(record));
+    }
+
+    return NULL;
+  }
+
+  // Every record once, each producer's in the order it ingested them and the
+  // running sums following the order they were written in
+  void check_ingested(KDB* db)
+  {
+    uint64_t next[INGEST_PRODUCERS] = { 0 };
+    uint64_t mismatches             = 0;
+    double   sum                    = 0.0;
+    KDB_DATA data;
+
+    CHECK(kdb_count(db) == INGEST_PRODUCERS * INGEST_RECORDS);
+
+    for (uint64_t i = 0; i < kdb_count(db); ++i)
+    {
+      if (!kdb_get_data(db, i, &data) || data.timestamp >= INGEST_PRODUCERS * INGEST_RECORDS)
+      {
+        mismatches += 1;
+
+        continue;
+      }
+
+      uint64_t producer = data.timestamp / INGEST_RECORDS;
+
+      sum        += data.value;
+      mismatches += data.timestamp % INGEST_RECORDS != next[producer] || data.value != value_at(data.timestamp) || !near(data.sum, sum);
+
+      next[producer] += 1;
+    }
+
+    CHECK(mismatches == 0);
+  }
+
+  // Several producers filling a small ring, so they also wait for room
+  void check_ingest(void)
+  {
+    printf("CHECK INGEST\n");
+
+    remove_files("ingest");
+
+    KDB* db = kdb_initialize("ingest");
+
+    CHECK(db != NULL);
+
+    if (!db)
+    {
+      return;
+    }
+
+    CHECK(kdb_ingest_start(db, 64));
+
+    pthread_t        threads[INGEST_PRODUCERS];
+    INGEST_PRODUCER  producers[INGEST_PRODUCERS];
+    KDB_INGEST_STATS stats;
+    uint64_t         failed = 0;
+
+    for (uint32_t p = 0; p < INGEST_PRODUCERS; ++p)
+    {
+      producers[p] = (INGEST_PRODUCER){ .db = db, .index = p };
+
+      pthread_create(&threads[p], NULL, ingest_records, &producers[p]);
+    }
+
+    for (uint32_t p = 0; p < INGEST_PRODUCERS; ++p)
+    {
+      pthread_join(threads[p], NULL);
+
+      failed += producers[p].failed;
+    }
+
+    CHECK(failed == 0 && kdb_ingest_flush(db));
+
+    kdb_ingest_stats(db, &stats);
+
+    CHECK(stats.enqueued == INGEST_PRODUCERS * INGEST_RECORDS && stats.written == stats.enqueued && stats.failed == 0);
+
+    check_ingested(db);
+
+    // Finalize stops the writer
+    CHECK(kdb_finalize(db));
+
+    db = kdb_initialize("ingest");
+
+    CHECK(db != NULL);
+
+    if (db)
+    {
+      check_ingested(db);
+      CHECK(kdb_finalize(db));
+    }
+  }
+
+  #define SHARED_READERS 3
+  #define SHARED_RECORDS 20000
+
+  typedef struct
+  {
+    KDB*          db;
+    const double* sums;
+    _Atomic bool  done;
+    _Atomic bool  wrote;
+  } SHARED_STATE;
+
+  typedef struct
+  {
+    SHARED_STATE* state;
+    uint32_t      index;
+    uint64_t      reads;
+    uint64_t      mismatches;
+  } SHARED_READER;
+
+  // Appends in batches and one by one while the readers run
+  void* shared_write(void* argument)
+  {
+    SHARED_STATE* state = (SHARED_STATE*)argument;
+    bool          wrote = true;
+
+    for (uint64_t i = 0; i < SHARED_RECORDS; )
+    {
+      if (i % 1000 < 500)
+      {
+        wrote = wrote && kdb_add_ts(state->db, i, value_at(i));
+        i    += 1;
+
+        continue;
+      }
+
+      wrote = wrote && kdb_begin(state->db);
+
+      for (uint64_t end = i + 100; i < end; ++i)
+      {
+        wrote = wrote && kdb_add_ts(state->db, i, value_at(i));
+      }
+
+      wrote = wrote && kdb_commit(state->db);
+    }
+
+    atomic_store(&state->wrote, wrote);
+    atomic_store(&state->done, true);
+
+    return NULL;
+  }
+
+  // Whatever a reader sees must be a prefix of the records the writer appends
+  void* shared_read(void* argument)
+  {
+    SHARED_READER* reader = (SHARED_READER*)argument;
+    KDB*           db     = reader->state->db;
+    const double*  sums   = reader->state->sums;
+    KDB_DATA       data;
+    KDB_ZONE       stats;
+
+    while (!atomic_load(&reader->state->done) || reader->reads < 10)
+    {
+      uint64_t count = kdb_count(db);
+      uint64_t step  = reader->reads * 7919 + reader->index;
+
+      reader->reads += 1;
+
+      if (count == 0)
+      {
+        continue;
+      }
+
+      // Point reads
+      for (uint64_t k = 0; k < 50; ++k)
+      {
+        uint64_t i = (step + k * 104729) % count;
+
+        reader->mismatches += !kdb_get_data(db, i, &data) || data.timestamp != i || data.value != value_at(i) || !near(data.sum, sums[i + 1]);
+      }
+
+      // A cursor over the tail that is being appended to
+      KDB_CURSOR      cursor;
+      const KDB_DATA* records;
+      uint64_t        block;
+      uint64_t        start    = count > 3000 ? count - 3000 : 0;
+      uint64_t        position = start;
+
+      if (kdb_cursor_open(&cursor, db, start, count - start, 256, KDB_CURSOR_READAHEAD))
+      {
+        while ((block = kdb_cursor_next_block(&cursor, &records)) > 0)
+        {
+          for (uint64_t i = 0; i < block; ++i, ++position)
+          {
+            reader->mismatches += records[i].timestamp != position || records[i].value != value_at(position);
+          }
+        }
+
+        reader->mismatches += cursor.failed || position != count;
+
+        kdb_cursor_close(&cursor);
+      }
+      else
+      {
+        reader->mismatches += 1;
+      }
+
+      // Zone aggregates over a range the writer already passed
+      uint64_t first = step % count;
+      uint64_t end   = first + 500 < count ? first + 500 : count;
+
+      if (kdb_range_stats(db, first, end, &stats))
+      {
+        KDB_VALUE_TYPE low  = value_at(first);
+        KDB_VALUE_TYPE high = value_at(first);
+
+        for (uint64_t i = first; i < end; ++i)
+        {
+          low  = value_at(i) < low ? value_at(i) : low;
+          high = value_at(i) > high ? value_at(i) : high;
+        }
+
+        reader->mismatches += stats.count != end - first || !near(stats.sum, sums[end] - sums[first]) || stats.min != low || stats.max != high;
+      }
+      else
+      {
+        reader->mismatches += 1;
+      }
+
+      // Calls nested under a lock the thread already holds reuse it, and the
+      // count can't move until it is released
+      KDB*     previous = kdb_lock(db, false);
+      uint64_t held     = kdb_count(db);
+
+      reader->mismatches += !kdb_get_data(db, held - 1, &data) || data.timestamp != held - 1 || kdb_count(db) != held;
+
+      kdb_unlock(db, previous);
+    }
+
+    return NULL;
+  }
+
+  // Readers running every kind of query while a writer appends
+  void check_shared(void)
+  {
+    printf("CHECK SHARED\n");
+
+    remove_files("shared");
+
+    double*       sums  = (double*)malloc(sizeof(double) * (SHARED_RECORDS + 1));
+    SHARED_STATE  state = { .db = kdb_initialize("shared"), .sums = sums };
+    SHARED_READER readers[SHARED_READERS];
+    pthread_t     threads[SHARED_READERS + 1];
+    uint64_t      mismatches = 0;
+    uint64_t      reads      = 0;
+
+    CHECK(state.db != NULL);
+
+    if (!state.db)
+    {
+      free(sums);
+
+      return;
+    }
+
+    sums[0] = 0.0;
+
+    for (uint64_t i = 0; i < SHARED_RECORDS; ++i)
+    {
+      sums[i + 1] = sums[i] + value_at(i);
+    }
+
+    CHECK(kdb_zones_enable(state.db));
+
+    pthread_create(&threads[SHARED_READERS], NULL, shared_write, &state);
+
+    for (uint32_t r = 0; r < SHARED_READERS; ++r)
+    {
+      readers[r] = (SHARED_READER){ .state = &state, .index = r };
+
+      pthread_create(&threads[r], NULL, shared_read, &readers[r]);
+    }
+
+    for (uint32_t r = 0; r <= SHARED_READERS; ++r)
+    {
+      pthread_join(threads[r], NULL);
+    }
+
+    for (uint32_t r = 0; r < SHARED_READERS; ++r)
+    {
+      mismatches += readers[r].mismatches;
+      reads      += readers[r].reads;
+    }
+
+    CHECK(atomic_load(&state.wrote) && mismatches == 0 && reads >= 10 * SHARED_READERS);
+
+    check_records(state.db, SHARED_RECORDS, 0);
+    CHECK(kdb_finalize(state.db));
+
+    free(sums);
+  }
+#endif
+
+#define HASHMAP_KEYS 100000
+
+#define KDB_HASHMAP_NAME       words
+#define KDB_HASHMAP_CAPACITY   32
+#define KDB_HASHMAP_KEY_TYPE   char*
+#define KDB_HASHMAP_VALUE_TYPE uint64_t
+#include "kdb_hashmap.h"
+
+#define KDB_HASHMAP_NAME       numbers
+#define KDB_HASHMAP_CAPACITY   32
+#define KDB_HASHMAP_KEY_TYPE   uint64_t
+#define KDB_HASHMAP_VALUE_TYPE uint64_t
+#include "kdb_hashmap.h"
+
+// Entries that collide on the last slot wrap around, removing the first one
+// has to shift the rest back so they can all still be found
+void check_hashmap_shift(void)
+{
+  uint64_t keys[5];
+  uint32_t found = 0;
+
+  for (uint64_t key = 1; found < 4; ++key)
+  {
+    if ((kdb_hashmap_hash_integer(key) & 31) == 31)
+    {
+      keys[found++] = key;
+    }
+  }
+
+  for (uint64_t key = 1; found < 5; ++key)
+  {
+    if ((kdb_hashmap_hash_integer(key) & 31) == 0)
+    {
+      keys[found++] = key;
+    }
+  }
+
+  for (uint32_t i = 0; i < 5; ++i)
+  {
+    CHECK(kdb_hashmap_numbers_set(keys[i], i + 1));
+  }
+
+  CHECK(kdb_hashmap_numbers_slots == 32 && kdb_hashmap_numbers_buffer[3].key == keys[4]);
+  CHECK(kdb_hashmap_numbers_remove(keys[0]) && !kdb_hashmap_numbers_remove(keys[0]));
+
+  // The collisions move back one slot and the entry whose home is slot 0 follows
+  CHECK(kdb_hashmap_numbers_buffer[31].key == keys[1] && kdb_hashmap_numbers_buffer[2].key == keys[4]);
+  CHECK(!kdb_hashmap_numbers_buffer[3].occupied && kdb_hashmap_numbers_count() == 4);
+
+  for (uint32_t i = 1; i < 5; ++i)
+  {
+    CHECK(kdb_hashmap_numbers_get(keys[i], 0) == i + 1);
+  }
+
+  CHECK(kdb_hashmap_numbers_get(keys[0], 0) == 0);
+
+  kdb_hashmap_numbers_clear();
+}
+
+// Growth, removal and lookups with both string and integer keys
+void check_hashmap(void)
+{
+  printf("CHECK HASHMAP\n");
+
+  char*    names      = (char*)malloc(HASHMAP_KEYS * 16);
+  uint64_t bad_growth = 0;
+  uint64_t bad_lookup = 0;
+
+  check_hashmap_shift();
+
+  for (uint64_t i = 0; i < HASHMAP_KEYS; ++i)
+  {
+    snprintf(names + i * 16, 16, "key%llu", (unsigned long long)i);
+
+    CHECK(kdb_hashmap_words_set(names + i * 16, i));
+    CHECK(kdb_hashmap_numbers_set(i * 3, i));
+
+    // Tables stay a power of two and under 3/4 full as they grow
+    bad_growth += (kdb_hashmap_words_slots & (kdb_hashmap_words_slots - 1)) != 0 || kdb_hashmap_words_count() * 4 > kdb_hashmap_words_slots * 3;
+    bad_growth += (kdb_hashmap_numbers_slots & (kdb_hashmap_numbers_slots - 1)) != 0 || kdb_hashmap_numbers_count() * 4 > kdb_hashmap_numbers_slots * 3;
+  }
+
+  CHECK(bad_growth == 0 && kdb_hashmap_words_slots >= HASHMAP_KEYS * 4 / 3);
+  CHECK(kdb_hashmap_words_count() == HASHMAP_KEYS && kdb_hashmap_numbers_count() == HASHMAP_KEYS);
+
+  // A key built elsewhere finds the same entry and setting it again only
+  // replaces the value
+  char name[16] = "key77";
+
+  CHECK(kdb_hashmap_words_get(name, HASHMAP_KEYS) == 77);
+  CHECK(kdb_hashmap_words_set(name, 78) && kdb_hashmap_words_get(names + 77 * 16, 0) == 78);
+  CHECK(kdb_hashmap_words_set(name, 77) && kdb_hashmap_words_count() == HASHMAP_KEYS);
+
+  for (uint64_t i = 0; i < HASHMAP_KEYS; i += 2)
+  {
+    bad_lookup += !kdb_hashmap_words_remove(names + i * 16) || kdb_hashmap_words_remove(names + i * 16);
+    bad_lookup += !kdb_hashmap_numbers_remove(i * 3) || kdb_hashmap_numbers_remove(i * 3);
+  }
+
+  CHECK(bad_lookup == 0);
+  CHECK(kdb_hashmap_words_count() == HASHMAP_KEYS / 2 && kdb_hashmap_numbers_count() == HASHMAP_KEYS / 2);
+
+  for (uint64_t i = 0; i < HASHMAP_KEYS; ++i)
+  {
+    uint64_t expected = i % 2 ? i : HASHMAP_KEYS;
+
+    bad_lookup += kdb_hashmap_words_get(names + i * 16, HASHMAP_KEYS) != expected;
+    bad_lookup += kdb_hashmap_numbers_get(i * 3, HASHMAP_KEYS) != expected;
+    bad_lookup += kdb_hashmap_numbers_get(i * 3 + 1, HASHMAP_KEYS) != HASHMAP_KEYS;
+  }
+
+  CHECK(bad_lookup == 0);
+
+  kdb_hashmap_words_clear();
+  kdb_hashmap_numbers_clear();
+
+  CHECK(kdb_hashmap_words_count() == 0 && kdb_hashmap_words_get(names + 16, HASHMAP_KEYS) == HASHMAP_KEYS);
+  CHECK(!kdb_hashmap_numbers_remove(3) && kdb_hashmap_numbers_get(3, HASHMAP_KEYS) == HASHMAP_KEYS);
+
+  free(names);
+}
+
+// SMA outputs of a pooled database must match its records
+uint64_t pool_mismatches(KDB* db, uint64_t count, uint64_t first)
+{
+  KDB_VALUE_TYPE outputs[100];
+  uint64_t       mismatches = !kdb_indicator_range(db, 0, 0, count, outputs);
+
+  for (uint64_t i = 0; mismatches == 0 && i < count; ++i)
+  {
+    double sum = 0.0;
+
+    for (uint64_t j = i >= 9 ? i - 9 : 0; j <= i; ++j)
+    {
+      sum += value_at(first + j);
+    }
+
+    mismatches += !near(outputs[i], sum / (i >= 9 ? 10 : i + 1));
+  }
+
+  return mismatches;
+}
+
+// More databases than handles, each with an indicators file that has to be
+// closed and reopened along with its database file
+void check_pool(void)
+{
+  printf("CHECK POOL\n");
+
+  KDB*           dbs[4] = { NULL };
+  char           name[16];
+  KDB_POOL_STATS stats;
+  uint32_t       indicator;
+
+  kdb_pool_configure(2);
+
+  for (uint32_t d = 0; d < 4; ++d)
+  {
+    snprintf(name, sizeof(name), "pool%u", d);
+    remove_files(name);
+
+    dbs[d] = kdb_initialize(name);
+
+    CHECK(dbs[d] != NULL && kdb_indicator_enable(dbs[d], KDB_INDICATOR_SMA, 10, &indicator));
+  }
+
+  for (uint64_t i = 0; i < 100; ++i)
+  {
+    for (uint32_t d = 0; d < 4; ++d)
+    {
+      if (dbs[d])
+      {
+        kdb_add_ts(dbs[d], i, value_at(d * 1000 + i));
+      }
+    }
+  }
+
+  kdb_pool_stats(&stats);
+
+  CHECK(stats.open <= 2 && stats.evictions > 0);
+
+  for (uint32_t pass = 0; pass < 2; ++pass)
+  {
+    uint32_t open       = 0;
+    uint32_t lingering  = 0;
+    uint64_t mismatches = 0;
+
+    for (uint32_t d = 0; d < 4; ++d)
+    {
+      if (dbs[d])
+      {
+        open       += dbs[d]->file != NULL;
+        lingering  += dbs[d]->indicators_file != NULL && dbs[d]->file == NULL;
+        mismatches += pool_mismatches(dbs[d], 100, d * 1000);
+
+        check_records(dbs[d], 100, d * 1000);
+      }
+    }
+
+    // Indicators files are only open next to a pooled database file
+    CHECK(open <= 2 && lingering == 0 && mismatches == 0);
+
+    // The second pass reads the columns saved in the first
+    for (uint32_t d = 0; d < 4; ++d)
+    {
+      if (dbs[d])
+      {
+        CHECK(kdb_finalize(dbs[d]));
+      }
+
+      snprintf(name, sizeof(name), "pool%u", d);
+
+      dbs[d] = pass == 0 ? kdb_initialize(name) : NULL;
+
+      CHECK(pass == 1 || (dbs[d] != NULL && dbs[d]->indicators_count == 1));
+    }
+  }
+
+  kdb_pool_configure(0);
+}
+
+// Series of one container written in turns, so their extents interleave,
+// then reopened and extended
+void check_container(void)
+{
+  printf("CHECK CONTAINER\n");
+
+  char*       names[3] = { "seriesa", "seriesb", "seriesc" };
+  KDB_OPTIONS options  = { 0 };
+
+  options.container = "checks";
+
+  remove_files("checks");
+
+  for (uint32_t s = 0; s < 3; ++s)
+  {
+    remove_files(names[s]);
+  }
+
+  for (uint32_t pass = 0; pass < 2; ++pass)
+  {
+    KDB* series[3] = { NULL };
+
+    // The third series joins the container once it already holds the others
+    for (uint32_t s = 0; s < 2 + pass; ++s)
+    {
+      series[s] = kdb_initialize_with_options(names[s], &options);
+
+      CHECK(series[s] != NULL);
+    }
+
+    for (uint64_t i = 0; i < 300; ++i)
+    {
+      for (uint32_t s = 0; s < 2 + pass; ++s)
+      {
+        uint64_t index = s < 2 ? pass * 300 + i : i;
+
+        if (series[s])
+        {
+          kdb_add_ts(series[s], index, value_at(s * 5000 + index));
+        }
+      }
+    }
+
+    for (uint32_t s = 0; s < 2 + pass; ++s)
+    {
+      if (series[s])
+      {
+        check_records(series[s], s < 2 ? (pass + 1) * 300 : 300, s * 5000);
+        CHECK(kdb_finalize(series[s]));
+      }
+    }
+  }
+
+  // Every series lives in the container, none of them gets its own file
+  FILE* file = fopen("seriesa.kdb", "rb");
+
+  CHECK(file == NULL);
+
+  if (file)
+  {
+    fclose(file);
+  }
+}
+
+// Indicator columns against SMA, EMA and WMA computed from every value
+void check_indicator_columns(KDB* db, const uint32_t* indicators, uint64_t count)
+{
+  KDB_VALUE_TYPE* columns[3];
+  uint64_t        mismatches = 0;
+  double          ema        = value_at(0);
+
+  for (uint32_t k = 0; k < 3; ++k)
+  {
+    columns[k] = (KDB_VALUE_TYPE*)malloc(sizeof(KDB_VALUE_TYPE) * count);
+
+    CHECK(kdb_indicator_range(db, indicators[k], 0, count, columns[k]));
+  }
+
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    double sma    = 0.0;
+    double wma    = 0.0;
+    double weight = 0.0;
+
+    for (uint64_t j = i + 1 > 15 ? i + 1 - 15 : 0; j <= i; ++j)
+    {
+      sma += value_at(j);
+    }
+
+    for (uint64_t j = i + 1 > 30 ? i + 1 - 30 : 0, w = 1; j <= i; ++j, ++w)
+    {
+      wma    += w * value_at(j);
+      weight += w;
+    }
+
+    ema += i > 0 ? 0.1 * (value_at(i) - ema) : 0.0;
+
+    mismatches += !near(columns[0][i], sma / (i + 1 < 15 ? i + 1 : 15));
+    mismatches += !near(columns[1][i], ema);
+    mismatches += !near(columns[2][i], wma / weight);
+  }
+
+  CHECK(mismatches == 0);
+
+  for (uint32_t k = 0; k < 3; ++k)
+  {
+    free(columns[k]);
+  }
+}
+
+// Columns extend with every append and carry over a reopen
+void check_indicators(void)
+{
+  printf("CHECK INDICATORS\n");
+
+  remove_files("indic");
+
+  KDB*     db = kdb_initialize("indic");
+  uint32_t indicators[3];
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  for (uint64_t i = 0; i < 500; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  CHECK(kdb_indicator_enable(db, KDB_INDICATOR_SMA, 15, &indicators[0]));
+  CHECK(kdb_indicator_enable(db, KDB_INDICATOR_EMA, 0.1, &indicators[1]));
+  CHECK(kdb_indicator_enable(db, KDB_INDICATOR_WMA, 30, &indicators[2]));
+
+  for (uint64_t i = 500; i < 1000; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  check_indicator_columns(db, indicators, 1000);
+  CHECK(kdb_finalize(db));
+
+  db = kdb_initialize("indic");
+
+  CHECK(db != NULL && db->indicators_count == 3);
+
+  if (!db)
+  {
+    return;
+  }
+
+  kdb_begin(db);
+
+  for (uint64_t i = 1000; i < 1500; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  CHECK(kdb_commit(db));
+
+  // Enabling them again gives back the loaded ones
+  CHECK(kdb_indicator_enable(db, KDB_INDICATOR_SMA, 15, &indicators[0]));
+  CHECK(kdb_indicator_enable(db, KDB_INDICATOR_EMA, 0.1, &indicators[1]));
+  CHECK(kdb_indicator_enable(db, KDB_INDICATOR_WMA, 30, &indicators[2]));
+
+  check_indicator_columns(db, indicators, 1500);
+  CHECK(kdb_finalize(db));
+}
+
+#define SMA_RECORDS 2000
+
+// Series of every frame over [start, start + count) against kdb_sma
+uint64_t sma_series_mismatches(KDB* db, uint64_t start, uint64_t count, const uint64_t* frames, size_t frames_count)
+{
+  KDB_VALUE_TYPE* out[4];
+  uint64_t        mismatches = 0;
+
+  for (size_t k = 0; k < frames_count; ++k)
+  {
+    out[k] = (KDB_VALUE_TYPE*)malloc(sizeof(KDB_VALUE_TYPE) * (count + 1));
+  }
+
+  mismatches += !kdb_sma_series_multi(db, start, count, frames, frames_count, out);
+
+  for (size_t k = 0; mismatches == 0 && k < frames_count; ++k)
+  {
+    for (uint64_t i = 0; i < count; ++i)
+    {
+      mismatches += !near(out[k][i], kdb_sma(db, start + i, frames[k]));
+    }
+  }
+
+  // A single frame goes through the same pass
+  mismatches += count > 0 && (!kdb_sma_series(db, start, count, frames[0], out[0]) || !near(out[0][count - 1], kdb_sma(db, start + count - 1, frames[0])));
+
+  for (size_t k = 0; k < frames_count; ++k)
+  {
+    free(out[k]);
+  }
+
+  return mismatches;
+}
+
+// Bulk SMA series, streamed from the sum column or copied from an indicator
+void check_sma_series(void)
+{
+  printf("CHECK SMA SERIES\n");
+
+  remove_files("smaser");
+
+  KDB*     db        = kdb_initialize("smaser");
+  uint64_t frames[4] = { 1, 15, 100, SMA_RECORDS + 50 };
+  uint32_t indicator;
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  for (uint64_t i = 0; i < SMA_RECORDS; ++i)
+  {
+    kdb_add_ts(db, i, value_at(i));
+  }
+
+  for (uint32_t pass = 0; pass < 2; ++pass)
+  {
+    CHECK(sma_series_mismatches(db, 0, SMA_RECORDS, frames, 4) == 0);
+    CHECK(sma_series_mismatches(db, 500, 700, frames, 4) == 0);
+    CHECK(sma_series_mismatches(db, SMA_RECORDS - 1, 1, frames, 4) == 0);
+    CHECK(sma_series_mismatches(db, 7, 3, frames + 2, 2) == 0);
+
+    // The second pass copies the 15 record frame from its column
+    CHECK(pass == 1 || kdb_indicator_enable(db, KDB_INDICATOR_SMA, 15, &indicator));
+  }
+
+  KDB_VALUE_TYPE  value;
+  KDB_VALUE_TYPE* out = &value;
+
+  CHECK(kdb_sma_series_multi(db, SMA_RECORDS, 0, frames, 4, &out));
+  CHECK(!kdb_sma_series(db, SMA_RECORDS, 1, 15, &value));
+  CHECK(!kdb_sma_series(db, 0, 1, 0, &value));
+  CHECK(kdb_finalize(db));
+}
+
+// Buckets of [t0, t1) at resolution against the records they hold, timestamps
+// are index * step
+void check_rollup_buckets(KDB* db, uint64_t resolution, uint64_t t0, uint64_t t1, uint64_t step)
+{
+  KDB_ROLLUP_BUCKET buckets[256];
+  uint32_t          found      = 0;
+  uint32_t          expected   = 0;
+  uint64_t          mismatches = 0;
+
+  CHECK(kdb_query_rollup(db, resolution, t0, t1, buckets, 256, &found));
+
+  for (uint64_t start = t0 - t0 % resolution; start < t1; start += resolution)
+  {
+    uint64_t first = (start + step - 1) / step;
+    uint64_t end   = (start + resolution + step - 1) / step;
+
+    end = end < kdb_count(db) ? end : kdb_count(db);
+
+    if (first >= end)
+    {
+      continue;
+    }
+
+    double sum  = 0.0;
+    double low  = value_at(first);
+    double high = value_at(first);
+
+    for (uint64_t i = first; i < end; ++i)
+    {
+      sum  += value_at(i);
+      low   = value_at(i) < low ? value_at(i) : low;
+      high  = value_at(i) > high ? value_at(i) : high;
+    }
+
+    const KDB_ROLLUP_BUCKET* bucket = &buckets[expected < found ? expected : 0];
+
+    mismatches += expected >= found || bucket->start != start || bucket->count != end - first || !near(bucket->sum, sum) ||
+      bucket->low != low || bucket->high != high || bucket->open != value_at(first) || bucket->close != value_at(end - 1);
+
+    expected += 1;
+  }
+
+  CHECK(found == expected && mismatches == 0);
+}
+
+// Rollups answer from their tiers or the file alike, and the tiers carry
+// over a reopen
+void check_rollups(void)
+{
+  printf("CHECK ROLLUPS\n");
+
+  remove_files("rollup");
+
+  KDB*     db       = kdb_initialize("rollup");
+  uint64_t widths[] = { 10, 100 };
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  for (uint64_t i = 0; i < 300; ++i)
+  {
+    kdb_add_ts(db, i * 7, value_at(i));
+  }
+
+  CHECK(kdb_rollup_enable(db, widths, 2));
+
+  for (uint64_t i = 300; i < 1000; ++i)
+  {
+    kdb_add_ts(db, i * 7, value_at(i));
+  }
+
+  check_rollup_buckets(db, 100, 0, 7000, 7);
+  check_rollup_buckets(db, 50, 1234, 5678, 7);
+  check_rollup_buckets(db, 33, 0, 7000, 7);
+  CHECK(kdb_finalize(db));
+
+  db = kdb_initialize("rollup");
+
+  CHECK(db != NULL && db->rollups_count == 2);
+
+  if (!db)
+  {
+    return;
+  }
+
+  CHECK(kdb_begin(db));
+
+  for (uint64_t i = 1000; i < 1200; ++i)
+  {
+    kdb_add_ts(db, i * 7, value_at(i));
+  }
+
+  CHECK(kdb_commit(db));
+
+  check_rollup_buckets(db, 10, 6543, 8400, 7);
+  check_rollup_buckets(db, 100, 0, 8400, 7);
+  check_rollup_buckets(db, 33, 0, 8400, 7);
+  CHECK(kdb_finalize(db));
+}
+
+// Points picked from the records of [start, end), timestamps are index * 7
+uint64_t downsample_mismatches(const KDB_POINT* points, uint32_t found, uint64_t start, uint64_t end)
+{
+  uint64_t mismatches = 0;
+
+  for (uint32_t i = 0; i < found; ++i)
+  {
+    mismatches += points[i].index < start || points[i].index >= end;
+    mismatches += points[i].value != value_at(points[i].index) || points[i].timestamp != points[i].index * 7;
+    mismatches += i > 0 && points[i].index <= points[i - 1].index;
+  }
+
+  return mismatches;
+}
+
+// Downsampling keeps the records that matter, whole ranges when they are
+// short and only the ends when there is no room for a bucket
+void check_downsample(void)
+{
+  printf("CHECK DOWNSAMPLE\n");
+
+  remove_files("downs");
+
+  KDB* db = kdb_initialize("downs");
+
+  CHECK(db != NULL);
+
+  if (!db)
+  {
+    return;
+  }
+
+  for (uint64_t i = 0; i < 1000; ++i)
+  {
+    kdb_add_ts(db, i * 7, value_at(i));
+  }
+
+  KDB_POINT points[100];
+  uint32_t  found     = 0;
+  uint64_t  lowest    = 0;
+  uint64_t  highest   = 0;
+  bool      low_kept  = false;
+  bool      high_kept = false;
+
+  for (uint64_t i = 0; i < 1000; ++i)
+  {
+    lowest  = value_at(i) < value_at(lowest) ? i : lowest;
+    highest = value_at(i) > value_at(highest) ? i : highest;
+  }
+
+  CHECK(kdb_downsample(db, 0, 1000, 100, KDB_DOWNSAMPLE_MIN_MAX, points, &found));
+
+  for (uint32_t i = 0; i < found; ++i)
+  {
+    low_kept  = low_kept || points[i].index == lowest;
+    high_kept = high_kept || points[i].index == highest;
+  }
+
+  CHECK(found > 0 && found <= 100 && downsample_mismatches(points, found, 0, 1000) == 0 && low_kept && high_kept);
+
+  CHECK(kdb_downsample(db, 0, 1000, 100, KDB_DOWNSAMPLE_LTTB, points, &found));
+  CHECK(found == 100 && downsample_mismatches(points, found, 0, 1000) == 0 && points[0].index == 0 && points[found - 1].index == 999);
+
+  CHECK(kdb_downsample(db, 250, 500, 40, KDB_DOWNSAMPLE_LTTB, points, &found));
+  CHECK(found == 40 && downsample_mismatches(points, found, 250, 750) == 0 && points[0].index == 250 && points[found - 1].index == 749);
+
+  // Short ranges come back whole
+  for (uint32_t mode = 0; mode < 2; ++mode)
+  {
+    CHECK(kdb_downsample(db, 10, 30, 100, mode ? KDB_DOWNSAMPLE_LTTB : KDB_DOWNSAMPLE_MIN_MAX, points, &found));
+    CHECK(found == 30 && downsample_mismatches(points, found, 10, 40) == 0 && points[0].index == 10);
+  }
+
+  CHECK(kdb_downsample(db, 0, 1000, 2, KDB_DOWNSAMPLE_LTTB, points, &found));
+  CHECK(found == 2 && points[0].index == 0 && points[1].index == 999 && downsample_mismatches(points, found, 0, 1000) == 0);
+
+  CHECK(!kdb_downsample(db, 900, 101, 100, KDB_DOWNSAMPLE_LTTB, points, &found) && found == 0);
+  CHECK(kdb_finalize(db));
+}
+
+// Copy the bytes of from over the ones of to, mode "r+b" keeps the file in
+// place as another process writing to it would
+bool copy_file(const char* from, const char* to, const char* mode)
+{
+  FILE* source      = fopen(from, "rb");
+  FILE* destination = fopen(to, mode);
+  char  buffer[4096];
+  bool  copied      = source != NULL && destination != NULL;
+
+  for (size_t read = 0; copied && (read = fread(buffer, 1, sizeof(buffer), source)) > 0;)
+  {
+    copied = fwrite(buffer, 1, read, destination) == read;
+  }
+
+  copied = copied && !ferror(source);
+
+  if (source)
+  {
+    fclose(source);
+  }
+
+  if (destination)
+  {
+    copied = fclose(destination) == 0 && copied;
+  }
+
+  return copied;
+}
+
+// A handle picks up the records written to its file by someone else, with
+// the timestamp index it already built following them. The file is swapped
+// with copies of itself taken at 300 and 500 records
+void check_refresh(void)
+{
+  printf("CHECK REFRESH\n");
+
+  remove_files("refresh");
+
+  for (uint32_t pass = 0; pass < 2; ++pass)
+  {
+    KDB* writer = kdb_initialize("refresh");
+
+    CHECK(writer != NULL);
+
+    if (!writer)
+    {
+      return;
+    }
+
+    for (uint64_t i = pass * 300; i < 300 + pass * 200; ++i)
+    {
+      kdb_add_ts(writer, i, value_at(i));
+    }
+
+    CHECK(kdb_finalize(writer));
+    CHECK(copy_file("refresh.kdb", pass ? "refresh.500" : "refresh.300", "wb"));
+  }
+
+  remove_files("refresh");
+
+  CHECK(copy_file("refresh.300", "refresh.kdb", "wb"));
+
+  KDB*     db       = kdb_initialize("refresh");
+  uint64_t appended = 1;
+  uint64_t index    = 0;
+
+  CHECK(db != NULL);
+
+  if (db)
+  {
+    CHECK(kdb_refresh(db, &appended) && appended == 0);
+    CHECK(kdb_find_ts(db, 299, KDB_BOUND_LOWER, &index) && index == 299);
+
+    CHECK(copy_file("refresh.500", "refresh.kdb", "r+b"));
+    CHECK(kdb_refresh(db, &appended) && appended == 200);
+
+    check_records(db, 500, 0);
+    check_stats(db, 500, 0);
+
+    CHECK(kdb_find_ts(db, 450, KDB_BOUND_LOWER, &index) && index == 450);
+    CHECK(kdb_find_ts(db, 450, KDB_BOUND_UPPER, &index) && index == 451);
+    CHECK(kdb_refresh(db, &appended) && appended == 0);
+
+    // A file counting fewer records than the handle is not a newer one
+    CHECK(copy_file("refresh.300", "refresh.kdb", "r+b"));
+    CHECK(!kdb_refresh(db, &appended) && appended == 0);
+    CHECK(kdb_count(db) == 500);
+    CHECK(kdb_finalize(db));
+  }
+
+  remove("refresh.300");
+  remove("refresh.500");
+}
+
 int main(void)
 {
   printf("sizeof(KDB):\t\t\t%lu\n", sizeof(KDB));
@@ -19,9 +2331,11 @@ int main(void)
   printf("sizeof(KDB_HEADER):\t\t%lu\n", sizeof(KDB_HEADER));
   printf("sizeof(KDB_DATA):\t\t%lu\n", sizeof(KDB_DATA));
 
+  remove_files(DB_NAME);
+
   printf("HASHMAP DUMP 1\n");
   kdb_hashmap_dbs_references_dump();
-  
+
   KDB_INITIALIZE(db, DB_NAME);
 
   if (!db)
@@ -53,6 +2367,20 @@ int main(void)
   printf("Variance:\t%f\n", kdb_variance(db));
   printf("Stddev:\t\t%f\n", kdb_stddev(db));
   printf("Median:\t\t%f\n", kdb_median(db));
+  printf("P90:\t\t%f\n", kdb_quantile(db, 0.9));
+  printf("P99:\t\t%f\n", kdb_quantile(db, 0.99));
+
+  check_stats(db, DB_RECORD_COUNT, 0);
+
+  KDB_AGGREGATE aggregate;
+
+  if (kdb_aggregate_range(db, 0, DB_RECORD_COUNT, KDB_AGGREGATE_ALL, &aggregate))
+  {
+    printf("Aggregate (%s):\tsum "KDB_VALUE_TYPE_FORMAT" min "KDB_VALUE_TYPE_FORMAT" max "KDB_VALUE_TYPE_FORMAT" variance "KDB_VALUE_TYPE_FORMAT"\n", kdb_kernels()->name, aggregate.sum, aggregate.min, aggregate.max, aggregate.variance);
+
+    CHECK(aggregate.count == DB_RECORD_COUNT && near(aggregate.sum, kdb_sum(db)) && near(aggregate.variance, kdb_variance(db)));
+    CHECK(aggregate.min == kdb_min(db) && aggregate.max == kdb_max(db));
+  }
 
   printf("\n");
 
@@ -63,6 +2391,8 @@ int main(void)
 
   KDB_INITIALIZE(db2, DB_NAME);
 
+  CHECK(db2 == db);
+
   printf("BEFORE\n");
   printf("db points to: %p\n", db);
   printf("db2 points to: %p\n", db2);
@@ -85,20 +2415,34 @@ int main(void)
   printf("db.initialized  = %d\n", db  ? db->initialized  : 0);
   printf("db2.initialized = %d\n", db2 ? db2->initialized : 0);
 
+  CHECK(db2->initialized && kdb_count(db2) == DB_RECORD_COUNT);
+
   printf("HASHMAP DUMP 5\n");
   kdb_hashmap_dbs_references_dump();
 
   printf("SMA\n");
 
   KDB_VALUE_TYPE sma;
+  uint64_t       mismatches = 0;
 
   for (size_t i = 0; i < DB_RECORD_COUNT; ++i)
   {
     sma = kdb_sma(db2, i, DB_SMA_FRAME);
 
     printf("Index: %d - SMA: %f\n", i, sma);
+
+    double sum = 0.0;
+
+    for (size_t j = i + 1 > DB_SMA_FRAME ? i + 1 - DB_SMA_FRAME : 0; j <= i; ++j)
+    {
+      sum += value_at(j);
+    }
+
+    mismatches += !near(sma, sum / (i + 1 < DB_SMA_FRAME ? i + 1 : DB_SMA_FRAME));
   }
 
+  CHECK(mismatches == 0);
+
   KDB_FINALIZE(db2);
 
   if (db2)
@@ -114,5 +2458,42 @@ int main(void)
   printf("HASHMAP DUMP 6\n");
   kdb_hashmap_dbs_references_dump();
 
-  return 0;
+  check_batch();
+  check_map();
+  check_cursor();
+  check_migration();
+  check_sketch();
+  check_find_ts();
+  check_filter();
+  check_pyramid();
+
+  #ifdef KDB_USE_COMPRESSION
+    check_compression();
+  #endif
+
+  check_aggregate();
+
+  #if !defined(KDB_USE_COMPRESSION) && !defined(KDB_USE_COLUMNS)
+    check_large();
+  #endif
+
+  check_durability();
+
+  #ifdef KDB_USE_THREADS
+    check_ingest();
+    check_shared();
+  #endif
+
+  check_hashmap();
+  check_pool();
+  check_container();
+  check_indicators();
+  check_sma_series();
+  check_rollups();
+  check_downsample();
+  check_refresh();
+
+  printf("%u CHECKS FAILED\n", failures);
+
+  return failures > 0 ? 1 : 0;
 }
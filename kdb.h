@@ -1,24 +1,150 @@
 #ifndef KDB_H_
 #define KDB_H_
 
+// 64-bit off_t for fseeko, include kdb.h before any other header for it to apply
+#if !defined(_WIN32) && !defined(_FILE_OFFSET_BITS)
+  #define _FILE_OFFSET_BITS 64
+#endif
+
 #include <errno.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <unistd.h>
+#else
+  #include <io.h>
+
+  // For MoveFileEx, min and max are field names here
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+
+  #ifndef WIN32_LEAN_AND_MEAN
+    #define WIN32_LEAN_AND_MEAN
+  #endif
+
+  #include <windows.h>
+#endif
+
+#ifdef KDB_USE_THREADS
+  #include <pthread.h>
+  #include <stdatomic.h>
+#endif
+
+// Seeks past 2GB, plain fseek takes a long which is 32-bit on Windows
+#ifdef _WIN32
+  #define KDB_SEEK(file, offset, whence) _fseeki64(file, (__int64)(offset), whence)
+#else
+  #define KDB_SEEK(file, offset, whence) fseeko(file, (off_t)(offset), whence)
+#endif
+
+// Force written data to the disk, macOS has no fdatasync
+#if defined(_WIN32)
+  #define KDB_FSYNC(file) _commit(_fileno(file))
+#elif defined(__APPLE__)
+  #define KDB_FSYNC(file) fsync(fileno(file))
+#else
+  #define KDB_FSYNC(file) fdatasync(fileno(file))
+#endif
+
+// Atomically replace a file with another, rename fails on Windows when the
+// target exists
+#if defined(_WIN32)
+  #define KDB_REPLACE(from, to) (MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0)
+#else
+  #define KDB_REPLACE(from, to) (rename(from, to) == 0)
+#endif
+
 #if defined(KDB_USE_LONG_DOUBLE) && defined(KDB_USE_DOUBLE)
   #error "You can't define KDB_USE_LONG_DOUBLE and KDB_USE_DOUBLE at the same time"
 #endif
 
+#if defined(KDB_USE_LONG_DOUBLE) && defined(KDB_USE_COMPRESSION)
+  #error "You can't define KDB_USE_LONG_DOUBLE and KDB_USE_COMPRESSION at the same time"
+#endif
+
+#if defined(KDB_USE_COLUMNS) && defined(KDB_USE_COMPRESSION)
+  #error "You can't define KDB_USE_COLUMNS and KDB_USE_COMPRESSION at the same time"
+#endif
+
 #define KDB_VERSION_SIZE      4
 #define KDB_NAME_SIZE         8
-#define KDB_VERSION           "KDB\1"
+#define KDB_VERSION           "KDB\2"
+#define KDB_VERSION_NUMBER    2
 #define KDB_FLAGS_TYPE        uint32_t
 #define KDB_FLAGS_TYPE_FORMAT "%04hX"
+#define KDB_CURSOR_CHUNK_SIZE 4096
+#define KDB_CURSOR_READAHEAD  1
+#define KDB_QUANTILE_SLOTS    4
+#define KDB_SKETCH_VERSION    "KDS\2"
+#define KDB_TS_INDEX_BLOCK    256
+#define KDB_ZONES_VERSION     "KDZ\2"
+
+#ifndef KDB_ZONE_SIZE
+  #define KDB_ZONE_SIZE 4096
+#endif
+
+#define KDB_PYRAMID_VERSION   "KDP\2"
+#define KDB_PYRAMID_FANOUT    16
+#define KDB_PYRAMID_LEVELS    8
+#define KDB_BLOCK_SIZE        1024
+#define KDB_BLOCK_MAX_BYTES   (KDB_BLOCK_SIZE * 20 + 16)
+#define KDB_SEGMENT_SIZE      (KDB_BLOCK_SIZE * (sizeof(uint64_t) + 2 * sizeof(KDB_VALUE_TYPE)))
+#define KDB_COLUMN_CHUNK      256
+#define KDB_HISTOGRAM_BINS    32
+
+// Indicators are derived columns, at most KDB_INDICATORS_MAX per database.
+// Their outputs are stored in pages of KDB_INDICATOR_PAGE values
+#define KDB_INDICATORS_VERSION "KDI\1"
+#define KDB_INDICATORS_MAX     16
+#define KDB_INDICATOR_PAGE     4096
+#define KDB_INDICATOR_CHUNK    256
+
+// Rollup tiers bucket records by time, their widths are in timestamp units
+// (seconds for kdb_add)
+#define KDB_ROLLUP_VERSION "KDR\1"
+#define KDB_ROLLUP_TIERS   8
+#define KDB_ROLLUP_MINUTE  60
+#define KDB_ROLLUP_HOUR    3600
+#define KDB_ROLLUP_DAY     86400
+
+// Relative accuracy of the quantile sketch and the buckets kept per sign.
+// With the defaults the covered range spans a factor of about 10^17
+#ifndef KDB_SKETCH_ALPHA
+  #define KDB_SKETCH_ALPHA 0.01
+#endif
+
+#ifndef KDB_SKETCH_BUCKETS
+  #define KDB_SKETCH_BUCKETS 2048
+#endif
+
+// Slots of the ingestion queue, a power of two, and the most records the
+// writer thread commits at once
+#ifndef KDB_QUEUE_CAPACITY
+  #define KDB_QUEUE_CAPACITY 65536
+#endif
+
+#define KDB_QUEUE_BATCH 4096
+
+// Series in a container file grow by extents, extent i holds
+// KDB_CONTAINER_EXTENT << i bytes. Directory blocks list their names
+#define KDB_CONTAINER_VERSION   "KDC\1"
+#define KDB_CONTAINER_EXTENT    4096
+#define KDB_CONTAINER_EXTENTS   40
+#define KDB_CONTAINER_DIRECTORY 64
+
+#ifndef KDB_SKETCH_MIN_VALUE
+  #define KDB_SKETCH_MIN_VALUE 1e-9
+#endif
 
 #ifdef KDB_USE_LONG_DOUBLE
   #define KDB_VALUE_TYPE        long double
@@ -27,9 +153,35 @@
   #define KDB_VALUE_TYPE_FORMAT "%f"
 
   #ifdef KDB_USE_DOUBLE
-    #define KDB_VALUE_TYPE double
+    #define KDB_VALUE_TYPE      double
+    #define KDB_VALUE_BITS_TYPE uint64_t
   #else
-    #define KDB_VALUE_TYPE float
+    #define KDB_VALUE_TYPE      float
+    #define KDB_VALUE_BITS_TYPE uint32_t
+  #endif
+#endif
+
+// Aggregation kernels use SSE2/AVX2 on x86 and NEON on ARM, picked at runtime
+// where the compiler allows it. Long double always runs the scalar kernels
+#if !defined(KDB_NO_SIMD) && !defined(KDB_USE_LONG_DOUBLE)
+  #if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>
+
+    #define KDB_SIMD_SSE2
+    #define KDB_SIMD_AVX2
+    #define KDB_TARGET(name)       __attribute__((target(name)))
+    #define KDB_CPU_SUPPORTS(name) (__builtin_cpu_init(), __builtin_cpu_supports(name))
+  #elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+    #include <intrin.h>
+
+    #define KDB_SIMD_SSE2
+    #define KDB_TARGET(name)
+    #define KDB_CPU_SUPPORTS(name) true
+  #elif defined(__ARM_NEON) && (defined(__aarch64__) || !defined(KDB_USE_DOUBLE))
+    #include <arm_neon.h>
+
+    #define KDB_SIMD_NEON
+    #define KDB_TARGET(name)
   #endif
 #endif
 
@@ -61,6 +213,57 @@
     } \
   } while (0)
 
+// Return call evaluated under the database lock, shared for readers and
+// exclusive for anything touching the file, the header or a cache. Calls
+// nested on the same thread reuse the outer lock
+#ifdef KDB_USE_THREADS
+  #define KDB_LOCKED(db, exclusive, type, call) \
+    do \
+    { \
+      KDB* kdb_previous = kdb_lock(db, exclusive); \
+      type kdb_result   = call; \
+      \
+      kdb_unlock(db, kdb_previous); \
+      \
+      return kdb_result; \
+    } while (0)
+
+  #define KDB_LOCKED_VOID(db, exclusive, call) \
+    do \
+    { \
+      KDB* kdb_previous = kdb_lock(db, exclusive); \
+      \
+      call; \
+      \
+      kdb_unlock(db, kdb_previous); \
+    } while (0)
+
+  // Queries over a lazily built structure share the lock once ready holds.
+  // Until then the call runs under the exclusive lock, which builds it
+  #define KDB_LOCKED_READY(db, ready, type, call) \
+    do \
+    { \
+      KDB* kdb_previous = kdb_lock(db, false); \
+      \
+      if (kdb_previous != db && !(ready)) \
+      { \
+        kdb_unlock(db, kdb_previous); \
+        \
+        kdb_previous = kdb_lock(db, true); \
+      } \
+      \
+      type kdb_result = call; \
+      \
+      kdb_unlock(db, kdb_previous); \
+      \
+      return kdb_result; \
+    } while (0)
+#else
+  #define KDB_LOCKED(db, exclusive, type, call)   return call
+  #define KDB_LOCKED_VOID(db, exclusive, call)    call
+  #define KDB_LOCKED_READY(db, ready, type, call) return call
+#endif
+
 #define KDB_PUSH_HEADER \
   KDB_HEADER old_header = { 0 }; \
   \
@@ -75,12 +278,49 @@
     memcpy(&db->header, &old_header, sizeof(KDB_HEADER)); \
   } while (0)
 
+typedef enum
+{
+  KDB_BOUND_LOWER,
+  KDB_BOUND_UPPER
+} KDB_BOUND;
+
+typedef enum
+{
+  KDB_PREDICATE_GREATER,
+  KDB_PREDICATE_GREATER_EQUAL,
+  KDB_PREDICATE_LESS,
+  KDB_PREDICATE_LESS_EQUAL
+} KDB_PREDICATE;
+
+typedef enum
+{
+  KDB_INDICATOR_SMA,
+  KDB_INDICATOR_EMA,
+  KDB_INDICATOR_WMA
+} KDB_INDICATOR_TYPE;
+
+typedef enum
+{
+  KDB_DOWNSAMPLE_LTTB,
+  KDB_DOWNSAMPLE_MIN_MAX
+} KDB_DOWNSAMPLE_MODE;
+
+typedef enum
+{
+  KDB_COLUMN_TIMESTAMP,
+  KDB_COLUMN_VALUE,
+  KDB_COLUMN_SUM
+} KDB_COLUMN;
+
 typedef enum
 {
   KDB_FLAGS_USE_DOUBLE          = 0b0001,
   KDB_FLAGS_USE_LONG_DOUBLE     = 0b0010,
   KDB_FLAGS_VARIANCE_CALCULATED = 0b0100,
-  KDB_FLAGS_MEDIAN_CALCULATED   = 0b1000
+  KDB_FLAGS_MEDIAN_CALCULATED   = 0b1000,
+  KDB_FLAGS_QUANTILES_CACHED    = 0b10000,
+  KDB_FLAGS_COMPRESSED          = 0b100000,
+  KDB_FLAGS_COLUMNAR            = 0b1000000
 } KDB_FLAGS;
 
 typedef struct
@@ -88,15 +328,34 @@ typedef struct
   char           version[KDB_VERSION_SIZE];
   char           name[KDB_NAME_SIZE];
   KDB_FLAGS_TYPE flags;
-  uint32_t       count;
+  uint64_t       count;
   KDB_VALUE_TYPE sum;
   KDB_VALUE_TYPE average;
   KDB_VALUE_TYPE min;
   KDB_VALUE_TYPE max;
   KDB_VALUE_TYPE variance;
   KDB_VALUE_TYPE median;
+  KDB_VALUE_TYPE m2;
+  double         quantile_keys[KDB_QUANTILE_SLOTS];
+  KDB_VALUE_TYPE quantile_values[KDB_QUANTILE_SLOTS];
+  uint64_t       tail_offset;
 } KDB_HEADER;
 
+// Header layout of version 1 files, kept for migration
+typedef struct
+{
+  char           version[KDB_VERSION_SIZE];
+  char           name[KDB_NAME_SIZE];
+  KDB_FLAGS_TYPE flags;
+  uint32_t       count;
+  KDB_VALUE_TYPE sum;
+  KDB_VALUE_TYPE average;
+  KDB_VALUE_TYPE min;
+  KDB_VALUE_TYPE max;
+  KDB_VALUE_TYPE variance;
+  KDB_VALUE_TYPE median;
+} KDB_HEADER_V1;
+
 typedef struct
 {
   uint64_t       timestamp;
@@ -104,15 +363,414 @@ typedef struct
   KDB_VALUE_TYPE sum;
 } KDB_DATA;
 
+typedef enum
+{
+  KDB_AGGREGATE_SUM       = 0b00001,
+  KDB_AGGREGATE_MIN_MAX   = 0b00010,
+  KDB_AGGREGATE_AVERAGE   = 0b00100,
+  KDB_AGGREGATE_VARIANCE  = 0b01000,
+  KDB_AGGREGATE_HISTOGRAM = 0b10000,
+  KDB_AGGREGATE_ALL       = 0b11111
+} KDB_AGGREGATE_STATS;
+
+// Result of kdb_aggregate_range. The histogram splits the database's whole
+// [min, max] range in KDB_HISTOGRAM_BINS, so ranges can be compared
 typedef struct
 {
-  bool       initialized;
-  char*      p_name;
-  char*      filename;
-  FILE*      file;
-  KDB_HEADER header;
+  uint64_t       count;
+  KDB_VALUE_TYPE sum;
+  KDB_VALUE_TYPE min;
+  KDB_VALUE_TYPE max;
+  KDB_VALUE_TYPE average;
+  KDB_VALUE_TYPE variance;
+  KDB_VALUE_TYPE m2;
+  uint64_t       histogram[KDB_HISTOGRAM_BINS];
+} KDB_AGGREGATE;
+
+typedef void           (*KDB_SUMMARY_KERNEL)(const KDB_VALUE_TYPE* values, uint32_t count, KDB_VALUE_TYPE* sum, KDB_VALUE_TYPE* min, KDB_VALUE_TYPE* max);
+typedef KDB_VALUE_TYPE (*KDB_DEVIATION_KERNEL)(const KDB_VALUE_TYPE* values, uint32_t count, KDB_VALUE_TYPE mean);
+
+typedef struct
+{
+  const char*          name;
+  KDB_SUMMARY_KERNEL   summary;
+  KDB_DEVIATION_KERNEL deviation;
+} KDB_KERNELS;
+
+// Compressed files store KDB_BLOCK_SIZE records per block, Gorilla style:
+// timestamps as delta of deltas and values XORed with the previous one. The
+// first record is kept whole and the running sums are rebuilt on decode
+typedef struct
+{
+  uint32_t       size;
+  uint32_t       count;
+  uint64_t       first_timestamp;
+  KDB_VALUE_TYPE first_value;
+  KDB_VALUE_TYPE first_sum;
+} KDB_BLOCK_HEADER;
+
+// Where the raw tail of a compressed file stood, to undo appends that could
+// not be completed
+typedef struct
+{
+  uint64_t tail_offset;
+  uint32_t tail_count;
+  uint32_t blocks_count;
+} KDB_TAIL_STATE;
+
+// Bit stream over a zeroed buffer, written and read most significant bit first
+typedef struct
+{
+  uint8_t* data;
+  uint64_t position;
+} KDB_BITS;
+
+// Aggregates of a block of KDB_ZONE_SIZE records, also used for range results
+typedef struct
+{
+  KDB_VALUE_TYPE min;
+  KDB_VALUE_TYPE max;
+  KDB_VALUE_TYPE sum;
+  uint64_t       count;
+} KDB_ZONE;
+
+typedef struct
+{
+  char     version[KDB_VERSION_SIZE];
+  uint32_t size;
+  uint64_t covered;
+  uint32_t count;
+} KDB_ZONES_HEADER;
+
+// Level k of the pyramid holds the minimum and maximum of every
+// KDB_PYRAMID_FANOUT^(k + 1) records
+typedef struct
+{
+  KDB_VALUE_TYPE min;
+  KDB_VALUE_TYPE max;
+} KDB_PYRAMID_NODE;
+
+typedef struct
+{
+  KDB_PYRAMID_NODE* nodes;
+  uint32_t          count;
+  uint32_t          capacity;
+} KDB_PYRAMID_LEVEL;
+
+typedef struct
+{
+  char     version[KDB_VERSION_SIZE];
+  uint32_t fanout;
+  uint64_t covered;
+  uint32_t levels;
+  uint32_t counts[KDB_PYRAMID_LEVELS];
+} KDB_PYRAMID_HEADER;
+
+// Window is the period of SMA and WMA, alpha the smoothing factor of EMA
+typedef struct
+{
+  uint32_t type;
+  uint32_t window;
+  double   alpha;
+} KDB_INDICATOR_SPEC;
+
+// Start of "name.kdi", the first count slots hold the indicators and how many
+// records their columns cover. Page p of slot s follows it at a fixed place,
+// see kdb_indicator_offset, so processes sharing the file never move pages
+typedef struct
+{
+  char               version[KDB_VERSION_SIZE];
+  uint32_t           count;
+  KDB_INDICATOR_SPEC specs[KDB_INDICATORS_MAX];
+  uint64_t           covered[KDB_INDICATORS_MAX];
+} KDB_INDICATORS_HEADER;
+
+// Slot of an indicator's column in the file plus the state that extends it by
+// one record. Ring holds the last window values, sum and weighted are their
+// plain and 1..n weighted sums, last is the previous EMA
+typedef struct
+{
+  KDB_INDICATOR_SPEC spec;
+  uint32_t           slot;
+  KDB_VALUE_TYPE*    ring;
+  uint32_t           filled;
+  uint32_t           position;
+  KDB_VALUE_TYPE     sum;
+  KDB_VALUE_TYPE     weighted;
+  KDB_VALUE_TYPE     last;
+} KDB_INDICATOR;
+
+// Record picked by kdb_downsample, index is its position in the database
+typedef struct
+{
+  uint64_t       index;
+  uint64_t       timestamp;
+  KDB_VALUE_TYPE value;
+} KDB_POINT;
+
+// Records whose timestamps fall in [start, start + width). Open and close
+// follow the order in which the records were appended
+typedef struct
+{
+  uint64_t       start;
+  uint64_t       count;
+  KDB_VALUE_TYPE open;
+  KDB_VALUE_TYPE high;
+  KDB_VALUE_TYPE low;
+  KDB_VALUE_TYPE close;
+  KDB_VALUE_TYPE sum;
+} KDB_ROLLUP_BUCKET;
+
+typedef struct
+{
+  uint64_t           width;
+  KDB_ROLLUP_BUCKET* buckets;
+  uint64_t           count;
+  uint64_t           capacity;
+} KDB_ROLLUP_TIER;
+
+typedef struct
+{
+  char     version[KDB_VERSION_SIZE];
+  uint32_t count;
+  uint64_t covered;
+  uint64_t widths[KDB_ROLLUP_TIERS];
+  uint64_t counts[KDB_ROLLUP_TIERS];
+} KDB_ROLLUP_HEADER;
+
+// Log bucketed quantile sketch (DDSketch). Every value lands in the bucket
+// ceil(log_gamma(|value|)) with gamma = (1 + alpha) / (1 - alpha), so any
+// quantile is answered within a relative error of alpha. When the values span
+// more than KDB_SKETCH_BUCKETS buckets the smallest magnitudes are collapsed
+// into the first bucket and only the lowest quantiles lose that guarantee
+typedef struct
+{
+  char     version[KDB_VERSION_SIZE];
+  uint32_t buckets;
+  double   alpha;
+  uint64_t count;
+  uint64_t zero_count;
+  int32_t  positive_offset;
+  int32_t  negative_offset;
+  uint64_t positive[KDB_SKETCH_BUCKETS];
+  uint64_t negative[KDB_SKETCH_BUCKETS];
+} KDB_SKETCH;
+
+// How far appends are pushed before returning. Flush hands every write to the
+// OS, sync also waits for the disk, group syncs every group_records records or
+// group_ms milliseconds and buffered leaves it all to stdio. kdb_sync and
+// kdb_finalize are barriers in every mode.
+// The group_ms limit needs KDB_USE_THREADS: a flusher thread per database
+// syncs once the last sync is group_ms old, also when appends pause. Without
+// threads nothing would run then, so databases asking for it fail to open
+typedef enum
+{
+  KDB_DURABILITY_FLUSH,
+  KDB_DURABILITY_SYNC,
+  KDB_DURABILITY_GROUP,
+  KDB_DURABILITY_BUFFERED
+} KDB_DURABILITY;
+
+// Zeroed options are the defaults. A container name stores the database as
+// one series of <container>.kdc instead of its own file
+typedef struct
+{
+  KDB_DURABILITY durability;
+  uint32_t       group_records;
+  uint32_t       group_ms;
+  const char*    container;
+} KDB_OPTIONS;
+
+typedef struct
+{
+  char     version[KDB_VERSION_SIZE];
+  uint32_t series;
+  uint64_t end;
+  uint64_t directory;
+} KDB_CONTAINER_HEADER;
+
+// Directory entry, table is the offset of the series' extent offsets
+typedef struct
+{
+  char     name[KDB_NAME_SIZE];
+  uint64_t table;
+} KDB_CONTAINER_ENTRY;
+
+typedef struct
+{
+  uint64_t            next;
+  KDB_CONTAINER_ENTRY entries[KDB_CONTAINER_DIRECTORY];
+} KDB_CONTAINER_BLOCK;
+
+// Open container shared by its series. Index is an open addressing table
+// of entry positions plus one, keyed by name
+typedef struct
+{
+  char*                name;
+  char*                filename;
+  FILE*                file;
+  uint64_t             references;
+  KDB_CONTAINER_HEADER header;
+  KDB_CONTAINER_ENTRY* entries;
+  uint32_t             entries_capacity;
+  uint64_t*            blocks;
+  uint32_t             blocks_capacity;
+  uint32_t*            index;
+  uint32_t             index_mask;
+#ifdef KDB_USE_THREADS
+  pthread_mutex_t      lock;
+#endif
+} KDB_CONTAINER;
+
+#ifdef KDB_USE_THREADS
+typedef struct
+{
+  _Atomic uint64_t sequence;
+  uint64_t         timestamp;
+  KDB_VALUE_TYPE   value;
+  uint64_t         enqueued_at;
+} KDB_QUEUE_SLOT;
+
+// Bounded MPSC ring. Producers claim slots with a CAS on head, the writer
+// thread alone moves tail and written, which trails it by the batch in flight
+typedef struct
+{
+  KDB_QUEUE_SLOT*  slots;
+  uint64_t         mask;
+  _Atomic uint64_t head;
+  _Atomic uint64_t tail;
+  _Atomic uint64_t written;
+  _Atomic bool     running;
+  _Atomic bool     sleeping;
+  _Atomic uint32_t waiting;
+  pthread_t        writer;
+  pthread_mutex_t  mutex;
+  pthread_cond_t   wake;
+  pthread_cond_t   progress;
+  _Atomic uint64_t stalls;
+  _Atomic uint64_t failed;
+  _Atomic uint64_t batches;
+  _Atomic uint64_t max_depth;
+  _Atomic uint64_t latency_total;
+  _Atomic uint64_t latency_max;
+  uint64_t         timestamps[KDB_QUEUE_BATCH];
+  KDB_VALUE_TYPE   values[KDB_QUEUE_BATCH];
+} KDB_QUEUE;
+
+// Latencies are in microseconds, from kdb_ingest until the batch holding the
+// record is written. Stalls count the times a producer found the ring full
+typedef struct
+{
+  uint64_t enqueued;
+  uint64_t written;
+  uint64_t failed;
+  uint64_t batches;
+  uint64_t stalls;
+  uint64_t depth;
+  uint64_t max_depth;
+  uint64_t latency_average;
+  uint64_t latency_max;
+} KDB_INGEST_STATS;
+
+// Thread enforcing the group_ms limit of a database
+typedef struct
+{
+  pthread_t       thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t  wake;
+  bool            running;
+} KDB_FLUSHER;
+#endif
+
+// Handles of the pool are shared by every database of the process. A zero
+// capacity keeps each file open for the lifetime of its database
+typedef struct
+{
+  uint32_t capacity;
+  uint32_t open;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} KDB_POOL_STATS;
+
+typedef struct KDB
+{
+  bool              initialized;
+  char*             p_name;
+  char*             filename;
+  FILE*             file;
+  KDB_HEADER        header;
+  bool              in_batch;
+  uint64_t          batch_start;
+  size_t            batch_count;
+  size_t            batch_capacity;
+  KDB_DATA*         batch;
+  KDB_HEADER        batch_header;
+  void*             map;
+  size_t            map_size;
+  uint64_t          map_capacity;
+  uint32_t          quantile_slot;
+  KDB_SKETCH*       sketch;
+  bool              ts_indexed;
+  uint64_t*         ts_index;
+  uint32_t          ts_index_count;
+  uint32_t          ts_index_capacity;
+  bool              zoned;
+  KDB_ZONE*         zones;
+  uint32_t          zones_count;
+  uint32_t          zones_capacity;
+  uint64_t          zones_covered;
+  bool              pyramided;
+  uint64_t          pyramid_covered;
+  KDB_PYRAMID_LEVEL pyramid[KDB_PYRAMID_LEVELS];
+  KDB_INDICATOR*    indicators;
+  uint32_t          indicators_count;
+  uint64_t          indicators_covered;
+  bool              indicators_warm;
+  FILE*             indicators_file;
+  KDB_ROLLUP_TIER*  rollups;
+  uint32_t          rollups_count;
+  uint64_t          rollups_covered;
+  uint64_t*         blocks;
+  uint32_t          blocks_count;
+  uint32_t          blocks_capacity;
+  bool              blocks_loaded;
+  KDB_DATA*         tail;
+  uint32_t          tail_count;
+  KDB_DATA*         decoded;
+  uint32_t          decoded_block;
+  uint8_t*          scratch;
+  KDB_OPTIONS       options;
+  uint64_t          unsynced;
+  uint64_t          synced_at;
+  bool              pooled;
+  struct KDB*       pool_prev;
+  struct KDB*       pool_next;
+  KDB_CONTAINER*    container;
+  uint64_t          table;
+  uint64_t          extents[KDB_CONTAINER_EXTENTS];
+#ifdef KDB_USE_THREADS
+  KDB_QUEUE*        queue;
+  KDB_FLUSHER*      flusher;
+  pthread_rwlock_t  lock;
+  pthread_mutex_t   io_lock;
+#endif
 } KDB;
 
+typedef struct
+{
+  KDB*            db;
+  uint64_t        position;
+  uint64_t        end;
+  uint32_t        chunk_size;
+  uint32_t        readahead;
+  bool            failed;
+  KDB_DATA*       buffer;
+  const KDB_DATA* block;
+  uint64_t        block_count;
+} KDB_CURSOR;
+
+// Open databases by name, the tables grow past their initial capacity
 #define KDB_HASHMAP_NAME       dbs
 #define KDB_HASHMAP_CAPACITY   32
 #define KDB_HASHMAP_KEY_TYPE   char*
@@ -125,31 +783,250 @@ typedef struct
 #define KDB_HASHMAP_VALUE_TYPE uint64_t
 #include "kdb_hashmap.h"
 
+#define KDB_HASHMAP_NAME       containers
+#define KDB_HASHMAP_CAPACITY   8
+#define KDB_HASHMAP_KEY_TYPE   char*
+#define KDB_HASHMAP_VALUE_TYPE KDB_CONTAINER*
+#include "kdb_hashmap.h"
+
 int            kdb_compare_values(const void* a, const void* b);
 KDB_VALUE_TYPE kdb_map_value(KDB_VALUE_TYPE value, KDB_VALUE_TYPE min_a, KDB_VALUE_TYPE max_a, KDB_VALUE_TYPE min_b, KDB_VALUE_TYPE max_b);
 void           kdb_dump_flags_binary(KDB* db);
 void           kdb_dump_flags_name(KDB* db);
 void           kdb_dump_header(KDB* db);
-void           kdb_dump_data(KDB_DATA* data);
+void           kdb_dump_data(const KDB_DATA* data);
 void           kdb_dump(KDB* db, bool include_all_data);
 bool           kdb_write_header(KDB* db);
+uint64_t       kdb_now_us(void);
+uint64_t       kdb_now_ms(void);
+bool           kdb_flush(KDB* db);
+bool           kdb_sync(KDB* db);
+bool           kdb_sync_locked(KDB* db);
+bool           kdb_refresh(KDB* db, uint64_t* appended);
+bool           kdb_refresh_locked(KDB* db, uint64_t* appended);
 bool           kdb_write_data(KDB* db, KDB_DATA* data);
+bool           kdb_migrate(KDB* db);
+uint32_t       kdb_leading_zeros(uint64_t value);
+uint32_t       kdb_trailing_zeros(uint64_t value);
+void           kdb_bits_write(KDB_BITS* bits, uint64_t value, uint32_t count);
+uint64_t       kdb_bits_read(KDB_BITS* bits, uint32_t count);
+uint32_t       kdb_encode_block(const KDB_DATA* records, uint32_t count, KDB_BLOCK_HEADER* header, uint8_t* out);
+void           kdb_decode_block(const KDB_BLOCK_HEADER* header, const uint8_t* payload, KDB_DATA* out);
+bool           kdb_compressed_open(KDB* db);
+void           kdb_compressed_close(KDB* db);
+bool           kdb_compressed_push_block(KDB* db, uint64_t offset);
+bool           kdb_compressed_blocks(KDB* db);
+bool           kdb_compressed_refresh(KDB* db, const KDB_HEADER* header);
+bool           kdb_compressed_load(KDB* db, uint32_t block);
+const KDB_DATA* kdb_compressed_span(KDB* db, uint64_t index, uint32_t* count);
+bool           kdb_compressed_append(KDB* db, uint64_t start, const KDB_DATA* records, uint64_t count);
+void           kdb_compressed_mark(KDB* db, KDB_TAIL_STATE* state);
+bool           kdb_compressed_restore(KDB* db, const KDB_TAIL_STATE* state);
+size_t         kdb_column_width(KDB_COLUMN column);
+uint64_t       kdb_column_offset(KDB_COLUMN column, uint64_t index);
+bool           kdb_write_column(KDB* db, KDB_COLUMN column, uint64_t start, uint64_t count, const void* in);
+bool           kdb_read_column(KDB* db, KDB_COLUMN column, uint64_t start, uint64_t count, void* out);
+bool           kdb_read_records(KDB* db, uint64_t start, uint64_t count, KDB_DATA* out);
+bool           kdb_write_records(KDB* db, uint64_t start, const KDB_DATA* records, uint64_t count);
+bool           kdb_file_read_at(FILE* file, uint64_t offset, void* buffer, size_t size);
+bool           kdb_file_write_at(FILE* file, uint64_t offset, const void* buffer, size_t size);
+bool           kdb_read_at(KDB* db, uint64_t offset, void* buffer, size_t size);
+bool           kdb_write_at(KDB* db, uint64_t offset, const void* buffer, size_t size);
+KDB_CONTAINER* kdb_container_open(const char* name);
+void           kdb_container_close(KDB_CONTAINER* container);
+bool           kdb_container_write(KDB_CONTAINER* container, uint64_t offset, const void* buffer, size_t size);
+bool           kdb_container_index(KDB_CONTAINER* container, uint32_t position);
+uint32_t       kdb_container_find(KDB_CONTAINER* container, const char* name);
+bool           kdb_container_add(KDB_CONTAINER* container, const char* name, uint32_t* position);
+uint64_t       kdb_container_allocate(KDB_CONTAINER* container, uint64_t size, uint64_t alignment);
+bool           kdb_container_attach(KDB* db, const char* name, bool* created);
+bool           kdb_container_extents(KDB* db);
+uint32_t       kdb_container_extent(uint64_t offset, uint64_t* start);
+bool           kdb_container_io(KDB* db, uint64_t offset, void* buffer, size_t size, bool write);
+FILE*          kdb_file(KDB* db);
+void           kdb_pool_link(KDB* db);
+void           kdb_pool_unlink(KDB* db);
+bool           kdb_pool_evict(KDB* db);
+void           kdb_pool_trim(uint32_t room);
+void           kdb_pool_attach(KDB* db);
+FILE*          kdb_pool_detach(KDB* db);
+void           kdb_pool_configure(uint32_t capacity);
+void           kdb_pool_stats(KDB_POOL_STATS* stats);
 KDB*           kdb_initialize(char* name);
+KDB*           kdb_initialize_with_options(char* name, const KDB_OPTIONS* options);
+KDB*           kdb_initialize_locked(char* name, const KDB_OPTIONS* options);
 bool           kdb_finalize(KDB* db);
+bool           kdb_finalize_locked(KDB* db);
+bool           kdb_map(KDB* db);
+bool           kdb_map_locked(KDB* db);
+void           kdb_unmap(KDB* db);
+void           kdb_unmap_locked(KDB* db);
+bool           kdb_remap(KDB* db, uint64_t count);
+uint64_t       kdb_committed_count(KDB* db);
+const KDB_DATA* kdb_records(KDB* db, uint64_t* count);
+const KDB_DATA* kdb_record(KDB* db, uint64_t index, KDB_DATA* buffer);
 bool           kdb_get_data(KDB* db, int64_t index, KDB_DATA* data);
+bool           kdb_get_data_locked(KDB* db, int64_t index, KDB_DATA* data);
+bool           kdb_get_range(KDB* db, uint64_t start, uint64_t count, KDB_DATA* out);
+bool           kdb_get_range_locked(KDB* db, uint64_t start, uint64_t count, KDB_DATA* out);
+void           kdb_advise(KDB* db, uint64_t start, uint64_t count);
+bool           kdb_cursor_open(KDB_CURSOR* cursor, KDB* db, uint64_t start, uint64_t count, uint32_t chunk_size, uint32_t readahead);
+bool           kdb_cursor_open_locked(KDB_CURSOR* cursor, KDB* db, uint64_t start, uint64_t count, uint32_t chunk_size, uint32_t readahead);
+uint64_t       kdb_cursor_next_block(KDB_CURSOR* cursor, const KDB_DATA** records);
+uint64_t       kdb_cursor_next_block_locked(KDB_CURSOR* cursor, const KDB_DATA** records);
+const KDB_DATA* kdb_cursor_next(KDB_CURSOR* cursor);
+void           kdb_cursor_close(KDB_CURSOR* cursor);
 bool           kdb_get_data_normalized(KDB* db, int64_t index, KDB_DATA* data);
+bool           kdb_get_data_normalized_locked(KDB* db, int64_t index, KDB_DATA* data);
 bool           kdb_get_data_normalized_neg(KDB* db, int64_t index, KDB_DATA* data);
+bool           kdb_get_data_normalized_neg_locked(KDB* db, int64_t index, KDB_DATA* data);
+void           kdb_apply_value(KDB_HEADER* header, KDB_VALUE_TYPE value);
+bool           kdb_reserve_batch(KDB* db, size_t capacity);
 bool           kdb_add_ts(KDB* db, uint64_t timestamp, KDB_VALUE_TYPE value);
+bool           kdb_add_ts_locked(KDB* db, uint64_t timestamp, KDB_VALUE_TYPE value);
 bool           kdb_add(KDB* db, KDB_VALUE_TYPE value);
-uint32_t       kdb_count(KDB* db);
+bool           kdb_begin(KDB* db);
+bool           kdb_begin_locked(KDB* db);
+bool           kdb_commit(KDB* db);
+bool           kdb_commit_locked(KDB* db);
+void           kdb_rollback(KDB* db);
+void           kdb_rollback_locked(KDB* db);
+bool           kdb_add_batch(KDB* db, const uint64_t* timestamps, const KDB_VALUE_TYPE* values, size_t count);
+bool           kdb_add_batch_locked(KDB* db, const uint64_t* timestamps, const KDB_VALUE_TYPE* values, size_t count);
+uint64_t       kdb_count(KDB* db);
+uint64_t       kdb_count_locked(KDB* db);
 KDB_VALUE_TYPE kdb_sum(KDB* db);
+KDB_VALUE_TYPE kdb_sum_locked(KDB* db);
 KDB_VALUE_TYPE kdb_average(KDB* db);
+KDB_VALUE_TYPE kdb_average_locked(KDB* db);
 KDB_VALUE_TYPE kdb_min(KDB* db);
+KDB_VALUE_TYPE kdb_min_locked(KDB* db);
 KDB_VALUE_TYPE kdb_max(KDB* db);
+KDB_VALUE_TYPE kdb_max_locked(KDB* db);
 KDB_VALUE_TYPE kdb_variance(KDB* db);
+KDB_VALUE_TYPE kdb_variance_locked(KDB* db);
 KDB_VALUE_TYPE kdb_stddev(KDB* db);
+KDB_VALUE_TYPE kdb_stddev_locked(KDB* db);
 KDB_VALUE_TYPE kdb_median(KDB* db);
-KDB_VALUE_TYPE kdb_sma(KDB* db, uint32_t index, uint32_t frame);
+KDB_VALUE_TYPE kdb_median_locked(KDB* db);
+bool           kdb_read_values(KDB* db, uint64_t start, uint64_t count, KDB_VALUE_TYPE* out);
+bool           kdb_read_values_locked(KDB* db, uint64_t start, uint64_t count, KDB_VALUE_TYPE* out);
+void           kdb_sort_values(KDB_VALUE_TYPE* values, int64_t size);
+void           kdb_select(KDB_VALUE_TYPE* values, int64_t left, int64_t right, const int64_t* ranks, size_t rank_count, uint32_t depth);
+bool           kdb_compute_quantiles(KDB* db, const double* qs, size_t count, KDB_VALUE_TYPE* out);
+KDB_VALUE_TYPE kdb_quantile(KDB* db, double q);
+KDB_VALUE_TYPE kdb_quantile_locked(KDB* db, double q);
+bool           kdb_quantiles(KDB* db, const double* qs, size_t count, KDB_VALUE_TYPE* out);
+bool           kdb_quantiles_locked(KDB* db, const double* qs, size_t count, KDB_VALUE_TYPE* out);
+KDB_VALUE_TYPE kdb_sma(KDB* db, uint64_t index, uint64_t frame);
+KDB_VALUE_TYPE kdb_sma_locked(KDB* db, uint64_t index, uint64_t frame);
+bool           kdb_sma_series(KDB* db, uint64_t start, uint64_t count, uint64_t frame, KDB_VALUE_TYPE* out);
+bool           kdb_sma_series_multi(KDB* db, uint64_t start, uint64_t count, const uint64_t* frames, size_t frames_count, KDB_VALUE_TYPE** out);
+bool           kdb_sma_series_multi_locked(KDB* db, uint64_t start, uint64_t count, const uint64_t* frames, size_t frames_count, KDB_VALUE_TYPE** out);
+char*          kdb_companion_filename(KDB* db, const char* extension);
+void           kdb_after_append(KDB* db, uint64_t first, const KDB_DATA* records, uint64_t count);
+void           kdb_sketch_reset(KDB_SKETCH* sketch);
+void           kdb_sketch_add_key(KDB_SKETCH* sketch, bool negative, int32_t key, uint64_t count);
+void           kdb_sketch_add(KDB_SKETCH* sketch, KDB_VALUE_TYPE value);
+bool           kdb_sketch_merge(KDB_SKETCH* into, const KDB_SKETCH* from);
+KDB_VALUE_TYPE kdb_sketch_quantile(const KDB_SKETCH* sketch, double q);
+bool           kdb_sketch_enable(KDB* db);
+bool           kdb_sketch_enable_locked(KDB* db);
+bool           kdb_sketch_load(KDB* db, bool create);
+bool           kdb_sketch_save(KDB* db);
+KDB_VALUE_TYPE kdb_quantile_approx(KDB* db, double q);
+KDB_VALUE_TYPE kdb_quantile_approx_locked(KDB* db, double q);
+KDB_VALUE_TYPE kdb_median_approx(KDB* db);
+KDB_VALUE_TYPE kdb_median_approx_locked(KDB* db);
+bool           kdb_ts_index_push(KDB* db, uint64_t timestamp);
+bool           kdb_ts_index_build(KDB* db);
+bool           kdb_find_ts(KDB* db, uint64_t timestamp, KDB_BOUND bound, uint64_t* index);
+bool           kdb_find_ts_locked(KDB* db, uint64_t timestamp, KDB_BOUND bound, uint64_t* index);
+bool           kdb_range_by_time(KDB* db, uint64_t t0, uint64_t t1, uint64_t* start, uint64_t* count);
+bool           kdb_range_by_time_locked(KDB* db, uint64_t t0, uint64_t t1, uint64_t* start, uint64_t* count);
+KDB_VALUE_TYPE kdb_sma_by_time(KDB* db, uint64_t t0, uint64_t t1);
+KDB_VALUE_TYPE kdb_sma_by_time_locked(KDB* db, uint64_t t0, uint64_t t1);
+bool           kdb_zones_add(KDB* db, const KDB_DATA* records, uint64_t count);
+bool           kdb_zones_enable(KDB* db);
+bool           kdb_zones_enable_locked(KDB* db);
+bool           kdb_zones_load(KDB* db, bool create);
+bool           kdb_zones_save(KDB* db);
+bool           kdb_range_stats(KDB* db, uint64_t start, uint64_t end, KDB_ZONE* stats);
+bool           kdb_range_stats_locked(KDB* db, uint64_t start, uint64_t end, KDB_ZONE* stats);
+bool           kdb_pyramid_add(KDB* db, const KDB_DATA* records, uint64_t count);
+void           kdb_pyramid_clear(KDB* db);
+bool           kdb_pyramid_enable(KDB* db);
+bool           kdb_pyramid_enable_locked(KDB* db);
+bool           kdb_pyramid_load(KDB* db, bool create);
+bool           kdb_pyramid_save(KDB* db);
+bool           kdb_range_min_max(KDB* db, uint64_t start, uint64_t end, KDB_VALUE_TYPE* min, KDB_VALUE_TYPE* max);
+bool           kdb_range_min_max_locked(KDB* db, uint64_t start, uint64_t end, KDB_VALUE_TYPE* min, KDB_VALUE_TYPE* max);
+KDB_VALUE_TYPE kdb_range_min(KDB* db, uint64_t start, uint64_t end);
+KDB_VALUE_TYPE kdb_range_max(KDB* db, uint64_t start, uint64_t end);
+bool           kdb_filter(KDB* db, KDB_PREDICATE predicate, KDB_VALUE_TYPE threshold, uint64_t* position, uint64_t end, uint64_t* indexes, uint32_t capacity, uint32_t* found);
+bool           kdb_filter_locked(KDB* db, KDB_PREDICATE predicate, KDB_VALUE_TYPE threshold, uint64_t* position, uint64_t end, uint64_t* indexes, uint32_t capacity, uint32_t* found);
+void           kdb_kernel_scalar_summary(const KDB_VALUE_TYPE* values, uint32_t count, KDB_VALUE_TYPE* sum, KDB_VALUE_TYPE* min, KDB_VALUE_TYPE* max);
+KDB_VALUE_TYPE kdb_kernel_scalar_deviation(const KDB_VALUE_TYPE* values, uint32_t count, KDB_VALUE_TYPE mean);
+const KDB_KERNELS* kdb_kernels(void);
+void           kdb_kernels_resolve(void);
+bool           kdb_aggregate_range(KDB* db, uint64_t start, uint64_t end, KDB_AGGREGATE_STATS stats, KDB_AGGREGATE* out);
+bool           kdb_aggregate_range_locked(KDB* db, uint64_t start, uint64_t end, KDB_AGGREGATE_STATS stats, KDB_AGGREGATE* out);
+void           kdb_indicator_reset(KDB_INDICATOR* indicator);
+KDB_VALUE_TYPE kdb_indicator_step(KDB_INDICATOR* indicator, KDB_VALUE_TYPE value);
+uint64_t       kdb_indicator_offset(uint32_t slot, uint64_t index);
+bool           kdb_indicator_warm_up(KDB* db, KDB_INDICATOR* indicator, uint64_t covered);
+bool           kdb_indicator_write(KDB* db, KDB_INDICATOR* indicator, uint64_t index, const KDB_VALUE_TYPE* values, uint64_t count);
+bool           kdb_indicator_replay(KDB* db, KDB_INDICATOR* indicator, uint64_t start, uint64_t end, bool store);
+bool           kdb_indicator_find(KDB* db, KDB_INDICATOR_TYPE type, double parameter, uint32_t* indicator);
+bool           kdb_indicator_enable(KDB* db, KDB_INDICATOR_TYPE type, double parameter, uint32_t* indicator);
+bool           kdb_indicator_enable_locked(KDB* db, KDB_INDICATOR_TYPE type, double parameter, uint32_t* indicator);
+bool           kdb_indicator_get(KDB* db, uint32_t indicator, uint64_t index, KDB_VALUE_TYPE* value);
+bool           kdb_indicator_get_locked(KDB* db, uint32_t indicator, uint64_t index, KDB_VALUE_TYPE* value);
+bool           kdb_indicator_range(KDB* db, uint32_t indicator, uint64_t start, uint64_t count, KDB_VALUE_TYPE* out);
+bool           kdb_indicator_range_locked(KDB* db, uint32_t indicator, uint64_t start, uint64_t count, KDB_VALUE_TYPE* out);
+bool           kdb_indicators_add(KDB* db, uint64_t first, const KDB_DATA* records, uint64_t count);
+bool           kdb_indicators_catch_up(KDB* db);
+bool           kdb_indicators_warm_up(KDB* db);
+void           kdb_indicators_clear(KDB* db);
+bool           kdb_indicators_open(KDB* db, bool create);
+FILE*          kdb_indicators_handle(KDB* db);
+bool           kdb_indicators_read(KDB* db, KDB_INDICATORS_HEADER* header);
+bool           kdb_indicators_load(KDB* db);
+bool           kdb_indicators_save(KDB* db);
+void           kdb_rollup_merge(KDB_ROLLUP_BUCKET* into, const KDB_ROLLUP_BUCKET* from);
+bool           kdb_rollup_push(KDB_ROLLUP_TIER* tier, uint64_t timestamp, KDB_VALUE_TYPE value);
+bool           kdb_rollup_emit(KDB_ROLLUP_BUCKET* out, uint32_t capacity, uint32_t* found, uint64_t resolution, const KDB_ROLLUP_BUCKET* bucket);
+bool           kdb_rollup_enable(KDB* db, const uint64_t* widths, uint32_t count);
+bool           kdb_rollup_enable_locked(KDB* db, const uint64_t* widths, uint32_t count);
+KDB_ROLLUP_TIER* kdb_rollup_tier(KDB* db, uint64_t resolution);
+bool           kdb_query_rollup(KDB* db, uint64_t resolution, uint64_t t0, uint64_t t1, KDB_ROLLUP_BUCKET* out, uint32_t capacity, uint32_t* found);
+bool           kdb_query_rollup_locked(KDB* db, uint64_t resolution, uint64_t t0, uint64_t t1, KDB_ROLLUP_BUCKET* out, uint32_t capacity, uint32_t* found);
+bool           kdb_rollups_add(KDB* db, const KDB_DATA* records, uint64_t count);
+void           kdb_rollups_reset(KDB* db);
+bool           kdb_rollups_catch_up(KDB* db);
+void           kdb_rollups_clear(KDB* db);
+bool           kdb_rollups_load(KDB* db);
+bool           kdb_rollups_save(KDB* db);
+bool           kdb_downsample(KDB* db, uint64_t start, uint64_t count, uint32_t target_points, KDB_DOWNSAMPLE_MODE mode, KDB_POINT* out, uint32_t* found);
+bool           kdb_downsample_locked(KDB* db, uint64_t start, uint64_t count, uint32_t target_points, KDB_DOWNSAMPLE_MODE mode, KDB_POINT* out, uint32_t* found);
+
+#ifdef KDB_USE_THREADS
+KDB*           kdb_lock(KDB* db, bool exclusive);
+void           kdb_unlock(KDB* db, KDB* previous);
+void           kdb_deadline(struct timespec* deadline, uint64_t timeout_ms);
+void*          kdb_flusher_run(void* argument);
+bool           kdb_flusher_start(KDB* db);
+void           kdb_flusher_stop(KDB* db);
+bool           kdb_queue_empty(KDB_QUEUE* queue);
+uint32_t       kdb_queue_drain(KDB_QUEUE* queue, uint64_t* enqueued_sum, uint64_t* oldest);
+void           kdb_queue_notify(KDB_QUEUE* queue);
+void*          kdb_queue_writer(void* argument);
+bool           kdb_ingest_start(KDB* db, uint32_t capacity);
+bool           kdb_ingest(KDB* db, uint64_t timestamp, KDB_VALUE_TYPE value);
+bool           kdb_ingest_flush(KDB* db);
+bool           kdb_ingest_stop(KDB* db);
+void           kdb_ingest_stats(KDB* db, KDB_INGEST_STATS* stats);
+#endif
 
 #define KDB_INITIALIZE(variable_name, db_name) \
   KDB* variable_name; \
@@ -173,6 +1050,70 @@ KDB_VALUE_TYPE kdb_sma(KDB* db, uint32_t index, uint32_t frame);
 #endif // KDB_H_
 
 #ifdef KDB_IMPLEMENTATION
+// Databases with an open file, most recently used first
+KDB*           kdb_pool_head = NULL;
+KDB*           kdb_pool_tail = NULL;
+KDB_POOL_STATS kdb_pool      = { 0 };
+
+#ifdef KDB_USE_THREADS
+// Guards the dbs and dbs_references maps
+pthread_mutex_t kdb_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Guards the handle pool
+pthread_mutex_t kdb_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Database whose lock the current thread holds
+_Thread_local KDB* kdb_lock_owner = NULL;
+
+// Take the lock of db unless this thread already holds it. Returns the
+// database held before, or db itself when nothing was taken
+KDB* kdb_lock(KDB* db, bool exclusive)
+{
+  if (!db || !db->initialized)
+  {
+    return db;
+  }
+
+  // Shared functions never call exclusive ones, so the held lock is enough
+  if (kdb_lock_owner == db)
+  {
+    return db;
+  }
+
+  // Without pread readers share the FILE position, so they take turns
+  #ifdef _WIN32
+    exclusive = true;
+  #endif
+
+  if (exclusive)
+  {
+    pthread_rwlock_wrlock(&db->lock);
+  }
+  else
+  {
+    pthread_rwlock_rdlock(&db->lock);
+  }
+
+  KDB* previous = kdb_lock_owner;
+
+  kdb_lock_owner = db;
+
+  return previous;
+}
+
+void kdb_unlock(KDB* db, KDB* previous)
+{
+  if (previous == db)
+  {
+    return;
+  }
+
+  kdb_lock_owner = previous;
+
+  pthread_rwlock_unlock(&db->lock);
+}
+#endif
+
 int kdb_compare_values(const void* a, const void* b)
 {
   KDB_VALUE_TYPE first  = *(const KDB_VALUE_TYPE*)a;
@@ -239,6 +1180,16 @@ void kdb_dump_flags_name(KDB* db)
     }
   }
 
+  if ((db->header.flags & KDB_FLAGS_QUANTILES_CACHED) != 0)
+  {
+    printf("%s%s", printed_flag ? " | " : "", "QUANTILES_CACHED");
+
+    if (!printed_flag)
+    {
+      printed_flag = true;
+    }
+  }
+
   if ((db->header.flags & KDB_FLAGS_VARIANCE_CALCULATED) != 0)
   {
     printf("%s%s", printed_flag ? " | " : "", "VARIANCE_CALCULATED");
@@ -268,6 +1219,26 @@ void kdb_dump_flags_name(KDB* db)
       printed_flag = true;
     }
   }
+
+  if ((db->header.flags & KDB_FLAGS_COMPRESSED) != 0)
+  {
+    printf("%s%s", printed_flag ? " | " : "", "COMPRESSED");
+
+    if (!printed_flag)
+    {
+      printed_flag = true;
+    }
+  }
+
+  if ((db->header.flags & KDB_FLAGS_COLUMNAR) != 0)
+  {
+    printf("%s%s", printed_flag ? " | " : "", "COLUMNAR");
+
+    if (!printed_flag)
+    {
+      printed_flag = true;
+    }
+  }
 }
 void kdb_dump_header(KDB* db)
 {
@@ -294,7 +1265,7 @@ void kdb_dump_header(KDB* db)
   kdb_dump_flags_name(db);
 
   printf(")\n");
-  printf("Records' count:\t%u\n",                db->header.count);
+  printf("Records' count:\t%llu\n",              (unsigned long long)db->header.count);
   printf("Sum:\t\t"KDB_VALUE_TYPE_FORMAT"\n",    db->header.sum);
   printf("Average:\t"KDB_VALUE_TYPE_FORMAT"\n",  db->header.average);
   printf("Minimum:\t"KDB_VALUE_TYPE_FORMAT"\n",  db->header.min);
@@ -304,7 +1275,7 @@ void kdb_dump_header(KDB* db)
   printf("Median:\t\t"KDB_VALUE_TYPE_FORMAT"\n", (db->header.flags & KDB_FLAGS_MEDIAN_CALCULATED) != 0 ? kdb_median(db) : INFINITY);
 }
 
-void kdb_dump_data(KDB_DATA* data)
+void kdb_dump_data(const KDB_DATA* data)
 {
   if (!data)
   {
@@ -327,19 +1298,22 @@ void kdb_dump(KDB* db, bool include_all_data)
     return;
   }
 
-  KDB_DATA data;
+  KDB_CURSOR      cursor;
+  const KDB_DATA* data;
 
-  for (uint32_t i = 0; i < db->header.count; ++i)
+  if (!kdb_cursor_open(&cursor, db, 0, db->header.count, 0, KDB_CURSOR_READAHEAD))
   {
-    if (!kdb_get_data(db, i, &data))
-    {
-      return;
-    }
+    return;
+  }
 
+  while ((data = kdb_cursor_next(&cursor)))
+  {
     printf("\n");
 
-    kdb_dump_data(&data);
+    kdb_dump_data(data);
   }
+
+  kdb_cursor_close(&cursor);
 }
 
 bool kdb_write_header(KDB* db)
@@ -351,485 +1325,7611 @@ bool kdb_write_header(KDB* db)
     return false;
   }
 
-  if (!db->file)
+  if (!kdb_file(db))
   {
     KDB_ERROR("File handler is not set\n");
 
     return false;
   }
 
-  if (fseek(db->file, 0, SEEK_SET) != 0)
-  {
-    KDB_ERROR("Error seeking for the start of the file\n");
-
-    return false;
-  }
-
-  if (fwrite(&db->header, sizeof(KDB_HEADER), 1, db->file) != 1)
+  if (!kdb_write_at(db, 0, &db->header, sizeof(KDB_HEADER)))
   {
     KDB_ERROR("Error while trying to write the file header\n");
 
     return false;
   }
 
-  if (fflush(db->file) != 0)
-  {
-    KDB_ERROR("Error writing file to disk\n");
+  return kdb_flush(db);
+}
 
-    return false;
+uint64_t kdb_now_us(void)
+{
+  struct timespec now;
+
+  if (timespec_get(&now, TIME_UTC) != TIME_UTC)
+  {
+    return 0;
   }
 
-  return true;
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
 }
 
-bool kdb_write_data(KDB* db, KDB_DATA* data)
+uint64_t kdb_now_ms(void)
 {
-  KDB_CHECK_INITIALIZED(db, false);
+  return kdb_now_us() / 1000;
+}
 
-  if (!db->file)
+// Apply the durability mode after a write. Records appended since the last
+// sync are counted in unsynced by the callers
+bool kdb_flush(KDB* db)
+{
+  switch (db->options.durability)
   {
-    KDB_ERROR("File handler is not set\n");
+    case KDB_DURABILITY_SYNC:
+      if (db->unsynced > 0)
+      {
+        return kdb_sync(db);
+      }
 
-    return false;
-  }
+      break;
 
-  if (fseek(db->file, 0, SEEK_END) != 0)
-  {
-    KDB_ERROR("Error seeking for the end of the file\n");
+    // In between appends the flusher thread checks the time limit
+    case KDB_DURABILITY_GROUP:
+      if (db->unsynced > 0 &&
+          ((db->options.group_records > 0 && db->unsynced >= db->options.group_records) ||
+           (db->options.group_ms > 0 && kdb_now_ms() - db->synced_at >= db->options.group_ms)))
+      {
+        return kdb_sync(db);
+      }
 
-    return false;
+      break;
+
+    default:
+      break;
   }
 
-  if (fwrite(data, sizeof(KDB_DATA), 1, db->file) != 1)
+  // Mapped and positional reads see the page cache, so buffered writes still
+  // have to reach it
+  #ifdef KDB_USE_THREADS
+    bool bypassed = true;
+  #else
+    bool bypassed = db->map != NULL;
+  #endif
+
+  // Files closed by the pool were flushed on the way out
+  if ((db->options.durability == KDB_DURABILITY_FLUSH || bypassed) && db->file && fflush(db->file) != 0)
   {
-    KDB_ERROR("Error while trying to write the data to file\n");
+    KDB_ERROR("Error writing file to disk\n");
 
     return false;
   }
 
-  if (fflush(db->file) != 0)
+  return true;
+}
+
+// Barrier, every committed record is on the disk when it returns. Records in
+// an open batch are not written yet and so not covered
+bool kdb_sync(KDB* db)
+{
+  KDB_LOCKED(db, true, bool, kdb_sync_locked(db));
+}
+
+bool kdb_sync_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  FILE* file = kdb_file(db);
+
+  if (!file || fflush(file) != 0 || KDB_FSYNC(file) != 0)
   {
-    KDB_ERROR("Error writing file to disk\n");
+    KDB_ERROR("Error syncing file to disk\n");
 
     return false;
   }
 
+  db->unsynced  = 0;
+  db->synced_at = kdb_now_ms();
+
   return true;
 }
 
-// Initialize the database's structure
-KDB* kdb_initialize(char* name)
+// Pick up the records another process appended to the file since it was
+// opened or last refreshed, appended receives how many there were. Only the
+// header and the new records are read
+bool kdb_refresh(KDB* db, uint64_t* appended)
 {
-  // Validate name limit
-  size_t name_size = strlen(name);
+  KDB_LOCKED(db, true, bool, kdb_refresh_locked(db, appended));
+}
 
-  if (name_size > KDB_NAME_SIZE)
+bool kdb_refresh_locked(KDB* db, uint64_t* appended)
+{
+  if (appended)
   {
-    KDB_ERROR("Database name is above the %d characters limit\n", KDB_NAME_SIZE);
+    *appended = 0;
+  }
+
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (db->in_batch)
+  {
+    KDB_ERROR("Cannot refresh a database in the middle of a batch\n");
 
     return false;
   }
 
-  for (size_t i = 0; i < name_size; ++i)
+  // Reads must not come from what stdio buffered before the writer appended
+  if (db->container)
   {
-    if (('a' <= name[i] && name[i] <= 'z') || ('0' <= name[i] && name[i] <= '9'))
+    if (!kdb_container_extents(db))
     {
-      continue;
+      return false;
     }
+  }
+  else
+  {
+    FILE* file = kdb_file(db);
 
-    KDB_ERROR("Database name has illegal characters. Characters allowed: a-z and 0-9. Found %c\n", name[i]);
+    if (!file || fflush(file) != 0)
+    {
+      KDB_ERROR("Error flushing the file\n");
 
-    return false;
+      return false;
+    }
   }
 
-  KDB* db = kdb_hashmap_dbs_get(name, NULL);
+  KDB_HEADER header;
 
-  if (db)
+  if (!kdb_read_at(db, 0, &header, sizeof(KDB_HEADER)))
   {
-    uint64_t references = kdb_hashmap_dbs_references_get(name, 0);
-
-    kdb_hashmap_dbs_references_set(db->p_name, references + 1);
+    KDB_ERROR("Failed to read the database header\n");
 
-    return db;
+    return false;
   }
 
-  db = (KDB*)malloc(sizeof(KDB));
+  KDB_FLAGS_TYPE format = KDB_FLAGS_USE_DOUBLE | KDB_FLAGS_USE_LONG_DOUBLE | KDB_FLAGS_COMPRESSED | KDB_FLAGS_COLUMNAR;
 
-  if (!db)
+  if (memcmp(header.version, db->header.version, KDB_VERSION_SIZE) != 0 || (header.flags & format) != (db->header.flags & format))
   {
-    KDB_ERROR("Could not alloc memory for the database structure\n");
+    KDB_ERROR("The database file was replaced\n");
 
-    return NULL;
+    return false;
   }
 
-  // Ensure everything is clean
-  memset(db, 0, sizeof(KDB));
-
-  // Initialize name pointer
-  char* p_name = (char*)malloc((name_size + 1) * sizeof(char));
-
-  if (!p_name)
+  if (header.count < db->header.count)
   {
-    KDB_ERROR("Could not allocate memory for the name\n");
+    KDB_ERROR("The database file lost records\n");
 
-    goto error;
+    return false;
   }
 
-  memset(p_name, 0, name_size + 1);
-
-  // Initialize filename
-  char* filename = (char*)malloc((name_size + 5) * sizeof(char));
+  if (header.count == db->header.count)
+  {
+    return true;
+  }
 
-  if (!filename)
+  // Writers allocate extents before counting their records, so the table read
+  // above may miss the ones the header now covers
+  if (db->container && !kdb_container_extents(db))
   {
-    KDB_ERROR("Could not allocate memory for the filename\n");
+    return false;
+  }
 
-    goto error;
+  if ((header.flags & KDB_FLAGS_COMPRESSED) != 0 && !kdb_compressed_refresh(db, &header))
+  {
+    return false;
   }
 
-  memset(filename, 0, name_size + 5);
+  uint64_t first = db->header.count;
 
-  // Fill name and filename
-  for (size_t i = 0; i < name_size; ++i)
+  db->header = header;
+
+  if (appended)
   {
-    p_name[i]   = name[i];
-    filename[i] = name[i];
+    *appended = header.count - first;
   }
 
-  filename[name_size + 0] = '.';
-  filename[name_size + 1] = 'k';
-  filename[name_size + 2] = 'd';
-  filename[name_size + 3] = 'b';
+  // Derived structures follow the new records as if they were appended here
+  if (!db->ts_indexed && !db->sketch && !db->zoned && !db->pyramided && db->indicators_count == 0 && db->rollups_count == 0)
+  {
+    return true;
+  }
 
-  db->p_name = p_name;
-  db->filename = filename;
+  KDB_CURSOR      cursor;
+  const KDB_DATA* records;
+  uint64_t        count;
 
-  // Try to open the file to read/update
-  db->file = fopen(filename, "r+b");
+  if (!kdb_cursor_open_locked(&cursor, db, first, header.count - first, 0, KDB_CURSOR_READAHEAD))
+  {
+    return false;
+  }
 
-  if (!db->file)
+  while ((count = kdb_cursor_next_block_locked(&cursor, &records)) > 0)
   {
-    // If file does not exist, try to create it
-    if (errno == ENOENT)
-    {
-      // Try to open the file to write/read
-      db->file = fopen(filename, "w+b");
+    kdb_after_append(db, first, records, count);
 
-      if (!db->file)
-      {
-        KDB_ERROR("Failed to create the file \"%s\"\n", filename);
+    first += count;
+  }
 
-        goto error;
-      }
+  bool failed = cursor.failed;
 
-      // Initialize data
-      memcpy(&db->header.version, &KDB_VERSION, KDB_VERSION_SIZE);
-      memcpy(&db->header.name, name, name_size);
+  kdb_cursor_close(&cursor);
 
-      #ifdef KDB_USE_LONG_DOUBLE
-        db->header.flags |= KDB_FLAGS_USE_LONG_DOUBLE;
-      #else
-        #ifdef KDB_USE_DOUBLE
-          db->header.flags |= KDB_FLAGS_USE_DOUBLE;
-        #endif
-      #endif
+  if (failed)
+  {
+    // Structures that can not skip records are rebuilt from the file later
+    db->ts_indexed     = false;
+    db->ts_index_count = 0;
+    db->zoned          = false;
 
-      // Try to write the header
-      if (!kdb_write_header(db))
-      {
-        goto error;
-      }
+    kdb_pyramid_clear(db);
 
-      // All good
-      goto success;
-    }
+    KDB_ERROR("Failed to read the appended records\n");
 
-    KDB_ERROR("Failed to open \"%s\"\n", filename);
+    return false;
   }
 
-  // Read data from file
-  char           f_version[KDB_VERSION_SIZE] = { 0 };
-  char           f_name[KDB_NAME_SIZE]       = { 0 };
-  size_t         f_name_size                 = 0;
-  KDB_FLAGS_TYPE f_flags                     = 0;
-  uint32_t       f_count                     = 0;
-  KDB_VALUE_TYPE f_sum                       = 0.0f;
-  KDB_VALUE_TYPE f_average                   = 0.0f;
-  KDB_VALUE_TYPE f_min                       = INFINITY;
-  KDB_VALUE_TYPE f_max                       = -INFINITY;
-  KDB_VALUE_TYPE f_variance                  = INFINITY;
-  KDB_VALUE_TYPE f_median                    = INFINITY;
+  return true;
+}
 
-  // Try to parse the version
-  if (fread(&f_version, sizeof(char), KDB_VERSION_SIZE, db->file) != KDB_VERSION_SIZE)
+// Write the newest record, the header must already count it
+bool kdb_write_data(KDB* db, KDB_DATA* data)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (db->header.count == 0)
   {
-    KDB_ERROR("Failed to read the database version\n");
+    KDB_ERROR("The header does not count any record\n");
 
-    goto error;
+    return false;
   }
 
-  // Check the magic string
-  if (strncmp(f_version, "KDB", 3) != 0)
-  {
-    KDB_ERROR("File has no magic string in header\n");
+  return kdb_write_records(db, db->header.count - 1, data, 1);
+}
 
-    goto error;
-  }
+// Rewrite a version 1 file with the current header. The records are copied
+// verbatim in chunks, the running mean and M2 it lacks are rebuilt from them
+bool kdb_migrate(KDB* db)
+{
+  size_t    filename_size = strlen(db->filename);
+  char*     tmp_filename  = (char*)malloc((filename_size + 5) * sizeof(char));
+  KDB_DATA* buffer        = (KDB_DATA*)malloc(KDB_CURSOR_CHUNK_SIZE * sizeof(KDB_DATA));
+  FILE*     tmp_file      = NULL;
+  bool      migrated      = false;
 
-  // Check if the version is right/supported
-  if (f_version[KDB_VERSION_SIZE - 1] != 1)
+  if (!tmp_filename || !buffer)
   {
-    KDB_ERROR("Unknown database version\n");
+    KDB_ERROR("Could not allocate memory for the migration\n");
 
-    goto error;
+    goto defer;
   }
 
-  // Try to parse the name
-  if (fread(&f_name, sizeof(char), KDB_NAME_SIZE, db->file) != KDB_NAME_SIZE)
+  memcpy(tmp_filename, db->filename, filename_size);
+  memcpy(tmp_filename + filename_size, ".tmp", 5);
+
+  tmp_file = fopen(tmp_filename, "w+b");
+
+  if (!tmp_file)
   {
-    KDB_ERROR("Failed to read the database name\n");
+    KDB_ERROR("Failed to create the file \"%s\"\n", tmp_filename);
 
-    goto error;
+    goto defer;
   }
 
-  // Validate the name
-  f_name_size = strlen(f_name);
-
-  if (f_name_size != name_size || strcmp(f_name, name) != 0)
+  if (KDB_SEEK(db->file, sizeof(KDB_HEADER_V1), SEEK_SET) != 0 || KDB_SEEK(tmp_file, sizeof(KDB_HEADER), SEEK_SET) != 0)
   {
-    KDB_ERROR("Wrong name for the database\n");
+    KDB_ERROR("Error seeking for the records\n");
 
-    goto error;
+    goto defer;
   }
 
-  // Try to parse the flags
-  if (fread(&f_flags, sizeof(KDB_FLAGS_TYPE), 1, db->file) != 1)
+  uint64_t       copied  = 0;
+  KDB_VALUE_TYPE average = 0.0f;
+  KDB_VALUE_TYPE m2      = 0.0f;
+  KDB_VALUE_TYPE delta;
+  size_t         bytes;
+
+  while ((bytes = fread(buffer, 1, KDB_CURSOR_CHUNK_SIZE * sizeof(KDB_DATA), db->file)) > 0)
   {
-    KDB_ERROR("Failed to read the flags from database\n");
+    uint64_t chunk = bytes / sizeof(KDB_DATA);
 
-    goto error;
-  }
+    for (uint64_t i = 0; i < chunk && copied + i < db->header.count; ++i)
+    {
+      delta    = buffer[i].value - average;
+      average += delta / (copied + i + 1);
+      m2      += delta * (buffer[i].value - average);
+    }
 
-  // Check compatibility between the library and the file
-  #ifdef KDB_USE_LONG_DOUBLE
-    if ((f_flags & KDB_FLAGS_USE_LONG_DOUBLE) == 0)
+    if (fwrite(buffer, 1, bytes, tmp_file) != bytes)
     {
-      KDB_ERROR("KDB is set to use long double and this file is not compatible\n");
+      KDB_ERROR("Error writing the migrated records\n");
 
-      goto error;
+      goto defer;
     }
-  #else
-    #ifdef KDB_USE_DOUBLE
-      if ((f_flags & KDB_FLAGS_USE_DOUBLE) == 0)
-      {
-        KDB_ERROR("KDB is set to use double and this file is not compatible\n");
 
-        goto error;
-      }
-    #endif
-  #endif
+    copied += chunk;
+  }
 
-  // Try to parse the records count
-  if (fread(&f_count, sizeof(uint32_t), 1, db->file) != 1)
+  if (ferror(db->file))
   {
-    KDB_ERROR("Failed to read the records' count from database\n");
+    KDB_ERROR("Error reading the records to migrate\n");
 
-    goto error;
+    goto defer;
   }
 
-  // Try to parse the sum
-  if (fread(&f_sum, sizeof(KDB_VALUE_TYPE), 1, db->file) != 1)
+  if (copied < db->header.count)
   {
-    KDB_ERROR("Failed to read the sum from database\n");
+    KDB_ERROR("The file holds fewer records than its header counts\n");
 
-    goto error;
+    goto defer;
   }
 
-  // Try to parse the average
-  if (fread(&f_average, sizeof(KDB_VALUE_TYPE), 1, db->file) != 1)
+  db->header.flags    |= KDB_FLAGS_VARIANCE_CALCULATED;
+  db->header.average   = db->header.count > 0 ? average : 0.0f;
+  db->header.m2        = m2;
+  db->header.variance  = db->header.count > 0 ? m2 / db->header.count : INFINITY;
+
+  // The migrated file must be on the disk before it replaces the original
+  if (KDB_SEEK(tmp_file, 0, SEEK_SET) != 0 || fwrite(&db->header, sizeof(KDB_HEADER), 1, tmp_file) != 1 || fflush(tmp_file) != 0 || KDB_FSYNC(tmp_file) != 0)
   {
-    KDB_ERROR("Failed to read the average from database\n");
+    KDB_ERROR("Error writing the migrated header\n");
 
-    goto error;
+    goto defer;
   }
 
-  // Try to parse the minimum
-  if (fread(&f_min, sizeof(KDB_VALUE_TYPE), 1, db->file) != 1)
+  if (fclose(tmp_file) != 0)
   {
-    KDB_ERROR("Failed to read the minimum from database\n");
+    tmp_file = NULL;
 
-    goto error;
-  }
+    KDB_ERROR("Error closing the migrated file\n");
 
-  // Try to parse the maximum
-  if (fread(&f_max, sizeof(KDB_VALUE_TYPE), 1, db->file) != 1)
-  {
-    KDB_ERROR("Failed to read the maximum from database\n");
+    remove(tmp_filename);
 
-    goto error;
+    goto defer;
   }
 
-  // Try to parse the variance
-  if (fread(&f_variance, sizeof(KDB_VALUE_TYPE), 1, db->file) != 1)
-  {
-    KDB_ERROR("Failed to read the variance from database\n");
+  tmp_file = NULL;
 
-    goto error;
-  }
+  // Windows can not replace a file that is still open
+  fclose(db->file);
 
-  // Try to parse the median
-  if (fread(&f_median, sizeof(KDB_VALUE_TYPE), 1, db->file) != 1)
+  db->file = NULL;
+
+  // Either the original or the migrated file is in place at any time
+  if (!KDB_REPLACE(tmp_filename, db->filename))
   {
-    KDB_ERROR("Failed to read the median from database\n");
+    KDB_ERROR("Failed to replace \"%s\" with the migrated file\n", db->filename);
 
-    goto error;
-  }
+    remove(tmp_filename);
 
-  // Initialize the database with the read/parsed data
-  memcpy(&db->header.version, &f_version, KDB_VERSION_SIZE);
-  memcpy(&db->header.name, &f_name, f_name_size);
+    goto defer;
+  }
 
-  db->header.flags    = f_flags;
-  db->header.count    = f_count;
-  db->header.sum      = f_sum;
-  db->header.average  = f_average;
-  db->header.min      = f_min;
-  db->header.max      = f_max;
-  db->header.variance = f_variance;
-  db->header.median   = f_median;
+  db->file = fopen(db->filename, "r+b");
 
-  // All good
-  success:
-    db->initialized = true;
+  if (!db->file)
+  {
+    KDB_ERROR("Failed to open \"%s\"\n", db->filename);
 
-    kdb_hashmap_dbs_set(p_name, db);
-    kdb_hashmap_dbs_references_set(p_name, 1);
+    goto defer;
+  }
 
-    return db;
+  migrated = true;
 
-  // Close the file
-  error:
-    if (db)
+  defer:
+    if (tmp_file)
     {
-      if (!kdb_finalize(db))
-      {
-        KDB_ERROR("Failed to properly finalize database\n");
-      }
+      fclose(tmp_file);
 
-      free(db);
+      remove(tmp_filename);
     }
-    else
-    {
-      if (p_name)
-      {
-        free(p_name);
-      }
 
-      if (filename)
-      {
-        free(filename);
-      }
+    if (!db->file)
+    {
+      db->file = fopen(db->filename, "r+b");
     }
 
-    return NULL;
+    free(tmp_filename);
+    free(buffer);
+
+    return migrated;
 }
 
-// Finalize the database's structure
-bool kdb_finalize(KDB* db)
+// Size in bytes of one element of a column
+size_t kdb_column_width(KDB_COLUMN column)
 {
-  if (!db)
-  {
-    return true;
-  }
+  return column == KDB_COLUMN_TIMESTAMP ? sizeof(uint64_t) : sizeof(KDB_VALUE_TYPE);
+}
 
-  uint64_t references = kdb_hashmap_dbs_references_get(db->p_name, 0);
+// File offset of a record's element in a columnar file. Segments hold
+// KDB_BLOCK_SIZE timestamps, then as many values and then as many sums
+uint64_t kdb_column_offset(KDB_COLUMN column, uint64_t index)
+{
+  uint64_t segment = index / KDB_BLOCK_SIZE;
+  uint64_t base    = 0;
 
-  if (references == 0)
+  if (column != KDB_COLUMN_TIMESTAMP)
   {
-    KDB_ERROR("There are no references to database\n");
-
-    return false;
+    base += sizeof(uint64_t) * KDB_BLOCK_SIZE;
   }
 
-  uint64_t new_references = references - 1;
-
-  kdb_hashmap_dbs_references_set(db->p_name, new_references);
-
-  if (new_references > 0)
+  if (column == KDB_COLUMN_SUM)
   {
-    return true;
+    base += sizeof(KDB_VALUE_TYPE) * KDB_BLOCK_SIZE;
   }
 
-  kdb_hashmap_dbs_references_remove(db->p_name);
+  return sizeof(KDB_HEADER) + segment * KDB_SEGMENT_SIZE + base + kdb_column_width(column) * (index % KDB_BLOCK_SIZE);
+}
 
-  // Close the file
-  if (db->file)
+// Write count elements of one column of a columnar file, one slice per segment
+bool kdb_write_column(KDB* db, KDB_COLUMN column, uint64_t start, uint64_t count, const void* in)
+{
+  const char* bytes = (const char*)in;
+  size_t      width = kdb_column_width(column);
+
+  while (count > 0)
   {
-    if (fclose(db->file) != 0)
+    uint32_t slice = KDB_BLOCK_SIZE - start % KDB_BLOCK_SIZE < count ? KDB_BLOCK_SIZE - start % KDB_BLOCK_SIZE : count;
+
+    if (!kdb_write_at(db, kdb_column_offset(column, start), bytes, width * slice))
     {
-      KDB_ERROR("Failed to close file handler\n");
+      KDB_ERROR("Error while trying to write a column to file\n");
 
       return false;
     }
 
-    db->file = NULL;
+    bytes += width * slice;
+    start += slice;
+    count -= slice;
   }
 
-  // Zero all data
-  if (db->p_name)
+  return true;
+}
+
+// Read count committed elements of one column into out. Columnar files read
+// only that column, row files pick it out of the records
+bool kdb_read_column(KDB* db, KDB_COLUMN column, uint64_t start, uint64_t count, void* out)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  char*  bytes = (char*)out;
+  size_t width = kdb_column_width(column);
+
+  if (start > kdb_committed_count(db) || count > kdb_committed_count(db) - start)
   {
-    free(db->p_name);
+    KDB_ERROR("Column range is out of the committed records\n");
 
-    db->p_name = NULL;
+    return false;
   }
 
-  if (db->filename)
+  if ((db->header.flags & KDB_FLAGS_COLUMNAR) == 0)
   {
-    free(db->filename);
+    KDB_DATA records[KDB_COLUMN_CHUNK];
 
-    db->filename = NULL;
-  }
+    while (count > 0)
+    {
+      uint32_t chunk = count < KDB_COLUMN_CHUNK ? count : KDB_COLUMN_CHUNK;
+
+      if (!kdb_get_range(db, start, chunk, records))
+      {
+        return false;
+      }
+
+      for (uint32_t i = 0; i < chunk; ++i, bytes += width)
+      {
+        switch (column)
+        {
+          case KDB_COLUMN_TIMESTAMP: memcpy(bytes, &records[i].timestamp, width); break;
+          case KDB_COLUMN_VALUE:     memcpy(bytes, &records[i].value, width);     break;
+          case KDB_COLUMN_SUM:       memcpy(bytes, &records[i].sum, width);       break;
+        }
+      }
+
+      start += chunk;
+      count -= chunk;
+    }
+
+    return true;
+  }
+
+  while (count > 0)
+  {
+    uint32_t slice = KDB_BLOCK_SIZE - start % KDB_BLOCK_SIZE < count ? KDB_BLOCK_SIZE - start % KDB_BLOCK_SIZE : count;
+
+    if (!kdb_read_at(db, kdb_column_offset(column, start), bytes, width * slice))
+    {
+      KDB_ERROR("Error reading a column\n");
+
+      return false;
+    }
+
+    bytes += width * slice;
+    start += slice;
+    count -= slice;
+  }
+
+  return true;
+}
+
+// Write count records starting at index start. Raw files store every record
+// in place, columnar files split them into their segments' columns and
+// compressed files only take appends, sealing a block whenever the raw tail
+// fills up
+bool kdb_write_records(KDB* db, uint64_t start, const KDB_DATA* records, uint64_t count)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (!kdb_file(db))
+  {
+    KDB_ERROR("File handler is not set\n");
+
+    return false;
+  }
+
+  if (count == 0)
+  {
+    return true;
+  }
+
+  if ((db->header.flags & KDB_FLAGS_COMPRESSED) != 0)
+  {
+    if (start % KDB_BLOCK_SIZE != db->tail_count)
+    {
+      KDB_ERROR("Compressed databases only support appending records\n");
+
+      return false;
+    }
+
+    if (!kdb_compressed_append(db, start, records, count))
+    {
+      return false;
+    }
+  }
+  else if ((db->header.flags & KDB_FLAGS_COLUMNAR) != 0)
+  {
+    uint64_t       timestamps[KDB_COLUMN_CHUNK];
+    KDB_VALUE_TYPE values[KDB_COLUMN_CHUNK];
+    KDB_VALUE_TYPE sums[KDB_COLUMN_CHUNK];
+
+    for (uint64_t done = 0; done < count; done += KDB_COLUMN_CHUNK)
+    {
+      uint32_t chunk = count - done < KDB_COLUMN_CHUNK ? count - done : KDB_COLUMN_CHUNK;
+
+      for (uint32_t i = 0; i < chunk; ++i)
+      {
+        timestamps[i] = records[done + i].timestamp;
+        values[i]     = records[done + i].value;
+        sums[i]       = records[done + i].sum;
+      }
+
+      if (!kdb_write_column(db, KDB_COLUMN_TIMESTAMP, start + done, chunk, timestamps) ||
+          !kdb_write_column(db, KDB_COLUMN_VALUE, start + done, chunk, values) ||
+          !kdb_write_column(db, KDB_COLUMN_SUM, start + done, chunk, sums))
+      {
+        return false;
+      }
+    }
+  }
+  else
+  {
+    if (!kdb_write_at(db, sizeof(KDB_HEADER) + sizeof(KDB_DATA) * start, records, sizeof(KDB_DATA) * count))
+    {
+      KDB_ERROR("Error while trying to write the data to file\n");
+
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Read count committed records starting at start, decoding blocks as needed
+bool kdb_read_records(KDB* db, uint64_t start, uint64_t count, KDB_DATA* out)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if ((db->header.flags & KDB_FLAGS_COLUMNAR) != 0)
+  {
+    uint64_t       timestamps[KDB_COLUMN_CHUNK];
+    KDB_VALUE_TYPE values[KDB_COLUMN_CHUNK];
+    KDB_VALUE_TYPE sums[KDB_COLUMN_CHUNK];
+
+    for (uint64_t done = 0; done < count; done += KDB_COLUMN_CHUNK)
+    {
+      uint32_t chunk = count - done < KDB_COLUMN_CHUNK ? count - done : KDB_COLUMN_CHUNK;
+
+      if (!kdb_read_column(db, KDB_COLUMN_TIMESTAMP, start + done, chunk, timestamps) ||
+          !kdb_read_column(db, KDB_COLUMN_VALUE, start + done, chunk, values) ||
+          !kdb_read_column(db, KDB_COLUMN_SUM, start + done, chunk, sums))
+      {
+        return false;
+      }
+
+      for (uint32_t i = 0; i < chunk; ++i)
+      {
+        out[done + i].timestamp = timestamps[i];
+        out[done + i].value     = values[i];
+        out[done + i].sum       = sums[i];
+      }
+    }
+
+    return true;
+  }
+
+  if ((db->header.flags & KDB_FLAGS_COMPRESSED) == 0)
+  {
+    if (!kdb_read_at(db, sizeof(KDB_HEADER) + sizeof(KDB_DATA) * start, out, sizeof(KDB_DATA) * count))
+    {
+      KDB_ERROR("Error reading the records\n");
+
+      return false;
+    }
+
+    return true;
+  }
+
+  const KDB_DATA* span;
+  uint32_t        available;
+
+  // Shared readers still take turns on the decoded block cache
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_lock(&db->io_lock);
+  #endif
+
+  while (count > 0)
+  {
+    if (!(span = kdb_compressed_span(db, start, &available)))
+    {
+      #ifdef KDB_USE_THREADS
+        pthread_mutex_unlock(&db->io_lock);
+      #endif
+
+      return false;
+    }
+
+    available = available < count ? available : (uint32_t)count;
+
+    memcpy(out, span, sizeof(KDB_DATA) * available);
+
+    out   += available;
+    start += available;
+    count -= available;
+  }
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_unlock(&db->io_lock);
+  #endif
+
+  return true;
+}
+
+// Read size bytes at offset of file. Threaded builds use positional reads,
+// readers sharing the lock can't move the FILE position under each other
+bool kdb_file_read_at(FILE* file, uint64_t offset, void* buffer, size_t size)
+{
+  if (!file)
+  {
+    return false;
+  }
+
+  #if defined(KDB_USE_THREADS) && !defined(_WIN32)
+    char* bytes = (char*)buffer;
+
+    while (size > 0)
+    {
+      ssize_t done = pread(fileno(file), bytes, size, (off_t)offset);
+
+      if (done < 0 && errno == EINTR)
+      {
+        continue;
+      }
+
+      if (done <= 0)
+      {
+        return false;
+      }
+
+      bytes  += done;
+      offset += done;
+      size   -= done;
+    }
+
+    return true;
+  #else
+    return KDB_SEEK(file, offset, SEEK_SET) == 0 && fread(buffer, 1, size, file) == size;
+  #endif
+}
+
+bool kdb_file_write_at(FILE* file, uint64_t offset, const void* buffer, size_t size)
+{
+  return file && KDB_SEEK(file, offset, SEEK_SET) == 0 && fwrite(buffer, 1, size, file) == size;
+}
+
+// Read size bytes at offset. Offsets are logical for series of a container
+bool kdb_read_at(KDB* db, uint64_t offset, void* buffer, size_t size)
+{
+  if (db->container)
+  {
+    return kdb_container_io(db, offset, buffer, size, false);
+  }
+
+  return kdb_file_read_at(kdb_file(db), offset, buffer, size);
+}
+
+// Write size bytes at offset. Offsets are logical for series of a container
+bool kdb_write_at(KDB* db, uint64_t offset, const void* buffer, size_t size)
+{
+  if (db->container)
+  {
+    return kdb_container_io(db, offset, (void*)buffer, size, true);
+  }
+
+  return kdb_file_write_at(kdb_file(db), offset, buffer, size);
+}
+
+// Open the container file of name, creating it when missing. Containers are
+// shared by their open series and closed with the last one
+KDB_CONTAINER* kdb_container_open(const char* name)
+{
+  KDB_CONTAINER* container = kdb_hashmap_containers_get((char*)name, NULL);
+
+  if (container)
+  {
+    ++container->references;
+
+    return container;
+  }
+
+  size_t name_size = strlen(name);
+
+  container = (KDB_CONTAINER*)calloc(1, sizeof(KDB_CONTAINER));
+
+  if (!container)
+  {
+    KDB_ERROR("Could not allocate memory for the container\n");
+
+    return NULL;
+  }
+
+  container->name     = (char*)malloc(name_size + 1);
+  container->filename = (char*)malloc(name_size + 5);
+
+  if (!container->name || !container->filename)
+  {
+    KDB_ERROR("Could not allocate memory for the container name\n");
+
+    goto error;
+  }
+
+  memcpy(container->name, name, name_size + 1);
+  memcpy(container->filename, name, name_size);
+  memcpy(container->filename + name_size, ".kdc", 5);
+
+  container->file = fopen(container->filename, "r+b");
+
+  if (!container->file)
+  {
+    if (errno != ENOENT || !(container->file = fopen(container->filename, "w+b")))
+    {
+      KDB_ERROR("Failed to open \"%s\"\n", container->filename);
+
+      goto error;
+    }
+
+    memcpy(&container->header.version, KDB_CONTAINER_VERSION, KDB_VERSION_SIZE);
+
+    container->header.end = sizeof(KDB_CONTAINER_HEADER);
+
+    if (!kdb_container_write(container, 0, &container->header, sizeof(KDB_CONTAINER_HEADER)))
+    {
+      KDB_ERROR("Error while trying to write the container header\n");
+
+      goto error;
+    }
+  }
+  else
+  {
+    if (fread(&container->header, sizeof(KDB_CONTAINER_HEADER), 1, container->file) != 1)
+    {
+      KDB_ERROR("Failed to read the container header\n");
+
+      goto error;
+    }
+
+    if (memcmp(container->header.version, KDB_CONTAINER_VERSION, KDB_VERSION_SIZE) != 0)
+    {
+      KDB_ERROR("Unknown container version\n");
+
+      goto error;
+    }
+  }
+
+  // Only the names and table offsets are loaded, extents are read per series
+  uint32_t series = container->header.series;
+  uint32_t blocks = (series + KDB_CONTAINER_DIRECTORY - 1) / KDB_CONTAINER_DIRECTORY;
+
+  if (series > 0)
+  {
+    container->entries          = (KDB_CONTAINER_ENTRY*)malloc(sizeof(KDB_CONTAINER_ENTRY) * series);
+    container->entries_capacity = series;
+    container->blocks           = (uint64_t*)malloc(sizeof(uint64_t) * blocks);
+    container->blocks_capacity  = blocks;
+
+    if (!container->entries || !container->blocks)
+    {
+      KDB_ERROR("Could not allocate memory for the container directory\n");
+
+      goto error;
+    }
+  }
+
+  KDB_CONTAINER_BLOCK block;
+  uint64_t            offset = container->header.directory;
+
+  for (uint32_t i = 0; i < blocks; ++i)
+  {
+    if (offset == 0 || KDB_SEEK(container->file, offset, SEEK_SET) != 0 || fread(&block, sizeof(KDB_CONTAINER_BLOCK), 1, container->file) != 1)
+    {
+      KDB_ERROR("Failed to read the container directory\n");
+
+      goto error;
+    }
+
+    container->blocks[i] = offset;
+
+    for (uint32_t j = 0; j < KDB_CONTAINER_DIRECTORY && i * KDB_CONTAINER_DIRECTORY + j < series; ++j)
+    {
+      container->entries[i * KDB_CONTAINER_DIRECTORY + j] = block.entries[j];
+
+      if (!kdb_container_index(container, i * KDB_CONTAINER_DIRECTORY + j))
+      {
+        goto error;
+      }
+    }
+
+    offset = block.next;
+  }
+
+  if (!kdb_hashmap_containers_set(container->name, container))
+  {
+    KDB_ERROR("Could not register the container\n");
+
+    goto error;
+  }
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_init(&container->lock, NULL);
+  #endif
+
+  container->references = 1;
+
+  return container;
+
+  error:
+    if (container->file)
+    {
+      fclose(container->file);
+    }
+
+    free(container->index);
+    free(container->blocks);
+    free(container->entries);
+    free(container->filename);
+    free(container->name);
+    free(container);
+
+    return NULL;
+}
+
+void kdb_container_close(KDB_CONTAINER* container)
+{
+  if (!container || --container->references > 0)
+  {
+    return;
+  }
+
+  kdb_hashmap_containers_remove(container->name);
+
+  if (fclose(container->file) != 0)
+  {
+    KDB_ERROR("Failed to close the container file\n");
+  }
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_destroy(&container->lock);
+  #endif
+
+  free(container->index);
+  free(container->blocks);
+  free(container->entries);
+  free(container->filename);
+  free(container->name);
+  free(container);
+}
+
+// Write at a physical offset of the container
+bool kdb_container_write(KDB_CONTAINER* container, uint64_t offset, const void* buffer, size_t size)
+{
+  return KDB_SEEK(container->file, offset, SEEK_SET) == 0 && fwrite(buffer, 1, size, container->file) == size;
+}
+
+// Add the entry at position to the name index, which doubles once half full
+bool kdb_container_index(KDB_CONTAINER* container, uint32_t position)
+{
+  if (!container->index || (uint64_t)(position + 1) * 2 > (uint64_t)container->index_mask + 1)
+  {
+    uint32_t  slots = container->index ? (container->index_mask + 1) * 2 : 64;
+    uint32_t* index = (uint32_t*)calloc(slots, sizeof(uint32_t));
+
+    if (!index)
+    {
+      KDB_ERROR("Could not allocate memory for the container index\n");
+
+      return false;
+    }
+
+    free(container->index);
+
+    container->index      = index;
+    container->index_mask = slots - 1;
+
+    for (uint32_t i = 0; i < position; ++i)
+    {
+      kdb_container_index(container, i);
+    }
+  }
+
+  char key[KDB_NAME_SIZE + 1] = { 0 };
+
+  memcpy(key, container->entries[position].name, KDB_NAME_SIZE);
+
+  uint32_t slot = (uint32_t)kdb_hashmap_hash(key) & container->index_mask;
+
+  while (container->index[slot] != 0)
+  {
+    slot = (slot + 1) & container->index_mask;
+  }
+
+  container->index[slot] = position + 1;
+
+  return true;
+}
+
+// Position of the series in the directory, UINT32_MAX when it is not there
+uint32_t kdb_container_find(KDB_CONTAINER* container, const char* name)
+{
+  if (!container->index)
+  {
+    return UINT32_MAX;
+  }
+
+  char key[KDB_NAME_SIZE + 1] = { 0 };
+
+  strncpy(key, name, KDB_NAME_SIZE);
+
+  for (uint32_t slot = (uint32_t)kdb_hashmap_hash(key) & container->index_mask; container->index[slot] != 0; slot = (slot + 1) & container->index_mask)
+  {
+    uint32_t position = container->index[slot] - 1;
+
+    if (memcmp(container->entries[position].name, key, KDB_NAME_SIZE) == 0)
+    {
+      return position;
+    }
+  }
+
+  return UINT32_MAX;
+}
+
+// Reserve size bytes at the end of the container, 0 when it fails. Space is
+// only claimed in the header, the file grows when the bytes are written
+uint64_t kdb_container_allocate(KDB_CONTAINER* container, uint64_t size, uint64_t alignment)
+{
+  uint64_t end    = container->header.end;
+  uint64_t offset = (end + alignment - 1) / alignment * alignment;
+
+  container->header.end = offset + size;
+
+  if (!kdb_container_write(container, 0, &container->header, sizeof(KDB_CONTAINER_HEADER)))
+  {
+    KDB_ERROR("Error while trying to write the container header\n");
+
+    container->header.end = end;
+
+    return 0;
+  }
+
+  return offset;
+}
+
+// Append a series to the directory along with its empty extent table. The
+// directory gains a block every KDB_CONTAINER_DIRECTORY series
+bool kdb_container_add(KDB_CONTAINER* container, const char* name, uint32_t* position)
+{
+  uint32_t count = container->header.series;
+  uint32_t block = count / KDB_CONTAINER_DIRECTORY;
+  bool     added = false;
+
+  if (count == UINT32_MAX - 1)
+  {
+    KDB_ERROR("The container is full\n");
+
+    return false;
+  }
+
+  if (count == container->entries_capacity)
+  {
+    uint32_t             capacity = container->entries_capacity > 0 ? container->entries_capacity * 2 : KDB_CONTAINER_DIRECTORY;
+    KDB_CONTAINER_ENTRY* entries  = (KDB_CONTAINER_ENTRY*)realloc(container->entries, sizeof(KDB_CONTAINER_ENTRY) * capacity);
+
+    if (!entries)
+    {
+      KDB_ERROR("Could not allocate memory for the container directory\n");
+
+      return false;
+    }
+
+    container->entries          = entries;
+    container->entries_capacity = capacity;
+  }
+
+  if (block == container->blocks_capacity)
+  {
+    uint32_t  capacity = container->blocks_capacity > 0 ? container->blocks_capacity * 2 : 4;
+    uint64_t* blocks   = (uint64_t*)realloc(container->blocks, sizeof(uint64_t) * capacity);
+
+    if (!blocks)
+    {
+      KDB_ERROR("Could not allocate memory for the container directory\n");
+
+      return false;
+    }
+
+    container->blocks          = blocks;
+    container->blocks_capacity = capacity;
+  }
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_lock(&container->lock);
+  #endif
+
+  KDB_CONTAINER_ENTRY entry                         = { 0 };
+  uint64_t            table[KDB_CONTAINER_EXTENTS] = { 0 };
+
+  // Names fill the whole field when they are KDB_NAME_SIZE long, without a NUL
+  memcpy(entry.name, name, strnlen(name, KDB_NAME_SIZE));
+
+  if (count % KDB_CONTAINER_DIRECTORY == 0)
+  {
+    KDB_CONTAINER_BLOCK empty  = { 0 };
+    uint64_t            offset = kdb_container_allocate(container, sizeof(KDB_CONTAINER_BLOCK), sizeof(uint64_t));
+
+    if (offset == 0 || !kdb_container_write(container, offset, &empty, sizeof(KDB_CONTAINER_BLOCK)))
+    {
+      goto add_end;
+    }
+
+    // Link the new block from the header or from the block before it
+    if (!kdb_container_write(container, block == 0 ? offsetof(KDB_CONTAINER_HEADER, directory) : container->blocks[block - 1], &offset, sizeof(uint64_t)))
+    {
+      goto add_end;
+    }
+
+    if (block == 0)
+    {
+      container->header.directory = offset;
+    }
+
+    container->blocks[block] = offset;
+  }
+
+  entry.table = kdb_container_allocate(container, sizeof(table), sizeof(uint64_t));
+
+  if (entry.table == 0 || !kdb_container_write(container, entry.table, table, sizeof(table)))
+  {
+    goto add_end;
+  }
+
+  uint64_t slot = container->blocks[block] + offsetof(KDB_CONTAINER_BLOCK, entries) + sizeof(KDB_CONTAINER_ENTRY) * (count % KDB_CONTAINER_DIRECTORY);
+
+  if (!kdb_container_write(container, slot, &entry, sizeof(KDB_CONTAINER_ENTRY)))
+  {
+    goto add_end;
+  }
+
+  // The series exists once the header counts it
+  container->header.series = count + 1;
+
+  if (!kdb_container_write(container, 0, &container->header, sizeof(KDB_CONTAINER_HEADER)) || fflush(container->file) != 0)
+  {
+    container->header.series = count;
+
+    goto add_end;
+  }
+
+  container->entries[count] = entry;
+
+  added = true;
+
+  add_end:
+    #ifdef KDB_USE_THREADS
+      pthread_mutex_unlock(&container->lock);
+    #endif
+
+    if (!added)
+    {
+      KDB_ERROR("Error while trying to add the series to the container\n");
+
+      return false;
+    }
+
+    *position = count;
+
+    return kdb_container_index(container, count);
+}
+
+// Bind db to its series of db->container, which is added when missing
+bool kdb_container_attach(KDB* db, const char* name, bool* created)
+{
+  KDB_CONTAINER* container = db->container;
+  uint32_t       position  = kdb_container_find(container, name);
+
+  *created = position == UINT32_MAX;
+
+  if (*created && !kdb_container_add(container, name, &position))
+  {
+    return false;
+  }
+
+  db->file  = container->file;
+  db->table = container->entries[position].table;
+
+  memset(db->extents, 0, sizeof(db->extents));
+
+  return *created || kdb_container_extents(db);
+}
+
+// Read the extent table of a series. The flush drops whatever stdio buffered
+// before another process grew the container
+bool kdb_container_extents(KDB* db)
+{
+  KDB_CONTAINER* container = db->container;
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_lock(&container->lock);
+  #endif
+
+  bool loaded = fflush(container->file) == 0 && KDB_SEEK(container->file, db->table, SEEK_SET) == 0 && fread(db->extents, sizeof(db->extents), 1, container->file) == 1;
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_unlock(&container->lock);
+  #endif
+
+  if (!loaded)
+  {
+    KDB_ERROR("Failed to read the extents of the series\n");
+  }
+
+  return loaded;
+}
+
+// Extent holding a logical offset, start receives the extent's first offset
+uint32_t kdb_container_extent(uint64_t offset, uint64_t* start)
+{
+  uint64_t units  = offset / KDB_CONTAINER_EXTENT + 1;
+  uint32_t extent = 63 - kdb_leading_zeros(units);
+
+  *start = KDB_CONTAINER_EXTENT * ((UINT64_C(1) << extent) - 1);
+
+  return extent;
+}
+
+// Move size bytes between buffer and a logical offset of a series, split at
+// extent boundaries. Writes append the extents they are missing
+bool kdb_container_io(KDB* db, uint64_t offset, void* buffer, size_t size, bool write)
+{
+  KDB_CONTAINER* container = db->container;
+  char*          bytes     = (char*)buffer;
+  bool           done      = true;
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_lock(&container->lock);
+  #endif
+
+  while (size > 0)
+  {
+    uint64_t start  = 0;
+    uint32_t extent = kdb_container_extent(offset, &start);
+
+    if (extent >= KDB_CONTAINER_EXTENTS)
+    {
+      KDB_ERROR("The series does not fit in its container\n");
+
+      done = false;
+
+      break;
+    }
+
+    uint64_t length = (uint64_t)KDB_CONTAINER_EXTENT << extent;
+    size_t   piece  = length - (offset - start) < size ? length - (offset - start) : size;
+
+    if (db->extents[extent] == 0)
+    {
+      if (!write)
+      {
+        done = false;
+
+        break;
+      }
+
+      // Extents start on a block boundary, like the records of a plain file
+      uint64_t physical = kdb_container_allocate(container, length, KDB_CONTAINER_EXTENT);
+
+      if (physical == 0 || !kdb_container_write(container, db->table + sizeof(uint64_t) * extent, &physical, sizeof(uint64_t)))
+      {
+        KDB_ERROR("Could not allocate an extent for the series\n");
+
+        done = false;
+
+        break;
+      }
+
+      db->extents[extent] = physical;
+    }
+
+    uint64_t physical = db->extents[extent] + offset - start;
+
+    if (write)
+    {
+      done = kdb_container_write(container, physical, bytes, piece);
+    }
+    else
+    {
+      done = KDB_SEEK(container->file, physical, SEEK_SET) == 0 && fread(bytes, 1, piece, container->file) == piece;
+    }
+
+    if (!done)
+    {
+      break;
+    }
+
+    bytes  += piece;
+    offset += piece;
+    size   -= piece;
+  }
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_unlock(&container->lock);
+  #endif
+
+  return done;
+}
+
+// Put db in front of the pool. Callers of the kdb_pool_ helpers below hold
+// the pool lock
+void kdb_pool_link(KDB* db)
+{
+  db->pool_prev = NULL;
+  db->pool_next = kdb_pool_head;
+
+  if (kdb_pool_head)
+  {
+    kdb_pool_head->pool_prev = db;
+  }
+  else
+  {
+    kdb_pool_tail = db;
+  }
+
+  kdb_pool_head = db;
+}
+
+void kdb_pool_unlink(KDB* db)
+{
+  if (db->pool_prev)
+  {
+    db->pool_prev->pool_next = db->pool_next;
+  }
+  else
+  {
+    kdb_pool_head = db->pool_next;
+  }
+
+  if (db->pool_next)
+  {
+    db->pool_next->pool_prev = db->pool_prev;
+  }
+  else
+  {
+    kdb_pool_tail = db->pool_prev;
+  }
+
+  db->pool_prev = NULL;
+  db->pool_next = NULL;
+}
+
+// Close the file of db, unless a call on another thread is using it
+bool kdb_pool_evict(KDB* db)
+{
+  #ifdef KDB_USE_THREADS
+    if (pthread_rwlock_trywrlock(&db->lock) != 0)
+    {
+      return false;
+    }
+  #endif
+
+  if (fclose(db->file) != 0)
+  {
+    KDB_ERROR("Failed to close file handler\n");
+  }
+
+  // The indicators file shares the place of the database file in the pool
+  if (db->indicators_file && fclose(db->indicators_file) != 0)
+  {
+    KDB_ERROR("Failed to close the indicators file\n");
+  }
+
+  db->file            = NULL;
+  db->indicators_file = NULL;
+
+  kdb_pool_unlink(db);
+
+  --kdb_pool.open;
+  ++kdb_pool.evictions;
+
+  #ifdef KDB_USE_THREADS
+    pthread_rwlock_unlock(&db->lock);
+  #endif
+
+  return true;
+}
+
+// Close least recently used files until room more fit under the capacity
+void kdb_pool_trim(uint32_t room)
+{
+  KDB* db = kdb_pool_tail;
+
+  while (db && kdb_pool.capacity > 0 && kdb_pool.open + room > kdb_pool.capacity)
+  {
+    KDB* previous = db->pool_prev;
+
+    kdb_pool_evict(db);
+
+    db = previous;
+  }
+}
+
+// File of db, reopened when the pool closed it. Every file access of a
+// database goes through here so the pool sees how recently it was used
+FILE* kdb_file(KDB* db)
+{
+  // Files are kept out of the pool while their database opens or closes
+  if (!db->pooled)
+  {
+    return db->file;
+  }
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_lock(&kdb_pool_lock);
+  #endif
+
+  if (db->file)
+  {
+    ++kdb_pool.hits;
+
+    if (kdb_pool_head != db)
+    {
+      kdb_pool_unlink(db);
+      kdb_pool_link(db);
+    }
+  }
+  else
+  {
+    ++kdb_pool.misses;
+
+    kdb_pool_trim(1);
+
+    db->file = fopen(db->filename, "r+b");
+
+    if (db->file)
+    {
+      kdb_pool_link(db);
+
+      ++kdb_pool.open;
+    }
+    else
+    {
+      KDB_ERROR("Could not reopen the database file\n");
+    }
+  }
+
+  FILE* file = db->file;
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_unlock(&kdb_pool_lock);
+  #endif
+
+  return file;
+}
+
+// Hand the file of a freshly opened database to the pool
+void kdb_pool_attach(KDB* db)
+{
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_lock(&kdb_pool_lock);
+  #endif
+
+  kdb_pool_trim(1);
+  kdb_pool_link(db);
+
+  ++kdb_pool.open;
+
+  db->pooled = true;
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_unlock(&kdb_pool_lock);
+  #endif
+}
+
+// Take the file of db back from the pool, reopening it if it was closed
+FILE* kdb_pool_detach(KDB* db)
+{
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_lock(&kdb_pool_lock);
+  #endif
+
+  if (db->pooled && db->file)
+  {
+    kdb_pool_unlink(db);
+
+    --kdb_pool.open;
+  }
+
+  db->pooled = false;
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_unlock(&kdb_pool_lock);
+  #endif
+
+  if (!db->file)
+  {
+    db->file = fopen(db->filename, "r+b");
+  }
+
+  return db->file;
+}
+
+// Cap the number of databases with files open at once, 0 lifts the cap. Its
+// indicators file is closed along with the file of a database. Lowering the
+// cap closes the least recently used files right away
+void kdb_pool_configure(uint32_t capacity)
+{
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_lock(&kdb_pool_lock);
+  #endif
+
+  kdb_pool.capacity = capacity;
+
+  kdb_pool_trim(0);
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_unlock(&kdb_pool_lock);
+  #endif
+}
+
+void kdb_pool_stats(KDB_POOL_STATS* stats)
+{
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_lock(&kdb_pool_lock);
+  #endif
+
+  *stats = kdb_pool;
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_unlock(&kdb_pool_lock);
+  #endif
+}
+
+uint32_t kdb_leading_zeros(uint64_t value)
+{
+  #if defined(__GNUC__) || defined(__clang__)
+    return value != 0 ? (uint32_t)__builtin_clzll(value) : 64;
+  #else
+    uint32_t zeros = 0;
+
+    for (uint64_t bit = (uint64_t)1 << 63; bit != 0 && (value & bit) == 0; bit >>= 1)
+    {
+      ++zeros;
+    }
+
+    return zeros;
+  #endif
+}
+
+uint32_t kdb_trailing_zeros(uint64_t value)
+{
+  #if defined(__GNUC__) || defined(__clang__)
+    return value != 0 ? (uint32_t)__builtin_ctzll(value) : 64;
+  #else
+    uint32_t zeros = 0;
+
+    for (uint64_t bit = 1; bit != 0 && (value & bit) == 0; bit <<= 1)
+    {
+      ++zeros;
+    }
+
+    return zeros;
+  #endif
+}
+
+void kdb_bits_write(KDB_BITS* bits, uint64_t value, uint32_t count)
+{
+  while (count > 0)
+  {
+    uint32_t offset = bits->position & 7;
+    uint32_t take   = 8 - offset < count ? 8 - offset : count;
+    uint8_t  chunk  = (uint8_t)((value >> (count - take)) & ((1u << take) - 1));
+
+    bits->data[bits->position >> 3] |= (uint8_t)(chunk << (8 - offset - take));
+    bits->position                  += take;
+
+    count -= take;
+  }
+}
+
+uint64_t kdb_bits_read(KDB_BITS* bits, uint32_t count)
+{
+  uint64_t value = 0;
+
+  while (count > 0)
+  {
+    uint32_t offset = bits->position & 7;
+    uint32_t take   = 8 - offset < count ? 8 - offset : count;
+    uint8_t  chunk  = (uint8_t)(bits->data[bits->position >> 3] >> (8 - offset - take)) & ((1u << take) - 1);
+
+    value           = (value << take) | chunk;
+    bits->position += take;
+
+    count -= take;
+  }
+
+  return value;
+}
+
+// Encode the records into out, which must hold KDB_BLOCK_MAX_BYTES zeroed
+// bytes. Returns the payload size, also stored in the block header
+uint32_t kdb_encode_block(const KDB_DATA* records, uint32_t count, KDB_BLOCK_HEADER* header, uint8_t* out)
+{
+  memset(header, 0, sizeof(KDB_BLOCK_HEADER));
+
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  header->count           = count;
+  header->first_timestamp = records[0].timestamp;
+  header->first_value     = records[0].value;
+  header->first_sum       = records[0].sum;
+
+  #ifndef KDB_USE_LONG_DOUBLE
+    const uint32_t width = sizeof(KDB_VALUE_BITS_TYPE) * 8;
+
+    KDB_BITS            bits        = { out, 0 };
+    uint64_t            previous_ts = records[0].timestamp;
+    uint64_t            previous_dt = 0;
+    KDB_VALUE_BITS_TYPE previous    = 0;
+    KDB_VALUE_BITS_TYPE current     = 0;
+    uint32_t            leading     = width + 1;
+    uint32_t            trailing    = 0;
+
+    memcpy(&previous, &records[0].value, sizeof(KDB_VALUE_BITS_TYPE));
+
+    for (uint32_t i = 1; i < count; ++i)
+    {
+      // Timestamps: delta of deltas in the smallest bucket that fits
+      uint64_t delta = records[i].timestamp - previous_ts;
+      int64_t  dod   = (int64_t)(delta - previous_dt);
+
+      if (dod == 0)
+      {
+        kdb_bits_write(&bits, 0b0, 1);
+      }
+      else if (dod >= -64 && dod < 64)
+      {
+        kdb_bits_write(&bits, 0b10, 2);
+        kdb_bits_write(&bits, (uint64_t)dod, 7);
+      }
+      else if (dod >= -256 && dod < 256)
+      {
+        kdb_bits_write(&bits, 0b110, 3);
+        kdb_bits_write(&bits, (uint64_t)dod, 9);
+      }
+      else if (dod >= -2048 && dod < 2048)
+      {
+        kdb_bits_write(&bits, 0b1110, 4);
+        kdb_bits_write(&bits, (uint64_t)dod, 12);
+      }
+      else
+      {
+        kdb_bits_write(&bits, 0b1111, 4);
+        kdb_bits_write(&bits, (uint64_t)dod, 64);
+      }
+
+      previous_ts = records[i].timestamp;
+      previous_dt = delta;
+
+      // Values: XOR with the previous one, reusing its window when it fits
+      memcpy(&current, &records[i].value, sizeof(KDB_VALUE_BITS_TYPE));
+
+      uint64_t xored = (uint64_t)(current ^ previous);
+
+      previous = current;
+
+      if (xored == 0)
+      {
+        kdb_bits_write(&bits, 0b0, 1);
+
+        continue;
+      }
+
+      uint32_t lead  = kdb_leading_zeros(xored) - (64 - width);
+      uint32_t trail = kdb_trailing_zeros(xored);
+
+      if (lead > 31)
+      {
+        lead = 31;
+      }
+
+      if (leading <= width && lead >= leading && trail >= trailing)
+      {
+        kdb_bits_write(&bits, 0b10, 2);
+        kdb_bits_write(&bits, xored >> trailing, width - leading - trailing);
+      }
+      else
+      {
+        leading  = lead;
+        trailing = trail;
+
+        kdb_bits_write(&bits, 0b11, 2);
+        kdb_bits_write(&bits, leading, 5);
+        kdb_bits_write(&bits, width - leading - trailing - 1, 6);
+        kdb_bits_write(&bits, xored >> trailing, width - leading - trailing);
+      }
+    }
+
+    header->size = (uint32_t)((bits.position + 7) / 8);
+  #else
+    // Long double builds can not enable compression, the codec is never reached
+    (void)out;
+  #endif
+
+  return header->size;
+}
+
+// Decode a block into out, rebuilding the running sums from the first one
+void kdb_decode_block(const KDB_BLOCK_HEADER* header, const uint8_t* payload, KDB_DATA* out)
+{
+  if (header->count == 0)
+  {
+    return;
+  }
+
+  out[0].timestamp = header->first_timestamp;
+  out[0].value     = header->first_value;
+  out[0].sum       = header->first_sum;
+
+  #ifndef KDB_USE_LONG_DOUBLE
+    const uint32_t width = sizeof(KDB_VALUE_BITS_TYPE) * 8;
+
+    KDB_BITS            bits     = { (uint8_t*)payload, 0 };
+    uint64_t            delta    = 0;
+    KDB_VALUE_BITS_TYPE previous = 0;
+    uint32_t            leading  = 0;
+    uint32_t            trailing = 0;
+    uint32_t            size;
+    uint64_t            raw;
+
+    memcpy(&previous, &header->first_value, sizeof(KDB_VALUE_BITS_TYPE));
+
+    for (uint32_t i = 1; i < header->count; ++i)
+    {
+      if (kdb_bits_read(&bits, 1) == 0)
+      {
+        size = 0;
+      }
+      else if (kdb_bits_read(&bits, 1) == 0)
+      {
+        size = 7;
+      }
+      else if (kdb_bits_read(&bits, 1) == 0)
+      {
+        size = 9;
+      }
+      else
+      {
+        size = kdb_bits_read(&bits, 1) == 0 ? 12 : 64;
+      }
+
+      if (size > 0)
+      {
+        raw = kdb_bits_read(&bits, size);
+
+        // Sign extend the bucket back to 64 bits
+        if (size < 64 && (raw & ((uint64_t)1 << (size - 1))) != 0)
+        {
+          raw |= ~(((uint64_t)1 << size) - 1);
+        }
+
+        delta += raw;
+      }
+
+      out[i].timestamp = out[i - 1].timestamp + delta;
+
+      if (kdb_bits_read(&bits, 1) != 0)
+      {
+        if (kdb_bits_read(&bits, 1) != 0)
+        {
+          leading  = (uint32_t)kdb_bits_read(&bits, 5);
+          trailing = width - leading - (uint32_t)kdb_bits_read(&bits, 6) - 1;
+        }
+
+        previous ^= (KDB_VALUE_BITS_TYPE)(kdb_bits_read(&bits, width - leading - trailing) << trailing);
+      }
+
+      memcpy(&out[i].value, &previous, sizeof(KDB_VALUE_BITS_TYPE));
+
+      out[i].sum = out[i - 1].sum + out[i].value;
+    }
+  #else
+    (void)payload;
+  #endif
+}
+
+// Set up the buffers of a compressed database and load its raw tail
+bool kdb_compressed_open(KDB* db)
+{
+  #ifdef KDB_USE_LONG_DOUBLE
+    (void)db;
+
+    KDB_ERROR("Compressed databases do not support long double\n");
+
+    return false;
+  #else
+    if (!db->tail)
+    {
+      db->tail    = (KDB_DATA*)malloc(sizeof(KDB_DATA) * KDB_BLOCK_SIZE);
+      db->decoded = (KDB_DATA*)malloc(sizeof(KDB_DATA) * KDB_BLOCK_SIZE);
+      db->scratch = (uint8_t*)malloc(KDB_BLOCK_MAX_BYTES);
+
+      if (!db->tail || !db->decoded || !db->scratch)
+      {
+        KDB_ERROR("Could not allocate memory for the compressed blocks\n");
+
+        return false;
+      }
+    }
+
+    db->decoded_block = UINT32_MAX;
+    db->tail_count    = db->header.count % KDB_BLOCK_SIZE;
+
+    if (db->tail_count == 0)
+    {
+      return true;
+    }
+
+    if (!kdb_read_at(db, db->header.tail_offset, db->tail, sizeof(KDB_DATA) * db->tail_count))
+    {
+      KDB_ERROR("Error reading the raw tail\n");
+
+      return false;
+    }
+
+    return true;
+  #endif
+}
+
+void kdb_compressed_close(KDB* db)
+{
+  free(db->blocks);
+  free(db->tail);
+  free(db->decoded);
+  free(db->scratch);
+
+  db->blocks          = NULL;
+  db->blocks_count    = 0;
+  db->blocks_capacity = 0;
+  db->blocks_loaded   = false;
+  db->tail            = NULL;
+  db->tail_count      = 0;
+  db->decoded         = NULL;
+  db->scratch         = NULL;
+}
+
+bool kdb_compressed_push_block(KDB* db, uint64_t offset)
+{
+  if (db->blocks_count == db->blocks_capacity)
+  {
+    uint32_t  capacity = db->blocks_capacity > 0 ? db->blocks_capacity * 2 : 64;
+    uint64_t* blocks   = (uint64_t*)realloc(db->blocks, sizeof(uint64_t) * capacity);
+
+    if (!blocks)
+    {
+      KDB_ERROR("Could not allocate memory for the block offsets\n");
+
+      return false;
+    }
+
+    db->blocks          = blocks;
+    db->blocks_capacity = capacity;
+  }
+
+  db->blocks[db->blocks_count++] = offset;
+
+  return true;
+}
+
+// Build the block offsets by walking the block headers, only done on the first
+// random access since appends never need them
+bool kdb_compressed_blocks(KDB* db)
+{
+  if (db->blocks_loaded)
+  {
+    return true;
+  }
+
+  KDB_BLOCK_HEADER header;
+  uint64_t         offset = sizeof(KDB_HEADER);
+  uint64_t         sealed = (kdb_committed_count(db) - db->tail_count) / KDB_BLOCK_SIZE;
+
+  db->blocks_count = 0;
+
+  for (uint64_t i = 0; i < sealed; ++i)
+  {
+    if (!kdb_compressed_push_block(db, offset))
+    {
+      return false;
+    }
+
+    if (!kdb_read_at(db, offset, &header, sizeof(KDB_BLOCK_HEADER)))
+    {
+      KDB_ERROR("Error reading the header of block %llu\n", (unsigned long long)i);
+
+      return false;
+    }
+
+    offset += sizeof(KDB_BLOCK_HEADER) + header.size;
+  }
+
+  if (offset != db->header.tail_offset)
+  {
+    KDB_ERROR("The compressed blocks do not match the header\n");
+
+    return false;
+  }
+
+  db->blocks_loaded = true;
+
+  return true;
+}
+
+// Move a compressed database to a header another process wrote. Sealed blocks
+// are never rewritten, so new ones are walked from where the old tail was.
+// The raw tail is read into the decoded buffer first, a failure keeps the old one
+bool kdb_compressed_refresh(KDB* db, const KDB_HEADER* header)
+{
+  uint32_t tail_count = header->count % KDB_BLOCK_SIZE;
+
+  db->decoded_block = UINT32_MAX;
+
+  if (tail_count > 0 && !kdb_read_at(db, header->tail_offset, db->decoded, sizeof(KDB_DATA) * tail_count))
+  {
+    KDB_ERROR("Error reading the raw tail\n");
+
+    return false;
+  }
+
+  KDB_BLOCK_HEADER block;
+  uint64_t         offset = db->header.tail_offset;
+
+  while (db->blocks_loaded && offset < header->tail_offset)
+  {
+    if (!kdb_compressed_push_block(db, offset) || !kdb_read_at(db, offset, &block, sizeof(KDB_BLOCK_HEADER)))
+    {
+      break;
+    }
+
+    offset += sizeof(KDB_BLOCK_HEADER) + block.size;
+  }
+
+  // Offsets that went astray are walked again on the next random access
+  if (offset != header->tail_offset)
+  {
+    db->blocks_loaded = false;
+  }
+
+  memcpy(db->tail, db->decoded, sizeof(KDB_DATA) * tail_count);
+
+  db->tail_count = tail_count;
+
+  return true;
+}
+
+// Decode a sealed block into the decoded buffer unless it is already there
+bool kdb_compressed_load(KDB* db, uint32_t block)
+{
+  if (db->decoded_block == block)
+  {
+    return true;
+  }
+
+  if (!kdb_compressed_blocks(db))
+  {
+    return false;
+  }
+
+  if (block >= db->blocks_count)
+  {
+    KDB_ERROR("Block %u is out of range\n", block);
+
+    return false;
+  }
+
+  KDB_BLOCK_HEADER header;
+
+  if (!kdb_read_at(db, db->blocks[block], &header, sizeof(KDB_BLOCK_HEADER)))
+  {
+    KDB_ERROR("Error reading the header of block %u\n", block);
+
+    return false;
+  }
+
+  if (header.count != KDB_BLOCK_SIZE || header.size > KDB_BLOCK_MAX_BYTES)
+  {
+    KDB_ERROR("Block %u is corrupted\n", block);
+
+    return false;
+  }
+
+  if (!kdb_read_at(db, db->blocks[block] + sizeof(KDB_BLOCK_HEADER), db->scratch, header.size))
+  {
+    KDB_ERROR("Error reading block %u\n", block);
+
+    return false;
+  }
+
+  kdb_decode_block(&header, db->scratch, db->decoded);
+
+  db->decoded_block = block;
+
+  return true;
+}
+
+// Committed records from index up to the end of its block or of the tail. The
+// pointer is only valid until the next read of the database
+const KDB_DATA* kdb_compressed_span(KDB* db, uint64_t index, uint32_t* count)
+{
+  uint64_t committed = kdb_committed_count(db);
+  uint64_t sealed    = committed - db->tail_count;
+
+  *count = 0;
+
+  if (index >= committed)
+  {
+    KDB_ERROR("Record %llu is out of range\n", (unsigned long long)index);
+
+    return NULL;
+  }
+
+  if (index >= sealed)
+  {
+    *count = (uint32_t)(committed - index);
+
+    return db->tail + (index - sealed);
+  }
+
+  if (!kdb_compressed_load(db, (uint32_t)(index / KDB_BLOCK_SIZE)))
+  {
+    return NULL;
+  }
+
+  *count = KDB_BLOCK_SIZE - index % KDB_BLOCK_SIZE;
+
+  return db->decoded + index % KDB_BLOCK_SIZE;
+}
+
+// Append records to the raw tail, sealing it into a compressed block each time
+// it fills up. The header's tail offset is updated but not written
+bool kdb_compressed_append(KDB* db, uint64_t start, const KDB_DATA* records, uint64_t count)
+{
+  KDB_TAIL_STATE state;
+  uint32_t       unwritten = db->tail_count;
+
+  kdb_compressed_mark(db, &state);
+
+  while (count > 0)
+  {
+    uint32_t take = KDB_BLOCK_SIZE - db->tail_count < count ? KDB_BLOCK_SIZE - db->tail_count : (uint32_t)count;
+
+    memcpy(db->tail + db->tail_count, records, sizeof(KDB_DATA) * take);
+
+    db->tail_count += take;
+    records        += take;
+    start          += take;
+    count          -= take;
+
+    if (db->tail_count < KDB_BLOCK_SIZE)
+    {
+      break;
+    }
+
+    KDB_BLOCK_HEADER header;
+
+    memset(db->scratch, 0, KDB_BLOCK_MAX_BYTES);
+
+    kdb_encode_block(db->tail, KDB_BLOCK_SIZE, &header, db->scratch);
+
+    if (!kdb_write_at(db, db->header.tail_offset, &header, sizeof(KDB_BLOCK_HEADER)) ||
+        !kdb_write_at(db, db->header.tail_offset + sizeof(KDB_BLOCK_HEADER), db->scratch, header.size))
+    {
+      KDB_ERROR("Error while trying to write a compressed block\n");
+
+      goto append_error;
+    }
+
+    if (db->blocks_loaded && !kdb_compressed_push_block(db, db->header.tail_offset))
+    {
+      db->blocks_loaded = false;
+    }
+
+    // The freshly sealed block is the most likely one to be read next
+    memcpy(db->decoded, db->tail, sizeof(KDB_DATA) * KDB_BLOCK_SIZE);
+
+    db->decoded_block       = (uint32_t)(start / KDB_BLOCK_SIZE - 1);
+    db->header.tail_offset += sizeof(KDB_BLOCK_HEADER) + header.size;
+    db->tail_count          = 0;
+
+    unwritten = 0;
+  }
+
+  if (db->tail_count > unwritten)
+  {
+    if (!kdb_write_at(db, db->header.tail_offset + sizeof(KDB_DATA) * unwritten, db->tail + unwritten, sizeof(KDB_DATA) * (db->tail_count - unwritten)))
+    {
+      KDB_ERROR("Error while trying to write the raw tail\n");
+
+      goto append_error;
+    }
+  }
+
+  return true;
+
+  append_error:
+    kdb_compressed_restore(db, &state);
+
+    return false;
+}
+
+void kdb_compressed_mark(KDB* db, KDB_TAIL_STATE* state)
+{
+  state->tail_offset  = db->header.tail_offset;
+  state->tail_count   = db->tail_count;
+  state->blocks_count = db->blocks_count;
+}
+
+// Put the tail back as it was when state was marked. Sealing a block writes
+// over the raw tail, so its records are written back for the file to match
+// the old header again. A block that was sealed since begins with them
+bool kdb_compressed_restore(KDB* db, const KDB_TAIL_STATE* state)
+{
+  if ((db->header.flags & KDB_FLAGS_COMPRESSED) == 0)
+  {
+    return true;
+  }
+
+  bool             sealed   = db->header.tail_offset != state->tail_offset;
+  bool             restored = true;
+  KDB_BLOCK_HEADER header;
+
+  db->header.tail_offset = state->tail_offset;
+  db->tail_count         = state->tail_count;
+  db->blocks_count       = state->blocks_count < db->blocks_count ? state->blocks_count : db->blocks_count;
+  db->decoded_block      = UINT32_MAX;
+
+  if (state->tail_count == 0)
+  {
+    return true;
+  }
+
+  if (sealed)
+  {
+    restored = kdb_read_at(db, state->tail_offset, &header, sizeof(KDB_BLOCK_HEADER)) &&
+               header.count == KDB_BLOCK_SIZE && header.size <= KDB_BLOCK_MAX_BYTES &&
+               kdb_read_at(db, state->tail_offset + sizeof(KDB_BLOCK_HEADER), db->scratch, header.size);
+
+    if (restored)
+    {
+      kdb_decode_block(&header, db->scratch, db->decoded);
+
+      memcpy(db->tail, db->decoded, sizeof(KDB_DATA) * state->tail_count);
+    }
+  }
+
+  if (!restored || !kdb_write_at(db, state->tail_offset, db->tail, sizeof(KDB_DATA) * state->tail_count))
+  {
+    KDB_ERROR("Error restoring the raw tail\n");
+
+    return false;
+  }
+
+  return true;
+}
+
+// Initialize the database's structure
+KDB* kdb_initialize(char* name)
+{
+  return kdb_initialize_with_options(name, NULL);
+}
+
+// Options only apply when the database is opened, further references share
+// the first ones
+KDB* kdb_initialize_with_options(char* name, const KDB_OPTIONS* options)
+{
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_lock(&kdb_registry_lock);
+
+    KDB* db = kdb_initialize_locked(name, options);
+
+    pthread_mutex_unlock(&kdb_registry_lock);
+
+    return db;
+  #else
+    return kdb_initialize_locked(name, options);
+  #endif
+}
+
+KDB* kdb_initialize_locked(char* name, const KDB_OPTIONS* options)
+{
+  // Validate name limit
+  size_t name_size = strlen(name);
+
+  if (name_size > KDB_NAME_SIZE)
+  {
+    KDB_ERROR("Database name is above the %d characters limit\n", KDB_NAME_SIZE);
+
+    return false;
+  }
+
+  for (size_t i = 0; i < name_size; ++i)
+  {
+    if (('a' <= name[i] && name[i] <= 'z') || ('0' <= name[i] && name[i] <= '9'))
+    {
+      continue;
+    }
+
+    KDB_ERROR("Database name has illegal characters. Characters allowed: a-z and 0-9. Found %c\n", name[i]);
+
+    return false;
+  }
+
+  // Nothing would sync records appended before a pause, see KDB_DURABILITY
+  #ifndef KDB_USE_THREADS
+    if (options && options->durability == KDB_DURABILITY_GROUP && options->group_ms > 0)
+    {
+      KDB_ERROR("The group_ms limit needs KDB_USE_THREADS, use group_records instead\n");
+
+      return NULL;
+    }
+  #endif
+
+  const char* container      = options ? options->container : NULL;
+  size_t      container_size = container ? strlen(container) : 0;
+
+  for (size_t i = 0; i < container_size; ++i)
+  {
+    if (('a' <= container[i] && container[i] <= 'z') || ('0' <= container[i] && container[i] <= '9'))
+    {
+      continue;
+    }
+
+    KDB_ERROR("Container name has illegal characters. Characters allowed: a-z and 0-9. Found %c\n", container[i]);
+
+    return NULL;
+  }
+
+  // Series of a container are registered as <container>.<name>
+  size_t prefix_size = container ? container_size + 1 : 0;
+  char*  p_name      = (char*)malloc((prefix_size + name_size + 1) * sizeof(char));
+
+  if (!p_name)
+  {
+    KDB_ERROR("Could not allocate memory for the name\n");
+
+    return NULL;
+  }
+
+  if (container)
+  {
+    memcpy(p_name, container, container_size);
+
+    p_name[container_size] = '.';
+  }
+
+  memcpy(p_name + prefix_size, name, name_size + 1);
+
+  KDB* db = kdb_hashmap_dbs_get(p_name, NULL);
+
+  if (db)
+  {
+    uint64_t references = kdb_hashmap_dbs_references_get(p_name, 0);
+
+    kdb_hashmap_dbs_references_set(db->p_name, references + 1);
+
+    free(p_name);
+
+    return db;
+  }
+
+  db = (KDB*)malloc(sizeof(KDB));
+
+  if (!db)
+  {
+    KDB_ERROR("Could not alloc memory for the database structure\n");
+
+    free(p_name);
+
+    return NULL;
+  }
+
+  // Ensure everything is clean
+  memset(db, 0, sizeof(KDB));
+
+  if (options)
+  {
+    db->options = *options;
+  }
+
+  db->options.container = NULL;
+  db->synced_at         = kdb_now_ms();
+  db->p_name            = p_name;
+
+  // Initialize filename, the container's one for series of a container
+  const char* file_name      = container ? container : name;
+  size_t      file_name_size = container ? container_size : name_size;
+  char*       filename       = (char*)malloc((file_name_size + 5) * sizeof(char));
+
+  if (!filename)
+  {
+    KDB_ERROR("Could not allocate memory for the filename\n");
+
+    goto error;
+  }
+
+  memcpy(filename, file_name, file_name_size);
+  memcpy(filename + file_name_size, container ? ".kdc" : ".kdb", 5);
+
+  db->filename = filename;
+
+  bool f_create = false;
+
+  if (container)
+  {
+    db->container = kdb_container_open(container);
+
+    if (!db->container || !kdb_container_attach(db, name, &f_create))
+    {
+      goto error;
+    }
+  }
+  else
+  {
+    // Try to open the file to read/update
+    db->file = fopen(filename, "r+b");
+
+    // If file does not exist, try to create it
+    if (!db->file && errno == ENOENT)
+    {
+      db->file = fopen(filename, "w+b");
+      f_create = true;
+    }
+
+    if (!db->file)
+    {
+      KDB_ERROR("Failed to open \"%s\"\n", filename);
+
+      goto error;
+    }
+  }
+
+  if (f_create)
+  {
+    // Initialize data
+    memcpy(&db->header.version, &KDB_VERSION, KDB_VERSION_SIZE);
+    memcpy(&db->header.name, name, name_size);
+
+    db->header.min         = INFINITY;
+    db->header.max         = -INFINITY;
+    db->header.variance    = INFINITY;
+    db->header.median      = INFINITY;
+    db->header.tail_offset = sizeof(KDB_HEADER);
+
+    #ifdef KDB_USE_LONG_DOUBLE
+      db->header.flags |= KDB_FLAGS_USE_LONG_DOUBLE;
+    #else
+      #ifdef KDB_USE_DOUBLE
+        db->header.flags |= KDB_FLAGS_USE_DOUBLE;
+      #endif
+    #endif
+
+    #ifdef KDB_USE_COMPRESSION
+      db->header.flags |= KDB_FLAGS_COMPRESSED;
+    #endif
+
+    #ifdef KDB_USE_COLUMNS
+      db->header.flags |= KDB_FLAGS_COLUMNAR;
+    #endif
+
+    // Try to write the header
+    if (!kdb_write_header(db))
+    {
+      goto error;
+    }
+
+    // All good
+    goto success;
+  }
+
+  // Read data from file
+  char   f_version[KDB_VERSION_SIZE] = { 0 };
+  size_t f_name_size                 = 0;
+  bool   f_migrate                   = false;
+
+  // Try to parse the version
+  if (!kdb_read_at(db, 0, &f_version, KDB_VERSION_SIZE))
+  {
+    KDB_ERROR("Failed to read the database version\n");
+
+    goto error;
+  }
+
+  // Check the magic string
+  if (strncmp(f_version, "KDB", 3) != 0)
+  {
+    KDB_ERROR("File has no magic string in header\n");
+
+    goto error;
+  }
+
+  // Check if the version is right/supported and parse the header accordingly
+  if (f_version[KDB_VERSION_SIZE - 1] == KDB_VERSION_NUMBER)
+  {
+    if (!kdb_read_at(db, 0, &db->header, sizeof(KDB_HEADER)))
+    {
+      KDB_ERROR("Failed to read the database header\n");
+
+      goto error;
+    }
+  }
+  else if (f_version[KDB_VERSION_SIZE - 1] == 1 && !db->container)
+  {
+    KDB_HEADER_V1 f_header = { 0 };
+
+    if (!kdb_read_at(db, 0, &f_header, sizeof(KDB_HEADER_V1)))
+    {
+      KDB_ERROR("Failed to read the database header\n");
+
+      goto error;
+    }
+
+    memcpy(&db->header.version, &KDB_VERSION, KDB_VERSION_SIZE);
+    memcpy(&db->header.name, &f_header.name, KDB_NAME_SIZE);
+
+    db->header.flags       = f_header.flags;
+    db->header.count       = f_header.count;
+    db->header.sum         = f_header.sum;
+    db->header.average     = f_header.average;
+    db->header.min         = f_header.min;
+    db->header.max         = f_header.max;
+    db->header.variance    = f_header.variance;
+    db->header.median      = f_header.median;
+    db->header.tail_offset = sizeof(KDB_HEADER);
+
+    f_migrate = true;
+  }
+  else
+  {
+    KDB_ERROR("Unknown database version\n");
+
+    goto error;
+  }
+
+  // Validate the name
+  f_name_size = strnlen(db->header.name, KDB_NAME_SIZE);
+
+  if (f_name_size != name_size || strncmp(db->header.name, name, name_size) != 0)
+  {
+    KDB_ERROR("Wrong name for the database\n");
+
+    goto error;
+  }
+
+  // Check compatibility between the library and the file
+  #ifdef KDB_USE_LONG_DOUBLE
+    if ((db->header.flags & KDB_FLAGS_USE_LONG_DOUBLE) == 0)
+    {
+      KDB_ERROR("KDB is set to use long double and this file is not compatible\n");
+
+      goto error;
+    }
+  #else
+    #ifdef KDB_USE_DOUBLE
+      if ((db->header.flags & KDB_FLAGS_USE_DOUBLE) == 0)
+      {
+        KDB_ERROR("KDB is set to use double and this file is not compatible\n");
+
+        goto error;
+      }
+    #else
+      if ((db->header.flags & (KDB_FLAGS_USE_DOUBLE | KDB_FLAGS_USE_LONG_DOUBLE)) != 0)
+      {
+        KDB_ERROR("KDB is set to use float and this file is not compatible\n");
+
+        goto error;
+      }
+    #endif
+  #endif
+
+  // Older files are rewritten with the current header, containers only hold
+  // current ones
+  if (f_migrate && !kdb_migrate(db))
+  {
+    goto error;
+  }
+
+  // All good
+  success:
+    if ((db->header.flags & KDB_FLAGS_COMPRESSED) != 0 && !kdb_compressed_open(db))
+    {
+      goto error;
+    }
+
+    #ifdef KDB_USE_THREADS
+      // Writers go first, a steady stream of readers would starve them otherwise
+      pthread_rwlockattr_t attributes;
+
+      pthread_rwlockattr_init(&attributes);
+
+      #ifdef __GLIBC__
+        pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+      #endif
+
+      pthread_rwlock_init(&db->lock, &attributes);
+      pthread_rwlockattr_destroy(&attributes);
+      pthread_mutex_init(&db->io_lock, NULL);
+    #endif
+
+    db->initialized = true;
+
+    if (!kdb_hashmap_dbs_references_set(p_name, 1) || !kdb_hashmap_dbs_set(p_name, db))
+    {
+      KDB_ERROR("Could not register the database\n");
+
+      goto error;
+    }
+
+    #ifdef KDB_USE_THREADS
+      if (db->options.durability == KDB_DURABILITY_GROUP && db->options.group_ms > 0 && !kdb_flusher_start(db))
+      {
+        goto error;
+      }
+    #endif
+
+    // The container keeps its file open for all of its series
+    if (!db->container)
+    {
+      kdb_pool_attach(db);
+    }
+
+    // Companion structures are optional, the database works without them
+    if (!kdb_sketch_load(db, false))
+    {
+      KDB_ERROR("Failed to load the quantile sketch\n");
+    }
+
+    if (!kdb_zones_load(db, false))
+    {
+      KDB_ERROR("Failed to load the zone maps\n");
+    }
+
+    if (!kdb_pyramid_load(db, false))
+    {
+      KDB_ERROR("Failed to load the min/max pyramid\n");
+    }
+
+    if (!kdb_indicators_load(db))
+    {
+      KDB_ERROR("Failed to load the indicators\n");
+    }
+
+    if (!kdb_rollups_load(db))
+    {
+      KDB_ERROR("Failed to load the rollup tiers\n");
+    }
+
+    return db;
+
+  // Registered databases are finalized, the others only closed
+  error:
+    if (kdb_hashmap_dbs_references_get(p_name, 0) > 0)
+    {
+      if (!kdb_finalize_locked(db))
+      {
+        KDB_ERROR("Failed to properly finalize database\n");
+      }
+    }
+    else
+    {
+      if (db->container)
+      {
+        kdb_container_close(db->container);
+      }
+      else if (db->file)
+      {
+        fclose(db->file);
+      }
+
+      kdb_compressed_close(db);
+
+      free(db->filename);
+      free(p_name);
+    }
+
+    free(db);
+
+    return NULL;
+}
+
+// Finalize the database's structure
+bool kdb_finalize(KDB* db)
+{
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_lock(&kdb_registry_lock);
+
+    bool finalized = kdb_finalize_locked(db);
+
+    pthread_mutex_unlock(&kdb_registry_lock);
+
+    return finalized;
+  #else
+    return kdb_finalize_locked(db);
+  #endif
+}
+
+bool kdb_finalize_locked(KDB* db)
+{
+  if (!db)
+  {
+    return true;
+  }
+
+  uint64_t references = kdb_hashmap_dbs_references_get(db->p_name, 0);
+
+  if (references == 0)
+  {
+    KDB_ERROR("There are no references to database\n");
+
+    return false;
+  }
+
+  uint64_t new_references = references - 1;
+
+  kdb_hashmap_dbs_references_set(db->p_name, new_references);
+
+  if (new_references > 0)
+  {
+    return true;
+  }
+
+  kdb_hashmap_dbs_references_remove(db->p_name);
+  kdb_hashmap_dbs_remove(db->p_name);
+
+  // Give the registry memory back once the last database is closed
+  if (kdb_hashmap_dbs_count() == 0)
+  {
+    kdb_hashmap_dbs_clear();
+    kdb_hashmap_dbs_references_clear();
+  }
+
+  #ifdef KDB_USE_THREADS
+    if (!kdb_ingest_stop(db))
+    {
+      KDB_ERROR("Some ingested records could not be written\n");
+    }
+
+    // The final sync below covers what it had left
+    kdb_flusher_stop(db);
+
+    // Wait for calls still running on other threads
+    pthread_rwlock_wrlock(&db->lock);
+    pthread_rwlock_unlock(&db->lock);
+  #endif
+
+  // The pool must not close the file while it is being finalized
+  if (!kdb_pool_detach(db))
+  {
+    KDB_ERROR("Failed to reopen the database file\n");
+  }
+
+  // Flush any pending batch before closing
+  if (db->in_batch && !kdb_commit(db))
+  {
+    KDB_ERROR("Failed to commit the pending batch\n");
+  }
+
+  if (!kdb_sync(db))
+  {
+    KDB_ERROR("Failed to sync the database\n");
+  }
+
+  if (db->batch)
+  {
+    free(db->batch);
+
+    db->batch          = NULL;
+    db->batch_capacity = 0;
+  }
+
+  if (db->sketch)
+  {
+    if (!kdb_sketch_save(db))
+    {
+      KDB_ERROR("Failed to save the quantile sketch\n");
+    }
+
+    free(db->sketch);
+
+    db->sketch = NULL;
+  }
+
+  if (db->ts_index)
+  {
+    free(db->ts_index);
+
+    db->ts_index          = NULL;
+    db->ts_index_count    = 0;
+    db->ts_index_capacity = 0;
+  }
+
+  db->ts_indexed = false;
+
+  if (db->zoned && !kdb_zones_save(db))
+  {
+    KDB_ERROR("Failed to save the zone maps\n");
+  }
+
+  if (db->zones)
+  {
+    free(db->zones);
+
+    db->zones          = NULL;
+    db->zones_count    = 0;
+    db->zones_capacity = 0;
+    db->zones_covered  = 0;
+  }
+
+  db->zoned = false;
+
+  if (db->pyramided && !kdb_pyramid_save(db))
+  {
+    KDB_ERROR("Failed to save the min/max pyramid\n");
+  }
+
+  kdb_pyramid_clear(db);
+
+  for (uint32_t i = 0; i < KDB_PYRAMID_LEVELS; ++i)
+  {
+    free(db->pyramid[i].nodes);
+
+    db->pyramid[i].nodes    = NULL;
+    db->pyramid[i].capacity = 0;
+  }
+
+  // Only the header is left to save, the columns are written as they grow
+  if (!kdb_indicators_save(db))
+  {
+    KDB_ERROR("Failed to save the indicators\n");
+  }
+
+  kdb_indicators_clear(db);
+
+  if (!kdb_rollups_save(db))
+  {
+    KDB_ERROR("Failed to save the rollup tiers\n");
+  }
+
+  kdb_rollups_clear(db);
+
+  kdb_unmap(db);
+  kdb_compressed_close(db);
+
+  // Close the file, series only let go of their container
+  if (db->container)
+  {
+    kdb_container_close(db->container);
+
+    db->container = NULL;
+    db->file      = NULL;
+  }
+  else if (db->file)
+  {
+    if (fclose(db->file) != 0)
+    {
+      KDB_ERROR("Failed to close file handler\n");
+
+      return false;
+    }
+
+    db->file = NULL;
+  }
+
+  // Zero all data
+  if (db->p_name)
+  {
+    free(db->p_name);
+
+    db->p_name = NULL;
+  }
+
+  if (db->filename)
+  {
+    free(db->filename);
+
+    db->filename = NULL;
+  }
 
   memset(&db->header.version, 0, KDB_VERSION_SIZE);
   memset(&db->header.name, 0, KDB_NAME_SIZE);
 
-  db->header.flags    = 0;
-  db->header.count    = 0;
-  db->header.sum      = 0.0f;
-  db->header.average  = 0.0f;
-  db->header.min      = INFINITY;
-  db->header.max      = -INFINITY;
-  db->header.variance = INFINITY;
-  db->header.median   = INFINITY;
+  db->header.flags    = 0;
+  db->header.count    = 0;
+  db->header.sum      = 0.0f;
+  db->header.average  = 0.0f;
+  db->header.min      = INFINITY;
+  db->header.max      = -INFINITY;
+  db->header.variance = INFINITY;
+  db->header.median   = INFINITY;
+  db->header.m2       = 0.0f;
+
+  db->initialized     = false;
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_destroy(&db->io_lock);
+    pthread_rwlock_destroy(&db->lock);
+  #endif
+
+  return true;
+}
+
+// Map the records' region of the file for copy-free reads
+bool kdb_map(KDB* db)
+{
+  KDB_LOCKED(db, true, bool, kdb_map_locked(db));
+}
+
+bool kdb_map_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  // Readers would have to remap under a shared lock, threaded builds read with pread
+  #ifdef KDB_USE_THREADS
+    KDB_ERROR("Memory mapping is not available with KDB_USE_THREADS\n");
+
+    return false;
+  #endif
+
+  #ifdef _WIN32
+    KDB_ERROR("Memory mapping is not supported on this platform\n");
+
+    return false;
+  #else
+    if ((db->header.flags & (KDB_FLAGS_COMPRESSED | KDB_FLAGS_COLUMNAR)) != 0)
+    {
+      KDB_ERROR("Only row databases can be mapped\n");
+
+      return false;
+    }
+
+    // Extents of a series are not contiguous in the container
+    if (db->container)
+    {
+      KDB_ERROR("Series of a container can't be mapped\n");
+
+      return false;
+    }
+
+    if (db->map)
+    {
+      return true;
+    }
+
+    return kdb_remap(db, kdb_committed_count(db));
+  #endif
+}
+
+void kdb_unmap(KDB* db)
+{
+  KDB_LOCKED_VOID(db, true, kdb_unmap_locked(db));
+}
+
+void kdb_unmap_locked(KDB* db)
+{
+  if (!db || !db->map)
+  {
+    return;
+  }
+
+  #ifndef _WIN32
+    if (munmap(db->map, db->map_size) != 0)
+    {
+      KDB_ERROR("Failed to unmap the file\n");
+    }
+  #endif
+
+  db->map          = NULL;
+  db->map_size     = 0;
+  db->map_capacity = 0;
+}
+
+// Grow the mapping so it covers at least count records. The mapping is
+// reserved past the end of the file, so appends only remap when it doubles
+bool kdb_remap(KDB* db, uint64_t count)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  #ifdef _WIN32
+    return false;
+  #else
+    if (db->map && count <= db->map_capacity)
+    {
+      return true;
+    }
+
+    uint64_t capacity = db->map_capacity > 0 ? db->map_capacity : 4096;
+
+    while (capacity < count)
+    {
+      capacity *= 2;
+    }
+
+    // The mapping must fit in the address space, 32 bit builds fall back to reads
+    if (capacity > (SIZE_MAX - sizeof(KDB_HEADER)) / sizeof(KDB_DATA))
+    {
+      KDB_ERROR("The file is too large to be mapped\n");
+
+      return false;
+    }
+
+    FILE* file = kdb_file(db);
+
+    if (!file || fflush(file) != 0)
+    {
+      KDB_ERROR("Error writing file to disk\n");
+
+      return false;
+    }
+
+    size_t size = sizeof(KDB_HEADER) + sizeof(KDB_DATA) * (size_t)capacity;
+    void*  map  = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(file), 0);
+
+    if (map == MAP_FAILED)
+    {
+      KDB_ERROR("Failed to map the file\n");
+
+      return false;
+    }
+
+    kdb_unmap(db);
+
+    db->map          = map;
+    db->map_size     = size;
+    db->map_capacity = capacity;
+
+    return true;
+  #endif
+}
+
+// Records already written to the file, excluding a pending batch
+uint64_t kdb_committed_count(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, 0);
+
+  return db->in_batch ? db->batch_start : db->header.count;
+}
+
+// Span of the committed records straight from the mapping, NULL when not mapped
+const KDB_DATA* kdb_records(KDB* db, uint64_t* count)
+{
+  if (count)
+  {
+    *count = 0;
+  }
+
+  KDB_CHECK_INITIALIZED(db, NULL);
+
+  if (!db->map)
+  {
+    return NULL;
+  }
+
+  uint64_t committed = kdb_committed_count(db);
+
+  if (!kdb_remap(db, committed))
+  {
+    return NULL;
+  }
+
+  if (count)
+  {
+    *count = committed;
+  }
+
+  return (const KDB_DATA*)((const char*)db->map + sizeof(KDB_HEADER));
+}
+
+// Pointer to a record without copying it when possible. Falls back to reading
+// into buffer when the database is not mapped
+const KDB_DATA* kdb_record(KDB* db, uint64_t index, KDB_DATA* buffer)
+{
+  KDB_CHECK_INITIALIZED(db, NULL);
+
+  if (index >= db->header.count)
+  {
+    return NULL;
+  }
+
+  if (db->in_batch && index >= db->batch_start)
+  {
+    return &db->batch[index - db->batch_start];
+  }
+
+  if (db->map && (index < db->map_capacity || kdb_remap(db, index + 1)))
+  {
+    return (const KDB_DATA*)((const char*)db->map + sizeof(KDB_HEADER)) + index;
+  }
+
+  return kdb_get_data(db, index, buffer) ? buffer : NULL;
+}
+
+bool kdb_get_data(KDB* db, int64_t index, KDB_DATA* data)
+{
+  KDB_LOCKED(db, false, bool, kdb_get_data_locked(db, index, data));
+}
+
+bool kdb_get_data_locked(KDB* db, int64_t index, KDB_DATA* data)
+{
+  data->timestamp = 0;
+  data->value     = 0.0f;
+  data->sum       = 0.0f;
+
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (index < 0 || (uint64_t)index >= db->header.count)
+  {
+    return true;
+  }
+
+  if (db->in_batch && (uint64_t)index >= db->batch_start)
+  {
+    memcpy(data, &db->batch[index - db->batch_start], sizeof(KDB_DATA));
+
+    return true;
+  }
+
+  if (db->map && ((uint64_t)index < db->map_capacity || kdb_remap(db, index + 1)))
+  {
+    memcpy(data, (const KDB_DATA*)((const char*)db->map + sizeof(KDB_HEADER)) + index, sizeof(KDB_DATA));
+
+    return true;
+  }
+
+  return kdb_read_records(db, index, 1, data);
+}
+
+// Copy count records starting at start into out. Records past the end are
+// zeroed, the same way kdb_get_data handles out of range indexes
+bool kdb_get_range(KDB* db, uint64_t start, uint64_t count, KDB_DATA* out)
+{
+  KDB_LOCKED(db, false, bool, kdb_get_range_locked(db, start, count, out));
+}
+
+bool kdb_get_range_locked(KDB* db, uint64_t start, uint64_t count, KDB_DATA* out)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (count == 0)
+  {
+    return true;
+  }
+
+  if (!out)
+  {
+    KDB_ERROR("Output pointer is NULL\n");
+
+    return false;
+  }
+
+  uint64_t available = start < db->header.count ? db->header.count - start : 0;
+  uint64_t wanted    = count < available ? count : available;
+  uint64_t committed = kdb_committed_count(db);
+  uint64_t copied    = 0;
+
+  // Committed records come from the mapping or from a single read
+  if (start < committed && wanted > 0)
+  {
+    uint64_t from_file = committed - start < wanted ? committed - start : wanted;
+
+    if (db->map && kdb_remap(db, committed))
+    {
+      memcpy(out, (const KDB_DATA*)((const char*)db->map + sizeof(KDB_HEADER)) + start, sizeof(KDB_DATA) * from_file);
+    }
+    else if (!kdb_read_records(db, start, from_file, out))
+    {
+      return false;
+    }
+
+    copied = from_file;
+  }
+
+  // The rest of the wanted records are still in the pending batch
+  if (copied < wanted)
+  {
+    memcpy(out + copied, &db->batch[start + copied - db->batch_start], sizeof(KDB_DATA) * (wanted - copied));
+
+    copied = wanted;
+  }
+
+  if (copied < count)
+  {
+    memset(out + copied, 0, sizeof(KDB_DATA) * (count - copied));
+  }
+
+  return true;
+}
+
+// Hint the OS that the given records are about to be read
+void kdb_advise(KDB* db, uint64_t start, uint64_t count)
+{
+  // Hints are not worth reopening a file the pool closed
+  if (!db || !db->initialized || !db->file || db->container || count == 0 || (db->header.flags & (KDB_FLAGS_COMPRESSED | KDB_FLAGS_COLUMNAR)) != 0)
+  {
+    return;
+  }
+
+  #if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(
+      fileno(db->file),
+      sizeof(KDB_HEADER) + sizeof(KDB_DATA) * (off_t)start,
+      sizeof(KDB_DATA) * (off_t)count,
+      POSIX_FADV_WILLNEED
+    );
+  #endif
+}
+
+// Sequential reader handing out contiguous blocks of up to chunk_size records.
+// readahead is the number of chunks hinted to the OS ahead of the current one
+bool kdb_cursor_open(KDB_CURSOR* cursor, KDB* db, uint64_t start, uint64_t count, uint32_t chunk_size, uint32_t readahead)
+{
+  KDB_LOCKED(db, false, bool, kdb_cursor_open_locked(cursor, db, start, count, chunk_size, readahead));
+}
+
+bool kdb_cursor_open_locked(KDB_CURSOR* cursor, KDB* db, uint64_t start, uint64_t count, uint32_t chunk_size, uint32_t readahead)
+{
+  if (!cursor)
+  {
+    KDB_ERROR("Cursor pointer is NULL\n");
+
+    return false;
+  }
+
+  memset(cursor, 0, sizeof(KDB_CURSOR));
+
+  KDB_CHECK_INITIALIZED(db, false);
+
+  uint64_t available = start < db->header.count ? db->header.count - start : 0;
+
+  cursor->db         = db;
+  cursor->position   = start;
+  cursor->end        = start + (count < available ? count : available);
+  cursor->chunk_size = chunk_size > 0 ? chunk_size : KDB_CURSOR_CHUNK_SIZE;
+  cursor->readahead  = readahead;
+
+  return true;
+}
+
+uint64_t kdb_cursor_next_block(KDB_CURSOR* cursor, const KDB_DATA** records)
+{
+  KDB_LOCKED(cursor ? cursor->db : NULL, false, uint64_t, kdb_cursor_next_block_locked(cursor, records));
+}
+
+uint64_t kdb_cursor_next_block_locked(KDB_CURSOR* cursor, const KDB_DATA** records)
+{
+  *records = NULL;
+
+  if (!cursor || !cursor->db || cursor->failed)
+  {
+    return 0;
+  }
+
+  // Hand out whatever kdb_cursor_next left of the current block first
+  if (cursor->block_count > 0)
+  {
+    uint64_t remaining = cursor->block_count;
+
+    *records            = cursor->block;
+    cursor->block_count = 0;
+
+    return remaining;
+  }
+
+  if (cursor->position >= cursor->end)
+  {
+    return 0;
+  }
+
+  KDB*     db        = cursor->db;
+  uint64_t start     = cursor->position;
+  uint64_t committed = kdb_committed_count(db);
+  uint64_t count     = 0;
+
+  // With threads the batch can move once the lock is released, so it is copied
+  #ifdef KDB_USE_THREADS
+    bool borrowed = false;
+  #else
+    bool borrowed = start >= committed;
+  #endif
+
+  if (borrowed)
+  {
+    // Pending batch records are already contiguous in memory
+    count    = cursor->end - start;
+    *records = &db->batch[start - db->batch_start];
+  }
+  else if (db->map && kdb_remap(db, committed))
+  {
+    count    = (cursor->end < committed ? cursor->end : committed) - start;
+    *records = (const KDB_DATA*)((const char*)db->map + sizeof(KDB_HEADER)) + start;
+  }
+  else
+  {
+    if (!cursor->buffer)
+    {
+      cursor->buffer = (KDB_DATA*)malloc(sizeof(KDB_DATA) * cursor->chunk_size);
+
+      if (!cursor->buffer)
+      {
+        KDB_ERROR("Could not allocate memory for the cursor buffer\n");
+
+        cursor->failed = true;
+
+        return 0;
+      }
+    }
+
+    uint64_t limit = start < committed && committed < cursor->end ? committed : cursor->end;
+
+    count = limit - start < cursor->chunk_size ? limit - start : cursor->chunk_size;
+
+    if (!kdb_get_range(db, start, count, cursor->buffer))
+    {
+      cursor->failed = true;
+
+      return 0;
+    }
+
+    *records = cursor->buffer;
+
+    if (cursor->readahead > 0 && start + count < limit)
+    {
+      kdb_advise(db, start + count, cursor->chunk_size * cursor->readahead);
+    }
+  }
+
+  cursor->position += count;
+
+  return count;
+}
+
+const KDB_DATA* kdb_cursor_next(KDB_CURSOR* cursor)
+{
+  if (!cursor)
+  {
+    return NULL;
+  }
+
+  if (cursor->block_count == 0)
+  {
+    cursor->block_count = kdb_cursor_next_block(cursor, &cursor->block);
+
+    if (cursor->block_count == 0)
+    {
+      return NULL;
+    }
+  }
+
+  --cursor->block_count;
+
+  return cursor->block++;
+}
+
+void kdb_cursor_close(KDB_CURSOR* cursor)
+{
+  if (!cursor)
+  {
+    return;
+  }
+
+  if (cursor->buffer)
+  {
+    free(cursor->buffer);
+  }
+
+  memset(cursor, 0, sizeof(KDB_CURSOR));
+}
+
+bool kdb_get_data_normalized(KDB* db, int64_t index, KDB_DATA* data)
+{
+  KDB_LOCKED(db, false, bool, kdb_get_data_normalized_locked(db, index, data));
+}
+
+bool kdb_get_data_normalized_locked(KDB* db, int64_t index, KDB_DATA* data)
+{
+  if (!kdb_get_data(db, index, data))
+  {
+    return false;
+  }
+
+  data->value = kdb_map_value(data->value, db->header.min, db->header.max, 0.0f, 1.0f);
+
+  return true;
+}
+
+bool kdb_get_data_normalized_neg(KDB* db, int64_t index, KDB_DATA* data)
+{
+  KDB_LOCKED(db, false, bool, kdb_get_data_normalized_neg_locked(db, index, data));
+}
+
+bool kdb_get_data_normalized_neg_locked(KDB* db, int64_t index, KDB_DATA* data)
+{
+  if (!kdb_get_data(db, index, data))
+  {
+    return false;
+  }
+
+  data->value = kdb_map_value(data->value, db->header.min, db->header.max, -1.0f, 1.0f);
+
+  return true;
+}
+
+void kdb_apply_value(KDB_HEADER* header, KDB_VALUE_TYPE value)
+{
+  header->flags |= KDB_FLAGS_VARIANCE_CALCULATED;
+  header->flags &= ~KDB_FLAGS_MEDIAN_CALCULATED;
+  header->flags &= ~KDB_FLAGS_QUANTILES_CACHED;
+
+  ++header->count;
+
+  // Welford's online update keeps the variance current on every insert
+  KDB_VALUE_TYPE delta = value - header->average;
+
+  header->sum      += value;
+  header->average  += delta / header->count;
+  header->m2       += delta * (value - header->average);
+  header->variance  = header->m2 / header->count;
+
+  if (value < header->min)
+  {
+    header->min = value;
+  }
+
+  if (value > header->max)
+  {
+    header->max = value;
+  }
+
+  header->median = INFINITY;
+}
+
+bool kdb_reserve_batch(KDB* db, size_t capacity)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (capacity <= db->batch_capacity)
+  {
+    return true;
+  }
+
+  size_t new_capacity = db->batch_capacity > 0 ? db->batch_capacity : 1024;
+
+  while (new_capacity < capacity)
+  {
+    new_capacity *= 2;
+  }
+
+  KDB_DATA* batch = (KDB_DATA*)realloc(db->batch, new_capacity * sizeof(KDB_DATA));
+
+  if (!batch)
+  {
+    KDB_ERROR("Could not allocate memory for the batch buffer\n");
+
+    return false;
+  }
+
+  db->batch          = batch;
+  db->batch_capacity = new_capacity;
+
+  return true;
+}
+
+bool kdb_add_ts(KDB* db, uint64_t timestamp, KDB_VALUE_TYPE value)
+{
+  KDB_LOCKED(db, true, bool, kdb_add_ts_locked(db, timestamp, value));
+}
+
+bool kdb_add_ts_locked(KDB* db, uint64_t timestamp, KDB_VALUE_TYPE value)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  // Inside a batch the record is only buffered, it reaches the file on commit
+  if (db->in_batch)
+  {
+    if (!kdb_reserve_batch(db, db->batch_count + 1))
+    {
+      return false;
+    }
+
+    kdb_apply_value(&db->header, value);
+
+    KDB_DATA* data = &db->batch[db->batch_count++];
+
+    data->timestamp = timestamp;
+    data->value     = value;
+    data->sum       = db->header.sum;
+
+    return true;
+  }
+
+  KDB_PUSH_HEADER;
+
+  KDB_TAIL_STATE tail;
+
+  kdb_compressed_mark(db, &tail);
+  kdb_apply_value(&db->header, value);
+
+  KDB_DATA data = {
+    .timestamp = timestamp,
+    .value     = value,
+    .sum       = db->header.sum
+  };
+
+  // The record goes first, compressed files only know the tail offset after it
+  if (!kdb_write_data(db, &data))
+  {
+    goto save_error;
+  }
+
+  db->unsynced += 1;
+
+  if (!kdb_write_header(db))
+  {
+    // The record made it to the file, a compressed tail must forget it
+    kdb_compressed_restore(db, &tail);
+
+    goto save_error;
+  }
+
+  kdb_after_append(db, db->header.count - 1, &data, 1);
+
+  return true;
+
+  save_error:
+    KDB_POP_HEADER;
+
+    return false;
+}
+
+bool kdb_add(KDB* db, KDB_VALUE_TYPE value)
+{
+  uint64_t timestamp = time(NULL);
+
+  return kdb_add_ts(db, timestamp, value);
+}
+
+bool kdb_begin(KDB* db)
+{
+  KDB_LOCKED(db, true, bool, kdb_begin_locked(db));
+}
+
+bool kdb_begin_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (db->in_batch)
+  {
+    KDB_ERROR("A batch is already open for this database\n");
+
+    return false;
+  }
+
+  memcpy(&db->batch_header, &db->header, sizeof(KDB_HEADER));
+
+  db->in_batch    = true;
+  db->batch_start = db->header.count;
+  db->batch_count = 0;
+
+  return true;
+}
+
+bool kdb_commit(KDB* db)
+{
+  KDB_LOCKED(db, true, bool, kdb_commit_locked(db));
+}
+
+bool kdb_commit_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (!db->in_batch)
+  {
+    KDB_ERROR("There is no open batch for this database\n");
+
+    return false;
+  }
+
+  if (db->batch_count > 0)
+  {
+    KDB_TAIL_STATE tail;
+
+    kdb_compressed_mark(db, &tail);
+
+    // Records go first so a failure never leaves a header counting missing data
+    if (!kdb_write_records(db, db->batch_start, db->batch, db->batch_count))
+    {
+      goto commit_error;
+    }
+
+    db->unsynced += db->batch_count;
+
+    if (!kdb_write_header(db))
+    {
+      // The records made it to the file, a compressed tail must forget them
+      kdb_compressed_restore(db, &tail);
+
+      goto commit_error;
+    }
+  }
+
+  db->in_batch = false;
+
+  kdb_after_append(db, db->batch_start, db->batch, db->batch_count);
+
+  db->batch_count = 0;
+
+  return true;
+
+  commit_error:
+    kdb_rollback(db);
+
+    return false;
+}
+
+void kdb_rollback(KDB* db)
+{
+  KDB_LOCKED_VOID(db, true, kdb_rollback_locked(db));
+}
+
+void kdb_rollback_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED_VOID(db);
+
+  if (!db->in_batch)
+  {
+    return;
+  }
+
+  memcpy(&db->header, &db->batch_header, sizeof(KDB_HEADER));
+
+  db->in_batch    = false;
+  db->batch_count = 0;
+}
+
+bool kdb_add_batch(KDB* db, const uint64_t* timestamps, const KDB_VALUE_TYPE* values, size_t count)
+{
+  KDB_LOCKED(db, true, bool, kdb_add_batch_locked(db, timestamps, values, count));
+}
+
+bool kdb_add_batch_locked(KDB* db, const uint64_t* timestamps, const KDB_VALUE_TYPE* values, size_t count)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (count == 0)
+  {
+    return true;
+  }
+
+  if (!values)
+  {
+    KDB_ERROR("Values pointer is NULL\n");
+
+    return false;
+  }
+
+  // Join the caller's batch if there is one, otherwise commit on our own
+  bool owns_batch = !db->in_batch;
+
+  if (owns_batch && !kdb_begin(db))
+  {
+    return false;
+  }
+
+  if (!kdb_reserve_batch(db, db->batch_count + count))
+  {
+    if (owns_batch)
+    {
+      kdb_rollback(db);
+    }
+
+    return false;
+  }
+
+  uint64_t  now  = timestamps ? 0 : (uint64_t)time(NULL);
+  KDB_DATA* data = &db->batch[db->batch_count];
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    kdb_apply_value(&db->header, values[i]);
+
+    data[i].timestamp = timestamps ? timestamps[i] : now;
+    data[i].value     = values[i];
+    data[i].sum       = db->header.sum;
+  }
+
+  db->batch_count += count;
+
+  if (!owns_batch)
+  {
+    return true;
+  }
+
+  return kdb_commit(db);
+}
+
+uint64_t kdb_count(KDB* db)
+{
+  KDB_LOCKED(db, false, uint64_t, kdb_count_locked(db));
+}
+
+uint64_t kdb_count_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, 0);
+
+  return db->header.count;
+}
+
+KDB_VALUE_TYPE kdb_sum(KDB* db)
+{
+  KDB_LOCKED(db, false, KDB_VALUE_TYPE, kdb_sum_locked(db));
+}
+
+KDB_VALUE_TYPE kdb_sum_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, 0.0f);
+
+  return db->header.sum;
+}
+
+KDB_VALUE_TYPE kdb_average(KDB* db)
+{
+  KDB_LOCKED(db, false, KDB_VALUE_TYPE, kdb_average_locked(db));
+}
+
+KDB_VALUE_TYPE kdb_average_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, 0.0f);
+
+  return db->header.average;
+}
+
+KDB_VALUE_TYPE kdb_min(KDB* db)
+{
+  KDB_LOCKED(db, false, KDB_VALUE_TYPE, kdb_min_locked(db));
+}
+
+KDB_VALUE_TYPE kdb_min_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, INFINITY);
+
+  return db->header.min;
+}
+
+KDB_VALUE_TYPE kdb_max(KDB* db)
+{
+  KDB_LOCKED(db, false, KDB_VALUE_TYPE, kdb_max_locked(db));
+}
+
+KDB_VALUE_TYPE kdb_max_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, -INFINITY);
+
+  return db->header.max;
+}
+
+KDB_VALUE_TYPE kdb_variance(KDB* db)
+{
+  KDB_LOCKED(db, false, KDB_VALUE_TYPE, kdb_variance_locked(db));
+}
+
+KDB_VALUE_TYPE kdb_variance_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, INFINITY);
+
+  if (db->header.count == 0)
+  {
+    return INFINITY;
+  }
+
+  return db->header.m2 / db->header.count;
+}
+
+KDB_VALUE_TYPE kdb_stddev(KDB* db)
+{
+  KDB_LOCKED(db, false, KDB_VALUE_TYPE, kdb_stddev_locked(db));
+}
+
+KDB_VALUE_TYPE kdb_stddev_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, INFINITY);
+
+  if (db->header.count == 0)
+  {
+    return INFINITY;
+  }
+
+  KDB_VALUE_TYPE variance = kdb_variance(db);
+
+  if (variance == INFINITY)
+  {
+    return INFINITY;
+  }
+
+  #ifdef KDB_USE_LONG_DOUBLE
+    return sqrtl(variance);
+  #else
+    #ifdef KDB_USE_DOUBLE
+      return sqrt(variance);
+    #else
+      return sqrtf(variance);
+    #endif
+  #endif
+}
+
+KDB_VALUE_TYPE kdb_median(KDB* db)
+{
+  KDB_LOCKED(db, true, KDB_VALUE_TYPE, kdb_median_locked(db));
+}
+
+KDB_VALUE_TYPE kdb_median_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, INFINITY);
+
+  if (db->header.count == 0)
+  {
+    return INFINITY;
+  }
+
+  if ((db->header.flags & KDB_FLAGS_MEDIAN_CALCULATED) != 0)
+  {
+    return db->header.median;
+  }
+
+  double         q      = 0.5;
+  KDB_VALUE_TYPE median = INFINITY;
+
+  if (!kdb_compute_quantiles(db, &q, 1, &median))
+  {
+    return INFINITY;
+  }
+
+  KDB_PUSH_HEADER;
+
+  db->header.flags  |= KDB_FLAGS_MEDIAN_CALCULATED;
+  db->header.median  = median;
+
+  // An open batch persists the header on commit
+  if (!db->in_batch && !kdb_write_header(db))
+  {
+    KDB_POP_HEADER;
+
+    return INFINITY;
+  }
+
+  return median;
+}
+
+bool kdb_read_values(KDB* db, uint64_t start, uint64_t count, KDB_VALUE_TYPE* out)
+{
+  KDB_LOCKED(db, false, bool, kdb_read_values_locked(db, start, count, out));
+}
+
+bool kdb_read_values_locked(KDB* db, uint64_t start, uint64_t count, KDB_VALUE_TYPE* out)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  KDB_CURSOR      cursor;
+  const KDB_DATA* records;
+  uint64_t        block;
+  uint64_t        filled = 0;
+
+  // Columnar files stream the value column alone
+  if ((db->header.flags & KDB_FLAGS_COLUMNAR) != 0 && start <= db->header.count && count <= db->header.count - start)
+  {
+    uint64_t committed = kdb_committed_count(db);
+
+    filled = start < committed ? (committed - start < count ? committed - start : count) : 0;
+
+    if (filled > 0 && !kdb_read_column(db, KDB_COLUMN_VALUE, start, filled, out))
+    {
+      return false;
+    }
+
+    for (; filled < count; ++filled)
+    {
+      out[filled] = db->batch[start + filled - db->batch_start].value;
+    }
+
+    return true;
+  }
+
+  if (!kdb_cursor_open(&cursor, db, start, count, 0, KDB_CURSOR_READAHEAD))
+  {
+    return false;
+  }
+
+  while ((block = kdb_cursor_next_block(&cursor, &records)) > 0)
+  {
+    for (uint64_t i = 0; i < block; ++i)
+    {
+      out[filled++] = records[i].value;
+    }
+  }
+
+  kdb_cursor_close(&cursor);
+
+  if (filled != count)
+  {
+    KDB_ERROR("Error reading the values\n");
+
+    return false;
+  }
+
+  return true;
+}
+
+// In place heap sort, the worst case fallback of kdb_select
+void kdb_sort_values(KDB_VALUE_TYPE* values, int64_t size)
+{
+  KDB_VALUE_TYPE swap;
+  int64_t        start = size / 2;
+  int64_t        end   = size;
+  int64_t        root;
+  int64_t        child;
+
+  while (end > 1)
+  {
+    if (start > 0)
+    {
+      root = --start;
+    }
+    else
+    {
+      --end;
+
+      swap        = values[0];
+      values[0]   = values[end];
+      values[end] = swap;
+
+      root = 0;
+    }
+
+    while ((child = root * 2 + 1) < end)
+    {
+      if (child + 1 < end && values[child] < values[child + 1])
+      {
+        ++child;
+      }
+
+      if (!(values[root] < values[child]))
+      {
+        break;
+      }
+
+      swap          = values[root];
+      values[root]  = values[child];
+      values[child] = swap;
+
+      root = child;
+    }
+  }
+}
+
+// Introselect over several sorted ranks at once. Each partition splits the
+// pending ranks between both sides, and ranges that stop shrinking fall back
+// to a heap sort once depth runs out
+void kdb_select(KDB_VALUE_TYPE* values, int64_t left, int64_t right, const int64_t* ranks, size_t rank_count, uint32_t depth)
+{
+  KDB_VALUE_TYPE swap;
+
+  while (rank_count > 0 && left < right)
+  {
+    if (depth == 0)
+    {
+      kdb_sort_values(values + left, right - left + 1);
+
+      return;
+    }
+
+    --depth;
+
+    // Median of three pivot
+    int64_t        middle = left + (right - left) / 2;
+    KDB_VALUE_TYPE a      = values[left];
+    KDB_VALUE_TYPE b      = values[middle];
+    KDB_VALUE_TYPE c      = values[right];
+    KDB_VALUE_TYPE pivot  = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+
+    int64_t i = left;
+    int64_t j = right;
+
+    while (i <= j)
+    {
+      while (values[i] < pivot)
+      {
+        ++i;
+      }
+
+      while (pivot < values[j])
+      {
+        --j;
+      }
+
+      if (i <= j)
+      {
+        swap      = values[i];
+        values[i] = values[j];
+        values[j] = swap;
+
+        ++i;
+        --j;
+      }
+    }
+
+    // [left, j] <= pivot, (j, i) == pivot and [i, right] >= pivot
+    size_t left_ranks = 0;
+
+    while (left_ranks < rank_count && ranks[left_ranks] <= j)
+    {
+      ++left_ranks;
+    }
+
+    size_t right_ranks = left_ranks;
+
+    while (right_ranks < rank_count && ranks[right_ranks] < i)
+    {
+      ++right_ranks;
+    }
+
+    kdb_select(values, left, j, ranks, left_ranks, depth);
+
+    ranks      += right_ranks;
+    rank_count -= right_ranks;
+    left        = i;
+  }
+}
+// Exact quantiles, interpolating linearly between the two closest ranks like
+// the median does for even counts. All requested ranks are selected in one pass
+bool kdb_compute_quantiles(KDB* db, const double* qs, size_t count, KDB_VALUE_TYPE* out)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  uint64_t records = db->header.count;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    if (!(qs[i] >= 0.0 && qs[i] <= 1.0))
+    {
+      KDB_ERROR("Quantile must be between 0 and 1\n");
+
+      return false;
+    }
+
+    out[i] = INFINITY;
+  }
+
+  if (count == 0 || records == 0)
+  {
+    return true;
+  }
+
+  KDB_VALUE_TYPE* values   = (KDB_VALUE_TYPE*)malloc(sizeof(KDB_VALUE_TYPE) * records);
+  int64_t*        ranks    = (int64_t*)malloc(sizeof(int64_t) * count * 2);
+  bool            computed = false;
+
+  if (!values || !ranks)
+  {
+    KDB_ERROR("Could not allocate the memory to calculate the quantiles\n");
+
+    goto defer;
+  }
+
+  if (!kdb_read_values(db, 0, records, values))
+  {
+    goto defer;
+  }
+
+  // Both neighbours of every quantile, sorted and without duplicates
+  size_t rank_count = 0;
+
+  for (size_t i = 0; i < count * 2; ++i)
+  {
+    int64_t rank = (int64_t)(qs[i / 2] * (records - 1)) + (int64_t)(i & 1);
+
+    if (rank > (int64_t)records - 1)
+    {
+      rank = records - 1;
+    }
+
+    size_t position = rank_count;
+
+    while (position > 0 && ranks[position - 1] > rank)
+    {
+      ranks[position] = ranks[position - 1];
+
+      --position;
+    }
+
+    if (position > 0 && ranks[position - 1] == rank)
+    {
+      memmove(&ranks[position], &ranks[position + 1], sizeof(int64_t) * (rank_count - position));
+
+      continue;
+    }
+
+    ranks[position] = rank;
+
+    ++rank_count;
+  }
+
+  uint32_t depth = 0;
+
+  for (uint64_t size = records; size > 1; size >>= 1)
+  {
+    depth += 2;
+  }
+
+  kdb_select(values, 0, records - 1, ranks, rank_count, depth);
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    double  position = qs[i] * (records - 1);
+    int64_t lower    = (int64_t)position;
+    int64_t upper    = lower + 1 < (int64_t)records ? lower + 1 : lower;
+
+    out[i] = values[lower] + (KDB_VALUE_TYPE)(position - lower) * (values[upper] - values[lower]);
+  }
+
+  computed = true;
+
+  defer:
+    free(values);
+    free(ranks);
+
+    return computed;
+}
+
+KDB_VALUE_TYPE kdb_quantile(KDB* db, double q)
+{
+  KDB_LOCKED(db, true, KDB_VALUE_TYPE, kdb_quantile_locked(db, q));
+}
+
+KDB_VALUE_TYPE kdb_quantile_locked(KDB* db, double q)
+{
+  KDB_VALUE_TYPE value = INFINITY;
+
+  if (!kdb_quantiles(db, &q, 1, &value))
+  {
+    return INFINITY;
+  }
+
+  return value;
+}
+
+// Quantiles served from the header's cache when possible. Misses are computed
+// together and stored back, evicting older slots in turn
+bool kdb_quantiles(KDB* db, const double* qs, size_t count, KDB_VALUE_TYPE* out)
+{
+  KDB_LOCKED(db, true, bool, kdb_quantiles_locked(db, qs, count, out));
+}
+
+bool kdb_quantiles_locked(KDB* db, const double* qs, size_t count, KDB_VALUE_TYPE* out)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (count == 0)
+  {
+    return true;
+  }
+
+  if (db->header.count == 0)
+  {
+    return kdb_compute_quantiles(db, qs, count, out);
+  }
+
+  bool cached = (db->header.flags & KDB_FLAGS_QUANTILES_CACHED) != 0;
+
+  double*         missing_qs     = (double*)malloc(sizeof(double) * count);
+  size_t*         missing_index  = (size_t*)malloc(sizeof(size_t) * count);
+  KDB_VALUE_TYPE* missing_values = (KDB_VALUE_TYPE*)malloc(sizeof(KDB_VALUE_TYPE) * count);
+  size_t          missing        = 0;
+  bool            result         = false;
+
+  if (!missing_qs || !missing_index || !missing_values)
+  {
+    KDB_ERROR("Could not allocate the memory to calculate the quantiles\n");
+
+    goto defer;
+  }
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    size_t slot = KDB_QUANTILE_SLOTS;
+
+    if (cached)
+    {
+      for (slot = 0; slot < KDB_QUANTILE_SLOTS && db->header.quantile_keys[slot] != qs[i]; ++slot);
+    }
+
+    if (slot < KDB_QUANTILE_SLOTS)
+    {
+      out[i] = db->header.quantile_values[slot];
+
+      continue;
+    }
+
+    missing_qs[missing]    = qs[i];
+    missing_index[missing] = i;
+
+    ++missing;
+  }
+
+  if (missing == 0)
+  {
+    result = true;
+
+    goto defer;
+  }
+
+  if (!kdb_compute_quantiles(db, missing_qs, missing, missing_values))
+  {
+    goto defer;
+  }
+
+  KDB_PUSH_HEADER;
+
+  if (!cached)
+  {
+    for (size_t slot = 0; slot < KDB_QUANTILE_SLOTS; ++slot)
+    {
+      db->header.quantile_keys[slot] = -1.0;
+    }
+
+    db->header.flags |= KDB_FLAGS_QUANTILES_CACHED;
+  }
+
+  for (size_t i = 0; i < missing; ++i)
+  {
+    out[missing_index[i]] = missing_values[i];
+
+    size_t slot;
+
+    for (slot = 0; slot < KDB_QUANTILE_SLOTS && db->header.quantile_keys[slot] >= 0.0; ++slot);
+
+    if (slot == KDB_QUANTILE_SLOTS)
+    {
+      slot = db->quantile_slot++ % KDB_QUANTILE_SLOTS;
+    }
+
+    db->header.quantile_keys[slot]   = missing_qs[i];
+    db->header.quantile_values[slot] = missing_values[i];
+  }
+
+  // An open batch persists the header on commit
+  if (!db->in_batch && !kdb_write_header(db))
+  {
+    KDB_POP_HEADER;
+
+    goto defer;
+  }
+
+  result = true;
+
+  defer:
+    free(missing_qs);
+    free(missing_index);
+    free(missing_values);
+
+    return result;
+}
+
+KDB_VALUE_TYPE kdb_sma(KDB* db, uint64_t index, uint64_t frame)
+{
+  KDB_LOCKED(db, false, KDB_VALUE_TYPE, kdb_sma_locked(db, index, frame));
+}
+
+KDB_VALUE_TYPE kdb_sma_locked(KDB* db, uint64_t index, uint64_t frame)
+{
+  KDB_CHECK_INITIALIZED(db, 0.0f);
+
+  if (frame == 0)
+  {
+    return 0.0f;
+  }
+
+  KDB_DATA initial = { 0 };
+  KDB_DATA final   = { 0 };
+
+  // The frame holds the records (index - frame, index], fewer near the start.
+  // Records before the first one read back with a zero sum
+  if (!kdb_get_data(db, (int64_t)index - (int64_t)frame, &initial))
+  {
+    return 0.0f;
+  }
+
+  if (!kdb_get_data(db, index, &final))
+  {
+    return 0.0f;
+  }
+
+  KDB_VALUE_TYPE difference = final.sum - initial.sum;
+  KDB_VALUE_TYPE sma        = difference / (index < frame ? index + 1 : frame);
+
+  return sma;
+}
+
+// kdb_sma for every record in [start, start + count), see kdb_sma_series_multi
+bool kdb_sma_series(KDB* db, uint64_t start, uint64_t count, uint64_t frame, KDB_VALUE_TYPE* out)
+{
+  return kdb_sma_series_multi(db, start, count, &frame, 1, &out);
+}
+
+// kdb_sma of several frames for every record in [start, start + count), out[k]
+// receives the averages of frames[k]. The sum column is read once from the
+// largest frame before start on, keeping the sums still needed in a ring.
+// Frames kept as SMA indicators are copied from their columns
+bool kdb_sma_series_multi(KDB* db, uint64_t start, uint64_t count, const uint64_t* frames, size_t frames_count, KDB_VALUE_TYPE** out)
+{
+  KDB_LOCKED(db, false, bool, kdb_sma_series_multi_locked(db, start, count, frames, frames_count, out));
+}
+
+bool kdb_sma_series_multi_locked(KDB* db, uint64_t start, uint64_t count, const uint64_t* frames, size_t frames_count, KDB_VALUE_TYPE** out)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (start > db->header.count || count > db->header.count - start)
+  {
+    KDB_ERROR("Range is out of bounds\n");
+
+    return false;
+  }
+
+  if (count == 0 || frames_count == 0)
+  {
+    return true;
+  }
+
+  bool* cached = (bool*)calloc(frames_count, sizeof(bool));
+
+  if (!cached)
+  {
+    KDB_ERROR("Could not allocate memory for the frames\n");
+
+    return false;
+  }
+
+  uint64_t largest = 0;
+
+  for (size_t k = 0; k < frames_count; ++k)
+  {
+    uint32_t indicator;
+
+    if (frames[k] == 0)
+    {
+      KDB_ERROR("Frames can't be empty\n");
+
+      free(cached);
+
+      return false;
+    }
+
+    cached[k] =
+      kdb_indicator_find(db, KDB_INDICATOR_SMA, (double)frames[k], &indicator) &&
+      kdb_indicator_range_locked(db, indicator, start, count, out[k]);
+
+    if (!cached[k] && frames[k] > largest)
+    {
+      largest = frames[k];
+    }
+  }
+
+  if (largest == 0)
+  {
+    free(cached);
+
+    return true;
+  }
+
+  // Sums further back than the first record are zero and never stored
+  uint64_t        end   = start + count;
+  uint64_t        size  = largest < end ? largest : end;
+  uint64_t        first = start > size ? start - size : 0;
+  KDB_VALUE_TYPE* ring  = (KDB_VALUE_TYPE*)malloc(sizeof(KDB_VALUE_TYPE) * size);
+
+  if (!ring)
+  {
+    KDB_ERROR("Could not allocate memory for the sums\n");
+
+    free(cached);
+
+    return false;
+  }
+
+  KDB_CURSOR      cursor;
+  const KDB_DATA* records;
+  uint64_t        block;
+  uint64_t        position = first;
+  bool            failed   = !kdb_cursor_open(&cursor, db, first, end - first, 0, KDB_CURSOR_READAHEAD);
+
+  while (!failed && (block = kdb_cursor_next_block(&cursor, &records)) > 0)
+  {
+    for (uint64_t i = 0; i < block; ++i, ++position)
+    {
+      KDB_VALUE_TYPE sum = records[i].sum;
+
+      for (size_t k = 0; position >= start && k < frames_count; ++k)
+      {
+        if (cached[k])
+        {
+          continue;
+        }
+
+        uint64_t       frame  = frames[k];
+        KDB_VALUE_TYPE before = position >= frame ? ring[(position - frame) % size] : 0.0f;
+
+        out[k][position - start] = (sum - before) / (position < frame ? position + 1 : frame);
+      }
+
+      ring[position % size] = sum;
+    }
+  }
+
+  if (!failed)
+  {
+    failed = cursor.failed || position != end;
+
+    kdb_cursor_close(&cursor);
+  }
+
+  free(ring);
+  free(cached);
+
+  return !failed;
+}
+
+// Filename of a structure stored next to the database, like "name.kds"
+char* kdb_companion_filename(KDB* db, const char* extension)
+{
+  size_t name_size      = strlen(db->p_name);
+  size_t extension_size = strlen(extension);
+  char*  filename       = (char*)malloc((name_size + extension_size + 2) * sizeof(char));
+
+  if (!filename)
+  {
+    KDB_ERROR("Could not allocate memory for the filename\n");
+
+    return NULL;
+  }
+
+  memcpy(filename, db->p_name, name_size);
+
+  filename[name_size] = '.';
+
+  memcpy(filename + name_size + 1, extension, extension_size + 1);
+
+  return filename;
+}
+
+// Called once records are safely in the file, keeps derived structures current.
+// first is the index of the first of the records
+void kdb_after_append(KDB* db, uint64_t first, const KDB_DATA* records, uint64_t count)
+{
+  if (db->ts_indexed)
+  {
+    for (uint64_t i = (KDB_TS_INDEX_BLOCK - first % KDB_TS_INDEX_BLOCK) % KDB_TS_INDEX_BLOCK; i < count; i += KDB_TS_INDEX_BLOCK)
+    {
+      if (!kdb_ts_index_push(db, records[i].timestamp))
+      {
+        // Dropping the index is safe, the next lookup rebuilds it
+        db->ts_indexed     = false;
+        db->ts_index_count = 0;
+
+        break;
+      }
+    }
+  }
+
+  if (db->sketch)
+  {
+    for (uint64_t i = 0; i < count; ++i)
+    {
+      kdb_sketch_add(db->sketch, records[i].value);
+    }
+  }
+
+  if (db->zoned && !kdb_zones_add(db, records, count))
+  {
+    // Dropped zones are rebuilt from the file on the next load
+    db->zoned = false;
+  }
+
+  if (db->pyramided && !kdb_pyramid_add(db, records, count))
+  {
+    kdb_pyramid_clear(db);
+  }
+
+  // Columns left behind by a failed append catch up from the file
+  if (db->indicators_count > 0 && !kdb_indicators_add(db, first, records, count))
+  {
+    KDB_ERROR("Failed to update the indicators\n");
+  }
+
+  if (db->rollups_count > 0)
+  {
+    bool current = db->rollups_covered == first;
+
+    if (!(current ? kdb_rollups_add(db, records, count) : kdb_rollups_catch_up(db)))
+    {
+      // Emptied tiers are built again from the file on the next append
+      kdb_rollups_reset(db);
+    }
+  }
+}
+
+void kdb_sketch_reset(KDB_SKETCH* sketch)
+{
+  memset(sketch, 0, sizeof(KDB_SKETCH));
+  memcpy(&sketch->version, KDB_SKETCH_VERSION, KDB_VERSION_SIZE);
+
+  sketch->buckets         = KDB_SKETCH_BUCKETS;
+  sketch->alpha           = KDB_SKETCH_ALPHA;
+  sketch->positive_offset = INT32_MIN;
+  sketch->negative_offset = INT32_MIN;
+}
+
+void kdb_sketch_add_key(KDB_SKETCH* sketch, bool negative, int32_t key, uint64_t count)
+{
+  uint64_t* buckets = negative ? sketch->negative : sketch->positive;
+  int32_t*  offset  = negative ? &sketch->negative_offset : &sketch->positive_offset;
+
+  // The first key centers the window so it can grow both ways
+  if (*offset == INT32_MIN)
+  {
+    *offset = key - KDB_SKETCH_BUCKETS / 2;
+  }
+
+  // Slide the window up, collapsing the smallest magnitudes into the first bucket
+  if (key >= *offset + KDB_SKETCH_BUCKETS)
+  {
+    int64_t shift = (int64_t)key - (*offset + KDB_SKETCH_BUCKETS - 1);
+
+    if (shift >= KDB_SKETCH_BUCKETS)
+    {
+      uint64_t total = 0;
+
+      for (uint32_t i = 0; i < KDB_SKETCH_BUCKETS; ++i)
+      {
+        total += buckets[i];
+      }
+
+      memset(buckets, 0, sizeof(uint64_t) * KDB_SKETCH_BUCKETS);
+
+      buckets[0] = total;
+    }
+    else
+    {
+      for (int64_t i = 1; i <= shift; ++i)
+      {
+        buckets[0] += buckets[i];
+      }
+
+      memmove(&buckets[1], &buckets[shift + 1], sizeof(uint64_t) * (KDB_SKETCH_BUCKETS - shift - 1));
+      memset(&buckets[KDB_SKETCH_BUCKETS - shift], 0, sizeof(uint64_t) * shift);
+    }
+
+    *offset += shift;
+  }
+
+  int64_t index = (int64_t)key - *offset;
+
+  buckets[index < 0 ? 0 : index] += count;
+}
+
+void kdb_sketch_add(KDB_SKETCH* sketch, KDB_VALUE_TYPE value)
+{
+  double magnitude = fabs((double)value);
+
+  ++sketch->count;
+
+  if (magnitude < KDB_SKETCH_MIN_VALUE)
+  {
+    ++sketch->zero_count;
+
+    return;
+  }
+
+  double  gamma = (1.0 + KDB_SKETCH_ALPHA) / (1.0 - KDB_SKETCH_ALPHA);
+  int32_t key   = (int32_t)ceil(log(magnitude) / log(gamma));
+
+  kdb_sketch_add_key(sketch, value < 0, key, 1);
+}
+
+// Sketches built with the same accuracy can be combined, e.g. across series
+bool kdb_sketch_merge(KDB_SKETCH* into, const KDB_SKETCH* from)
+{
+  if (!into || !from)
+  {
+    KDB_ERROR("Sketch pointer is NULL\n");
+
+    return false;
+  }
+
+  if (into->alpha != from->alpha || into->buckets != from->buckets)
+  {
+    KDB_ERROR("Sketches were built with different settings\n");
+
+    return false;
+  }
+
+  for (uint32_t i = 0; i < KDB_SKETCH_BUCKETS; ++i)
+  {
+    if (from->positive[i] > 0)
+    {
+      kdb_sketch_add_key(into, false, from->positive_offset + (int32_t)i, from->positive[i]);
+    }
+
+    if (from->negative[i] > 0)
+    {
+      kdb_sketch_add_key(into, true, from->negative_offset + (int32_t)i, from->negative[i]);
+    }
+  }
+
+  into->count      += from->count;
+  into->zero_count += from->zero_count;
+
+  return true;
+}
+
+KDB_VALUE_TYPE kdb_sketch_quantile(const KDB_SKETCH* sketch, double q)
+{
+  if (!sketch || sketch->count == 0 || !(q >= 0.0 && q <= 1.0))
+  {
+    return INFINITY;
+  }
+
+  double   gamma  = (1.0 + KDB_SKETCH_ALPHA) / (1.0 - KDB_SKETCH_ALPHA);
+  uint64_t rank   = (uint64_t)(q * (sketch->count - 1));
+  uint64_t passed = 0;
+
+  // Ascending order: most negative values first, then zeros, then positives
+  for (int32_t i = KDB_SKETCH_BUCKETS - 1; i >= 0; --i)
+  {
+    passed += sketch->negative[i];
+
+    if (passed > rank)
+    {
+      return (KDB_VALUE_TYPE)(-2.0 * pow(gamma, sketch->negative_offset + i) / (gamma + 1.0));
+    }
+  }
+
+  passed += sketch->zero_count;
+
+  if (passed > rank)
+  {
+    return 0.0f;
+  }
+
+  for (int32_t i = 0; i < KDB_SKETCH_BUCKETS; ++i)
+  {
+    passed += sketch->positive[i];
+
+    if (passed > rank)
+    {
+      return (KDB_VALUE_TYPE)(2.0 * pow(gamma, sketch->positive_offset + i) / (gamma + 1.0));
+    }
+  }
+
+  return INFINITY;
+}
+
+// Start keeping a sketch for the database in "name.kds"
+bool kdb_sketch_enable(KDB* db)
+{
+  KDB_LOCKED(db, true, bool, kdb_sketch_enable_locked(db));
+}
+
+bool kdb_sketch_enable_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (db->sketch)
+  {
+    return true;
+  }
+
+  return kdb_sketch_load(db, true) && kdb_sketch_save(db);
+}
+
+// Load the sketch file if there is one (or create it) and catch up with the
+// records appended since it was last saved
+bool kdb_sketch_load(KDB* db, bool create)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  char* filename = kdb_companion_filename(db, "kds");
+
+  if (!filename)
+  {
+    return false;
+  }
+
+  FILE* file = fopen(filename, "rb");
+
+  free(filename);
+
+  if (!file && !create)
+  {
+    return true;
+  }
+
+  KDB_SKETCH* sketch = (KDB_SKETCH*)malloc(sizeof(KDB_SKETCH));
+
+  if (!sketch)
+  {
+    KDB_ERROR("Could not allocate memory for the sketch\n");
+
+    if (file)
+    {
+      fclose(file);
+    }
+
+    return false;
+  }
+
+  bool valid = file && fread(sketch, sizeof(KDB_SKETCH), 1, file) == 1;
+
+  if (file)
+  {
+    fclose(file);
+  }
+
+  // Anything that does not match this build or is ahead of the data is rebuilt
+  if (
+    !valid ||
+    memcmp(&sketch->version, KDB_SKETCH_VERSION, KDB_VERSION_SIZE) != 0 ||
+    sketch->alpha != KDB_SKETCH_ALPHA ||
+    sketch->buckets != KDB_SKETCH_BUCKETS ||
+    sketch->count > kdb_committed_count(db)
+  )
+  {
+    kdb_sketch_reset(sketch);
+  }
+
+  KDB_CURSOR      cursor;
+  const KDB_DATA* records;
+  uint64_t        count;
+
+  if (!kdb_cursor_open(&cursor, db, sketch->count, kdb_committed_count(db) - sketch->count, 0, KDB_CURSOR_READAHEAD))
+  {
+    free(sketch);
+
+    return false;
+  }
+
+  while ((count = kdb_cursor_next_block(&cursor, &records)) > 0)
+  {
+    for (uint64_t i = 0; i < count; ++i)
+    {
+      kdb_sketch_add(sketch, records[i].value);
+    }
+  }
+
+  bool failed = cursor.failed;
+
+  kdb_cursor_close(&cursor);
+
+  if (failed)
+  {
+    free(sketch);
+
+    return false;
+  }
+
+  db->sketch = sketch;
+
+  return true;
+}
+
+bool kdb_sketch_save(KDB* db)
+{
+  if (!db || !db->sketch)
+  {
+    return true;
+  }
+
+  char* filename = kdb_companion_filename(db, "kds");
+
+  if (!filename)
+  {
+    return false;
+  }
+
+  FILE* file = fopen(filename, "wb");
+
+  free(filename);
+
+  if (!file)
+  {
+    KDB_ERROR("Failed to create the sketch file\n");
+
+    return false;
+  }
+
+  bool saved = fwrite(db->sketch, sizeof(KDB_SKETCH), 1, file) == 1;
+
+  if (fclose(file) != 0 || !saved)
+  {
+    KDB_ERROR("Error while trying to write the sketch\n");
+
+    return false;
+  }
+
+  return true;
+}
+
+// Approximate quantile from the sketch, within KDB_SKETCH_ALPHA relative error.
+// Use kdb_quantile for exact results
+KDB_VALUE_TYPE kdb_quantile_approx(KDB* db, double q)
+{
+  KDB_LOCKED(db, false, KDB_VALUE_TYPE, kdb_quantile_approx_locked(db, q));
+}
+
+KDB_VALUE_TYPE kdb_quantile_approx_locked(KDB* db, double q)
+{
+  KDB_CHECK_INITIALIZED(db, INFINITY);
+
+  if (!db->sketch)
+  {
+    KDB_ERROR("The quantile sketch is not enabled\n");
+
+    return INFINITY;
+  }
+
+  if (db->sketch->count == 0)
+  {
+    return INFINITY;
+  }
+
+  KDB_VALUE_TYPE value = kdb_sketch_quantile(db->sketch, q);
+
+  // Bucket midpoints can step out of the observed range at the extremes
+  if (value < db->header.min)
+  {
+    value = db->header.min;
+  }
+
+  if (value > db->header.max)
+  {
+    value = db->header.max;
+  }
+
+  return value;
+}
+
+KDB_VALUE_TYPE kdb_median_approx(KDB* db)
+{
+  KDB_LOCKED(db, false, KDB_VALUE_TYPE, kdb_median_approx_locked(db));
+}
+
+KDB_VALUE_TYPE kdb_median_approx_locked(KDB* db)
+{
+  return kdb_quantile_approx(db, 0.5);
+}
+
+bool kdb_ts_index_push(KDB* db, uint64_t timestamp)
+{
+  if (db->ts_index_count == db->ts_index_capacity)
+  {
+    uint32_t  capacity = db->ts_index_capacity > 0 ? db->ts_index_capacity * 2 : 64;
+    uint64_t* ts_index = (uint64_t*)realloc(db->ts_index, sizeof(uint64_t) * capacity);
+
+    if (!ts_index)
+    {
+      KDB_ERROR("Could not allocate memory for the timestamp index\n");
+
+      return false;
+    }
+
+    db->ts_index          = ts_index;
+    db->ts_index_capacity = capacity;
+  }
+
+  db->ts_index[db->ts_index_count++] = timestamp;
+
+  return true;
+}
+
+// Sparse in memory index holding the timestamp of the first record of every
+// KDB_TS_INDEX_BLOCK records. Built on the first lookup, then kept current on
+// append. Timestamps are expected to never decrease, as kdb_add produces them
+bool kdb_ts_index_build(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (db->ts_indexed)
+  {
+    return true;
+  }
+
+  uint64_t        committed = kdb_committed_count(db);
+  KDB_DATA        buffer;
+  const KDB_DATA* data;
+
+  db->ts_index_count = 0;
+
+  for (uint64_t i = 0; i < committed; i += KDB_TS_INDEX_BLOCK)
+  {
+    if (!(data = kdb_record(db, i, &buffer)) || !kdb_ts_index_push(db, data->timestamp))
+    {
+      db->ts_index_count = 0;
+
+      return false;
+    }
+  }
+
+  db->ts_indexed = true;
+
+  return true;
+}
+
+// First record whose timestamp is >= timestamp (lower bound) or > timestamp
+// (upper bound). index is set to the records' count when there is none
+bool kdb_find_ts(KDB* db, uint64_t timestamp, KDB_BOUND bound, uint64_t* index)
+{
+  KDB_LOCKED_READY(db, db->ts_indexed, bool, kdb_find_ts_locked(db, timestamp, bound, index));
+}
+
+bool kdb_find_ts_locked(KDB* db, uint64_t timestamp, KDB_BOUND bound, uint64_t* index)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (!kdb_ts_index_build(db))
+  {
+    return false;
+  }
+
+  #define KDB_TS_BEFORE(ts) (bound == KDB_BOUND_UPPER ? (ts) <= timestamp : (ts) < timestamp)
+
+  uint64_t committed = kdb_committed_count(db);
+  uint64_t low       = 0;
+  uint64_t high      = db->ts_index_count;
+  uint64_t middle;
+
+  // First block starting at or after the target, the answer is in the block before it
+  while (low < high)
+  {
+    middle = low + (high - low) / 2;
+
+    if (KDB_TS_BEFORE(db->ts_index[middle]))
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+
+  uint64_t result = 0;
+
+  if (low > 0)
+  {
+    uint64_t block_start = (low - 1) * KDB_TS_INDEX_BLOCK;
+    uint64_t block_end   = block_start + KDB_TS_INDEX_BLOCK < committed ? block_start + KDB_TS_INDEX_BLOCK : committed;
+
+    low  = block_start + 1;
+    high = block_end;
+
+    if (db->map)
+    {
+      KDB_DATA        buffer;
+      const KDB_DATA* data;
+
+      while (low < high)
+      {
+        middle = low + (high - low) / 2;
+
+        if (!(data = kdb_record(db, middle, &buffer)))
+        {
+          return false;
+        }
+
+        if (KDB_TS_BEFORE(data->timestamp))
+        {
+          low = middle + 1;
+        }
+        else
+        {
+          high = middle;
+        }
+      }
+    }
+    else
+    {
+      // A single read of the block, then the search runs in memory
+      KDB_DATA block[KDB_TS_INDEX_BLOCK];
+
+      if (!kdb_get_range(db, block_start, block_end - block_start, block))
+      {
+        return false;
+      }
+
+      while (low < high)
+      {
+        middle = low + (high - low) / 2;
+
+        if (KDB_TS_BEFORE(block[middle - block_start].timestamp))
+        {
+          low = middle + 1;
+        }
+        else
+        {
+          high = middle;
+        }
+      }
+    }
+
+    result = low;
+  }
+
+  // Past every committed record, the pending batch is searched in memory
+  if (result == committed && db->in_batch)
+  {
+    low  = 0;
+    high = db->batch_count;
+
+    while (low < high)
+    {
+      middle = low + (high - low) / 2;
+
+      if (KDB_TS_BEFORE(db->batch[middle].timestamp))
+      {
+        low = middle + 1;
+      }
+      else
+      {
+        high = middle;
+      }
+    }
+
+    result += low;
+  }
+
+  #undef KDB_TS_BEFORE
+
+  *index = result;
+
+  return true;
+}
+
+// Records with t0 <= timestamp < t1
+bool kdb_range_by_time(KDB* db, uint64_t t0, uint64_t t1, uint64_t* start, uint64_t* count)
+{
+  KDB_LOCKED_READY(db, db->ts_indexed, bool, kdb_range_by_time_locked(db, t0, t1, start, count));
+}
+
+bool kdb_range_by_time_locked(KDB* db, uint64_t t0, uint64_t t1, uint64_t* start, uint64_t* count)
+{
+  uint64_t end;
+
+  *start = 0;
+  *count = 0;
+
+  if (t1 <= t0)
+  {
+    return true;
+  }
+
+  if (!kdb_find_ts(db, t0, KDB_BOUND_LOWER, start) || !kdb_find_ts(db, t1, KDB_BOUND_LOWER, &end))
+  {
+    return false;
+  }
+
+  *count = end - *start;
+
+  return true;
+}
+
+// Average of the values with t0 <= timestamp < t1, from the records' running sums
+KDB_VALUE_TYPE kdb_sma_by_time(KDB* db, uint64_t t0, uint64_t t1)
+{
+  KDB_LOCKED_READY(db, db->ts_indexed, KDB_VALUE_TYPE, kdb_sma_by_time_locked(db, t0, t1));
+}
+
+KDB_VALUE_TYPE kdb_sma_by_time_locked(KDB* db, uint64_t t0, uint64_t t1)
+{
+  uint64_t start;
+  uint64_t count;
+
+  if (!kdb_range_by_time(db, t0, t1, &start, &count) || count == 0)
+  {
+    return 0.0f;
+  }
+
+  KDB_DATA initial = { 0 };
+  KDB_DATA final   = { 0 };
+
+  if (start > 0 && !kdb_get_data(db, start - 1, &initial))
+  {
+    return 0.0f;
+  }
+
+  if (!kdb_get_data(db, start + count - 1, &final))
+  {
+    return 0.0f;
+  }
+
+  return (final.sum - initial.sum) / count;
+}
+
+// Append records, which must directly follow the ones already covered
+bool kdb_zones_add(KDB* db, const KDB_DATA* records, uint64_t count)
+{
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    if (db->zones_covered % KDB_ZONE_SIZE == 0)
+    {
+      if (db->zones_count == db->zones_capacity)
+      {
+        uint32_t  capacity = db->zones_capacity > 0 ? db->zones_capacity * 2 : 16;
+        KDB_ZONE* zones    = (KDB_ZONE*)realloc(db->zones, sizeof(KDB_ZONE) * capacity);
+
+        if (!zones)
+        {
+          KDB_ERROR("Could not allocate memory for the zone maps\n");
+
+          return false;
+        }
+
+        db->zones          = zones;
+        db->zones_capacity = capacity;
+      }
+
+      KDB_ZONE* zone = &db->zones[db->zones_count++];
+
+      zone->min   = INFINITY;
+      zone->max   = -INFINITY;
+      zone->sum   = 0.0f;
+      zone->count = 0;
+    }
+
+    KDB_ZONE*      zone  = &db->zones[db->zones_count - 1];
+    KDB_VALUE_TYPE value = records[i].value;
+
+    if (value < zone->min)
+    {
+      zone->min = value;
+    }
+
+    if (value > zone->max)
+    {
+      zone->max = value;
+    }
+
+    zone->sum += value;
+
+    ++zone->count;
+    ++db->zones_covered;
+  }
+
+  return true;
+}
+
+// Start keeping zone maps for the database in "name.kdz"
+bool kdb_zones_enable(KDB* db)
+{
+  KDB_LOCKED(db, true, bool, kdb_zones_enable_locked(db));
+}
+
+bool kdb_zones_enable_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (db->zoned)
+  {
+    return true;
+  }
+
+  return kdb_zones_load(db, true) && kdb_zones_save(db);
+}
+
+// Load the zone maps if there are any (or create them) and catch up with the
+// records appended since they were last saved
+bool kdb_zones_load(KDB* db, bool create)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  char* filename = kdb_companion_filename(db, "kdz");
+
+  if (!filename)
+  {
+    return false;
+  }
+
+  FILE* file = fopen(filename, "rb");
+
+  free(filename);
+
+  if (!file && !create)
+  {
+    return true;
+  }
+
+  KDB_ZONES_HEADER header = { 0 };
+
+  db->zones_count   = 0;
+  db->zones_covered = 0;
+
+  bool valid = file && fread(&header, sizeof(KDB_ZONES_HEADER), 1, file) == 1;
+
+  valid = valid &&
+    memcmp(&header.version, KDB_ZONES_VERSION, KDB_VERSION_SIZE) == 0 &&
+    header.size == KDB_ZONE_SIZE &&
+    header.covered <= kdb_committed_count(db) &&
+    header.count == (header.covered + KDB_ZONE_SIZE - 1) / KDB_ZONE_SIZE;
+
+  if (valid && header.count > 0)
+  {
+    db->zones = (KDB_ZONE*)malloc(sizeof(KDB_ZONE) * header.count);
+
+    if (!db->zones)
+    {
+      KDB_ERROR("Could not allocate memory for the zone maps\n");
+
+      fclose(file);
+
+      return false;
+    }
+
+    db->zones_capacity = header.count;
+
+    if (fread(db->zones, sizeof(KDB_ZONE), header.count, file) == header.count)
+    {
+      db->zones_count   = header.count;
+      db->zones_covered = header.covered;
+    }
+  }
+
+  if (file)
+  {
+    fclose(file);
+  }
+
+  KDB_CURSOR      cursor;
+  const KDB_DATA* records;
+  uint64_t        count;
+  bool            failed = false;
+
+  if (!kdb_cursor_open(&cursor, db, db->zones_covered, kdb_committed_count(db) - db->zones_covered, 0, KDB_CURSOR_READAHEAD))
+  {
+    return false;
+  }
+
+  while (!failed && (count = kdb_cursor_next_block(&cursor, &records)) > 0)
+  {
+    failed = !kdb_zones_add(db, records, count);
+  }
+
+  failed = failed || cursor.failed;
+
+  kdb_cursor_close(&cursor);
+
+  if (failed)
+  {
+    db->zones_count   = 0;
+    db->zones_covered = 0;
+
+    return false;
+  }
+
+  db->zoned = true;
+
+  return true;
+}
+
+bool kdb_zones_save(KDB* db)
+{
+  if (!db || !db->zoned)
+  {
+    return true;
+  }
+
+  char* filename = kdb_companion_filename(db, "kdz");
+
+  if (!filename)
+  {
+    return false;
+  }
+
+  FILE* file = fopen(filename, "wb");
+
+  free(filename);
+
+  if (!file)
+  {
+    KDB_ERROR("Failed to create the zone maps file\n");
+
+    return false;
+  }
+
+  KDB_ZONES_HEADER header = {
+    .size    = KDB_ZONE_SIZE,
+    .covered = db->zones_covered,
+    .count   = db->zones_count
+  };
+
+  memcpy(&header.version, KDB_ZONES_VERSION, KDB_VERSION_SIZE);
+
+  // An empty database has no zones allocated yet
+  bool saved =
+    fwrite(&header, sizeof(KDB_ZONES_HEADER), 1, file) == 1 &&
+    (db->zones_count == 0 || fwrite(db->zones, sizeof(KDB_ZONE), db->zones_count, file) == db->zones_count);
+
+  if (fclose(file) != 0 || !saved)
+  {
+    KDB_ERROR("Error while trying to write the zone maps\n");
+
+    return false;
+  }
+
+  return true;
+}
+
+// Minimum, maximum, sum and count of the records in [start, end). Whole zones
+// are taken from the zone maps, only the edges and the pending batch are read
+bool kdb_range_stats(KDB* db, uint64_t start, uint64_t end, KDB_ZONE* stats)
+{
+  KDB_LOCKED_READY(db, db->zoned, bool, kdb_range_stats_locked(db, start, end, stats));
+}
+
+bool kdb_range_stats_locked(KDB* db, uint64_t start, uint64_t end, KDB_ZONE* stats)
+{
+  stats->min   = INFINITY;
+  stats->max   = -INFINITY;
+  stats->sum   = 0.0f;
+  stats->count = 0;
+
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (end > db->header.count)
+  {
+    end = db->header.count;
+  }
+
+  if (!db->zoned && !kdb_zones_enable(db))
+  {
+    return false;
+  }
+
+  uint64_t position = start;
+
+  while (position < end)
+  {
+    uint64_t  index = position / KDB_ZONE_SIZE;
+    KDB_ZONE* zone  = index < db->zones_count ? &db->zones[index] : NULL;
+
+    if (zone && position == index * KDB_ZONE_SIZE && position + zone->count <= end && zone->count > 0)
+    {
+      if (zone->min < stats->min)
+      {
+        stats->min = zone->min;
+      }
+
+      if (zone->max > stats->max)
+      {
+        stats->max = zone->max;
+      }
+
+      stats->sum   += zone->sum;
+      stats->count += zone->count;
+      position     += zone->count;
+
+      continue;
+    }
+
+    // Partial zone, or records the zone maps do not cover yet
+    uint64_t limit = zone ? (index + 1) * KDB_ZONE_SIZE : end;
+
+    if (limit > end)
+    {
+      limit = end;
+    }
+
+    KDB_AGGREGATE partial;
+
+    if (!kdb_aggregate_range(db, position, limit, KDB_AGGREGATE_SUM | KDB_AGGREGATE_MIN_MAX, &partial))
+    {
+      return false;
+    }
+
+    if (partial.min < stats->min)
+    {
+      stats->min = partial.min;
+    }
+
+    if (partial.max > stats->max)
+    {
+      stats->max = partial.max;
+    }
+
+    stats->sum   += partial.sum;
+    stats->count += partial.count;
+    position      = limit;
+  }
+
+  return true;
+}
+
+// Indexes in [*position, end) whose value matches the predicate, up to
+// capacity of them. *position is left where the search stopped, so calling
+// again continues from there until it reaches end. Zones that cannot match
+// are skipped and zones that match entirely are never read
+bool kdb_filter(KDB* db, KDB_PREDICATE predicate, KDB_VALUE_TYPE threshold, uint64_t* position, uint64_t end, uint64_t* indexes, uint32_t capacity, uint32_t* found)
+{
+  KDB_LOCKED_READY(db, db->zoned, bool, kdb_filter_locked(db, predicate, threshold, position, end, indexes, capacity, found));
+}
+
+bool kdb_filter_locked(KDB* db, KDB_PREDICATE predicate, KDB_VALUE_TYPE threshold, uint64_t* position, uint64_t end, uint64_t* indexes, uint32_t capacity, uint32_t* found)
+{
+  *found = 0;
+
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (end > db->header.count)
+  {
+    end = db->header.count;
+  }
+
+  if (!db->zoned && !kdb_zones_enable(db))
+  {
+    return false;
+  }
+
+  #define KDB_MATCHES(value) ( \
+    predicate == KDB_PREDICATE_GREATER       ? (value) >  threshold : \
+    predicate == KDB_PREDICATE_GREATER_EQUAL ? (value) >= threshold : \
+    predicate == KDB_PREDICATE_LESS          ? (value) <  threshold : \
+                                               (value) <= threshold \
+  )
+
+  while (*position < end && *found < capacity)
+  {
+    uint64_t  index = *position / KDB_ZONE_SIZE;
+    KDB_ZONE* zone  = index < db->zones_count ? &db->zones[index] : NULL;
+    uint64_t  limit = zone ? index * KDB_ZONE_SIZE + zone->count : end;
+
+    if (limit > end || limit <= *position)
+    {
+      limit = end;
+      zone  = NULL;
+    }
+
+    if (zone)
+    {
+      bool lower_matches = KDB_MATCHES(zone->min);
+      bool upper_matches = KDB_MATCHES(zone->max);
+
+      // Neither bound matches, so no value in between does
+      if (!lower_matches && !upper_matches)
+      {
+        *position = limit;
+
+        continue;
+      }
+
+      // Both bounds match, so every value in between does
+      if (lower_matches && upper_matches)
+      {
+        while (*position < limit && *found < capacity)
+        {
+          indexes[(*found)++] = (*position)++;
+        }
+
+        continue;
+      }
+    }
+
+    KDB_CURSOR      cursor;
+    const KDB_DATA* records;
+    uint64_t        count;
+
+    if (!kdb_cursor_open(&cursor, db, *position, limit - *position, 0, KDB_CURSOR_READAHEAD))
+    {
+      return false;
+    }
+
+    while (*found < capacity && (count = kdb_cursor_next_block(&cursor, &records)) > 0)
+    {
+      uint64_t i;
+
+      for (i = 0; i < count && *found < capacity; ++i)
+      {
+        if (KDB_MATCHES(records[i].value))
+        {
+          indexes[(*found)++] = *position + i;
+        }
+      }
+
+      *position += i;
+    }
+
+    bool failed = cursor.failed;
+
+    kdb_cursor_close(&cursor);
+
+    if (failed)
+    {
+      return false;
+    }
+  }
+
+  #undef KDB_MATCHES
+
+  return true;
+}
+
+// Append records to every level, they must directly follow the covered ones
+bool kdb_pyramid_add(KDB* db, const KDB_DATA* records, uint64_t count)
+{
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    KDB_VALUE_TYPE value = records[i].value;
+    uint64_t       index = db->pyramid_covered;
+
+    for (uint32_t level = 0; level < KDB_PYRAMID_LEVELS; ++level)
+    {
+      KDB_PYRAMID_LEVEL* current = &db->pyramid[level];
+
+      index /= KDB_PYRAMID_FANOUT;
+
+      if (index == current->count)
+      {
+        if (current->count == current->capacity)
+        {
+          uint32_t          capacity = current->capacity > 0 ? current->capacity * 2 : 16;
+          KDB_PYRAMID_NODE* nodes    = (KDB_PYRAMID_NODE*)realloc(current->nodes, sizeof(KDB_PYRAMID_NODE) * capacity);
+
+          if (!nodes)
+          {
+            KDB_ERROR("Could not allocate memory for the min/max pyramid\n");
+
+            return false;
+          }
+
+          current->nodes    = nodes;
+          current->capacity = capacity;
+        }
+
+        current->nodes[current->count].min = value;
+        current->nodes[current->count].max = value;
+
+        ++current->count;
+
+        continue;
+      }
+
+      KDB_PYRAMID_NODE* node = &current->nodes[index];
+
+      if (value < node->min)
+      {
+        node->min = value;
+      }
+
+      if (value > node->max)
+      {
+        node->max = value;
+      }
+    }
+
+    ++db->pyramid_covered;
+  }
+
+  return true;
+}
+
+// Forget the pyramid's contents, keeping the allocated levels
+void kdb_pyramid_clear(KDB* db)
+{
+  for (uint32_t i = 0; i < KDB_PYRAMID_LEVELS; ++i)
+  {
+    db->pyramid[i].count = 0;
+  }
+
+  db->pyramid_covered = 0;
+  db->pyramided       = false;
+}
+
+// Start keeping the min/max pyramid for the database in "name.kdp"
+bool kdb_pyramid_enable(KDB* db)
+{
+  KDB_LOCKED(db, true, bool, kdb_pyramid_enable_locked(db));
+}
+
+bool kdb_pyramid_enable_locked(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (db->pyramided)
+  {
+    return true;
+  }
+
+  return kdb_pyramid_load(db, true) && kdb_pyramid_save(db);
+}
+
+// Load the pyramid if there is one (or create it) and catch up with the
+// records appended since it was last saved
+bool kdb_pyramid_load(KDB* db, bool create)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  char* filename = kdb_companion_filename(db, "kdp");
+
+  if (!filename)
+  {
+    return false;
+  }
+
+  FILE* file = fopen(filename, "rb");
+
+  free(filename);
+
+  if (!file && !create)
+  {
+    return true;
+  }
+
+  KDB_PYRAMID_HEADER header = { 0 };
+
+  kdb_pyramid_clear(db);
+
+  bool valid = file && fread(&header, sizeof(KDB_PYRAMID_HEADER), 1, file) == 1;
+
+  valid = valid &&
+    memcmp(&header.version, KDB_PYRAMID_VERSION, KDB_VERSION_SIZE) == 0 &&
+    header.fanout == KDB_PYRAMID_FANOUT &&
+    header.levels == KDB_PYRAMID_LEVELS &&
+    header.covered <= kdb_committed_count(db);
+
+  for (uint32_t i = 0; valid && i < KDB_PYRAMID_LEVELS; ++i)
+  {
+    KDB_PYRAMID_LEVEL* level = &db->pyramid[i];
+
+    if (header.counts[i] > level->capacity)
+    {
+      KDB_PYRAMID_NODE* nodes = (KDB_PYRAMID_NODE*)realloc(level->nodes, sizeof(KDB_PYRAMID_NODE) * header.counts[i]);
+
+      if (!nodes)
+      {
+        KDB_ERROR("Could not allocate memory for the min/max pyramid\n");
+
+        valid = false;
+
+        break;
+      }
+
+      level->nodes    = nodes;
+      level->capacity = header.counts[i];
+    }
+
+    valid = header.counts[i] == 0 || fread(level->nodes, sizeof(KDB_PYRAMID_NODE), header.counts[i], file) == header.counts[i];
+
+    level->count = header.counts[i];
+  }
+
+  if (file)
+  {
+    fclose(file);
+  }
+
+  if (valid)
+  {
+    db->pyramid_covered = header.covered;
+  }
+  else
+  {
+    kdb_pyramid_clear(db);
+  }
+
+  KDB_CURSOR      cursor;
+  const KDB_DATA* records;
+  uint64_t        count;
+  bool            failed = false;
+
+  if (!kdb_cursor_open(&cursor, db, db->pyramid_covered, kdb_committed_count(db) - db->pyramid_covered, 0, KDB_CURSOR_READAHEAD))
+  {
+    return false;
+  }
+
+  while (!failed && (count = kdb_cursor_next_block(&cursor, &records)) > 0)
+  {
+    failed = !kdb_pyramid_add(db, records, count);
+  }
+
+  failed = failed || cursor.failed;
+
+  kdb_cursor_close(&cursor);
+
+  if (failed)
+  {
+    kdb_pyramid_clear(db);
+
+    return false;
+  }
+
+  db->pyramided = true;
+
+  return true;
+}
+
+bool kdb_pyramid_save(KDB* db)
+{
+  if (!db || !db->pyramided)
+  {
+    return true;
+  }
+
+  char* filename = kdb_companion_filename(db, "kdp");
+
+  if (!filename)
+  {
+    return false;
+  }
+
+  FILE* file = fopen(filename, "wb");
+
+  free(filename);
+
+  if (!file)
+  {
+    KDB_ERROR("Failed to create the min/max pyramid file\n");
+
+    return false;
+  }
+
+  KDB_PYRAMID_HEADER header = {
+    .fanout  = KDB_PYRAMID_FANOUT,
+    .covered = db->pyramid_covered,
+    .levels  = KDB_PYRAMID_LEVELS
+  };
+
+  memcpy(&header.version, KDB_PYRAMID_VERSION, KDB_VERSION_SIZE);
+
+  for (uint32_t i = 0; i < KDB_PYRAMID_LEVELS; ++i)
+  {
+    header.counts[i] = db->pyramid[i].count;
+  }
+
+  bool saved = fwrite(&header, sizeof(KDB_PYRAMID_HEADER), 1, file) == 1;
+
+  // Levels above the records have no nodes allocated yet
+  for (uint32_t i = 0; saved && i < KDB_PYRAMID_LEVELS; ++i)
+  {
+    saved = db->pyramid[i].count == 0 || fwrite(db->pyramid[i].nodes, sizeof(KDB_PYRAMID_NODE), db->pyramid[i].count, file) == db->pyramid[i].count;
+  }
+
+  if (fclose(file) != 0 || !saved)
+  {
+    KDB_ERROR("Error while trying to write the min/max pyramid\n");
+
+    return false;
+  }
+
+  return true;
+}
+
+// Minimum and maximum of the records in [start, end). Aligned runs of records
+// are answered by the highest pyramid level that fits, so only up to
+// 2 * (KDB_PYRAMID_FANOUT - 1) nodes per level and the unaligned edges are read
+bool kdb_range_min_max(KDB* db, uint64_t start, uint64_t end, KDB_VALUE_TYPE* min, KDB_VALUE_TYPE* max)
+{
+  KDB_LOCKED_READY(db, db->pyramided, bool, kdb_range_min_max_locked(db, start, end, min, max));
+}
+
+bool kdb_range_min_max_locked(KDB* db, uint64_t start, uint64_t end, KDB_VALUE_TYPE* min, KDB_VALUE_TYPE* max)
+{
+  *min = INFINITY;
+  *max = -INFINITY;
+
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (end > db->header.count)
+  {
+    end = db->header.count;
+  }
+
+  if (start >= end)
+  {
+    return true;
+  }
+
+  if (!db->pyramided && !kdb_pyramid_enable(db))
+  {
+    return false;
+  }
+
+  // Records the pyramid does not cover yet, plus the edges below the first level
+  uint64_t covered = end < db->pyramid_covered ? end : db->pyramid_covered;
+  uint64_t low     = start;
+  uint64_t high    = covered;
+
+  if (low < high)
+  {
+    uint64_t aligned_low  = (low + KDB_PYRAMID_FANOUT - 1) / KDB_PYRAMID_FANOUT * KDB_PYRAMID_FANOUT;
+    uint64_t aligned_high = high / KDB_PYRAMID_FANOUT * KDB_PYRAMID_FANOUT;
+
+    if (aligned_low >= aligned_high)
+    {
+      aligned_low  = high;
+      aligned_high = high;
+    }
+
+    low  = aligned_low;
+    high = aligned_high;
+  }
+  else
+  {
+    low  = start;
+    high = start;
+  }
+
+  uint64_t edges[3][2] = {
+    { start,                             low                              },
+    { high,                              covered > high ? covered : high  },
+    { covered > start ? covered : start, end                              }
+  };
+
+  for (uint32_t e = 0; e < 3; ++e)
+  {
+    if (edges[e][0] >= edges[e][1])
+    {
+      continue;
+    }
+
+    KDB_CURSOR      cursor;
+    const KDB_DATA* records;
+    uint64_t        count;
+
+    if (!kdb_cursor_open(&cursor, db, edges[e][0], edges[e][1] - edges[e][0], 0, KDB_CURSOR_READAHEAD))
+    {
+      return false;
+    }
+
+    while ((count = kdb_cursor_next_block(&cursor, &records)) > 0)
+    {
+      for (uint64_t i = 0; i < count; ++i)
+      {
+        if (records[i].value < *min)
+        {
+          *min = records[i].value;
+        }
+
+        if (records[i].value > *max)
+        {
+          *max = records[i].value;
+        }
+      }
+    }
+
+    bool failed = cursor.failed;
+
+    kdb_cursor_close(&cursor);
+
+    if (failed)
+    {
+      return false;
+    }
+  }
+
+  // Walk up the levels consuming nodes until both ends align to the next one
+  uint64_t size = KDB_PYRAMID_FANOUT;
+
+  for (uint32_t level = 0; level < KDB_PYRAMID_LEVELS && low < high; ++level, size *= KDB_PYRAMID_FANOUT)
+  {
+    uint64_t          next  = size * KDB_PYRAMID_FANOUT;
+    KDB_PYRAMID_NODE* nodes = db->pyramid[level].nodes;
+
+    while (low < high && (low % next != 0 || level == KDB_PYRAMID_LEVELS - 1))
+    {
+      KDB_PYRAMID_NODE* node = &nodes[low / size];
+
+      *min = node->min < *min ? node->min : *min;
+      *max = node->max > *max ? node->max : *max;
+
+      low += size;
+    }
+
+    while (low < high && high % next != 0)
+    {
+      high -= size;
+
+      KDB_PYRAMID_NODE* node = &nodes[high / size];
+
+      *min = node->min < *min ? node->min : *min;
+      *max = node->max > *max ? node->max : *max;
+    }
+  }
+
+  return true;
+}
+
+KDB_VALUE_TYPE kdb_range_min(KDB* db, uint64_t start, uint64_t end)
+{
+  KDB_VALUE_TYPE min;
+  KDB_VALUE_TYPE max;
+
+  if (!kdb_range_min_max(db, start, end, &min, &max))
+  {
+    return INFINITY;
+  }
+
+  return min;
+}
+
+KDB_VALUE_TYPE kdb_range_max(KDB* db, uint64_t start, uint64_t end)
+{
+  KDB_VALUE_TYPE min;
+  KDB_VALUE_TYPE max;
+
+  if (!kdb_range_min_max(db, start, end, &min, &max))
+  {
+    return -INFINITY;
+  }
+
+  return max;
+}
+
+// Sum, min and max of the values in one pass
+void kdb_kernel_scalar_summary(const KDB_VALUE_TYPE* values, uint32_t count, KDB_VALUE_TYPE* sum, KDB_VALUE_TYPE* min, KDB_VALUE_TYPE* max)
+{
+  KDB_VALUE_TYPE total   = 0.0f;
+  KDB_VALUE_TYPE minimum = INFINITY;
+  KDB_VALUE_TYPE maximum = -INFINITY;
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    total   += values[i];
+    minimum  = values[i] < minimum ? values[i] : minimum;
+    maximum  = values[i] > maximum ? values[i] : maximum;
+  }
+
+  *sum = total;
+  *min = minimum;
+  *max = maximum;
+}
+
+// Sum of the squared differences to mean, the M2 of the values
+KDB_VALUE_TYPE kdb_kernel_scalar_deviation(const KDB_VALUE_TYPE* values, uint32_t count, KDB_VALUE_TYPE mean)
+{
+  KDB_VALUE_TYPE total = 0.0f;
+  KDB_VALUE_TYPE difference;
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    difference  = values[i] - mean;
+    total      += difference * difference;
+  }
+
+  return total;
+}
+
+// Vector versions of the kernels above, lanes are reduced at the end and the
+// remainder goes through the scalar kernels
+#define KDB_DEFINE_KERNELS(NAME, TARGET, VECTOR, LANES, LOAD, STORE, SET, ADD, SUB, MUL, MIN, MAX) \
+  TARGET void kdb_kernel_##NAME##_summary(const KDB_VALUE_TYPE* values, uint32_t count, KDB_VALUE_TYPE* sum, KDB_VALUE_TYPE* min, KDB_VALUE_TYPE* max) \
+  { \
+    KDB_VALUE_TYPE lanes[LANES]; \
+    VECTOR         sums = SET(0.0f); \
+    VECTOR         mins = SET(INFINITY); \
+    VECTOR         maxs = SET(-INFINITY); \
+    uint32_t       i    = 0; \
+    \
+    for (; i + LANES <= count; i += LANES) \
+    { \
+      VECTOR chunk = LOAD(values + i); \
+      \
+      sums = ADD(sums, chunk); \
+      mins = MIN(mins, chunk); \
+      maxs = MAX(maxs, chunk); \
+    } \
+    \
+    kdb_kernel_scalar_summary(values + i, count - i, sum, min, max); \
+    \
+    STORE(lanes, sums); \
+    \
+    for (uint32_t j = 0; j < LANES; ++j) \
+    { \
+      *sum += lanes[j]; \
+    } \
+    \
+    STORE(lanes, mins); \
+    \
+    for (uint32_t j = 0; j < LANES; ++j) \
+    { \
+      *min = lanes[j] < *min ? lanes[j] : *min; \
+    } \
+    \
+    STORE(lanes, maxs); \
+    \
+    for (uint32_t j = 0; j < LANES; ++j) \
+    { \
+      *max = lanes[j] > *max ? lanes[j] : *max; \
+    } \
+  } \
+  \
+  TARGET KDB_VALUE_TYPE kdb_kernel_##NAME##_deviation(const KDB_VALUE_TYPE* values, uint32_t count, KDB_VALUE_TYPE mean) \
+  { \
+    KDB_VALUE_TYPE lanes[LANES]; \
+    VECTOR         totals = SET(0.0f); \
+    VECTOR         means  = SET(mean); \
+    uint32_t       i      = 0; \
+    \
+    for (; i + LANES <= count; i += LANES) \
+    { \
+      VECTOR difference = SUB(LOAD(values + i), means); \
+      \
+      totals = ADD(totals, MUL(difference, difference)); \
+    } \
+    \
+    KDB_VALUE_TYPE total = kdb_kernel_scalar_deviation(values + i, count - i, mean); \
+    \
+    STORE(lanes, totals); \
+    \
+    for (uint32_t j = 0; j < LANES; ++j) \
+    { \
+      total += lanes[j]; \
+    } \
+    \
+    return total; \
+  }
+
+#ifdef KDB_USE_DOUBLE
+  #ifdef KDB_SIMD_SSE2
+    KDB_DEFINE_KERNELS(sse2, KDB_TARGET("sse2"), __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_add_pd, _mm_sub_pd, _mm_mul_pd, _mm_min_pd, _mm_max_pd)
+  #endif
+
+  #ifdef KDB_SIMD_AVX2
+    KDB_DEFINE_KERNELS(avx2, KDB_TARGET("avx2"), __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, _mm256_min_pd, _mm256_max_pd)
+  #endif
+
+  #ifdef KDB_SIMD_NEON
+    KDB_DEFINE_KERNELS(neon, KDB_TARGET(""), float64x2_t, 2, vld1q_f64, vst1q_f64, vdupq_n_f64, vaddq_f64, vsubq_f64, vmulq_f64, vminq_f64, vmaxq_f64)
+  #endif
+#else
+  #ifdef KDB_SIMD_SSE2
+    KDB_DEFINE_KERNELS(sse2, KDB_TARGET("sse2"), __m128, 4, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_min_ps, _mm_max_ps)
+  #endif
+
+  #ifdef KDB_SIMD_AVX2
+    KDB_DEFINE_KERNELS(avx2, KDB_TARGET("avx2"), __m256, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, _mm256_min_ps, _mm256_max_ps)
+  #endif
+
+  #ifdef KDB_SIMD_NEON
+    KDB_DEFINE_KERNELS(neon, KDB_TARGET(""), float32x4_t, 4, vld1q_f32, vst1q_f32, vdupq_n_f32, vaddq_f32, vsubq_f32, vmulq_f32, vminq_f32, vmaxq_f32)
+  #endif
+#endif
+
+KDB_KERNELS kdb_kernels_best = { NULL, NULL, NULL };
+
+// Pick the best kernels for the running CPU
+void kdb_kernels_resolve(void)
+{
+  KDB_KERNELS kernels;
+
+  kernels.name      = "scalar";
+  kernels.summary   = kdb_kernel_scalar_summary;
+  kernels.deviation = kdb_kernel_scalar_deviation;
+
+  #ifdef KDB_SIMD_NEON
+    kernels.name      = "neon";
+    kernels.summary   = kdb_kernel_neon_summary;
+    kernels.deviation = kdb_kernel_neon_deviation;
+  #endif
+
+  #ifdef KDB_SIMD_SSE2
+    if (KDB_CPU_SUPPORTS("sse2"))
+    {
+      kernels.name      = "sse2";
+      kernels.summary   = kdb_kernel_sse2_summary;
+      kernels.deviation = kdb_kernel_sse2_deviation;
+    }
+  #endif
+
+  #ifdef KDB_SIMD_AVX2
+    if (KDB_CPU_SUPPORTS("avx2"))
+    {
+      kernels.name      = "avx2";
+      kernels.summary   = kdb_kernel_avx2_summary;
+      kernels.deviation = kdb_kernel_avx2_deviation;
+    }
+  #endif
+
+  kdb_kernels_best = kernels;
+}
+
+// Best kernels for the running CPU, resolved on the first call
+const KDB_KERNELS* kdb_kernels(void)
+{
+  #ifdef KDB_USE_THREADS
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, kdb_kernels_resolve);
+  #else
+    if (!kdb_kernels_best.name)
+    {
+      kdb_kernels_resolve();
+    }
+  #endif
+
+  return &kdb_kernels_best;
+}
+
+// Several statistics of the records in [start, end) in a single pass. Chunks
+// are summarized by the kernels and their M2 merged with Chan's formula
+bool kdb_aggregate_range(KDB* db, uint64_t start, uint64_t end, KDB_AGGREGATE_STATS stats, KDB_AGGREGATE* out)
+{
+  KDB_LOCKED(db, false, bool, kdb_aggregate_range_locked(db, start, end, stats, out));
+}
+
+bool kdb_aggregate_range_locked(KDB* db, uint64_t start, uint64_t end, KDB_AGGREGATE_STATS stats, KDB_AGGREGATE* out)
+{
+  memset(out, 0, sizeof(KDB_AGGREGATE));
+
+  out->min      = INFINITY;
+  out->max      = -INFINITY;
+  out->variance = INFINITY;
+
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (end > db->header.count)
+  {
+    end = db->header.count;
+  }
+
+  if (start >= end)
+  {
+    return true;
+  }
+
+  KDB_VALUE_TYPE* values = (KDB_VALUE_TYPE*)malloc(sizeof(KDB_VALUE_TYPE) * KDB_CURSOR_CHUNK_SIZE);
+
+  if (!values)
+  {
+    KDB_ERROR("Could not allocate memory for the values\n");
+
+    return false;
+  }
+
+  const KDB_KERNELS* kernels = kdb_kernels();
+  KDB_VALUE_TYPE     width   = (db->header.max - db->header.min) / KDB_HISTOGRAM_BINS;
+  KDB_VALUE_TYPE     sum;
+  KDB_VALUE_TYPE     min;
+  KDB_VALUE_TYPE     max;
+  bool               failed  = false;
+
+  for (uint64_t position = start; position < end; )
+  {
+    uint32_t chunk = end - position < KDB_CURSOR_CHUNK_SIZE ? end - position : KDB_CURSOR_CHUNK_SIZE;
+
+    if (!kdb_read_values(db, position, chunk, values))
+    {
+      failed = true;
+
+      break;
+    }
+
+    kernels->summary(values, chunk, &sum, &min, &max);
+
+    if ((stats & KDB_AGGREGATE_VARIANCE) != 0)
+    {
+      KDB_VALUE_TYPE mean  = sum / chunk;
+      KDB_VALUE_TYPE m2    = kernels->deviation(values, chunk, mean);
+      KDB_VALUE_TYPE delta = mean - (out->count > 0 ? out->sum / out->count : 0.0f);
+
+      out->m2 += m2 + delta * delta * ((KDB_VALUE_TYPE)out->count * chunk / (out->count + chunk));
+    }
+
+    if ((stats & KDB_AGGREGATE_HISTOGRAM) != 0)
+    {
+      for (uint32_t i = 0; i < chunk; ++i)
+      {
+        int64_t bin = width > 0.0f ? (int64_t)((values[i] - db->header.min) / width) : 0;
+
+        bin = bin < 0 ? 0 : bin >= KDB_HISTOGRAM_BINS ? KDB_HISTOGRAM_BINS - 1 : bin;
+
+        ++out->histogram[bin];
+      }
+    }
+
+    out->sum   += sum;
+    out->min    = min < out->min ? min : out->min;
+    out->max    = max > out->max ? max : out->max;
+    out->count += chunk;
+
+    position += chunk;
+  }
+
+  free(values);
+
+  if (failed)
+  {
+    return false;
+  }
+
+  out->average = out->sum / out->count;
+
+  if ((stats & KDB_AGGREGATE_VARIANCE) != 0)
+  {
+    out->variance = out->m2 / out->count;
+  }
+
+  return true;
+}
+
+void kdb_indicator_reset(KDB_INDICATOR* indicator)
+{
+  indicator->filled   = 0;
+  indicator->position = 0;
+  indicator->sum      = 0.0f;
+  indicator->weighted = 0.0f;
+  indicator->last     = 0.0f;
+}
+
+// Extend the indicator by one value and return its output. While warming up
+// SMA and WMA average the values seen so far, EMA starts at the first value
+KDB_VALUE_TYPE kdb_indicator_step(KDB_INDICATOR* indicator, KDB_VALUE_TYPE value)
+{
+  uint32_t window = indicator->spec.window;
+
+  if (indicator->spec.type == KDB_INDICATOR_EMA)
+  {
+    if (indicator->filled == 0)
+    {
+      indicator->last   = value;
+      indicator->filled = 1;
+    }
+    else
+    {
+      indicator->last += (KDB_VALUE_TYPE)indicator->spec.alpha * (value - indicator->last);
+    }
+
+    return indicator->last;
+  }
+
+  if (indicator->filled < window)
+  {
+    indicator->ring[indicator->filled++] = value;
+
+    indicator->sum      += value;
+    indicator->weighted += indicator->filled * value;
+  }
+  else
+  {
+    KDB_VALUE_TYPE oldest = indicator->ring[indicator->position];
+
+    // Every weight drops by one, which also takes the oldest value out
+    indicator->weighted += window * value - indicator->sum;
+    indicator->sum      += value - oldest;
+
+    indicator->ring[indicator->position] = value;
+    indicator->position                  = (indicator->position + 1) % window;
+
+    // Summing again once per lap keeps rounding errors from building up
+    if (indicator->position == 0)
+    {
+      indicator->sum      = 0.0f;
+      indicator->weighted = 0.0f;
+
+      for (uint32_t i = 0; i < window; ++i)
+      {
+        indicator->sum      += indicator->ring[i];
+        indicator->weighted += (i + 1) * indicator->ring[i];
+      }
+    }
+  }
+
+  if (indicator->spec.type == KDB_INDICATOR_SMA)
+  {
+    return indicator->sum / indicator->filled;
+  }
+
+  return indicator->weighted / ((KDB_VALUE_TYPE)indicator->filled * (indicator->filled + 1) / 2);
+}
+
+// Place of the output of the record at index in the column of a slot. Page p
+// of every slot comes before page p + 1 of any, slots nobody uses leave holes
+// that file systems with sparse files don't store
+uint64_t kdb_indicator_offset(uint32_t slot, uint64_t index)
+{
+  uint64_t page = (index / KDB_INDICATOR_PAGE) * KDB_INDICATORS_MAX + slot;
+
+  return sizeof(KDB_INDICATORS_HEADER) + (page * KDB_INDICATOR_PAGE + index % KDB_INDICATOR_PAGE) * sizeof(KDB_VALUE_TYPE);
+}
+
+// Write the outputs of the records in [index, index + count) to the column
+bool kdb_indicator_write(KDB* db, KDB_INDICATOR* indicator, uint64_t index, const KDB_VALUE_TYPE* values, uint64_t count)
+{
+  while (count > 0)
+  {
+    uint64_t within = index % KDB_INDICATOR_PAGE;
+    uint64_t take   = KDB_INDICATOR_PAGE - within < count ? KDB_INDICATOR_PAGE - within : count;
+
+    if (!kdb_file_write_at(kdb_indicators_handle(db), kdb_indicator_offset(indicator->slot, index), values, sizeof(KDB_VALUE_TYPE) * take))
+    {
+      KDB_ERROR("Error while trying to write the indicator outputs\n");
+
+      return false;
+    }
+
+    index  += take;
+    values += take;
+    count  -= take;
+  }
+
+  return true;
+}
+
+// Run the records in [start, end) through one indicator, writing its outputs
+// at their positions or only warming up its state
+bool kdb_indicator_replay(KDB* db, KDB_INDICATOR* indicator, uint64_t start, uint64_t end, bool store)
+{
+  KDB_CURSOR      cursor;
+  const KDB_DATA* records;
+  uint64_t        count;
+  uint64_t        position = start;
+  bool            failed   = false;
+  KDB_VALUE_TYPE  outputs[KDB_INDICATOR_CHUNK];
+
+  if (!kdb_cursor_open(&cursor, db, start, end - start, 0, KDB_CURSOR_READAHEAD))
+  {
+    return false;
+  }
+
+  while (!failed && (count = kdb_cursor_next_block(&cursor, &records)) > 0)
+  {
+    for (uint64_t done = 0; !failed && done < count; done += KDB_INDICATOR_CHUNK)
+    {
+      uint64_t take = count - done < KDB_INDICATOR_CHUNK ? count - done : KDB_INDICATOR_CHUNK;
+
+      for (uint64_t i = 0; i < take; ++i)
+      {
+        outputs[i] = kdb_indicator_step(indicator, records[done + i].value);
+      }
+
+      failed    = store && !kdb_indicator_write(db, indicator, position, outputs, take);
+      position += take;
+    }
+  }
+
+  failed = failed || cursor.failed;
+
+  kdb_cursor_close(&cursor);
+
+  return !failed;
+}
+
+// Rebuild the state of an indicator from the last of the first covered
+// records, EMA only needs its last output
+bool kdb_indicator_warm_up(KDB* db, KDB_INDICATOR* indicator, uint64_t covered)
+{
+  kdb_indicator_reset(indicator);
+
+  if (indicator->spec.type != KDB_INDICATOR_EMA)
+  {
+    uint64_t warm = covered < indicator->spec.window ? covered : indicator->spec.window;
+
+    return kdb_indicator_replay(db, indicator, covered - warm, covered, false);
+  }
+
+  if (covered > 0 && !kdb_file_read_at(kdb_indicators_handle(db), kdb_indicator_offset(indicator->slot, covered - 1), &indicator->last, sizeof(KDB_VALUE_TYPE)))
+  {
+    KDB_ERROR("Error while trying to read the indicator outputs\n");
+
+    return false;
+  }
+
+  indicator->filled = covered > 0 ? 1 : 0;
+
+  return true;
+}
+
+bool kdb_indicator_find(KDB* db, KDB_INDICATOR_TYPE type, double parameter, uint32_t* indicator)
+{
+  for (uint32_t i = 0; i < db->indicators_count; ++i)
+  {
+    const KDB_INDICATOR_SPEC* spec = &db->indicators[i].spec;
+
+    if (spec->type != (uint32_t)type)
+    {
+      continue;
+    }
+
+    if (type == KDB_INDICATOR_EMA ? spec->alpha == parameter : spec->window == parameter)
+    {
+      *indicator = i;
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Keep an indicator as a column next to the records, saved in "name.kdi".
+// Parameter is the window of SMA and WMA or the smoothing factor of EMA in
+// (0, 1]. Enabling the same indicator again gives back its number
+bool kdb_indicator_enable(KDB* db, KDB_INDICATOR_TYPE type, double parameter, uint32_t* indicator)
+{
+  KDB_LOCKED(db, true, bool, kdb_indicator_enable_locked(db, type, parameter, indicator));
+}
+
+bool kdb_indicator_enable_locked(KDB* db, KDB_INDICATOR_TYPE type, double parameter, uint32_t* indicator)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (kdb_indicator_find(db, type, parameter, indicator))
+  {
+    return true;
+  }
+
+  bool valid = type == KDB_INDICATOR_EMA ?
+    parameter > 0.0 && parameter <= 1.0 :
+    (type == KDB_INDICATOR_SMA || type == KDB_INDICATOR_WMA) && parameter >= 1.0 && parameter <= UINT32_MAX && parameter == (uint32_t)parameter;
+
+  if (!valid)
+  {
+    KDB_ERROR("Invalid indicator %d with parameter %f\n", (int)type, parameter);
+
+    return false;
+  }
+
+  KDB_INDICATORS_HEADER header;
+
+  // The new column must end where the others do
+  if (!kdb_indicators_catch_up(db) || (!kdb_indicators_handle(db) && !kdb_indicators_open(db, true)) || !kdb_indicators_read(db, &header))
+  {
+    return false;
+  }
+
+  KDB_INDICATOR_SPEC spec = {
+    .type   = (uint32_t)type,
+    .window = type == KDB_INDICATOR_EMA ? 0 : (uint32_t)parameter,
+    .alpha  = type == KDB_INDICATOR_EMA ? parameter : 0.0
+  };
+
+  // Another process sharing the file may keep the indicator already
+  uint32_t slot = 0;
+
+  while (slot < header.count && (header.specs[slot].type != spec.type || header.specs[slot].window != spec.window || header.specs[slot].alpha != spec.alpha))
+  {
+    slot += 1;
+  }
+
+  if (db->indicators_count == KDB_INDICATORS_MAX || slot == KDB_INDICATORS_MAX)
+  {
+    KDB_ERROR("There can't be more than %d indicators\n", KDB_INDICATORS_MAX);
+
+    return false;
+  }
+
+  KDB_INDICATOR* indicators = (KDB_INDICATOR*)realloc(db->indicators, sizeof(KDB_INDICATOR) * (db->indicators_count + 1));
+
+  if (!indicators)
+  {
+    KDB_ERROR("Could not allocate memory for the indicators\n");
+
+    return false;
+  }
+
+  db->indicators = indicators;
+
+  KDB_INDICATOR* created = &db->indicators[db->indicators_count];
+
+  memset(created, 0, sizeof(KDB_INDICATOR));
+
+  created->spec = spec;
+  created->slot = slot;
+
+  if (spec.window > 0)
+  {
+    created->ring = (KDB_VALUE_TYPE*)malloc(sizeof(KDB_VALUE_TYPE) * spec.window);
+
+    if (!created->ring)
+    {
+      KDB_ERROR("Could not allocate memory for the indicator window\n");
+
+      return false;
+    }
+  }
+
+  // Only the outputs nobody wrote yet are computed
+  uint64_t start = 0;
+
+  if (slot < header.count)
+  {
+    start = header.covered[slot] < db->indicators_covered ? header.covered[slot] : db->indicators_covered;
+  }
+
+  if (!kdb_indicator_warm_up(db, created, start) || !kdb_indicator_replay(db, created, start, db->indicators_covered, true))
+  {
+    free(created->ring);
+
+    return false;
+  }
+
+  *indicator = db->indicators_count++;
+
+  return kdb_indicators_save(db);
+}
+
+// Output of an indicator for the record at index
+bool kdb_indicator_get(KDB* db, uint32_t indicator, uint64_t index, KDB_VALUE_TYPE* value)
+{
+  KDB_LOCKED(db, false, bool, kdb_indicator_get_locked(db, indicator, index, value));
+}
+
+bool kdb_indicator_get_locked(KDB* db, uint32_t indicator, uint64_t index, KDB_VALUE_TYPE* value)
+{
+  return kdb_indicator_range_locked(db, indicator, index, 1, value);
+}
+
+// Outputs of an indicator for the records in [start, start + count), read
+// straight from the pages of its column
+bool kdb_indicator_range(KDB* db, uint32_t indicator, uint64_t start, uint64_t count, KDB_VALUE_TYPE* out)
+{
+  KDB_LOCKED(db, false, bool, kdb_indicator_range_locked(db, indicator, start, count, out));
+}
+
+bool kdb_indicator_range_locked(KDB* db, uint32_t indicator, uint64_t start, uint64_t count, KDB_VALUE_TYPE* out)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (indicator >= db->indicators_count)
+  {
+    KDB_ERROR("There is no indicator %u\n", indicator);
+
+    return false;
+  }
+
+  if (start > db->indicators_covered || count > db->indicators_covered - start)
+  {
+    return false;
+  }
+
+  uint32_t slot = db->indicators[indicator].slot;
+
+  while (count > 0)
+  {
+    uint64_t within = start % KDB_INDICATOR_PAGE;
+    uint64_t take   = KDB_INDICATOR_PAGE - within < count ? KDB_INDICATOR_PAGE - within : count;
+
+    if (!kdb_file_read_at(kdb_indicators_handle(db), kdb_indicator_offset(slot, start), out, sizeof(KDB_VALUE_TYPE) * take))
+    {
+      KDB_ERROR("Error while trying to read the indicator outputs\n");
+
+      return false;
+    }
+
+    start += take;
+    out   += take;
+    count -= take;
+  }
+
+  return true;
+}
+
+// Extend every column by the records appended from first on. Columns left
+// behind by a failed append catch up from the file instead
+bool kdb_indicators_add(KDB* db, uint64_t first, const KDB_DATA* records, uint64_t count)
+{
+  if (db->indicators_count == 0 || count == 0)
+  {
+    return true;
+  }
+
+  if (db->indicators_covered != first)
+  {
+    return kdb_indicators_catch_up(db);
+  }
+
+  if (!db->indicators_warm && !kdb_indicators_warm_up(db))
+  {
+    return false;
+  }
+
+  KDB_VALUE_TYPE outputs[KDB_INDICATOR_CHUNK];
+
+  for (uint64_t done = 0; done < count; done += KDB_INDICATOR_CHUNK)
+  {
+    uint64_t take = count - done < KDB_INDICATOR_CHUNK ? count - done : KDB_INDICATOR_CHUNK;
+
+    for (uint32_t i = 0; i < db->indicators_count; ++i)
+    {
+      KDB_INDICATOR* indicator = &db->indicators[i];
+
+      for (uint64_t j = 0; j < take; ++j)
+      {
+        outputs[j] = kdb_indicator_step(indicator, records[done + j].value);
+      }
+
+      if (!kdb_indicator_write(db, indicator, first + done, outputs, take))
+      {
+        // States went past the covered records, they are rebuilt before the next append
+        db->indicators_warm = false;
+
+        return false;
+      }
+    }
+  }
+
+  // Threaded builds read the outputs around what stdio buffered
+  if (fflush(db->indicators_file) != 0)
+  {
+    KDB_ERROR("Error while trying to write the indicator outputs\n");
+
+    db->indicators_warm = false;
+
+    return false;
+  }
+
+  db->indicators_covered = first + count;
+
+  // The header follows once a page fills, a crash only loses the outputs of
+  // the pages after it
+  if (first / KDB_INDICATOR_PAGE != db->indicators_covered / KDB_INDICATOR_PAGE)
+  {
+    return kdb_indicators_save(db);
+  }
+
+  return true;
+}
+
+bool kdb_indicators_catch_up(KDB* db)
+{
+  uint64_t committed = kdb_committed_count(db);
+
+  if (db->indicators_count == 0)
+  {
+    db->indicators_covered = committed;
+
+    return true;
+  }
+
+  KDB_CURSOR      cursor;
+  const KDB_DATA* records;
+  uint64_t        count;
+  bool            failed = false;
+
+  if (!kdb_cursor_open(&cursor, db, db->indicators_covered, committed - db->indicators_covered, 0, KDB_CURSOR_READAHEAD))
+  {
+    return false;
+  }
+
+  while (!failed && (count = kdb_cursor_next_block(&cursor, &records)) > 0)
+  {
+    failed = !kdb_indicators_add(db, db->indicators_covered, records, count);
+  }
+
+  failed = failed || cursor.failed;
+
+  kdb_cursor_close(&cursor);
+
+  return !failed;
+}
+
+bool kdb_indicators_warm_up(KDB* db)
+{
+  for (uint32_t i = 0; i < db->indicators_count; ++i)
+  {
+    if (!kdb_indicator_warm_up(db, &db->indicators[i], db->indicators_covered))
+    {
+      return false;
+    }
+  }
+
+  db->indicators_warm = true;
+
+  return true;
+}
+
+void kdb_indicators_clear(KDB* db)
+{
+  for (uint32_t i = 0; i < db->indicators_count; ++i)
+  {
+    free(db->indicators[i].ring);
+  }
+
+  free(db->indicators);
+
+  if (db->indicators_file)
+  {
+    fclose(db->indicators_file);
+  }
+
+  db->indicators         = NULL;
+  db->indicators_count   = 0;
+  db->indicators_covered = 0;
+  db->indicators_warm    = false;
+  db->indicators_file    = NULL;
+}
+
+// Open "name.kdi", create makes an empty one when there is none
+bool kdb_indicators_open(KDB* db, bool create)
+{
+  char* filename = kdb_companion_filename(db, "kdi");
+
+  if (!filename)
+  {
+    return false;
+  }
+
+  db->indicators_file = fopen(filename, "r+b");
+
+  if (!db->indicators_file && create)
+  {
+    db->indicators_file = fopen(filename, "w+b");
+
+    // Pages come after the header, it has to be in place before them
+    if (!db->indicators_file || !kdb_indicators_save(db))
+    {
+      KDB_ERROR("Failed to create the indicators file\n");
+
+      if (db->indicators_file)
+      {
+        fclose(db->indicators_file);
+
+        db->indicators_file = NULL;
+      }
+
+      free(filename);
+
+      return false;
+    }
+  }
+
+  free(filename);
+
+  return db->indicators_file != NULL;
+}
+
+// Indicators file of db, reopened when the pool closed it. Using it keeps the
+// database in its place in the pool
+FILE* kdb_indicators_handle(KDB* db)
+{
+  if (db->pooled && !kdb_file(db))
+  {
+    return NULL;
+  }
+
+  // Readers sharing the database may get here together
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_lock(&kdb_pool_lock);
+  #endif
+
+  if (!db->indicators_file && db->indicators_count > 0)
+  {
+    char* filename = kdb_companion_filename(db, "kdi");
+
+    db->indicators_file = filename ? fopen(filename, "r+b") : NULL;
+
+    if (!db->indicators_file)
+    {
+      KDB_ERROR("Could not reopen the indicators file\n");
+    }
+
+    free(filename);
+  }
+
+  FILE* file = db->indicators_file;
+
+  #ifdef KDB_USE_THREADS
+    pthread_mutex_unlock(&kdb_pool_lock);
+  #endif
+
+  return file;
+}
+
+// Read the header of the indicators file as it is now, other processes may
+// have added slots since it was opened. A file left empty has none
+bool kdb_indicators_read(KDB* db, KDB_INDICATORS_HEADER* header)
+{
+  memset(header, 0, sizeof(KDB_INDICATORS_HEADER));
+  memcpy(&header->version, KDB_INDICATORS_VERSION, KDB_VERSION_SIZE);
+
+  FILE* file = kdb_indicators_handle(db);
+
+  if (!file || fseek(file, 0, SEEK_END) != 0)
+  {
+    KDB_ERROR("Error while trying to read the indicators\n");
+
+    return false;
+  }
+
+  if (ftell(file) == 0)
+  {
+    return true;
+  }
+
+  bool valid = kdb_file_read_at(file, 0, header, sizeof(KDB_INDICATORS_HEADER)) &&
+    memcmp(&header->version, KDB_INDICATORS_VERSION, KDB_VERSION_SIZE) == 0 &&
+    header->count <= KDB_INDICATORS_MAX;
+
+  for (uint32_t i = 0; valid && i < header->count; ++i)
+  {
+    const KDB_INDICATOR_SPEC* spec = &header->specs[i];
+
+    valid = spec->type == KDB_INDICATOR_EMA ?
+      spec->alpha > 0.0 && spec->alpha <= 1.0 :
+      (spec->type == KDB_INDICATOR_SMA || spec->type == KDB_INDICATOR_WMA) && spec->window > 0;
+  }
+
+  if (!valid)
+  {
+    KDB_ERROR("Invalid indicators file\n");
+
+    return false;
+  }
+
+  return true;
+}
+
+// Load the indicators saved for the database and catch up with the records
+// appended since. Their states are warmed up on the next append
+bool kdb_indicators_load(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  kdb_indicators_clear(db);
+
+  if (!kdb_indicators_open(db, false))
+  {
+    return true;
+  }
+
+  KDB_INDICATORS_HEADER header;
+
+  bool     valid   = kdb_indicators_read(db, &header);
+  uint64_t covered = kdb_committed_count(db);
+
+  if (valid && header.count > 0)
+  {
+    db->indicators = (KDB_INDICATOR*)calloc(header.count, sizeof(KDB_INDICATOR));
+    valid          = db->indicators != NULL;
+  }
+
+  for (uint32_t i = 0; valid && i < header.count; ++i)
+  {
+    KDB_INDICATOR* indicator = &db->indicators[i];
+
+    indicator->spec = header.specs[i];
+    indicator->slot = i;
+
+    if (indicator->spec.window > 0)
+    {
+      indicator->ring = (KDB_VALUE_TYPE*)malloc(sizeof(KDB_VALUE_TYPE) * indicator->spec.window);
+      valid           = indicator->ring != NULL;
+    }
+
+    db->indicators_count += valid ? 1 : 0;
+
+    // Records the database lost take their outputs with them
+    if (header.covered[i] < covered)
+    {
+      covered = header.covered[i];
+    }
+  }
+
+  db->indicators_covered = covered;
+
+  if (!valid || !kdb_indicators_catch_up(db))
+  {
+    kdb_indicators_clear(db);
+
+    return false;
+  }
+
+  return true;
+}
+
+// Write the slots of the indicators to the header of their file, keeping the
+// ones other processes added. The outputs they count must already be in it
+bool kdb_indicators_save(KDB* db)
+{
+  if (!db || (!db->indicators_file && db->indicators_count == 0))
+  {
+    return true;
+  }
+
+  KDB_INDICATORS_HEADER header;
+
+  if (!kdb_indicators_read(db, &header))
+  {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < db->indicators_count; ++i)
+  {
+    uint32_t slot = db->indicators[i].slot;
+
+    header.specs[slot]   = db->indicators[i].spec;
+    header.covered[slot] = db->indicators_covered;
+    header.count         = slot < header.count ? header.count : slot + 1;
+  }
+
+  if (!kdb_file_write_at(db->indicators_file, 0, &header, sizeof(KDB_INDICATORS_HEADER)) || fflush(db->indicators_file) != 0)
+  {
+    KDB_ERROR("Error while trying to write the indicators\n");
+
+    return false;
+  }
+
+  return true;
+}
+
+void kdb_rollup_merge(KDB_ROLLUP_BUCKET* into, const KDB_ROLLUP_BUCKET* from)
+{
+  if (from->high > into->high)
+  {
+    into->high = from->high;
+  }
+
+  if (from->low < into->low)
+  {
+    into->low = from->low;
+  }
+
+  into->close  = from->close;
+  into->count += from->count;
+  into->sum   += from->sum;
+}
+
+// Add a record to the bucket of its timestamp. Records come in time order so
+// the last bucket is the usual target, older timestamps search for theirs
+bool kdb_rollup_push(KDB_ROLLUP_TIER* tier, uint64_t timestamp, KDB_VALUE_TYPE value)
+{
+  KDB_ROLLUP_BUCKET record = {
+    .start = timestamp - timestamp % tier->width,
+    .count = 1,
+    .open  = value,
+    .high  = value,
+    .low   = value,
+    .close = value,
+    .sum   = value
+  };
+
+  uint64_t index = tier->count;
+
+  if (index > 0 && tier->buckets[index - 1].start >= record.start)
+  {
+    uint64_t low  = 0;
+    uint64_t high = index;
+
+    while (low < high)
+    {
+      uint64_t middle = low + (high - low) / 2;
+
+      if (tier->buckets[middle].start < record.start)
+      {
+        low = middle + 1;
+      }
+      else
+      {
+        high = middle;
+      }
+    }
+
+    index = low;
+
+    if (tier->buckets[index].start == record.start)
+    {
+      kdb_rollup_merge(&tier->buckets[index], &record);
+
+      return true;
+    }
+  }
+
+  if (tier->count == tier->capacity)
+  {
+    uint64_t           capacity = tier->capacity > 0 ? tier->capacity * 2 : 64;
+    KDB_ROLLUP_BUCKET* buckets  = (KDB_ROLLUP_BUCKET*)realloc(tier->buckets, sizeof(KDB_ROLLUP_BUCKET) * capacity);
+
+    if (!buckets)
+    {
+      KDB_ERROR("Could not allocate memory for the rollup tier\n");
+
+      return false;
+    }
+
+    tier->buckets  = buckets;
+    tier->capacity = capacity;
+  }
+
+  memmove(&tier->buckets[index + 1], &tier->buckets[index], sizeof(KDB_ROLLUP_BUCKET) * (tier->count - index));
+
+  tier->buckets[index] = record;
+
+  ++tier->count;
+
+  return true;
+}
+
+// Fold a bucket into the results at the requested resolution. False once the
+// results are full and the bucket would start a new one
+bool kdb_rollup_emit(KDB_ROLLUP_BUCKET* out, uint32_t capacity, uint32_t* found, uint64_t resolution, const KDB_ROLLUP_BUCKET* bucket)
+{
+  uint64_t start = bucket->start - bucket->start % resolution;
+
+  if (*found > 0 && out[*found - 1].start == start)
+  {
+    kdb_rollup_merge(&out[*found - 1], bucket);
+
+    return true;
+  }
+
+  if (*found == capacity)
+  {
+    return false;
+  }
+
+  out[*found]       = *bucket;
+  out[*found].start = start;
+
+  ++*found;
+
+  return true;
+}
+
+// Keep rollup tiers of the given widths, saved in "name.kdr". Tiers already
+// kept are left as they are, new ones are built from every record
+bool kdb_rollup_enable(KDB* db, const uint64_t* widths, uint32_t count)
+{
+  KDB_LOCKED(db, true, bool, kdb_rollup_enable_locked(db, widths, count));
+}
+
+bool kdb_rollup_enable_locked(KDB* db, const uint64_t* widths, uint32_t count)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  bool added = false;
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    uint32_t position = 0;
+
+    if (widths[i] == 0)
+    {
+      KDB_ERROR("Rollup tiers can't be empty\n");
+
+      return false;
+    }
+
+    // Tiers stay sorted from the finest to the coarsest
+    while (position < db->rollups_count && db->rollups[position].width < widths[i])
+    {
+      ++position;
+    }
+
+    if (position < db->rollups_count && db->rollups[position].width == widths[i])
+    {
+      continue;
+    }
+
+    if (db->rollups_count == KDB_ROLLUP_TIERS)
+    {
+      KDB_ERROR("There can't be more than %d rollup tiers\n", KDB_ROLLUP_TIERS);
+
+      return false;
+    }
+
+    KDB_ROLLUP_TIER* tiers = (KDB_ROLLUP_TIER*)realloc(db->rollups, sizeof(KDB_ROLLUP_TIER) * (db->rollups_count + 1));
+
+    if (!tiers)
+    {
+      KDB_ERROR("Could not allocate memory for the rollup tiers\n");
+
+      return false;
+    }
+
+    db->rollups = tiers;
+
+    memmove(&db->rollups[position + 1], &db->rollups[position], sizeof(KDB_ROLLUP_TIER) * (db->rollups_count - position));
+    memset(&db->rollups[position], 0, sizeof(KDB_ROLLUP_TIER));
+
+    db->rollups[position].width = widths[i];
+
+    ++db->rollups_count;
+
+    added = true;
+  }
+
+  if (!added)
+  {
+    return true;
+  }
+
+  kdb_rollups_reset(db);
+
+  if (!kdb_rollups_catch_up(db))
+  {
+    kdb_rollups_reset(db);
+
+    return false;
+  }
+
+  return kdb_rollups_save(db);
+}
+
+// Coarsest tier whose width divides resolution, NULL when none does
+KDB_ROLLUP_TIER* kdb_rollup_tier(KDB* db, uint64_t resolution)
+{
+  KDB_ROLLUP_TIER* tier = NULL;
+
+  for (uint32_t i = 0; i < db->rollups_count; ++i)
+  {
+    if (resolution % db->rollups[i].width == 0)
+    {
+      tier = &db->rollups[i];
+    }
+  }
+
+  return tier;
+}
+
+// Buckets of resolution width holding the records in [t0, t1), with t0 and t1
+// widened to whole buckets. Empty buckets are left out. The coarsest tier
+// whose width divides the resolution answers, records it doesn't cover yet
+// (and every record when no tier fits) are read from the file. When found
+// reaches capacity query again from the bucket after the last one
+bool kdb_query_rollup(KDB* db, uint64_t resolution, uint64_t t0, uint64_t t1, KDB_ROLLUP_BUCKET* out, uint32_t capacity, uint32_t* found)
+{
+  KDB_LOCKED_READY(db, db->ts_indexed || kdb_rollup_tier(db, resolution), bool, kdb_query_rollup_locked(db, resolution, t0, t1, out, capacity, found));
+}
+
+bool kdb_query_rollup_locked(KDB* db, uint64_t resolution, uint64_t t0, uint64_t t1, KDB_ROLLUP_BUCKET* out, uint32_t capacity, uint32_t* found)
+{
+  *found = 0;
+
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (resolution == 0)
+  {
+    KDB_ERROR("Resolution can't be zero\n");
+
+    return false;
+  }
+
+  uint64_t         low  = t0 - t0 % resolution;
+  uint64_t         high = t1 % resolution == 0 ? t1 : t1 - t1 % resolution + resolution;
+  uint64_t         raw  = 0;
+  KDB_ROLLUP_TIER* tier = kdb_rollup_tier(db, resolution);
+
+  // Widening t1 overflows next to the largest timestamp
+  if (high < t1)
+  {
+    high = UINT64_MAX;
+  }
+
+  if (high <= low)
+  {
+    return true;
+  }
+
+  if (tier)
+  {
+    uint64_t first = 0;
+    uint64_t last  = tier->count;
+
+    while (first < last)
+    {
+      uint64_t middle = first + (last - first) / 2;
+
+      if (tier->buckets[middle].start < low)
+      {
+        first = middle + 1;
+      }
+      else
+      {
+        last = middle;
+      }
+    }
+
+    for (uint64_t i = first; i < tier->count && tier->buckets[i].start < high; ++i)
+    {
+      if (!kdb_rollup_emit(out, capacity, found, resolution, &tier->buckets[i]))
+      {
+        return true;
+      }
+    }
+
+    raw = db->rollups_covered;
+  }
+  else if (!kdb_find_ts_locked(db, low, KDB_BOUND_LOWER, &raw))
+  {
+    return false;
+  }
 
-  db->initialized     = false;
+  KDB_CURSOR      cursor;
+  const KDB_DATA* records;
+  uint64_t        count;
+  bool            done = false;
+
+  if (!kdb_cursor_open(&cursor, db, raw, db->header.count - raw, 0, KDB_CURSOR_READAHEAD))
+  {
+    return false;
+  }
+
+  while (!done && (count = kdb_cursor_next_block(&cursor, &records)) > 0)
+  {
+    for (uint64_t i = 0; !done && i < count; ++i)
+    {
+      const KDB_DATA* data = &records[i];
+
+      if (data->timestamp < low)
+      {
+        continue;
+      }
+
+      KDB_ROLLUP_BUCKET bucket = {
+        .start = data->timestamp,
+        .count = 1,
+        .open  = data->value,
+        .high  = data->value,
+        .low   = data->value,
+        .close = data->value,
+        .sum   = data->value
+      };
+
+      done = data->timestamp >= high || !kdb_rollup_emit(out, capacity, found, resolution, &bucket);
+    }
+  }
+
+  bool failed = cursor.failed;
+
+  kdb_cursor_close(&cursor);
+
+  return !failed;
+}
+
+bool kdb_rollups_add(KDB* db, const KDB_DATA* records, uint64_t count)
+{
+  for (uint32_t i = 0; i < db->rollups_count; ++i)
+  {
+    for (uint64_t j = 0; j < count; ++j)
+    {
+      if (!kdb_rollup_push(&db->rollups[i], records[j].timestamp, records[j].value))
+      {
+        return false;
+      }
+    }
+  }
+
+  db->rollups_covered += count;
+
+  return true;
+}
+
+// Empty every tier, keeping their widths
+void kdb_rollups_reset(KDB* db)
+{
+  for (uint32_t i = 0; i < db->rollups_count; ++i)
+  {
+    db->rollups[i].count = 0;
+  }
+
+  db->rollups_covered = 0;
+}
+
+bool kdb_rollups_catch_up(KDB* db)
+{
+  uint64_t committed = kdb_committed_count(db);
+
+  if (db->rollups_count == 0)
+  {
+    db->rollups_covered = committed;
+
+    return true;
+  }
+
+  KDB_CURSOR      cursor;
+  const KDB_DATA* records;
+  uint64_t        count;
+  bool            failed = false;
+
+  if (!kdb_cursor_open(&cursor, db, db->rollups_covered, committed - db->rollups_covered, 0, KDB_CURSOR_READAHEAD))
+  {
+    return false;
+  }
+
+  while (!failed && (count = kdb_cursor_next_block(&cursor, &records)) > 0)
+  {
+    failed = !kdb_rollups_add(db, records, count);
+  }
+
+  failed = failed || cursor.failed;
+
+  kdb_cursor_close(&cursor);
+
+  return !failed;
+}
+
+void kdb_rollups_clear(KDB* db)
+{
+  for (uint32_t i = 0; i < db->rollups_count; ++i)
+  {
+    free(db->rollups[i].buckets);
+  }
+
+  free(db->rollups);
+
+  db->rollups         = NULL;
+  db->rollups_count   = 0;
+  db->rollups_covered = 0;
+}
+
+// Load the rollup tiers saved for the database and catch up with the records
+// appended since. Tiers that can't be read back are built again
+bool kdb_rollups_load(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, false);
+
+  char* filename = kdb_companion_filename(db, "kdr");
+
+  if (!filename)
+  {
+    return false;
+  }
+
+  FILE* file = fopen(filename, "rb");
+
+  free(filename);
+
+  if (!file)
+  {
+    return true;
+  }
+
+  KDB_ROLLUP_HEADER header = { 0 };
+
+  kdb_rollups_clear(db);
+
+  bool valid = fread(&header, sizeof(KDB_ROLLUP_HEADER), 1, file) == 1;
+
+  valid = valid &&
+    memcmp(&header.version, KDB_ROLLUP_VERSION, KDB_VERSION_SIZE) == 0 &&
+    header.count > 0 &&
+    header.count <= KDB_ROLLUP_TIERS;
+
+  for (uint32_t i = 0; valid && i < header.count; ++i)
+  {
+    valid = header.widths[i] > 0 && (i == 0 || header.widths[i] > header.widths[i - 1]);
+  }
+
+  if (valid)
+  {
+    db->rollups = (KDB_ROLLUP_TIER*)calloc(header.count, sizeof(KDB_ROLLUP_TIER));
+    valid       = db->rollups != NULL;
+  }
+
+  if (!valid)
+  {
+    KDB_ERROR("Invalid rollup tiers file\n");
+
+    fclose(file);
+
+    return false;
+  }
+
+  db->rollups_count = header.count;
+
+  bool buckets = header.covered <= kdb_committed_count(db);
+
+  for (uint32_t i = 0; buckets && i < header.count; ++i)
+  {
+    KDB_ROLLUP_TIER* tier = &db->rollups[i];
+
+    if (header.counts[i] > 0)
+    {
+      tier->buckets  = (KDB_ROLLUP_BUCKET*)malloc(sizeof(KDB_ROLLUP_BUCKET) * header.counts[i]);
+      tier->capacity = tier->buckets ? header.counts[i] : 0;
+      tier->count    = tier->capacity;
+    }
+
+    buckets = tier->count == header.counts[i] && (tier->count == 0 || fread(tier->buckets, sizeof(KDB_ROLLUP_BUCKET), tier->count, file) == tier->count);
+  }
+
+  fclose(file);
+
+  for (uint32_t i = 0; i < header.count; ++i)
+  {
+    db->rollups[i].width = header.widths[i];
+  }
+
+  if (buckets)
+  {
+    db->rollups_covered = header.covered;
+  }
+  else
+  {
+    kdb_rollups_reset(db);
+  }
+
+  if (!kdb_rollups_catch_up(db))
+  {
+    kdb_rollups_clear(db);
+
+    return false;
+  }
+
+  return true;
+}
+
+bool kdb_rollups_save(KDB* db)
+{
+  if (!db || db->rollups_count == 0)
+  {
+    return true;
+  }
+
+  char* filename = kdb_companion_filename(db, "kdr");
+
+  if (!filename)
+  {
+    return false;
+  }
+
+  FILE* file = fopen(filename, "wb");
+
+  free(filename);
+
+  if (!file)
+  {
+    KDB_ERROR("Failed to create the rollup tiers file\n");
+
+    return false;
+  }
+
+  KDB_ROLLUP_HEADER header = {
+    .count   = db->rollups_count,
+    .covered = db->rollups_covered
+  };
+
+  memcpy(&header.version, KDB_ROLLUP_VERSION, KDB_VERSION_SIZE);
+
+  for (uint32_t i = 0; i < db->rollups_count; ++i)
+  {
+    header.widths[i] = db->rollups[i].width;
+    header.counts[i] = db->rollups[i].count;
+  }
+
+  bool saved = fwrite(&header, sizeof(KDB_ROLLUP_HEADER), 1, file) == 1;
+
+  // Empty tiers have no buckets allocated yet
+  for (uint32_t i = 0; saved && i < db->rollups_count; ++i)
+  {
+    saved = db->rollups[i].count == 0 || fwrite(db->rollups[i].buckets, sizeof(KDB_ROLLUP_BUCKET), db->rollups[i].count, file) == db->rollups[i].count;
+  }
+
+  if (fclose(file) != 0 || !saved)
+  {
+    KDB_ERROR("Error while trying to write the rollup tiers\n");
+
+    return false;
+  }
+
+  return true;
+}
+
+// Pick at most target_points records of [start, start + count) that draw like
+// all of them. LTTB keeps the first and last records plus, for each bucket in
+// between, the one forming the largest triangle with the record picked before
+// it and the average of the next bucket, taken from the sum column. Min/max
+// keeps the lowest and highest records of target_points / 2 buckets, one per
+// pixel column when target_points is twice the width. The records are read
+// once, found receives the number of points written to out
+bool kdb_downsample(KDB* db, uint64_t start, uint64_t count, uint32_t target_points, KDB_DOWNSAMPLE_MODE mode, KDB_POINT* out, uint32_t* found)
+{
+  KDB_LOCKED(db, false, bool, kdb_downsample_locked(db, start, count, target_points, mode, out, found));
+}
+
+bool kdb_downsample_locked(KDB* db, uint64_t start, uint64_t count, uint32_t target_points, KDB_DOWNSAMPLE_MODE mode, KDB_POINT* out, uint32_t* found)
+{
+  *found = 0;
+
+  KDB_CHECK_INITIALIZED(db, false);
+
+  if (start > db->header.count || count > db->header.count - start)
+  {
+    KDB_ERROR("Range is out of bounds\n");
+
+    return false;
+  }
+
+  bool     lttb    = mode == KDB_DOWNSAMPLE_LTTB;
+  bool     all     = count <= target_points;
+  uint64_t end     = start + count;
+  uint64_t buckets = lttb ? (target_points > 2 ? target_points - 2 : 0) : target_points / 2;
+
+  // Too few points for a single bucket, only the ends are kept
+  if (!all && buckets == 0)
+  {
+    for (uint32_t i = 0; i < target_points; ++i)
+    {
+      KDB_DATA data;
+      uint64_t index = i == 0 ? start : end - 1;
+
+      if (!kdb_get_data_locked(db, index, &data))
+      {
+        return false;
+      }
+
+      out[(*found)++] = (KDB_POINT){ .index = index, .timestamp = data.timestamp, .value = data.value };
+    }
+
+    return true;
+  }
+
+  KDB_CURSOR      cursor;
+  const KDB_DATA* records;
+  uint64_t        block;
+  uint64_t        position = start;
+
+  if (!kdb_cursor_open(&cursor, db, start, count, 0, KDB_CURSOR_READAHEAD))
+  {
+    return false;
+  }
+
+  // Bucket k holds [first + k * span / buckets, first + (k + 1) * span / buckets)
+  uint64_t  first        = lttb ? start + 1 : start;
+  uint64_t  span         = lttb ? count - 2 : count;
+  uint64_t  bucket       = 0;
+  uint64_t  bucket_start = first;
+  uint64_t  bucket_end   = all ? end : first + span / buckets;
+  KDB_POINT best         = { 0 };
+  KDB_POINT lowest       = { 0 };
+  KDB_POINT highest      = { 0 };
+  double    best_area    = -1.0;
+  double    next_x       = 0.0;
+  double    next_y       = 0.0;
+  bool      failed       = false;
+
+  while (!failed && (block = kdb_cursor_next_block(&cursor, &records)) > 0)
+  {
+    for (uint64_t i = 0; !failed && i < block; ++i, ++position)
+    {
+      KDB_POINT point = {
+        .index     = position,
+        .timestamp = records[i].timestamp,
+        .value     = records[i].value
+      };
+
+      if (all || (lttb && (position == start || position + 1 == end)))
+      {
+        out[(*found)++] = point;
+
+        continue;
+      }
+
+      if (!lttb)
+      {
+        if (position == bucket_start || point.value < lowest.value)
+        {
+          lowest = point;
+        }
+
+        if (position == bucket_start || point.value > highest.value)
+        {
+          highest = point;
+        }
+      }
+      else
+      {
+        // Entering a bucket, aim at the average of the next one or the last record
+        if (position == bucket_start)
+        {
+          KDB_DATA before;
+          KDB_DATA last;
+          uint64_t next_end = bucket + 1 < buckets ? first + (bucket + 2) * span / buckets : end;
+
+          failed =
+            !kdb_get_data_locked(db, bucket_end - 1, &before) ||
+            !kdb_get_data_locked(db, next_end - 1, &last);
+
+          if (bucket + 1 < buckets)
+          {
+            next_x = (double)(bucket_end + next_end - 1) / 2.0;
+            next_y = (double)(last.sum - before.sum) / (double)(next_end - bucket_end);
+          }
+          else
+          {
+            next_x = (double)(end - 1);
+            next_y = (double)last.value;
+          }
+
+          best_area = -1.0;
+        }
+
+        const KDB_POINT* previous = &out[*found - 1];
+
+        double area = fabs(
+          ((double)previous->index - next_x) * ((double)point.value - (double)previous->value) -
+          ((double)previous->index - (double)point.index) * (next_y - (double)previous->value)
+        );
+
+        if (area > best_area)
+        {
+          best      = point;
+          best_area = area;
+        }
+      }
+
+      if (position + 1 < bucket_end)
+      {
+        continue;
+      }
+
+      if (lttb)
+      {
+        out[(*found)++] = best;
+      }
+      else
+      {
+        out[(*found)++] = lowest.index < highest.index ? lowest : highest;
+
+        if (lowest.index != highest.index)
+        {
+          out[(*found)++] = lowest.index < highest.index ? highest : lowest;
+        }
+      }
+
+      ++bucket;
+
+      bucket_start = bucket_end;
+      bucket_end   = first + (bucket + 1) * span / buckets;
+    }
+  }
+
+  failed = failed || cursor.failed;
+
+  kdb_cursor_close(&cursor);
+
+  return !failed;
+}
+
+#ifdef KDB_USE_THREADS
+// Absolute time timeout_ms from now, for pthread_cond_timedwait
+void kdb_deadline(struct timespec* deadline, uint64_t timeout_ms)
+{
+  timespec_get(deadline, TIME_UTC);
+
+  deadline->tv_sec  += timeout_ms / 1000;
+  deadline->tv_nsec += (timeout_ms % 1000) * 1000000;
+
+  if (deadline->tv_nsec >= 1000000000)
+  {
+    deadline->tv_sec  += 1;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+// Sleep until the last sync is group_ms old and sync if records came in
+// meanwhile. Appends sync on their own when they find it that old
+void* kdb_flusher_run(void* argument)
+{
+  KDB*         db       = (KDB*)argument;
+  KDB_FLUSHER* flusher  = db->flusher;
+  uint64_t     group_ms = db->options.group_ms;
+  uint64_t     wait_ms  = group_ms;
+
+  pthread_mutex_lock(&flusher->mutex);
+
+  while (flusher->running)
+  {
+    struct timespec deadline;
+
+    kdb_deadline(&deadline, wait_ms);
+
+    if (pthread_cond_timedwait(&flusher->wake, &flusher->mutex, &deadline) == 0 || !flusher->running)
+    {
+      continue;
+    }
+
+    pthread_mutex_unlock(&flusher->mutex);
+
+    KDB*     previous = kdb_lock(db, true);
+    uint64_t age      = kdb_now_ms() - db->synced_at;
+    bool     synced   = db->unsynced == 0 || age < group_ms || kdb_sync_locked(db);
+
+    // Without records to sync the next ones are synced by their append
+    age     = kdb_now_ms() - db->synced_at;
+    wait_ms = age < group_ms ? group_ms - age : group_ms;
+
+    kdb_unlock(db, previous);
+
+    if (!synced)
+    {
+      KDB_ERROR("Failed to sync the database in the background\n");
+    }
+
+    pthread_mutex_lock(&flusher->mutex);
+  }
+
+  pthread_mutex_unlock(&flusher->mutex);
 
-  return true;
+  return NULL;
 }
 
-bool kdb_get_data(KDB* db, int64_t index, KDB_DATA* data)
+bool kdb_flusher_start(KDB* db)
 {
-  data->timestamp = 0;
-  data->value     = 0.0f;
-  data->sum       = 0.0f;
-
-  KDB_CHECK_INITIALIZED(db, false);
-
-  if (index < 0 || index >= db->header.count)
-  {
-    return true;
-  }
+  KDB_FLUSHER* flusher = (KDB_FLUSHER*)calloc(1, sizeof(KDB_FLUSHER));
 
-  if (fseek(db->file, sizeof(KDB_HEADER) + sizeof(KDB_DATA) * index, SEEK_SET) != 0)
+  if (!flusher)
   {
-    KDB_ERROR("Error seeking for the index's data\n");
+    KDB_ERROR("Could not allocate memory for the flusher\n");
 
     return false;
   }
 
-  if (fread(data, sizeof(KDB_DATA), 1, db->file) != 1)
+  flusher->running = true;
+
+  pthread_mutex_init(&flusher->mutex, NULL);
+  pthread_cond_init(&flusher->wake, NULL);
+
+  db->flusher = flusher;
+
+  if (pthread_create(&flusher->thread, NULL, kdb_flusher_run, db) != 0)
   {
-    KDB_ERROR("Error reading the index's data\n");
+    KDB_ERROR("Could not start the flusher thread\n");
+
+    db->flusher = NULL;
+
+    pthread_cond_destroy(&flusher->wake);
+    pthread_mutex_destroy(&flusher->mutex);
+
+    free(flusher);
 
     return false;
   }
@@ -837,301 +8937,409 @@ bool kdb_get_data(KDB* db, int64_t index, KDB_DATA* data)
   return true;
 }
 
-bool kdb_get_data_normalized(KDB* db, int64_t index, KDB_DATA* data)
+void kdb_flusher_stop(KDB* db)
 {
-  if (!kdb_get_data(db, index, data))
+  KDB_FLUSHER* flusher = db->flusher;
+
+  if (!flusher)
   {
-    return false;
+    return;
   }
 
-  data->value = kdb_map_value(data->value, db->header.min, db->header.max, 0.0f, 1.0f);
+  pthread_mutex_lock(&flusher->mutex);
 
-  return true;
-}
+  flusher->running = false;
 
-bool kdb_get_data_normalized_neg(KDB* db, int64_t index, KDB_DATA* data)
-{
-  if (!kdb_get_data(db, index, data))
-  {
-    return false;
-  }
+  pthread_cond_signal(&flusher->wake);
+  pthread_mutex_unlock(&flusher->mutex);
 
-  data->value = kdb_map_value(data->value, db->header.min, db->header.max, -1.0f, 1.0f);
+  pthread_join(flusher->thread, NULL);
 
-  return true;
-}
+  db->flusher = NULL;
 
-bool kdb_add_ts(KDB* db, uint64_t timestamp, KDB_VALUE_TYPE value)
-{
-  KDB_CHECK_INITIALIZED(db, false);
+  pthread_cond_destroy(&flusher->wake);
+  pthread_mutex_destroy(&flusher->mutex);
 
-  KDB_PUSH_HEADER;
+  free(flusher);
+}
 
-  db->header.flags &= ~KDB_FLAGS_VARIANCE_CALCULATED;
-  db->header.flags &= ~KDB_FLAGS_MEDIAN_CALCULATED;
+// Only meaningful on the writer thread, producers may be publishing meanwhile
+bool kdb_queue_empty(KDB_QUEUE* queue)
+{
+  uint64_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
 
-  ++db->header.count;
+  return atomic_load(&queue->slots[tail & queue->mask].sequence) != tail + 1;
+}
 
-  db->header.sum     += value;
-  db->header.average  = db->header.sum / db->header.count;
+// Move up to a batch of published records out of the ring, freeing their slots
+uint32_t kdb_queue_drain(KDB_QUEUE* queue, uint64_t* enqueued_sum, uint64_t* oldest)
+{
+  uint64_t tail  = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  uint64_t depth = atomic_load_explicit(&queue->head, memory_order_relaxed) - tail;
+  uint32_t count = 0;
 
-  if (value < db->header.min)
+  if (depth > atomic_load_explicit(&queue->max_depth, memory_order_relaxed))
   {
-    db->header.min = value;
+    atomic_store_explicit(&queue->max_depth, depth, memory_order_relaxed);
   }
 
-  if (value > db->header.max)
+  *enqueued_sum = 0;
+
+  while (count < KDB_QUEUE_BATCH)
   {
-    db->header.max = value;
+    KDB_QUEUE_SLOT* slot = &queue->slots[tail & queue->mask];
+
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != tail + 1)
+    {
+      break;
+    }
+
+    if (count == 0)
+    {
+      *oldest = slot->enqueued_at;
+    }
+
+    queue->timestamps[count] = slot->timestamp;
+    queue->values[count]     = slot->value;
+    *enqueued_sum           += slot->enqueued_at;
+
+    // Hand the slot to the producer one lap ahead
+    atomic_store(&slot->sequence, tail + queue->mask + 1);
+
+    ++tail;
+    ++count;
   }
 
-  db->header.variance = INFINITY;
-  db->header.median   = INFINITY;
+  atomic_store_explicit(&queue->tail, tail, memory_order_relaxed);
 
-  if (!kdb_write_header(db))
+  return count;
+}
+
+// Wake producers waiting for room and callers waiting on kdb_ingest_flush
+void kdb_queue_notify(KDB_QUEUE* queue)
+{
+  if (atomic_load(&queue->waiting) > 0)
   {
-    goto save_error;
+    pthread_mutex_lock(&queue->mutex);
+    pthread_cond_broadcast(&queue->progress);
+    pthread_mutex_unlock(&queue->mutex);
   }
+}
 
-  KDB_DATA data = {
-    .timestamp = timestamp,
-    .value     = value,
-    .sum       = db->header.sum
-  };
+void* kdb_queue_writer(void* argument)
+{
+  KDB*       db    = (KDB*)argument;
+  KDB_QUEUE* queue = db->queue;
+  uint64_t   enqueued_sum;
+  uint64_t   oldest;
 
-  if (!kdb_write_data(db, &data))
+  for (;;)
   {
-    goto save_error;
-  }
+    uint32_t count = kdb_queue_drain(queue, &enqueued_sum, &oldest);
 
-  return true;
+    kdb_queue_notify(queue);
 
-  save_error:
-    KDB_POP_HEADER;
+    if (count > 0)
+    {
+      // One commit per batch, so the header is written once for all of it
+      if (!kdb_add_batch(db, queue->timestamps, queue->values, count))
+      {
+        atomic_fetch_add(&queue->failed, count);
+      }
 
-    return false;
-}
+      uint64_t now = kdb_now_us();
 
-bool kdb_add(KDB* db, KDB_VALUE_TYPE value)
-{
-  uint64_t timestamp = time(NULL);
+      atomic_fetch_add(&queue->batches, 1);
+      atomic_fetch_add(&queue->latency_total, now * count - enqueued_sum);
 
-  return kdb_add_ts(db, timestamp, value);
-}
+      if (now - oldest > atomic_load_explicit(&queue->latency_max, memory_order_relaxed))
+      {
+        atomic_store_explicit(&queue->latency_max, now - oldest, memory_order_relaxed);
+      }
 
-uint32_t kdb_count(KDB* db)
-{
-  KDB_CHECK_INITIALIZED(db, 0);
+      atomic_fetch_add(&queue->written, count);
 
-  return db->header.count;
-}
+      kdb_queue_notify(queue);
 
-KDB_VALUE_TYPE kdb_sum(KDB* db)
-{
-  KDB_CHECK_INITIALIZED(db, 0.0f);
+      continue;
+    }
 
-  return db->header.sum;
-}
+    if (!atomic_load(&queue->running))
+    {
+      break;
+    }
 
-KDB_VALUE_TYPE kdb_average(KDB* db)
-{
-  KDB_CHECK_INITIALIZED(db, 0.0f);
+    // Idle, producers wake it up and the flusher thread covers group_ms
+    struct timespec deadline;
 
-  return db->header.average;
-}
+    kdb_deadline(&deadline, 100);
 
-KDB_VALUE_TYPE kdb_min(KDB* db)
-{
-  KDB_CHECK_INITIALIZED(db, INFINITY);
+    // Producers check sleeping after publishing, so one of both sides sees the other
+    pthread_mutex_lock(&queue->mutex);
 
-  return db->header.min;
-}
+    atomic_store(&queue->sleeping, true);
 
-KDB_VALUE_TYPE kdb_max(KDB* db)
-{
-  KDB_CHECK_INITIALIZED(db, -INFINITY);
+    if (kdb_queue_empty(queue) && atomic_load(&queue->running))
+    {
+      pthread_cond_timedwait(&queue->wake, &queue->mutex, &deadline);
+    }
 
-  return db->header.max;
+    atomic_store(&queue->sleeping, false);
+
+    pthread_mutex_unlock(&queue->mutex);
+  }
+
+  return NULL;
 }
 
-KDB_VALUE_TYPE kdb_variance(KDB* db)
+// Switch to asynchronous ingestion. Afterwards only kdb_ingest may append to
+// the database, the writer thread owns every write until kdb_ingest_stop
+bool kdb_ingest_start(KDB* db, uint32_t capacity)
 {
-  KDB_CHECK_INITIALIZED(db, INFINITY);
+  KDB_CHECK_INITIALIZED(db, false);
 
-  if (db->header.count == 0)
+  if (db->queue)
   {
-    return INFINITY;
+    KDB_ERROR("The ingestion queue is already running\n");
+
+    return false;
   }
 
-  if ((db->header.flags & KDB_FLAGS_VARIANCE_CALCULATED) != 0)
+  if (db->in_batch)
   {
-    return db->header.variance;
+    KDB_ERROR("The ingestion queue can't start inside a batch\n");
+
+    return false;
   }
 
-  KDB_VALUE_TYPE summation = 0.0f;
+  uint64_t slots = 2;
 
-  KDB_DATA       data;
-  KDB_VALUE_TYPE difference;
+  while (slots < (capacity > 0 ? capacity : KDB_QUEUE_CAPACITY))
+  {
+    slots *= 2;
+  }
+
+  KDB_QUEUE* queue = (KDB_QUEUE*)calloc(1, sizeof(KDB_QUEUE));
 
-  for (uint32_t i = 0; i < db->header.count; ++i)
+  if (!queue || !(queue->slots = (KDB_QUEUE_SLOT*)malloc(sizeof(KDB_QUEUE_SLOT) * slots)))
   {
-    if (!kdb_get_data(db, i, &data))
-    {
-      return INFINITY;
-    }
+    KDB_ERROR("Could not allocate memory for the ingestion queue\n");
 
-    difference = data.value - db->header.average;
+    free(queue);
 
-    summation += difference * difference;
+    return false;
   }
 
-  KDB_VALUE_TYPE variance = summation / db->header.count;
+  queue->mask = slots - 1;
 
-  KDB_PUSH_HEADER;
+  for (uint64_t i = 0; i < slots; ++i)
+  {
+    atomic_init(&queue->slots[i].sequence, i);
+  }
 
-  db->header.flags    |= KDB_FLAGS_VARIANCE_CALCULATED;
-  db->header.variance  = variance;
+  atomic_init(&queue->running, true);
 
-  if (!kdb_write_header(db))
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_cond_init(&queue->wake, NULL);
+  pthread_cond_init(&queue->progress, NULL);
+
+  db->queue = queue;
+
+  if (pthread_create(&queue->writer, NULL, kdb_queue_writer, db) != 0)
   {
-    KDB_POP_HEADER;
+    KDB_ERROR("Could not start the writer thread\n");
 
-    return INFINITY;
+    db->queue = NULL;
+
+    pthread_cond_destroy(&queue->progress);
+    pthread_cond_destroy(&queue->wake);
+    pthread_mutex_destroy(&queue->mutex);
+
+    free(queue->slots);
+    free(queue);
+
+    return false;
   }
 
-  return variance;
+  return true;
 }
 
-KDB_VALUE_TYPE kdb_stddev(KDB* db)
+// Enqueue a record from any thread. When the ring is full the producer waits
+// for the writer to free slots
+bool kdb_ingest(KDB* db, uint64_t timestamp, KDB_VALUE_TYPE value)
 {
-  KDB_CHECK_INITIALIZED(db, INFINITY);
+  KDB_CHECK_INITIALIZED(db, false);
 
-  if (db->header.count == 0)
+  KDB_QUEUE* queue = db->queue;
+
+  if (!queue)
   {
-    return INFINITY;
+    KDB_ERROR("The ingestion queue is not running\n");
+
+    return false;
   }
 
-  KDB_VALUE_TYPE variance = kdb_variance(db);
+  uint64_t        position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  KDB_QUEUE_SLOT* slot;
 
-  if (variance == INFINITY)
+  for (;;)
   {
-    return INFINITY;
-  }
+    slot = &queue->slots[position & queue->mask];
 
-  #ifdef KDB_USE_LONG_DOUBLE
-    return sqrtl(variance);
-  #else
-    #ifdef KDB_USE_DOUBLE
-      return sqrt(variance);
-    #else
-      return sqrtf(variance);
-    #endif
-  #endif
-}
+    int64_t distance = (int64_t)(atomic_load_explicit(&slot->sequence, memory_order_acquire) - position);
 
-KDB_VALUE_TYPE kdb_median(KDB* db)
-{
-  KDB_CHECK_INITIALIZED(db, INFINITY);
+    if (distance == 0)
+    {
+      if (atomic_compare_exchange_weak_explicit(&queue->head, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if (distance < 0)
+    {
+      // Full, the writer frees slots a whole batch at a time
+      atomic_fetch_add(&queue->stalls, 1);
 
-  if (db->header.count == 0)
-  {
-    return INFINITY;
-  }
+      pthread_mutex_lock(&queue->mutex);
 
-  if ((db->header.flags & KDB_FLAGS_MEDIAN_CALCULATED) != 0)
-  {
-    return db->header.median;
-  }
+      atomic_fetch_add(&queue->waiting, 1);
 
-  KDB_VALUE_TYPE* values = (KDB_VALUE_TYPE*)malloc(sizeof(KDB_VALUE_TYPE) * db->header.count);
+      while (atomic_load(&queue->running) && (int64_t)(atomic_load(&slot->sequence) - position) < 0)
+      {
+        pthread_cond_wait(&queue->progress, &queue->mutex);
+      }
 
-  if (!values)
-  {
-    KDB_ERROR("Could not allocate the memory to calculate the median\n");
+      atomic_fetch_sub(&queue->waiting, 1);
 
-    return INFINITY;
-  }
+      pthread_mutex_unlock(&queue->mutex);
 
-  KDB_VALUE_TYPE median = INFINITY;
-  KDB_DATA       data;
+      if (!atomic_load(&queue->running))
+      {
+        KDB_ERROR("The ingestion queue was stopped\n");
 
-  for (uint32_t i = 0; i < db->header.count; ++i)
-  {
-    if (!kdb_get_data(db, i, &data))
+        return false;
+      }
+
+      position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    }
+    else
     {
-      goto defer;
+      position = atomic_load_explicit(&queue->head, memory_order_relaxed);
     }
-
-    values[i] = data.value;
   }
 
-  qsort(values, db->header.count, sizeof(KDB_VALUE_TYPE), &kdb_compare_values);
+  slot->timestamp   = timestamp;
+  slot->value       = value;
+  slot->enqueued_at = kdb_now_us();
 
-  if ((db->header.count & 1) == 0)
-  {
-    int second_index = db->header.count / 2;
-    int first_index  = second_index - 1;
+  atomic_store(&slot->sequence, position + 1);
 
-    median = (values[first_index] + values[second_index]) / 2.0f;
-  }
-  else
+  if (atomic_load(&queue->sleeping))
   {
-    int index = db->header.count / 2;
-
-    median = values[index];
+    pthread_mutex_lock(&queue->mutex);
+    pthread_cond_signal(&queue->wake);
+    pthread_mutex_unlock(&queue->mutex);
   }
 
-  KDB_PUSH_HEADER;
+  return true;
+}
 
-  db->header.flags  |= KDB_FLAGS_MEDIAN_CALCULATED;
-  db->header.median  = median;
+// Wait until every record enqueued before the call is written. Fails when
+// some write failed meanwhile
+bool kdb_ingest_flush(KDB* db)
+{
+  KDB_CHECK_INITIALIZED(db, false);
 
-  if (!kdb_write_header(db))
+  KDB_QUEUE* queue = db->queue;
+
+  if (!queue)
   {
-    KDB_POP_HEADER;
+    return true;
+  }
 
-    median = INFINITY;
+  uint64_t target = atomic_load(&queue->head);
+  uint64_t failed = atomic_load(&queue->failed);
 
-    goto defer;
+  pthread_mutex_lock(&queue->mutex);
+
+  atomic_fetch_add(&queue->waiting, 1);
+
+  while (atomic_load(&queue->running) && atomic_load(&queue->written) < target)
+  {
+    pthread_cond_signal(&queue->wake);
+    pthread_cond_wait(&queue->progress, &queue->mutex);
   }
 
-  defer:
-    free(values);
+  atomic_fetch_sub(&queue->waiting, 1);
 
-    return median;
+  pthread_mutex_unlock(&queue->mutex);
+
+  return atomic_load(&queue->written) >= target && atomic_load(&queue->failed) == failed;
 }
 
-KDB_VALUE_TYPE kdb_sma(KDB* db, uint32_t index, uint32_t frame)
+// Drain the ring and join the writer. Producers must be done by then
+bool kdb_ingest_stop(KDB* db)
 {
-  KDB_CHECK_INITIALIZED(db, 0.0f);
+  KDB_CHECK_INITIALIZED(db, false);
 
-  if (frame == 0)
+  KDB_QUEUE* queue = db->queue;
+
+  if (!queue)
   {
-    return 0.0f;
+    return true;
   }
 
-  KDB_DATA initial = { 0 };
-  KDB_DATA final   = { 0 };
+  pthread_mutex_lock(&queue->mutex);
 
-  if (!kdb_get_data(db, index - frame + 1, &initial))
-  {
-    return 0.0f;
-  }
+  atomic_store(&queue->running, false);
 
-  if (!kdb_get_data(db, index, &final))
+  pthread_cond_broadcast(&queue->wake);
+  pthread_cond_broadcast(&queue->progress);
+  pthread_mutex_unlock(&queue->mutex);
+
+  pthread_join(queue->writer, NULL);
+
+  bool drained = atomic_load(&queue->failed) == 0;
+
+  db->queue = NULL;
+
+  pthread_cond_destroy(&queue->progress);
+  pthread_cond_destroy(&queue->wake);
+  pthread_mutex_destroy(&queue->mutex);
+
+  free(queue->slots);
+  free(queue);
+
+  return drained;
+}
+
+void kdb_ingest_stats(KDB* db, KDB_INGEST_STATS* stats)
+{
+  memset(stats, 0, sizeof(KDB_INGEST_STATS));
+
+  KDB_CHECK_INITIALIZED_VOID(db);
+
+  KDB_QUEUE* queue = db->queue;
+
+  if (!queue)
   {
-    return 0.0f;
+    return;
   }
 
-  KDB_VALUE_TYPE difference = final.sum - initial.sum;
-  KDB_VALUE_TYPE sma        = difference / frame;
-
-  return sma;
+  stats->enqueued        = atomic_load(&queue->head);
+  stats->written         = atomic_load(&queue->written);
+  stats->failed          = atomic_load(&queue->failed);
+  stats->batches         = atomic_load(&queue->batches);
+  stats->stalls          = atomic_load(&queue->stalls);
+  stats->depth           = stats->enqueued - atomic_load(&queue->tail);
+  stats->max_depth       = atomic_load(&queue->max_depth);
+  stats->latency_average = stats->written > 0 ? atomic_load(&queue->latency_total) / stats->written : 0;
+  stats->latency_max     = atomic_load(&queue->latency_max);
 }
+#endif
 #endif // KDB_IMPLEMENTATION
 
 /* TODO
  * Add comments
  * Test removing sum from records
- *   Add a cache for optimizing moving averages
   */
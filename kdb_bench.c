@@ -0,0 +1,543 @@
+// Benchmarks of ingest, point reads and statistics. Results are written to
+// stdout as JSON, progress goes to stderr. Sizes are given as arguments with
+// an optional K, M or B suffix, kdb_bench 1K 1M 1B
+#define KDB_IMPLEMENTATION
+#include "kdb.h"
+
+#include "perlin.h"
+
+#define BENCH_SINGLE      "bsingle"
+#define BENCH_BATCH       "bbatch"
+#define BENCH_CHUNK       65536
+#define BENCH_BATCH_SIZE  4096
+#define BENCH_MAX_SAMPLES 1000000
+#define BENCH_READS       1000000
+#define BENCH_REPEATS     1000
+#define BENCH_MEDIANS     5
+#define BENCH_OPENS       20
+#define BENCH_SMA_FRAME   30
+#define BENCH_SEED        0x9E3779B97F4A7C15ull
+
+// Latencies of one measurement. Past BENCH_MAX_SAMPLES operations only every
+// stride-th one is timed, so memory stays bounded at a billion points
+typedef struct
+{
+  uint64_t* values;
+  uint64_t  count;
+  uint64_t  capacity;
+  uint64_t  stride;
+  uint64_t  ops;
+  uint64_t  total_ns;
+} BENCH_SAMPLES;
+
+uint64_t bench_now_ns(void)
+{
+  struct timespec now;
+
+  #ifdef CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  #else
+    timespec_get(&now, TIME_UTC);
+  #endif
+
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+uint64_t bench_random(uint64_t* state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+
+  return *state;
+}
+
+// Deterministic workload, rows of a million points keep the coordinates
+// small enough for float precision at a billion points
+KDB_VALUE_TYPE bench_value(uint64_t index)
+{
+  return perlin2d((index % 1000000) * 0.1f, (float)(index / 1000000), 0.123f, 5);
+}
+
+bool bench_samples_init(BENCH_SAMPLES* samples, uint64_t ops)
+{
+  memset(samples, 0, sizeof(BENCH_SAMPLES));
+
+  samples->stride   = ops > BENCH_MAX_SAMPLES ? (ops + BENCH_MAX_SAMPLES - 1) / BENCH_MAX_SAMPLES : 1;
+  samples->capacity = ops / samples->stride + 1;
+  samples->values   = (uint64_t*)malloc(sizeof(uint64_t) * samples->capacity);
+
+  if (!samples->values)
+  {
+    fprintf(stderr, "Could not allocate memory for the samples\n");
+
+    return false;
+  }
+
+  return true;
+}
+
+void bench_samples_free(BENCH_SAMPLES* samples)
+{
+  free(samples->values);
+
+  samples->values = NULL;
+}
+
+bool bench_timed(const BENCH_SAMPLES* samples)
+{
+  return samples->ops % samples->stride == 0;
+}
+
+void bench_add(BENCH_SAMPLES* samples, bool timed, uint64_t elapsed)
+{
+  if (timed && samples->count < samples->capacity)
+  {
+    samples->values[samples->count++] = elapsed;
+  }
+
+  samples->ops += 1;
+}
+
+int bench_compare(const void* a, const void* b)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+
+  return (x > y) - (x < y);
+}
+
+uint64_t bench_percentile(const BENCH_SAMPLES* samples, double percentile)
+{
+  if (samples->count == 0)
+  {
+    return 0;
+  }
+
+  return samples->values[(uint64_t)(percentile * (samples->count - 1) + 0.5)];
+}
+
+// One measurement as a JSON member, items counts records for throughput when
+// an operation handles more than one
+void bench_print(const char* name, BENCH_SAMPLES* samples, uint64_t items, bool last)
+{
+  qsort(samples->values, samples->count, sizeof(uint64_t), bench_compare);
+
+  uint64_t sum = 0;
+
+  for (uint64_t i = 0; i < samples->count; ++i)
+  {
+    sum += samples->values[i];
+  }
+
+  double seconds = samples->total_ns / 1e9;
+
+  printf("        \"%s\": {\n", name);
+  printf("          \"ops\": %llu,\n", (unsigned long long)samples->ops);
+  printf("          \"samples\": %llu,\n", (unsigned long long)samples->count);
+  printf("          \"total_ms\": %.3f,\n", samples->total_ns / 1e6);
+  printf("          \"ops_per_sec\": %.1f,\n", seconds > 0 ? samples->ops / seconds : 0.0);
+  printf("          \"records_per_sec\": %.1f,\n", seconds > 0 ? items / seconds : 0.0);
+  printf("          \"min_ns\": %llu,\n", (unsigned long long)(samples->count > 0 ? samples->values[0] : 0));
+  printf("          \"mean_ns\": %llu,\n", (unsigned long long)(samples->count > 0 ? sum / samples->count : 0));
+  printf("          \"p50_ns\": %llu,\n", (unsigned long long)bench_percentile(samples, 0.5));
+  printf("          \"p90_ns\": %llu,\n", (unsigned long long)bench_percentile(samples, 0.9));
+  printf("          \"p99_ns\": %llu,\n", (unsigned long long)bench_percentile(samples, 0.99));
+  printf("          \"p999_ns\": %llu,\n", (unsigned long long)bench_percentile(samples, 0.999));
+  printf("          \"max_ns\": %llu\n", (unsigned long long)(samples->count > 0 ? samples->values[samples->count - 1] : 0));
+  printf("        }%s\n", last ? "" : ",");
+
+  bench_samples_free(samples);
+}
+
+void bench_remove(const char* name)
+{
+  char filename[64];
+
+  snprintf(filename, sizeof(filename), "%s.kdb", name);
+
+  remove(filename);
+}
+
+uint64_t bench_parse(const char* text)
+{
+  char*    end   = NULL;
+  uint64_t count = strtoull(text, &end, 10);
+
+  switch (end ? *end : '\0')
+  {
+    case 'k': case 'K': return count * 1000;
+    case 'm': case 'M': return count * 1000000;
+    case 'b': case 'B': return count * 1000000000;
+    default:            return count;
+  }
+}
+
+// kdb_add_ts one record at a time, values are generated between the timed
+// stretches so perlin2d stays out of the numbers
+bool bench_single(uint64_t points, KDB_VALUE_TYPE* values)
+{
+  BENCH_SAMPLES samples;
+
+  bench_remove(BENCH_SINGLE);
+
+  KDB* db = kdb_initialize(BENCH_SINGLE);
+
+  if (!db || !bench_samples_init(&samples, points))
+  {
+    return false;
+  }
+
+  for (uint64_t start = 0; start < points; start += BENCH_CHUNK)
+  {
+    uint64_t count = points - start < BENCH_CHUNK ? points - start : BENCH_CHUNK;
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+      values[i] = bench_value(start + i);
+    }
+
+    uint64_t began = bench_now_ns();
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+      bool     timed = bench_timed(&samples);
+      uint64_t t0    = timed ? bench_now_ns() : 0;
+
+      if (!kdb_add_ts(db, start + i, values[i]))
+      {
+        return false;
+      }
+
+      bench_add(&samples, timed, timed ? bench_now_ns() - t0 : 0);
+    }
+
+    samples.total_ns += bench_now_ns() - began;
+  }
+
+  bench_print("add_ts", &samples, points, false);
+
+  kdb_finalize(db);
+  bench_remove(BENCH_SINGLE);
+
+  return true;
+}
+
+// Batches of BENCH_BATCH_SIZE records between kdb_begin and kdb_commit, the
+// file is kept for the read and statistics measurements
+bool bench_batch(uint64_t points, KDB_VALUE_TYPE* values)
+{
+  BENCH_SAMPLES samples;
+
+  bench_remove(BENCH_BATCH);
+
+  KDB* db = kdb_initialize(BENCH_BATCH);
+
+  if (!db || !bench_samples_init(&samples, points / BENCH_BATCH_SIZE + 1))
+  {
+    return false;
+  }
+
+  for (uint64_t start = 0; start < points; start += BENCH_BATCH_SIZE)
+  {
+    uint64_t count = points - start < BENCH_BATCH_SIZE ? points - start : BENCH_BATCH_SIZE;
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+      values[i] = bench_value(start + i);
+    }
+
+    bool     timed = bench_timed(&samples);
+    uint64_t t0    = bench_now_ns();
+
+    if (!kdb_begin(db))
+    {
+      return false;
+    }
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+      if (!kdb_add_ts(db, start + i, values[i]))
+      {
+        return false;
+      }
+    }
+
+    if (!kdb_commit(db))
+    {
+      return false;
+    }
+
+    uint64_t elapsed = bench_now_ns() - t0;
+
+    samples.total_ns += elapsed;
+
+    bench_add(&samples, timed, elapsed);
+  }
+
+  bench_print("batch", &samples, points, false);
+
+  return kdb_finalize(db);
+}
+
+// Opening and closing the batch file, the database is left open afterwards
+KDB* bench_open_close(void)
+{
+  BENCH_SAMPLES opens;
+  BENCH_SAMPLES closes;
+
+  if (!bench_samples_init(&opens, BENCH_OPENS) || !bench_samples_init(&closes, BENCH_OPENS))
+  {
+    return NULL;
+  }
+
+  KDB* db = NULL;
+
+  for (uint32_t i = 0; i < BENCH_OPENS; ++i)
+  {
+    uint64_t t0 = bench_now_ns();
+
+    db = kdb_initialize(BENCH_BATCH);
+
+    uint64_t t1 = bench_now_ns();
+
+    if (!db)
+    {
+      return NULL;
+    }
+
+    opens.total_ns += t1 - t0;
+
+    bench_add(&opens, true, t1 - t0);
+
+    if (i + 1 == BENCH_OPENS)
+    {
+      break;
+    }
+
+    if (!kdb_finalize(db))
+    {
+      return NULL;
+    }
+
+    uint64_t t2 = bench_now_ns();
+
+    closes.total_ns += t2 - t1;
+
+    bench_add(&closes, true, t2 - t1);
+  }
+
+  bench_print("open", &opens, 0, false);
+  bench_print("close", &closes, 0, false);
+
+  return db;
+}
+
+bool bench_reads(KDB* db, uint64_t points, bool random)
+{
+  BENCH_SAMPLES samples;
+  KDB_DATA      data;
+  uint64_t      state = BENCH_SEED;
+  uint64_t      reads = random ? BENCH_READS : points;
+
+  if (!bench_samples_init(&samples, reads))
+  {
+    return false;
+  }
+
+  uint64_t began = bench_now_ns();
+
+  for (uint64_t i = 0; i < reads; ++i)
+  {
+    uint64_t index = random ? bench_random(&state) % points : i;
+    bool     timed = bench_timed(&samples);
+    uint64_t t0    = timed ? bench_now_ns() : 0;
+
+    if (!kdb_get_data(db, (int64_t)index, &data))
+    {
+      return false;
+    }
+
+    bench_add(&samples, timed, timed ? bench_now_ns() - t0 : 0);
+  }
+
+  samples.total_ns = bench_now_ns() - began;
+
+  bench_print(random ? "get_data_random" : "get_data_sequential", &samples, reads, false);
+
+  return true;
+}
+
+// The variance comes from the running M2 and the median is cached in the
+// header, so the cache is dropped before each median to time the real work
+bool bench_statistics(KDB* db, uint64_t points)
+{
+  BENCH_SAMPLES  samples;
+  KDB_VALUE_TYPE result = 0.0f;
+  uint64_t       state  = BENCH_SEED;
+
+  if (!bench_samples_init(&samples, BENCH_REPEATS))
+  {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < BENCH_REPEATS; ++i)
+  {
+    uint64_t t0 = bench_now_ns();
+
+    result += kdb_variance(db);
+
+    uint64_t elapsed = bench_now_ns() - t0;
+
+    samples.total_ns += elapsed;
+
+    bench_add(&samples, true, elapsed);
+  }
+
+  bench_print("variance", &samples, 0, false);
+
+  if (!bench_samples_init(&samples, BENCH_MEDIANS))
+  {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < BENCH_MEDIANS; ++i)
+  {
+    db->header.flags &= ~KDB_FLAGS_MEDIAN_CALCULATED;
+
+    uint64_t t0 = bench_now_ns();
+
+    result += kdb_median(db);
+
+    uint64_t elapsed = bench_now_ns() - t0;
+
+    samples.total_ns += elapsed;
+
+    bench_add(&samples, true, elapsed);
+  }
+
+  bench_print("median", &samples, points * BENCH_MEDIANS, false);
+
+  if (!bench_samples_init(&samples, BENCH_READS))
+  {
+    return false;
+  }
+
+  uint64_t began = bench_now_ns();
+
+  for (uint32_t i = 0; i < BENCH_READS; ++i)
+  {
+    uint64_t index = bench_random(&state) % points;
+    bool     timed = bench_timed(&samples);
+    uint64_t t0    = timed ? bench_now_ns() : 0;
+
+    result += kdb_sma(db, index, BENCH_SMA_FRAME);
+
+    bench_add(&samples, timed, timed ? bench_now_ns() - t0 : 0);
+  }
+
+  samples.total_ns = bench_now_ns() - began;
+
+  bench_print("sma", &samples, BENCH_READS, true);
+
+  // Keeps the calls from being optimized away
+  fprintf(stderr, "checksum %f\n", (double)result);
+
+  return true;
+}
+
+bool bench_run(uint64_t points, KDB_VALUE_TYPE* values, bool last)
+{
+  fprintf(stderr, "Benchmarking %llu points\n", (unsigned long long)points);
+
+  printf("    {\n");
+  printf("      \"points\": %llu,\n", (unsigned long long)points);
+  printf("      \"results\": {\n");
+
+  if (!bench_single(points, values) || !bench_batch(points, values))
+  {
+    return false;
+  }
+
+  KDB* db = bench_open_close();
+
+  if (!db || !bench_reads(db, points, false) || !bench_reads(db, points, true) || !bench_statistics(db, points))
+  {
+    return false;
+  }
+
+  printf("      }\n");
+  printf("    }%s\n", last ? "" : ",");
+
+  fflush(stdout);
+
+  kdb_finalize(db);
+  bench_remove(BENCH_BATCH);
+
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  uint64_t defaults[] = { 1000, 10000, 100000, 1000000 };
+  uint32_t runs       = argc > 1 ? (uint32_t)(argc - 1) : sizeof(defaults) / sizeof(defaults[0]);
+
+  KDB_VALUE_TYPE* values = (KDB_VALUE_TYPE*)malloc(sizeof(KDB_VALUE_TYPE) * BENCH_CHUNK);
+
+  if (!values)
+  {
+    return 1;
+  }
+
+  printf("{\n");
+  printf("  \"format\": %d,\n", KDB_VERSION_NUMBER);
+
+  #ifdef KDB_USE_LONG_DOUBLE
+    printf("  \"value_type\": \"long double\",\n");
+  #elif defined(KDB_USE_DOUBLE)
+    printf("  \"value_type\": \"double\",\n");
+  #else
+    printf("  \"value_type\": \"float\",\n");
+  #endif
+
+  #ifdef KDB_USE_COMPRESSION
+    printf("  \"compression\": true,\n");
+  #else
+    printf("  \"compression\": false,\n");
+  #endif
+
+  #ifdef KDB_USE_COLUMNS
+    printf("  \"columns\": true,\n");
+  #else
+    printf("  \"columns\": false,\n");
+  #endif
+
+  #ifdef KDB_USE_THREADS
+    printf("  \"threads\": true,\n");
+  #else
+    printf("  \"threads\": false,\n");
+  #endif
+
+  printf("  \"runs\": [\n");
+
+  for (uint32_t i = 0; i < runs; ++i)
+  {
+    uint64_t points = argc > 1 ? bench_parse(argv[i + 1]) : defaults[i];
+
+    if (points == 0 || !bench_run(points, values, i + 1 == runs))
+    {
+      fprintf(stderr, "Benchmark failed at %llu points\n", (unsigned long long)points);
+
+      free(values);
+
+      return 1;
+    }
+  }
+
+  printf("  ]\n");
+  printf("}\n");
+
+  free(values);
+
+  return 0;
+}
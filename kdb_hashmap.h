@@ -1,12 +1,16 @@
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifndef KDB_HASHMAP_NAME
   #error "KDB_HASHMAP_NAME is not defined"
 #endif
 
+// Initial number of slots, the table doubles whenever it gets too full
 #ifndef KDB_HASHMAP_CAPACITY
-  #error "KDB_HASHMAP_CAPACITY is not defined"
+  #define KDB_HASHMAP_CAPACITY 32
 #endif
 
 #ifndef KDB_HASHMAP_KEY_TYPE
@@ -26,247 +30,281 @@
 #define KDB_HASHMAP_FUNCTION_GET      KDB_HASHMAP_GLUE(KDB_HASHMAP_FUNCTION_BASE, get)
 #define KDB_HASHMAP_FUNCTION_SET      KDB_HASHMAP_GLUE(KDB_HASHMAP_FUNCTION_BASE, set)
 #define KDB_HASHMAP_FUNCTION_DEL      KDB_HASHMAP_GLUE(KDB_HASHMAP_FUNCTION_BASE, remove)
+#define KDB_HASHMAP_FUNCTION_COUNT    KDB_HASHMAP_GLUE(KDB_HASHMAP_FUNCTION_BASE, count)
+#define KDB_HASHMAP_FUNCTION_CLEAR    KDB_HASHMAP_GLUE(KDB_HASHMAP_FUNCTION_BASE, clear)
+#define KDB_HASHMAP_FUNCTION_HASH     KDB_HASHMAP_GLUE(KDB_HASHMAP_FUNCTION_BASE, hash)
+#define KDB_HASHMAP_FUNCTION_FIND     KDB_HASHMAP_GLUE(KDB_HASHMAP_FUNCTION_BASE, find)
+#define KDB_HASHMAP_FUNCTION_GROW     KDB_HASHMAP_GLUE(KDB_HASHMAP_FUNCTION_BASE, grow)
 #define KDB_HASHMAP_BUFFER            KDB_HASHMAP_GLUE(KDB_HASHMAP_FUNCTION_BASE, buffer)
+#define KDB_HASHMAP_SLOTS             KDB_HASHMAP_GLUE(KDB_HASHMAP_FUNCTION_BASE, slots)
+#define KDB_HASHMAP_ENTRIES           KDB_HASHMAP_GLUE(KDB_HASHMAP_FUNCTION_BASE, entries)
+#define KDB_HASHMAP_IS_STRING         (__builtin_types_compatible_p(typeof(KDB_HASHMAP_KEY_TYPE), char*) == 1)
 
 typedef struct
 {
   KDB_HASHMAP_KEY_TYPE   key;
   KDB_HASHMAP_VALUE_TYPE value;
+  uint64_t               hash;
   bool                   occupied;
 } KDB_HASHMAP_ENTRY;
 
-KDB_HASHMAP_ENTRY KDB_HASHMAP_BUFFER[KDB_HASHMAP_CAPACITY] = { 0 };
+// The table is allocated on the first set, slots is always a power of two
+KDB_HASHMAP_ENTRY* KDB_HASHMAP_BUFFER  = NULL;
+uint64_t           KDB_HASHMAP_SLOTS   = 0;
+uint64_t           KDB_HASHMAP_ENTRIES = 0;
 
 #ifndef KDB_HASHMAP_HASH_FUNCTIONS
   #define KDB_HASHMAP_HASH_FUNCTIONS 1
 
+  // FNV-1a over a NUL terminated string
   uint64_t kdb_hashmap_hash(void* key)
   {
-    uint64_t hash = 0;
+    uint64_t             hash      = 0xcbf29ce484222325ULL;
+    const unsigned char* character = (const unsigned char*)key;
 
-    while (*((char*)key) != 0)
+    while (*character != 0)
     {
-      hash += *((char*)key);
+      hash ^= *character;
+      hash *= 0x100000001b3ULL;
 
-      ++key;
+      ++character;
     }
 
-    hash %= KDB_HASHMAP_CAPACITY;
-
     return hash;
   }
-#endif
 
-void KDB_HASHMAP_FUNCTION_DUMP(void)
-{
-  uint64_t entries = 0;
-
-  for (uint64_t i = 0; i < KDB_HASHMAP_CAPACITY; ++i)
+  // splitmix64 finalizer, sequential integers end up far apart
+  uint64_t kdb_hashmap_hash_integer(uint64_t key)
   {
-    if (!KDB_HASHMAP_BUFFER[i].occupied)
-    {
-      continue;
-    }
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
 
-    ++entries;
-
-    if (__builtin_types_compatible_p(typeof(KDB_HASHMAP_KEY_TYPE), char*) == 1)
-    {
-      printf(
-        "Entry: %llu - Key: %s - Value: %llu\n",
-        i,
-        KDB_HASHMAP_BUFFER[i].key,
-        (uint64_t)KDB_HASHMAP_BUFFER[i].value
-      );
-    }
-    else
-    {
-      printf(
-        "Entry: %llu - Key: %llu - Value: %llu\n",
-        i,
-        (uint64_t)KDB_HASHMAP_BUFFER[i].key,
-        (uint64_t)KDB_HASHMAP_BUFFER[i].value
-      );
-    }
+    return key;
   }
+#endif
 
-  if (entries == 0)
+uint64_t KDB_HASHMAP_FUNCTION_HASH(KDB_HASHMAP_KEY_TYPE key)
+{
+  if (KDB_HASHMAP_IS_STRING)
   {
-    printf("EMPTY\n");
+    return kdb_hashmap_hash((void*)(uintptr_t)key);
   }
+
+  return kdb_hashmap_hash_integer((uint64_t)(uintptr_t)key);
 }
 
-KDB_HASHMAP_VALUE_TYPE KDB_HASHMAP_FUNCTION_GET(KDB_HASHMAP_KEY_TYPE key, KDB_HASHMAP_VALUE_TYPE default_value)
+// Slot holding key, or the empty slot where the probe for it ended
+uint64_t KDB_HASHMAP_FUNCTION_FIND(KDB_HASHMAP_KEY_TYPE key, uint64_t hash)
 {
-  uint64_t hash = 0;
-
-  if (__builtin_types_compatible_p(typeof(KDB_HASHMAP_KEY_TYPE), char*) == 1)
-  {
-    hash = kdb_hashmap_hash((void*)(uintptr_t)key);
-  }
-  else
-  {
-    hash = (uint64_t)key % KDB_HASHMAP_CAPACITY;
-  }
+  uint64_t mask = KDB_HASHMAP_SLOTS - 1;
+  uint64_t slot = hash & mask;
 
-  for (uint64_t tries = 0; tries < KDB_HASHMAP_CAPACITY; ++tries)
+  while (KDB_HASHMAP_BUFFER[slot].occupied)
   {
-    if (!KDB_HASHMAP_BUFFER[hash].occupied)
+    if (KDB_HASHMAP_BUFFER[slot].hash == hash)
     {
-      break;
-    }
-
-    if (__builtin_types_compatible_p(typeof(KDB_HASHMAP_KEY_TYPE), char*) == 1)
-    {
-      if (strcmp(KDB_HASHMAP_BUFFER[hash].key, key) != 0)
+      if (KDB_HASHMAP_IS_STRING)
       {
-        hash = (hash + 1) % KDB_HASHMAP_CAPACITY;
-
-        continue;
+        if (strcmp((const char*)(uintptr_t)KDB_HASHMAP_BUFFER[slot].key, (const char*)(uintptr_t)key) == 0)
+        {
+          break;
+        }
       }
-    }
-    else
-    {
-      if (KDB_HASHMAP_BUFFER[hash].key != key)
+      else if (KDB_HASHMAP_BUFFER[slot].key == key)
       {
-        hash = (hash + 1) % KDB_HASHMAP_CAPACITY;
-
-        continue;
+        break;
       }
     }
 
-    return KDB_HASHMAP_BUFFER[hash].value;
+    slot = (slot + 1) & mask;
   }
 
-  return default_value;
+  return slot;
 }
 
-bool KDB_HASHMAP_FUNCTION_SET(KDB_HASHMAP_KEY_TYPE key, KDB_HASHMAP_VALUE_TYPE value)
+// Move every entry into a table of the given number of slots
+bool KDB_HASHMAP_FUNCTION_GROW(uint64_t slots)
 {
-  uint64_t hash = 0;
+  KDB_HASHMAP_ENTRY* old_buffer = KDB_HASHMAP_BUFFER;
+  uint64_t           old_slots  = KDB_HASHMAP_SLOTS;
+  KDB_HASHMAP_ENTRY* buffer     = (KDB_HASHMAP_ENTRY*)calloc(slots, sizeof(KDB_HASHMAP_ENTRY));
 
-  if (__builtin_types_compatible_p(typeof(KDB_HASHMAP_KEY_TYPE), char*) == 1)
+  if (!buffer)
   {
-    hash = kdb_hashmap_hash((void*)(uintptr_t)key);
+    return false;
   }
-  else
+
+  KDB_HASHMAP_BUFFER = buffer;
+  KDB_HASHMAP_SLOTS  = slots;
+
+  for (uint64_t i = 0; i < old_slots; ++i)
   {
-    hash = (uint64_t)key % KDB_HASHMAP_CAPACITY;
+    if (!old_buffer[i].occupied)
+    {
+      continue;
+    }
+
+    KDB_HASHMAP_BUFFER[KDB_HASHMAP_FUNCTION_FIND(old_buffer[i].key, old_buffer[i].hash)] = old_buffer[i];
   }
 
-  uint64_t tries = 0;
+  free(old_buffer);
 
-  for (tries = 0; tries < KDB_HASHMAP_CAPACITY; ++tries)
-  {
+  return true;
+}
 
-    if (!KDB_HASHMAP_BUFFER[hash].occupied)
+void KDB_HASHMAP_FUNCTION_DUMP(void)
+{
+  for (uint64_t i = 0; i < KDB_HASHMAP_SLOTS; ++i)
+  {
+    if (!KDB_HASHMAP_BUFFER[i].occupied)
     {
-      break;
+      continue;
     }
 
-    if (__builtin_types_compatible_p(typeof(KDB_HASHMAP_KEY_TYPE), char*) == 1)
+    if (KDB_HASHMAP_IS_STRING)
     {
-      if (strcmp(KDB_HASHMAP_BUFFER[hash].key, key) == 0)
-      {
-        break;
-      }
+      printf(
+        "Entry: %llu - Key: %s - Value: %llu\n",
+        (unsigned long long)i,
+        (const char*)(uintptr_t)KDB_HASHMAP_BUFFER[i].key,
+        (unsigned long long)(uintptr_t)KDB_HASHMAP_BUFFER[i].value
+      );
     }
     else
     {
-      if (KDB_HASHMAP_BUFFER[hash].key == key)
-      {
-        break;
-      }
+      printf(
+        "Entry: %llu - Key: %llu - Value: %llu\n",
+        (unsigned long long)i,
+        (unsigned long long)(uintptr_t)KDB_HASHMAP_BUFFER[i].key,
+        (unsigned long long)(uintptr_t)KDB_HASHMAP_BUFFER[i].value
+      );
     }
-
-    hash = (hash + 1) % KDB_HASHMAP_CAPACITY;
   }
 
-  if (tries == KDB_HASHMAP_CAPACITY)
+  if (KDB_HASHMAP_ENTRIES == 0)
   {
-    return false;
+    printf("EMPTY\n");
   }
+}
 
-  if (!KDB_HASHMAP_BUFFER[hash].occupied)
-  {
-    KDB_HASHMAP_BUFFER[hash].key      = key;
-    KDB_HASHMAP_BUFFER[hash].occupied = true;
-  }
+uint64_t KDB_HASHMAP_FUNCTION_COUNT(void)
+{
+  return KDB_HASHMAP_ENTRIES;
+}
 
-  KDB_HASHMAP_BUFFER[hash].value = value;
+// Drop every entry and release the table, keys are not owned by the map
+void KDB_HASHMAP_FUNCTION_CLEAR(void)
+{
+  free(KDB_HASHMAP_BUFFER);
 
-  return true;
+  KDB_HASHMAP_BUFFER  = NULL;
+  KDB_HASHMAP_SLOTS   = 0;
+  KDB_HASHMAP_ENTRIES = 0;
 }
 
-bool KDB_HASHMAP_FUNCTION_DEL(KDB_HASHMAP_KEY_TYPE key)
+KDB_HASHMAP_VALUE_TYPE KDB_HASHMAP_FUNCTION_GET(KDB_HASHMAP_KEY_TYPE key, KDB_HASHMAP_VALUE_TYPE default_value)
 {
-  uint64_t hash = 0;
-
-  if (__builtin_types_compatible_p(typeof(KDB_HASHMAP_KEY_TYPE), char*) == 1)
+  if (KDB_HASHMAP_ENTRIES == 0)
   {
-    hash = kdb_hashmap_hash((void*)(uintptr_t)key);
+    return default_value;
   }
-  else
+
+  uint64_t slot = KDB_HASHMAP_FUNCTION_FIND(key, KDB_HASHMAP_FUNCTION_HASH(key));
+
+  if (!KDB_HASHMAP_BUFFER[slot].occupied)
   {
-    hash = (uint64_t)key % KDB_HASHMAP_CAPACITY;
+    return default_value;
   }
 
-  uint64_t tries = 0;
+  return KDB_HASHMAP_BUFFER[slot].value;
+}
 
-  for (tries = 0; tries < KDB_HASHMAP_CAPACITY; ++tries)
+bool KDB_HASHMAP_FUNCTION_SET(KDB_HASHMAP_KEY_TYPE key, KDB_HASHMAP_VALUE_TYPE value)
+{
+  // Keep the load factor under 3/4 so probe sequences stay short
+  if ((KDB_HASHMAP_ENTRIES + 1) * 4 > KDB_HASHMAP_SLOTS * 3)
   {
+    uint64_t slots = KDB_HASHMAP_SLOTS ? KDB_HASHMAP_SLOTS * 2 : 1;
 
-    if (!KDB_HASHMAP_BUFFER[hash].occupied)
+    while (slots < KDB_HASHMAP_CAPACITY)
     {
-      break;
+      slots *= 2;
     }
 
-    if (__builtin_types_compatible_p(typeof(KDB_HASHMAP_KEY_TYPE), char*) == 1)
-    {
-      if (strcmp(KDB_HASHMAP_BUFFER[hash].key, key) == 0)
-      {
-        break;
-      }
-    }
-    else
+    if (!KDB_HASHMAP_FUNCTION_GROW(slots))
     {
-      if (KDB_HASHMAP_BUFFER[hash].key == key)
-      {
-        break;
-      }
+      return false;
     }
-
-    hash = (hash + 1) % KDB_HASHMAP_CAPACITY;
   }
 
-  if (tries == KDB_HASHMAP_CAPACITY)
+  uint64_t hash = KDB_HASHMAP_FUNCTION_HASH(key);
+  uint64_t slot = KDB_HASHMAP_FUNCTION_FIND(key, hash);
+
+  if (!KDB_HASHMAP_BUFFER[slot].occupied)
   {
-    return false;
+    KDB_HASHMAP_BUFFER[slot].key      = key;
+    KDB_HASHMAP_BUFFER[slot].hash     = hash;
+    KDB_HASHMAP_BUFFER[slot].occupied = true;
+
+    ++KDB_HASHMAP_ENTRIES;
   }
 
-  if (!KDB_HASHMAP_BUFFER[hash].occupied)
+  KDB_HASHMAP_BUFFER[slot].value = value;
+
+  return true;
+}
+
+bool KDB_HASHMAP_FUNCTION_DEL(KDB_HASHMAP_KEY_TYPE key)
+{
+  if (KDB_HASHMAP_ENTRIES == 0)
   {
     return false;
   }
 
-  if (__builtin_types_compatible_p(typeof(KDB_HASHMAP_KEY_TYPE), char*) == 1)
+  uint64_t mask = KDB_HASHMAP_SLOTS - 1;
+  uint64_t hole = KDB_HASHMAP_FUNCTION_FIND(key, KDB_HASHMAP_FUNCTION_HASH(key));
+
+  if (!KDB_HASHMAP_BUFFER[hole].occupied)
   {
-    KDB_HASHMAP_BUFFER[hash].key = NULL;
+    return false;
   }
-  else
+
+  // Backward shift, entries after the hole move back when that keeps them
+  // reachable from their home slot so no tombstones are needed
+  for (uint64_t slot = (hole + 1) & mask; KDB_HASHMAP_BUFFER[slot].occupied; slot = (slot + 1) & mask)
   {
-    KDB_HASHMAP_BUFFER[hash].key = 0;
+    uint64_t home = KDB_HASHMAP_BUFFER[slot].hash & mask;
+
+    if (((slot - home) & mask) >= ((slot - hole) & mask))
+    {
+      KDB_HASHMAP_BUFFER[hole] = KDB_HASHMAP_BUFFER[slot];
+      hole                     = slot;
+    }
   }
 
-  KDB_HASHMAP_BUFFER[hash].occupied   = false;
-  KDB_HASHMAP_BUFFER[hash].value      = 0;
+  memset(&KDB_HASHMAP_BUFFER[hole], 0, sizeof(KDB_HASHMAP_ENTRY));
+
+  --KDB_HASHMAP_ENTRIES;
 
   return true;
 }
 
+#undef KDB_HASHMAP_IS_STRING
+#undef KDB_HASHMAP_ENTRIES
+#undef KDB_HASHMAP_SLOTS
 #undef KDB_HASHMAP_BUFFER
+#undef KDB_HASHMAP_FUNCTION_GROW
+#undef KDB_HASHMAP_FUNCTION_FIND
+#undef KDB_HASHMAP_FUNCTION_HASH
+#undef KDB_HASHMAP_FUNCTION_CLEAR
+#undef KDB_HASHMAP_FUNCTION_COUNT
+#undef KDB_HASHMAP_FUNCTION_DEL
 #undef KDB_HASHMAP_FUNCTION_SET
 #undef KDB_HASHMAP_FUNCTION_GET
+#undef KDB_HASHMAP_FUNCTION_DUMP
 #undef KDB_HASHMAP_FUNCTION_BASE
 #undef KDB_HASHMAP
 #undef KDB_HASHMAP_ENTRY
@@ -1,5 +1,21 @@
 cls
 del *.kdb
+del *.kds
+del *.kdz
+del *.kdp
+del *.kdi
+del *.kdc
+del *.kdr
 del *.exe
 gcc -o file_tests.exe -ggdb file_tests.c
 file_tests.exe
+if errorlevel 1 exit /b 1
+gcc -o file_tests_compression.exe -ggdb -DKDB_USE_COMPRESSION file_tests.c
+file_tests_compression.exe
+if errorlevel 1 exit /b 1
+gcc -o file_tests_columns.exe -ggdb -DKDB_USE_COLUMNS file_tests.c
+file_tests_columns.exe
+if errorlevel 1 exit /b 1
+gcc -o file_tests_threads.exe -ggdb -DKDB_USE_THREADS -pthread file_tests.c
+file_tests_threads.exe
+if errorlevel 1 exit /b 1
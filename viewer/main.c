@@ -8,6 +8,186 @@
 #define SMA_SHORT 15
 #define SMA_LONG  30
 
+// Seconds between two checks for records appended by a writer
+#define LIVE_POLL 0.1
+
+// LTTB picks depend on the whole range, so they are redone less often
+#define LTTB_POLL 1.0
+
+// Records loaded so far with both of their moving averages
+typedef struct
+{
+  uint64_t        count;
+  uint64_t        capacity;
+  float*          values;
+  KDB_VALUE_TYPE* sma1;
+  KDB_VALUE_TYPE* sma2;
+} SERIES;
+
+// Lowest and highest record of every pixel column. Each column covers bucket
+// records, neighbouring columns are merged once the records outgrow the screen
+typedef struct
+{
+  uint64_t* lows;
+  uint64_t* highs;
+  uint32_t  count;
+  uint32_t  capacity;
+  uint64_t  bucket;
+} ENVELOPE;
+
+void envelope_add(ENVELOPE* envelope, const float* values, uint64_t index)
+{
+  if (index / envelope->bucket >= envelope->capacity)
+  {
+    for (uint32_t i = 0; i < envelope->count / 2; ++i)
+    {
+      uint64_t low_a  = envelope->lows[2 * i];
+      uint64_t low_b  = envelope->lows[2 * i + 1];
+      uint64_t high_a = envelope->highs[2 * i];
+      uint64_t high_b = envelope->highs[2 * i + 1];
+
+      envelope->lows[i]  = values[low_b] < values[low_a] ? low_b : low_a;
+      envelope->highs[i] = values[high_b] > values[high_a] ? high_b : high_a;
+    }
+
+    envelope->count  /= 2;
+    envelope->bucket *= 2;
+  }
+
+  uint64_t column = index / envelope->bucket;
+
+  if (column == envelope->count)
+  {
+    envelope->lows[column]  = index;
+    envelope->highs[column] = index;
+    envelope->count        += 1;
+
+    return;
+  }
+
+  if (values[index] < values[envelope->lows[column]])
+  {
+    envelope->lows[column] = index;
+  }
+
+  if (values[index] > values[envelope->highs[column]])
+  {
+    envelope->highs[column] = index;
+  }
+}
+
+// Both extremes of every column in record order, like KDB_DOWNSAMPLE_MIN_MAX
+void envelope_points(const ENVELOPE* envelope, const float* values, KDB_POINT* points, uint32_t* found)
+{
+  *found = 0;
+
+  for (uint32_t i = 0; i < envelope->count; ++i)
+  {
+    uint64_t first = envelope->lows[i] < envelope->highs[i] ? envelope->lows[i] : envelope->highs[i];
+    uint64_t last  = envelope->lows[i] < envelope->highs[i] ? envelope->highs[i] : envelope->lows[i];
+
+    points[*found].index = first;
+    points[*found].value = values[first];
+    *found += 1;
+
+    if (last != first)
+    {
+      points[*found].index = last;
+      points[*found].value = values[last];
+      *found += 1;
+    }
+  }
+}
+
+// Read the records past the ones already loaded up to count. Only the new tail
+// is read and averaged, so a refresh costs as much as what was appended
+bool series_load(KDB* db, SERIES* series, ENVELOPE* envelope, uint64_t count)
+{
+  if (count <= series->count)
+  {
+    return true;
+  }
+
+  if (count > series->capacity)
+  {
+    uint64_t capacity = series->capacity > 0 ? series->capacity : 4096;
+
+    while (capacity < count)
+    {
+      capacity *= 2;
+    }
+
+    float* values = realloc(series->values, capacity * sizeof(float));
+
+    if (!values)
+    {
+      return false;
+    }
+
+    series->values = values;
+
+    KDB_VALUE_TYPE* sma1 = realloc(series->sma1, capacity * sizeof(KDB_VALUE_TYPE));
+
+    if (!sma1)
+    {
+      return false;
+    }
+
+    series->sma1 = sma1;
+
+    KDB_VALUE_TYPE* sma2 = realloc(series->sma2, capacity * sizeof(KDB_VALUE_TYPE));
+
+    if (!sma2)
+    {
+      return false;
+    }
+
+    series->sma2     = sma2;
+    series->capacity = capacity;
+  }
+
+  KDB_CURSOR cursor;
+  const KDB_DATA* data = NULL;
+
+  if (!kdb_cursor_open(&cursor, db, series->count, count - series->count, 0, KDB_CURSOR_READAHEAD))
+  {
+    return false;
+  }
+
+  for (uint64_t i = series->count; i < count; ++i)
+  {
+    data = kdb_cursor_next(&cursor);
+
+    if (!data)
+    {
+      break;
+    }
+
+    series->values[i] = data->value;
+  }
+
+  kdb_cursor_close(&cursor);
+
+  // Both averages come out of a single pass over the sums
+  uint64_t        frames[2] = { SMA_SHORT, SMA_LONG };
+  KDB_VALUE_TYPE* smas[2]   = { series->sma1 + series->count, series->sma2 + series->count };
+
+  // The count stays put on failure so the next poll reads the same tail again
+  if (!data || !kdb_sma_series_multi(db, series->count, count - series->count, frames, 2, smas))
+  {
+    return false;
+  }
+
+  for (uint64_t i = series->count; i < count; ++i)
+  {
+    envelope_add(envelope, series->values, i);
+  }
+
+  series->count = count;
+
+  return true;
+}
+
 int main()
 {
   KDB_INITIALIZE(db, "test");
@@ -17,78 +197,143 @@ int main()
     return 1;
   }
 
-  KDB_DATA data;
-  float* values = malloc(db->header.count * sizeof(float));
-  float* sma1 = malloc(db->header.count * sizeof(float));
-  float* sma2 = malloc(db->header.count * sizeof(float));
+  // Falls back to regular reads where mapping is not available
+  kdb_map(db);
+
   char* buffer1 = malloc(256 * sizeof(char));
   char* buffer2 = malloc(256 * sizeof(char));
   char* buffer3 = malloc(256 * sizeof(char));
   char* buffer4 = malloc(256 * sizeof(char));
 
-  for (size_t i = 0; i < db->header.count; ++i)
-  {
-    kdb_get_data(db, i, &data);
+  const int screenWidth = 1024;
+  const int screenHeight = 768;
 
-    values[i] = data.value;
+  // Frames draw the lowest and highest record of every pixel column, or the
+  // LTTB pick after pressing L, instead of every record
+  uint32_t target = 2 * screenWidth;
+  uint32_t points_count = 0;
+  KDB_POINT* points = calloc(target, sizeof(KDB_POINT));
+  KDB_DOWNSAMPLE_MODE mode = KDB_DOWNSAMPLE_MIN_MAX;
 
-    sma1[i] = kdb_sma(db, i, SMA_SHORT);
-    sma2[i] = kdb_sma(db, i, SMA_LONG);
-  }
+  SERIES series = { 0 };
+  ENVELOPE envelope = { 0 };
 
-  const int screenWidth = 1024;
-  const int screenHeight = 768;
+  envelope.lows = malloc(screenWidth * sizeof(uint64_t));
+  envelope.highs = malloc(screenWidth * sizeof(uint64_t));
+  envelope.capacity = screenWidth;
+  envelope.bucket = 1;
+
+  // A failed first load is retried by the live tail below
+  series_load(db, &series, &envelope, kdb_count(db));
 
   InitWindow(screenWidth, screenHeight, "KrakluniaDB Visualizer");
 
   SetTargetFPS(60);
 
+  // The chart is only drawn again when records arrive or the mode changes,
+  // frames in between just copy it and draw the cursor over it
+  RenderTexture2D chart = LoadRenderTexture(screenWidth, screenHeight);
+
+  bool stale = true;
+  double polled_at = 0.0;
+  double sampled_at = -LTTB_POLL;
+
   while (!WindowShouldClose())
   {
-    BeginDrawing();
-      ClearBackground(CLITERAL(Color){ 51, 51, 51, 255 });
+    double now = GetTime();
+
+    // Live tail, picks up whatever a writer appended since the last poll
+    if (now - polled_at >= LIVE_POLL)
+    {
+      polled_at = now;
+
+      kdb_refresh(db, NULL);
 
-      float previous_x = 0.0f;
-      float previous_y1 = 1.0f;
-      float previous_y2 = 1.0f;
-      float previous_y3 = 1.0f;
+      if (kdb_count(db) > series.count && series_load(db, &series, &envelope, kdb_count(db)))
+      {
+        stale = true;
+      }
+    }
+
+    if (IsKeyPressed(KEY_L))
+    {
+      mode = mode == KDB_DOWNSAMPLE_MIN_MAX ? KDB_DOWNSAMPLE_LTTB : KDB_DOWNSAMPLE_MIN_MAX;
 
-      float x = 0.0f;
-      float y1 = 1.0f;
-      float y2 = 1.0f;
-      float y3 = 1.0f;
+      stale = true;
+      sampled_at = -LTTB_POLL;
+    }
 
-      for (size_t i = 0; i < db->header.count; ++i)
+    if (stale && (mode == KDB_DOWNSAMPLE_MIN_MAX || now - sampled_at >= LTTB_POLL))
+    {
+      if (mode == KDB_DOWNSAMPLE_MIN_MAX)
       {
-        x = ((float)i / db->header.count);
-
-        y1 = (1.0f - values[i]);
-        y2 = (1.0f - sma1[i]);
-        y3 = (1.0f - sma2[i]);
-
-        DrawLine(
-          (int)(previous_x * screenWidth), (int)(previous_y1 * screenHeight),
-          (int)(x * screenWidth), (int)(y1 * screenHeight),
-          CLITERAL(Color){ 0, 0, 255, 255 }
-        );
-
-        DrawLine(
-          (int)(previous_x * screenWidth), (int)(previous_y2 * screenHeight),
-          (int)(x * screenWidth), (int)(y2 * screenHeight),
-          CLITERAL(Color){ 0, 255, 0, 255 }
-        );
-
-        DrawLine(
-          (int)(previous_x * screenWidth), (int)(previous_y3 * screenHeight),
-          (int)(x * screenWidth), (int)(y3 * screenHeight),
-          CLITERAL(Color){ 255, 0, 0, 255 }
-        );
-
-        previous_x = x;
-        previous_y1 = y1;
-        previous_y2 = y2;
-        previous_y3 = y3;
+        envelope_points(&envelope, series.values, points, &points_count);
       }
+      else
+      {
+        kdb_downsample(db, 0, series.count, target, mode, points, &points_count);
+      }
+
+      stale = false;
+      sampled_at = now;
+
+      BeginTextureMode(chart);
+        ClearBackground(CLITERAL(Color){ 51, 51, 51, 255 });
+
+        float previous_x = 0.0f;
+        float previous_y1 = 1.0f;
+        float previous_y2 = 1.0f;
+        float previous_y3 = 1.0f;
+
+        float x = 0.0f;
+        float y1 = 1.0f;
+        float y2 = 1.0f;
+        float y3 = 1.0f;
+
+        for (uint32_t i = 0; i < points_count; ++i)
+        {
+          size_t point = points[i].index;
+
+          x = ((float)point / series.count);
+
+          y1 = (1.0f - points[i].value);
+          y2 = (1.0f - series.sma1[point]);
+          y3 = (1.0f - series.sma2[point]);
+
+          DrawLine(
+            (int)(previous_x * screenWidth), (int)(previous_y1 * screenHeight),
+            (int)(x * screenWidth), (int)(y1 * screenHeight),
+            CLITERAL(Color){ 0, 0, 255, 255 }
+          );
+
+          DrawLine(
+            (int)(previous_x * screenWidth), (int)(previous_y2 * screenHeight),
+            (int)(x * screenWidth), (int)(y2 * screenHeight),
+            CLITERAL(Color){ 0, 255, 0, 255 }
+          );
+
+          DrawLine(
+            (int)(previous_x * screenWidth), (int)(previous_y3 * screenHeight),
+            (int)(x * screenWidth), (int)(y3 * screenHeight),
+            CLITERAL(Color){ 255, 0, 0, 255 }
+          );
+
+          previous_x = x;
+          previous_y1 = y1;
+          previous_y2 = y2;
+          previous_y3 = y3;
+        }
+      EndTextureMode();
+    }
+
+    BeginDrawing();
+      // Render textures are stored upside down
+      DrawTextureRec(
+        chart.texture,
+        CLITERAL(Rectangle){ 0.0f, 0.0f, (float)screenWidth, -(float)screenHeight },
+        CLITERAL(Vector2){ 0.0f, 0.0f },
+        CLITERAL(Color){ 255, 255, 255, 255 }
+      );
 
       int mouse_x = GetMouseX();
       int mouse_y = GetMouseY();
@@ -105,51 +350,59 @@ int main()
         CLITERAL(Color){ 255, 255, 255, 255 }
       );
 
-      size_t index = ((float)mouse_x / screenWidth) * db->header.count;
+      size_t index = ((float)mouse_x / screenWidth) * series.count;
 
-      sprintf(buffer1, "Index %lu", index);
-      sprintf(buffer2, "%f", values[index]);
-      sprintf(buffer3, "%f", sma1[index]);
-      sprintf(buffer4, "%f", sma2[index]);
+      if (index < series.count)
+      {
+        sprintf(buffer1, "Index %lu", index);
+        sprintf(buffer2, "%f", series.values[index]);
+        sprintf(buffer3, "%f", series.sma1[index]);
+        sprintf(buffer4, "%f", series.sma2[index]);
 
-      int font_size = screenHeight * 0.03f;
+        int font_size = screenHeight * 0.03f;
 
-      int buffer1_width = MeasureText(buffer1, font_size);
-      int buffer2_width = MeasureText(buffer2, font_size);
-      int buffer3_width = MeasureText(buffer3, font_size);
-      int buffer4_width = MeasureText(buffer4, font_size);
+        int buffer1_width = MeasureText(buffer1, font_size);
+        int buffer2_width = MeasureText(buffer2, font_size);
+        int buffer3_width = MeasureText(buffer3, font_size);
+        int buffer4_width = MeasureText(buffer4, font_size);
 
-      int max_width = fmax(fmax(fmax(buffer1_width, buffer2_width), buffer3_width), buffer4_width);
+        int max_width = fmax(fmax(fmax(buffer1_width, buffer2_width), buffer3_width), buffer4_width);
 
-      int origin_x = mouse_x;
-      int origin_y = mouse_y;
+        int origin_x = mouse_x;
+        int origin_y = mouse_y;
 
-      if (origin_x > screenWidth - max_width - 10)
-      {
-        origin_x -= max_width + 10;
-      }
+        if (origin_x > screenWidth - max_width - 10)
+        {
+          origin_x -= max_width + 10;
+        }
 
-      if (origin_y < font_size * 4 + 5)
-      {
-        origin_y += font_size * 4 + 5;
-      }
+        if (origin_y < font_size * 4 + 5)
+        {
+          origin_y += font_size * 4 + 5;
+        }
 
-      DrawText(buffer1, origin_x + 5, origin_y - font_size * 4, font_size, CLITERAL(Color){ 255, 255, 255, 255 });
-      DrawText(buffer2, origin_x + 5, origin_y - font_size * 3, font_size, CLITERAL(Color){ 0, 0, 255, 255 });
-      DrawText(buffer3, origin_x + 5, origin_y - font_size * 2, font_size, CLITERAL(Color){ 0, 255, 0, 255 });
-      DrawText(buffer4, origin_x + 5, origin_y - font_size, font_size, CLITERAL(Color){ 255, 0, 0, 255 });
+        DrawText(buffer1, origin_x + 5, origin_y - font_size * 4, font_size, CLITERAL(Color){ 255, 255, 255, 255 });
+        DrawText(buffer2, origin_x + 5, origin_y - font_size * 3, font_size, CLITERAL(Color){ 0, 0, 255, 255 });
+        DrawText(buffer3, origin_x + 5, origin_y - font_size * 2, font_size, CLITERAL(Color){ 0, 255, 0, 255 });
+        DrawText(buffer4, origin_x + 5, origin_y - font_size, font_size, CLITERAL(Color){ 255, 0, 0, 255 });
+      }
     EndDrawing();
   }
 
+  UnloadRenderTexture(chart);
+
   CloseWindow();
 
   free(buffer4);
   free(buffer3);
   free(buffer2);
   free(buffer1);
-  free(sma2);
-  free(sma1);
-  free(values);
+  free(envelope.highs);
+  free(envelope.lows);
+  free(points);
+  free(series.sma2);
+  free(series.sma1);
+  free(series.values);
 
   KDB_FINALIZE(db);
 